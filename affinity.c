@@ -0,0 +1,388 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * CPU and NUMA placement. On a multi socket machine each GPU hangs off one
+ * socket's PCIe root, and a miner thread, the postcalc threads verifying its
+ * results or host RAM padbuffers on the other socket cross the interconnect
+ * for every transfer. With --affinity auto each OpenCL GPU gets cores on the
+ * node sysfs reports for its PCI address, with --gpu-cpus the user names them.
+ *
+ * A GPU's miner threads are pinned to its cores, its postcalc threads to its
+ * node and its buffers are created by a thread bound to the node with the
+ * node preferred for new pages, so drivers that allocate host memory with the
+ * normal page allocator place it there. Network, submit and API threads are
+ * kept off the cores given to miner threads when any are left over.
+ *
+ * Placement is only implemented on Linux, elsewhere the options are accepted
+ * and ignored.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "miner.h"
+#include "affinity.h"
+
+enum affinity_policy {
+	AFFINITY_NONE,
+	AFFINITY_AUTO,
+};
+
+static enum affinity_policy opt_affinity = AFFINITY_NONE;
+static int gpu_cpulists;
+
+char *set_affinity(char *arg)
+{
+	if (!strcasecmp(arg, "none"))
+		opt_affinity = AFFINITY_NONE;
+	else if (!strcasecmp(arg, "auto"))
+		opt_affinity = AFFINITY_AUTO;
+	else
+		return "Invalid value passed to set_affinity, use none or auto";
+	return NULL;
+}
+
+#ifdef __linux
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define MPOL_DEFAULT	0
+#define MPOL_PREFERRED	1
+#define NODE_BITS	(sizeof(unsigned long) * 8)
+
+struct gpu_place {
+	bool placed;
+	int node;		/* -1 if unknown */
+	cpu_set_t cpus;		/* Miner threads */
+	cpu_set_t node_cpus;	/* Postcalc threads and buffer creation */
+};
+
+static char *gpu_cpulist[MAX_GPUDEVICES];
+static struct gpu_place places[MAX_GPUDEVICES];
+static cpu_set_t service_cpus;
+static bool service_pinned;
+
+/* Parses a cpu list such as 0-3,8,10-11. Ranges may also be separated by :
+ * so per device lists can be given comma separated on the command line. */
+static bool parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *s = list;
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*s && !isspace((unsigned char)*s)) {
+		lo = strtol(s, &end, 10);
+		if (end == s || lo < 0 || lo >= CPU_SETSIZE)
+			return false;
+		hi = lo;
+		s = end;
+		if (*s == '-') {
+			s++;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo || hi >= CPU_SETSIZE)
+				return false;
+			s = end;
+		}
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+		if (*s == ',' || *s == ':')
+			s++;
+		else if (*s && !isspace((unsigned char)*s))
+			return false;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+static char *cpuset_str(const cpu_set_t *set, char *buf, size_t len)
+{
+	int cpu, lo = -1;
+	size_t off = 0;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+		bool in = cpu < CPU_SETSIZE && CPU_ISSET(cpu, set);
+
+		if (in && lo < 0)
+			lo = cpu;
+		else if (!in && lo >= 0) {
+			if (off < len)
+				off += snprintf(buf + off, len - off, lo == cpu - 1 ? "%s%d" : "%s%d-%d",
+						off ? "," : "", lo, cpu - 1);
+			lo = -1;
+		}
+	}
+	return buf;
+}
+
+static bool read_sysfs(const char *path, char *buf, size_t len)
+{
+	FILE *fp = fopen(path, "r");
+	bool ret;
+
+	if (!fp)
+		return false;
+	ret = fgets(buf, len, fp) != NULL;
+	fclose(fp);
+	return ret;
+}
+
+/* The node and cpus sysfs lists as local to a PCI device */
+static bool pci_locality(const char *pci_addr, int *node, cpu_set_t *cpus)
+{
+	char path[128], buf[1024];
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", pci_addr);
+	if (!read_sysfs(path, buf, sizeof(buf)))
+		return false;
+	*node = atoi(buf);
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/local_cpulist", pci_addr);
+	if (!read_sysfs(path, buf, sizeof(buf)))
+		return false;
+	return parse_cpulist(buf, cpus);
+}
+
+/* The node the first cpu in set belongs to, for explicit cpu lists */
+static int cpuset_node(const cpu_set_t *set)
+{
+	char path[128];
+	int cpu, node;
+
+	for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, set); cpu++)
+		;
+	for (node = 0; node < (int)NODE_BITS; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+		if (!access(path, F_OK))
+			return node;
+	}
+	return -1;
+}
+
+char *set_gpu_cpus(char *arg)
+{
+	char *nextptr;
+	cpu_set_t set;
+	int i;
+
+	for (nextptr = strtok(arg, ","); nextptr; nextptr = strtok(NULL, ",")) {
+		if (gpu_cpulists >= MAX_GPUDEVICES)
+			return "Too many values passed to set_gpu_cpus";
+		if (!parse_cpulist(nextptr, &set))
+			return "Invalid cpu list passed to set_gpu_cpus";
+		gpu_cpulist[gpu_cpulists++] = strdup(nextptr);
+	}
+	if (!gpu_cpulists)
+		return "Invalid parameters for set_gpu_cpus";
+	if (gpu_cpulists == 1) {
+		for (i = 1; i < MAX_GPUDEVICES; i++)
+			gpu_cpulist[i] = gpu_cpulist[0];
+	}
+	return NULL;
+}
+
+/* Takes the next count cores of node_cpus, preferring ones no other GPU has,
+ * for a GPU's miner threads */
+static void reserve_cores(const cpu_set_t *node_cpus, const cpu_set_t *reserved,
+			  int count, cpu_set_t *cpus)
+{
+	int cpu, pass;
+
+	CPU_ZERO(cpus);
+	for (pass = 0; pass < 2 && CPU_COUNT(cpus) < count; pass++) {
+		for (cpu = CPU_SETSIZE - 1; cpu >= 0 && CPU_COUNT(cpus) < count; cpu--) {
+			if (!CPU_ISSET(cpu, node_cpus) || CPU_ISSET(cpu, cpus))
+				continue;
+			if (!pass && CPU_ISSET(cpu, reserved))
+				continue;
+			CPU_SET(cpu, cpus);
+		}
+	}
+}
+
+/* Works out every GPU's placement before any mining, network or API thread
+ * starts. Miner cores are taken from the top of each node, away from the
+ * low numbered cores interrupts and the rest of the system favour. */
+void affinity_init(void)
+{
+	cpu_set_t online, reserved;
+	char buf[256];
+	int i;
+
+	if (opt_affinity == AFFINITY_NONE && !gpu_cpulists)
+		return;
+	if (sched_getaffinity(0, sizeof(online), &online)) {
+		applog(LOG_WARNING, "Failed to get CPU affinity, not placing threads");
+		return;
+	}
+	CPU_ZERO(&reserved);
+
+#ifdef HAVE_OPENCL
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = devices[i];
+		struct gpu_place *place;
+
+		if (cgpu->drv->drv_id != DRIVER_OPENCL || cgpu->device_id >= MAX_GPUDEVICES)
+			continue;
+		place = &places[cgpu->device_id];
+
+		if (gpu_cpulist[cgpu->device_id]) {
+			parse_cpulist(gpu_cpulist[cgpu->device_id], &place->cpus);
+			CPU_AND(&place->cpus, &place->cpus, &online);
+			if (!CPU_COUNT(&place->cpus)) {
+				applog(LOG_WARNING, "GPU %d: none of CPUs %s are available, not placing it",
+				       cgpu->device_id, gpu_cpulist[cgpu->device_id]);
+				continue;
+			}
+			place->node_cpus = place->cpus;
+			place->node = cpuset_node(&place->cpus);
+		} else if (opt_affinity == AFFINITY_AUTO) {
+			if (!cgpu->pci_addr[0] || !pci_locality(cgpu->pci_addr, &place->node, &place->node_cpus)) {
+				applog(LOG_INFO, "GPU %d: PCI locality unknown, not placing it", cgpu->device_id);
+				continue;
+			}
+			CPU_AND(&place->node_cpus, &place->node_cpus, &online);
+			/* Single node machines report -1, nothing to gain */
+			if (place->node < 0 || !CPU_COUNT(&place->node_cpus))
+				continue;
+			reserve_cores(&place->node_cpus, &reserved, cgpu->threads, &place->cpus);
+		} else
+			continue;
+
+		place->placed = true;
+		CPU_OR(&reserved, &reserved, &place->cpus);
+		applog(LOG_NOTICE, "GPU %d: %s%s NUMA node %d, miner threads on CPUs %s",
+		       cgpu->device_id, cgpu->pci_addr[0] ? "PCI " : "", cgpu->pci_addr,
+		       place->node, cpuset_str(&place->cpus, buf, sizeof(buf)));
+	}
+#endif
+
+	if (!CPU_COUNT(&reserved))
+		return;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &online) && !CPU_ISSET(i, &reserved))
+			CPU_SET(i, &service_cpus);
+	}
+	if (!CPU_COUNT(&service_cpus)) {
+		applog(LOG_WARNING, "Every CPU is given to a GPU, network and API threads are not placed");
+		return;
+	}
+	service_pinned = true;
+	applog(LOG_NOTICE, "Network and API threads on CPUs %s", cpuset_str(&service_cpus, buf, sizeof(buf)));
+}
+
+static struct gpu_place *gpu_place(struct cgpu_info *cgpu)
+{
+	if (cgpu->drv->drv_id != DRIVER_OPENCL || cgpu->device_id < 0 || cgpu->device_id >= MAX_GPUDEVICES)
+		return NULL;
+	if (!places[cgpu->device_id].placed)
+		return NULL;
+	return &places[cgpu->device_id];
+}
+
+static void pin_thread(const cpu_set_t *set)
+{
+	if (sched_setaffinity(0, sizeof(*set), set))
+		applog(LOG_DEBUG, "Failed to set thread CPU affinity");
+}
+
+/* Bind the calling thread to cgpu's node while it creates cgpu's buffers */
+void affinity_gpu_enter(struct cgpu_info *cgpu, struct affinity_saved *saved)
+{
+	struct gpu_place *place = gpu_place(cgpu);
+	unsigned long nodes;
+
+	saved->bound = false;
+	saved->policy = false;
+	if (!place || sched_getaffinity(0, sizeof(saved->cpus), &saved->cpus))
+		return;
+	saved->bound = true;
+	pin_thread(&place->node_cpus);
+
+#if defined(SYS_get_mempolicy) && defined(SYS_set_mempolicy)
+	if (place->node < 0 || place->node >= (int)NODE_BITS)
+		return;
+	saved->nodes = 0;
+	if (syscall(SYS_get_mempolicy, &saved->mode, &saved->nodes, NODE_BITS, NULL, 0))
+		saved->mode = MPOL_DEFAULT;
+	nodes = 1UL << place->node;
+	if (!syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodes, NODE_BITS))
+		saved->policy = true;
+#endif
+}
+
+void affinity_gpu_leave(struct affinity_saved *saved)
+{
+	if (!saved->bound)
+		return;
+#if defined(SYS_set_mempolicy)
+	if (saved->policy)
+		syscall(SYS_set_mempolicy, saved->mode, saved->mode == MPOL_DEFAULT ? NULL : &saved->nodes, NODE_BITS);
+#endif
+	pin_thread(&saved->cpus);
+}
+
+/* Called by a GPU's miner threads */
+void affinity_gpu_thread(struct cgpu_info *cgpu)
+{
+	struct gpu_place *place = gpu_place(cgpu);
+
+	if (place)
+		pin_thread(&place->cpus);
+}
+
+/* Called by the threads verifying a GPU's results */
+void affinity_gpu_verify(struct cgpu_info *cgpu)
+{
+	struct gpu_place *place = gpu_place(cgpu);
+
+	if (place)
+		pin_thread(&place->node_cpus);
+}
+
+/* Called by network, submit and API threads */
+void affinity_service_thread(void)
+{
+	if (service_pinned)
+		pin_thread(&service_cpus);
+}
+#else /* __linux */
+char *set_gpu_cpus(char *arg)
+{
+	gpu_cpulists = arg && *arg;
+	return NULL;
+}
+
+void affinity_init(void)
+{
+	if (opt_affinity != AFFINITY_NONE || gpu_cpulists)
+		applog(LOG_WARNING, "CPU affinity is not supported on this platform, ignoring it");
+}
+
+void affinity_gpu_enter(struct cgpu_info __maybe_unused *cgpu, struct affinity_saved *saved)
+{
+	saved->bound = false;
+}
+
+void affinity_gpu_leave(struct affinity_saved __maybe_unused *saved)
+{
+}
+
+void affinity_gpu_thread(struct cgpu_info __maybe_unused *cgpu)
+{
+}
+
+void affinity_gpu_verify(struct cgpu_info __maybe_unused *cgpu)
+{
+}
+
+void affinity_service_thread(void)
+{
+}
+#endif /* __linux */
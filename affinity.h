@@ -0,0 +1,32 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <stdbool.h>
+
+#ifdef __linux
+#include <sched.h>
+#endif
+
+struct cgpu_info;
+
+/* What affinity_gpu_enter() changed on the calling thread */
+struct affinity_saved {
+	bool bound;
+#ifdef __linux
+	cpu_set_t cpus;
+	bool policy;
+	int mode;
+	unsigned long nodes;
+#endif
+};
+
+extern char *set_affinity(char *arg);
+extern char *set_gpu_cpus(char *arg);
+extern void affinity_init(void);
+extern void affinity_gpu_enter(struct cgpu_info *cgpu, struct affinity_saved *saved);
+extern void affinity_gpu_leave(struct affinity_saved *saved);
+extern void affinity_gpu_thread(struct cgpu_info *cgpu);
+extern void affinity_gpu_verify(struct cgpu_info *cgpu);
+extern void affinity_service_thread(void);
+
+#endif /* __AFFINITY_H__ */
@@ -27,6 +27,9 @@
 #include "compat.h"
 #include "miner.h"
 #include "util.h"
+#include "trace.h"
+#include "work-pool.h"
+#include "dyntune.h"
 
 #if defined(USE_BFLSC) || defined(USE_AVALON)
 #define HAVE_AN_ASIC 1
@@ -236,6 +239,7 @@ static const char *OSINFO =
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
+#define _LATENCY	"LATENCY"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -278,6 +282,7 @@ static const char ISJSON = '{';
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
+#define JSON_LATENCY	JSON1 _LATENCY JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
@@ -412,6 +417,10 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_ASCNOID 114
 #endif
 #define MSG_ASCUSBNODEV 115
+#define MSG_LATENCY 116
+#define MSG_TRACE 117
+#define MSG_TRACEOFF 118
+#define MSG_TRACEERR 119
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -609,6 +618,10 @@ struct CODES {
  { SEVERITY_SUCC,  MSG_ASCIDENT,PARAM_ASC,	"Identify command sent to ASC%d" },
  { SEVERITY_WARN,  MSG_ASCNOID,	PARAM_ASC,	"ASC%d does not support identify" },
 #endif
+ { SEVERITY_SUCC,  MSG_LATENCY,	PARAM_NONE,	"Share latency" },
+ { SEVERITY_SUCC,  MSG_TRACE,	PARAM_BOTH,	"Wrote %d trace events to '%s'" },
+ { SEVERITY_ERR,   MSG_TRACEOFF,PARAM_NONE,	"Tracing is not enabled, start with --trace" },
+ { SEVERITY_ERR,   MSG_TRACEERR,PARAM_STR,	"Can't write trace file '%s'" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -1545,17 +1558,23 @@ static const char *status2str(enum alive status)
 static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
+	struct stats_snapshot stats;
+	struct cgpu_snapshot snap;
 	char intensity[20];
 	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
+	double utility;
 	float gt, gv;
 	int ga, gf, gp, gc, gm, pt;
 
 	if (gpu >= 0 && gpu < nDevs) {
 		struct cgpu_info *cgpu = &gpus[gpu];
 
-		cgpu->utility = cgpu->accepted / ( total_secs ? total_secs : 1 ) * 60;
+		get_stats_snapshot(&stats);
+		get_cgpu_snapshot(cgpu, &snap);
+
+		utility = snap.accepted / ( stats.total_secs ? stats.total_secs : 1 ) * 60;
 
 #ifdef HAVE_ADL
 		if (!gpu_stats(gpu, &gt, &gc, &gm, &gv, &ga, &gf, &gp, &pt))
@@ -1585,26 +1604,47 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 		root = api_add_volts(root, "GPU Voltage", &gv, false);
 		root = api_add_int(root, "GPU Activity", &ga, false);
 		root = api_add_int(root, "Powertune", &pt, false);
-		double mhs = cgpu->total_mhashes / total_secs;
+		double mhs = snap.total_mhashes / stats.total_secs;
 		root = api_add_mhs(root, "MHS av", &mhs, false);
 		char mhsname[27];
 		sprintf(mhsname, "MHS %ds", opt_log_interval);
-		root = api_add_mhs(root, mhsname, &(cgpu->rolling), false);
-		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
-		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
-		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
-		root = api_add_utility(root, "Utility", &(cgpu->utility), false);
+		root = api_add_mhs(root, mhsname, &(snap.rolling), false);
+		root = api_add_int(root, "Accepted", &(snap.accepted), false);
+		root = api_add_int(root, "Rejected", &(snap.rejected), false);
+		root = api_add_int(root, "Hardware Errors", &(snap.hw_errors), false);
+		root = api_add_utility(root, "Utility", &utility, false);
 		root = api_add_string(root, "Intensity", intensity, false);
-		int last_share_pool = cgpu->last_share_pool_time > 0 ?
-					cgpu->last_share_pool : -1;
+		int last_share_pool = snap.last_share_pool_time > 0 ?
+					snap.last_share_pool : -1;
 		root = api_add_int(root, "Last Share Pool", &last_share_pool, false);
-		root = api_add_time(root, "Last Share Time", &(cgpu->last_share_pool_time), false);
-		root = api_add_mhtotal(root, "Total MH", &(cgpu->total_mhashes), false);
-		root = api_add_int(root, "Diff1 Work", &(cgpu->diff1), false);
-		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
-		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
-		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
-		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
+		root = api_add_time(root, "Last Share Time", &(snap.last_share_pool_time), false);
+		root = api_add_mhtotal(root, "Total MH", &(snap.total_mhashes), false);
+		root = api_add_int(root, "Diff1 Work", &(snap.diff1), false);
+		root = api_add_diff(root, "Difficulty Accepted", &(snap.diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(snap.diff_rejected), false);
+		root = api_add_diff(root, "Last Share Difficulty", &(snap.last_share_diff), false);
+		root = api_add_time(root, "Last Valid Work", &(snap.last_device_valid_work), false);
+#ifdef USE_SCRYPT
+		double vram_mhs = snap.pad_hashes[PC_VRAM] / 1000000.0 / stats.total_secs;
+		double ram_mhs = snap.pad_hashes[PC_RAM] / 1000000.0 / stats.total_secs;
+		root = api_add_mhs(root, "VRAM MHS av", &vram_mhs, true);
+		root = api_add_mhs(root, "RAM MHS av", &ram_mhs, true);
+
+		struct dyntune_status tune;
+		uint64_t tune_threads, tune_max;
+
+		dyntune_status(cgpu, &tune);
+		tune_threads = tune.threads;
+		tune_max = tune.max_threads;
+		root = api_add_const(root, "Launch Tuner", dyntune_state_str(tune.state), false);
+		root = api_add_uint64(root, "Launch Threads", &tune_threads, true);
+		root = api_add_uint64(root, "Launch Max Threads", &tune_max, true);
+		root = api_add_int(root, "Launch Sub-batches", &tune.batches, true);
+		root = api_add_int(root, "Launch Max Sub-batches", &tune.max_batches, true);
+		root = api_add_mhs(root, "Launch MHS", &tune.mhs, true);
+		root = api_add_double(root, "Launch Scan ms", &tune.scan_ms, true);
+		root = api_add_uint(root, "Launch Searches", &tune.explores, true);
+#endif
 
 		root = print_data(root, buf, isjson, precom);
 		io_add(io_data, buf);
@@ -1627,6 +1667,8 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 			return;
 
 		struct cgpu_info *cgpu = get_devices(dev);
+		struct cgpu_snapshot snap;
+		double utility;
 		float temp = cgpu->temp;
 		struct timeval now;
 		double dev_runtime;
@@ -1641,7 +1683,9 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 		if (dev_runtime < 1.0)
 			dev_runtime = 1.0;
 
-		cgpu->utility = cgpu->accepted / dev_runtime * 60;
+		get_cgpu_snapshot(cgpu, &snap);
+
+		utility = snap.accepted / dev_runtime * 60;
 
 		if (cgpu->deven != DEV_DISABLED)
 			enabled = (char *)YES;
@@ -1656,28 +1700,28 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 		root = api_add_string(root, "Enabled", enabled, false);
 		root = api_add_string(root, "Status", status, false);
 		root = api_add_temp(root, "Temperature", &temp, false);
-		double mhs = cgpu->total_mhashes / dev_runtime;
+		double mhs = snap.total_mhashes / dev_runtime;
 		root = api_add_mhs(root, "MHS av", &mhs, false);
 		char mhsname[27];
 		sprintf(mhsname, "MHS %ds", opt_log_interval);
-		root = api_add_mhs(root, mhsname, &(cgpu->rolling), false);
-		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
-		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
-		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
-		root = api_add_utility(root, "Utility", &(cgpu->utility), false);
-		int last_share_pool = cgpu->last_share_pool_time > 0 ?
-					cgpu->last_share_pool : -1;
+		root = api_add_mhs(root, mhsname, &(snap.rolling), false);
+		root = api_add_int(root, "Accepted", &(snap.accepted), false);
+		root = api_add_int(root, "Rejected", &(snap.rejected), false);
+		root = api_add_int(root, "Hardware Errors", &(snap.hw_errors), false);
+		root = api_add_utility(root, "Utility", &utility, false);
+		int last_share_pool = snap.last_share_pool_time > 0 ?
+					snap.last_share_pool : -1;
 		root = api_add_int(root, "Last Share Pool", &last_share_pool, false);
-		root = api_add_time(root, "Last Share Time", &(cgpu->last_share_pool_time), false);
-		root = api_add_mhtotal(root, "Total MH", &(cgpu->total_mhashes), false);
-		root = api_add_int(root, "Diff1 Work", &(cgpu->diff1), false);
-		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
-		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
-		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
+		root = api_add_time(root, "Last Share Time", &(snap.last_share_pool_time), false);
+		root = api_add_mhtotal(root, "Total MH", &(snap.total_mhashes), false);
+		root = api_add_int(root, "Diff1 Work", &(snap.diff1), false);
+		root = api_add_diff(root, "Difficulty Accepted", &(snap.diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(snap.diff_rejected), false);
+		root = api_add_diff(root, "Last Share Difficulty", &(snap.last_share_diff), false);
 #ifdef USE_USBUTILS
 		root = api_add_bool(root, "No Device", &(cgpu->usbinfo.nodev), false);
 #endif
-		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
+		root = api_add_time(root, "Last Valid Work", &(snap.last_device_valid_work), false);
 
 		root = print_data(root, buf, isjson, precom);
 		io_add(io_data, buf);
@@ -1700,6 +1744,8 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 			return;
 
 		struct cgpu_info *cgpu = get_devices(dev);
+		struct cgpu_snapshot snap;
+		double utility;
 		double frequency = 0;
 		float temp = cgpu->temp;
 		struct timeval now;
@@ -1715,6 +1761,8 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 		if (dev_runtime < 1.0)
 			dev_runtime = 1.0;
 
+		get_cgpu_snapshot(cgpu, &snap);
+
 #ifdef USE_ZTEX
 		if (cgpu->drv->drv_id == DRIVER_ZTEX && cgpu->device_ztex)
 			frequency = cgpu->device_ztex->freqM1 * (cgpu->device_ztex->freqM + 1);
@@ -1724,7 +1772,7 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 			frequency = cgpu->clock;
 #endif
 
-		cgpu->utility = cgpu->accepted / dev_runtime * 60;
+		utility = snap.accepted / dev_runtime * 60;
 
 		if (cgpu->deven != DEV_DISABLED)
 			enabled = (char *)YES;
@@ -1739,29 +1787,29 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 		root = api_add_string(root, "Enabled", enabled, false);
 		root = api_add_string(root, "Status", status, false);
 		root = api_add_temp(root, "Temperature", &temp, false);
-		double mhs = cgpu->total_mhashes / dev_runtime;
+		double mhs = snap.total_mhashes / dev_runtime;
 		root = api_add_mhs(root, "MHS av", &mhs, false);
 		char mhsname[27];
 		sprintf(mhsname, "MHS %ds", opt_log_interval);
-		root = api_add_mhs(root, mhsname, &(cgpu->rolling), false);
-		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
-		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
-		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
-		root = api_add_utility(root, "Utility", &(cgpu->utility), false);
-		int last_share_pool = cgpu->last_share_pool_time > 0 ?
-					cgpu->last_share_pool : -1;
+		root = api_add_mhs(root, mhsname, &(snap.rolling), false);
+		root = api_add_int(root, "Accepted", &(snap.accepted), false);
+		root = api_add_int(root, "Rejected", &(snap.rejected), false);
+		root = api_add_int(root, "Hardware Errors", &(snap.hw_errors), false);
+		root = api_add_utility(root, "Utility", &utility, false);
+		int last_share_pool = snap.last_share_pool_time > 0 ?
+					snap.last_share_pool : -1;
 		root = api_add_int(root, "Last Share Pool", &last_share_pool, false);
-		root = api_add_time(root, "Last Share Time", &(cgpu->last_share_pool_time), false);
-		root = api_add_mhtotal(root, "Total MH", &(cgpu->total_mhashes), false);
+		root = api_add_time(root, "Last Share Time", &(snap.last_share_pool_time), false);
+		root = api_add_mhtotal(root, "Total MH", &(snap.total_mhashes), false);
 		root = api_add_freq(root, "Frequency", &frequency, false);
-		root = api_add_int(root, "Diff1 Work", &(cgpu->diff1), false);
-		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
-		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
-		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
+		root = api_add_int(root, "Diff1 Work", &(snap.diff1), false);
+		root = api_add_diff(root, "Difficulty Accepted", &(snap.diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(snap.diff_rejected), false);
+		root = api_add_diff(root, "Last Share Difficulty", &(snap.last_share_diff), false);
 #ifdef USE_USBUTILS
 		root = api_add_bool(root, "No Device", &(cgpu->usbinfo.nodev), false);
 #endif
-		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
+		root = api_add_time(root, "Last Valid Work", &(snap.last_device_valid_work), false);
 
 		root = print_data(root, buf, isjson, precom);
 		io_add(io_data, buf);
@@ -2071,10 +2119,13 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 
 	for (i = 0; i < total_pools; i++) {
 		struct pool *pool = pools[i];
+		struct pool_snapshot snap;
 
 		if (pool->removed)
 			continue;
 
+		get_pool_snapshot(pool, &snap);
+
 		switch (pool->enabled) {
 			case POOL_DISABLED:
 				status = (char *)DISABLED;
@@ -2103,16 +2154,16 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_string(root, "Status", status, false);
 		root = api_add_int(root, "Priority", &(pool->prio), false);
 		root = api_add_string(root, "Long Poll", lp, false);
-		root = api_add_uint(root, "Getworks", &(pool->getwork_requested), false);
-		root = api_add_int(root, "Accepted", &(pool->accepted), false);
-		root = api_add_int(root, "Rejected", &(pool->rejected), false);
-		root = api_add_uint(root, "Discarded", &(pool->discarded_work), false);
-		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
-		root = api_add_uint(root, "Get Failures", &(pool->getfail_occasions), false);
-		root = api_add_uint(root, "Remote Failures", &(pool->remotefail_occasions), false);
+		root = api_add_uint(root, "Getworks", &(snap.getwork_requested), false);
+		root = api_add_int(root, "Accepted", &(snap.accepted), false);
+		root = api_add_int(root, "Rejected", &(snap.rejected), false);
+		root = api_add_uint(root, "Discarded", &(snap.discarded_work), false);
+		root = api_add_uint(root, "Stale", &(snap.stale_shares), false);
+		root = api_add_uint(root, "Get Failures", &(snap.getfail_occasions), false);
+		root = api_add_uint(root, "Remote Failures", &(snap.remotefail_occasions), false);
 		root = api_add_escape(root, "User", pool->rpc_user, false);
-		root = api_add_time(root, "Last Share Time", &(pool->last_share_time), false);
-		root = api_add_int(root, "Diff1 Shares", &(pool->diff1), false);
+		root = api_add_time(root, "Last Share Time", &(snap.last_share_time), false);
+		root = api_add_int(root, "Diff1 Shares", &(snap.diff1), false);
 		if (pool->rpc_proxy) {
 			root = api_add_const(root, "Proxy Type", proxytype(pool->rpc_proxytype), false);
 			root = api_add_escape(root, "Proxy", pool->rpc_proxy, false);
@@ -2120,10 +2171,10 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 			root = api_add_const(root, "Proxy Type", BLANK, false);
 			root = api_add_const(root, "Proxy", BLANK, false);
 		}
-		root = api_add_diff(root, "Difficulty Accepted", &(pool->diff_accepted), false);
-		root = api_add_diff(root, "Difficulty Rejected", &(pool->diff_rejected), false);
-		root = api_add_diff(root, "Difficulty Stale", &(pool->diff_stale), false);
-		root = api_add_diff(root, "Last Share Difficulty", &(pool->last_share_diff), false);
+		root = api_add_diff(root, "Difficulty Accepted", &(snap.diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(snap.diff_rejected), false);
+		root = api_add_diff(root, "Difficulty Stale", &(snap.diff_stale), false);
+		root = api_add_diff(root, "Last Share Difficulty", &(snap.last_share_diff), false);
 		root = api_add_bool(root, "Has Stratum", &(pool->has_stratum), false);
 		root = api_add_bool(root, "Stratum Active", &(pool->stratum_active), false);
 		if (pool->stratum_active)
@@ -2131,7 +2182,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		else
 			root = api_add_const(root, "Stratum URL", BLANK, false);
 		root = api_add_bool(root, "Has GBT", &(pool->has_gbt), false);
-		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_uint64(root, "Best Share", &(snap.best_diff), true);
 
 		root = print_data(root, buf, isjson, isjson && (i > 0));
 		io_add(io_data, buf);
@@ -2144,42 +2195,50 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
+	struct stats_snapshot snap;
 	char buf[TMPBUFSIZ];
 	bool io_open;
 	double utility, mhs, work_utility;
+	uint64_t log_dropped;
+	struct work_pool_stats wps;
 
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
 
-	// stop hashmeter() changing some while copying
-	mutex_lock(&hash_lock);
+	get_stats_snapshot(&snap);
 
-	utility = total_accepted / ( total_secs ? total_secs : 1 ) * 60;
-	mhs = total_mhashes_done / total_secs;
-	work_utility = total_diff1 / ( total_secs ? total_secs : 1 ) * 60;
+	utility = snap.total_accepted / ( snap.total_secs ? snap.total_secs : 1 ) * 60;
+	mhs = snap.total_mhashes_done / snap.total_secs;
+	work_utility = snap.total_diff1 / ( snap.total_secs ? snap.total_secs : 1 ) * 60;
 
-	root = api_add_elapsed(root, "Elapsed", &(total_secs), true);
+	root = api_add_elapsed(root, "Elapsed", &(snap.total_secs), true);
 	root = api_add_mhs(root, "MHS av", &(mhs), false);
-	root = api_add_uint(root, "Found Blocks", &(found_blocks), true);
-	root = api_add_int(root, "Getworks", &(total_getworks), true);
-	root = api_add_int(root, "Accepted", &(total_accepted), true);
-	root = api_add_int(root, "Rejected", &(total_rejected), true);
-	root = api_add_int(root, "Hardware Errors", &(hw_errors), true);
+	root = api_add_uint(root, "Found Blocks", &(snap.found_blocks), true);
+	root = api_add_int(root, "Getworks", &(snap.total_getworks), true);
+	root = api_add_int(root, "Accepted", &(snap.total_accepted), true);
+	root = api_add_int(root, "Rejected", &(snap.total_rejected), true);
+	root = api_add_int(root, "Hardware Errors", &(snap.hw_errors), true);
 	root = api_add_utility(root, "Utility", &(utility), false);
-	root = api_add_int(root, "Discarded", &(total_discarded), true);
-	root = api_add_int(root, "Stale", &(total_stale), true);
-	root = api_add_uint(root, "Get Failures", &(total_go), true);
-	root = api_add_uint(root, "Local Work", &(local_work), true);
-	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
-	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
-	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
+	root = api_add_int(root, "Discarded", &(snap.total_discarded), true);
+	root = api_add_int(root, "Stale", &(snap.total_stale), true);
+	root = api_add_uint(root, "Get Failures", &(snap.total_go), true);
+	root = api_add_uint(root, "Local Work", &(snap.local_work), true);
+	root = api_add_uint(root, "Remote Failures", &(snap.total_ro), true);
+	root = api_add_uint(root, "Network Blocks", &(snap.new_blocks), true);
+	root = api_add_mhtotal(root, "Total MH", &(snap.total_mhashes_done), true);
 	root = api_add_utility(root, "Work Utility", &(work_utility), false);
-	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
-	root = api_add_diff(root, "Difficulty Rejected", &(total_diff_rejected), true);
-	root = api_add_diff(root, "Difficulty Stale", &(total_diff_stale), true);
-	root = api_add_uint64(root, "Best Share", &(best_diff), true);
-
-	mutex_unlock(&hash_lock);
+	root = api_add_diff(root, "Difficulty Accepted", &(snap.total_diff_accepted), true);
+	root = api_add_diff(root, "Difficulty Rejected", &(snap.total_diff_rejected), true);
+	root = api_add_diff(root, "Difficulty Stale", &(snap.total_diff_stale), true);
+	root = api_add_uint64(root, "Best Share", &(snap.best_diff), true);
+	log_dropped = log_drops();
+	root = api_add_uint64(root, "Log Dropped", &(log_dropped), true);
+	work_pool_stats(&wps);
+	root = api_add_uint64(root, "Work Cached", &(wps.cached), true);
+	root = api_add_uint64(root, "Work Depot", &(wps.depot), true);
+	root = api_add_uint64(root, "Work Allocated", &(wps.allocated), true);
+	root = api_add_uint64(root, "Work Strings Inline", &(wps.str_inline), true);
+	root = api_add_uint64(root, "Work Strings Heap", &(wps.str_heap), true);
 
 	root = print_data(root, buf, isjson, false);
 	io_add(io_data, buf);
@@ -3298,6 +3357,89 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 #endif
 }
 
+static void sharelatency(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+	bool io_open = false;
+	int i, j, n = 0;
+
+	if (total_pools == 0) {
+		message(io_data, MSG_NOPOOL, 0, NULL, isjson);
+		return;
+	}
+
+	message(io_data, MSG_LATENCY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LATENCY);
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->removed)
+			continue;
+
+		for (j = 0; j < SS_MAX; j++) {
+			struct latency_hist *hist = &pool->latency[j];
+			uint64_t count = hist->count;
+			double mean, p50, p90, p99, p999, max;
+
+			mean = count ? (double)hist->sum_us / count / 1000.0 : 0;
+			p50 = latency_percentile(hist, 50.0) / 1000.0;
+			p90 = latency_percentile(hist, 90.0) / 1000.0;
+			p99 = latency_percentile(hist, 99.0) / 1000.0;
+			p999 = latency_percentile(hist, 99.9) / 1000.0;
+			max = hist->max_us / 1000.0;
+
+			root = api_add_int(root, "POOL", &i, false);
+			root = api_add_const(root, "Stage", share_stage_names[j], false);
+			root = api_add_uint64(root, "Count", &count, true);
+			root = api_add_double(root, "Mean ms", &mean, true);
+			root = api_add_double(root, "P50 ms", &p50, true);
+			root = api_add_double(root, "P90 ms", &p90, true);
+			root = api_add_double(root, "P99 ms", &p99, true);
+			root = api_add_double(root, "P99.9 ms", &p999, true);
+			root = api_add_double(root, "Max ms", &max, true);
+
+			root = print_data(root, buf, isjson, isjson && (n > 0));
+			io_add(io_data, buf);
+			n++;
+		}
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+static void tracedump(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	char filename[PATH_MAX];
+	int events;
+	char *ptr;
+
+	if (!opt_trace) {
+		message(io_data, MSG_TRACEOFF, 0, NULL, isjson);
+		return;
+	}
+
+	if (param == NULL || *param == '\0') {
+		trace_default_file(filename, sizeof(filename));
+		param = filename;
+	}
+
+	events = trace_dump(param);
+
+	ptr = escape_string(param, isjson);
+	if (events < 0)
+		message(io_data, MSG_TRACEERR, 0, ptr, isjson);
+	else
+		message(io_data, MSG_TRACE, events, ptr, isjson);
+	if (ptr != param)
+		free(ptr);
+	ptr = NULL;
+}
+
 #ifdef HAVE_AN_FPGA
 static void pgaset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
@@ -3694,6 +3836,8 @@ struct CMDS {
 	{ "debug",		debugstate,	true },
 	{ "setconfig",		setconfig,	true },
 	{ "usbstats",		usbstats,	false },
+	{ "latency",		sharelatency,	false },
+	{ "tracedump",		tracedump,	true },
 #ifdef HAVE_AN_FPGA
 	{ "pgaset",		pgaset,		true },
 #endif
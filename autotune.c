@@ -0,0 +1,446 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Scrypt lookup gap, thread concurrency, worksize and split kernel auto-tuner.
+ * Before a GPU starts mining, each candidate setting is built with initCl()
+ * and the kernel run on a generated header for a few seconds. The search is
+ * one dimension at a time, holding the others at their best so far, and
+ * settings given on the command line are left alone. The winner is stored in
+ * a JSON tuning cache keyed by device name, algorithm and Nfactor, so later
+ * starts with the same key skip straight to mining. When scrypt-chacha moves
+ * a GPU to a new Nfactor, its background plan build takes the cached settings
+ * for that Nfactor, and if there are none the candidates are timed between
+ * releasing the old plan and starting the new one.
+ */
+
+#include "config.h"
+
+#if defined(HAVE_OPENCL) && defined(USE_SCRYPT)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "ocl.h"
+#include "util.h"
+#include "autotune.h"
+
+bool opt_autotune;
+/* Tuning cache, kept next to the kernel binaries by default */
+char *opt_tune_file;
+/* Seconds each candidate is timed for */
+int opt_tune_time = 5;
+
+#define TUNE_FILE	"yacminer.tune"
+
+static const int tune_lookup_gaps[] = { 1, 2, 4, 8, 16, 32, 0 };
+static const int tune_worksizes[] = { 8, 16, 32, 64, 128, 256, 0 };
+/* Thread concurrency as a percentage of what fits in memory */
+static const int tune_tc_percent[] = { 75, 50, 0 };
+
+struct tune_cfg {
+	int lookup_gap;
+	size_t thread_concurrency;	/* 0 fills the available memory */
+	size_t worksize;		/* 0 is the initCl() default */
+	int split_kernels;		/* as cgpu_info.split_kernels */
+	size_t threads;			/* thread concurrency the trial ran with */
+	double hashrate;
+};
+
+static bool tune_done[MAX_GPUDEVICES];
+/* Settings given on the command line, before any tune was applied */
+static struct tune_cfg tune_given[MAX_GPUDEVICES];
+
+static const char *tune_path(void)
+{
+	return opt_tune_file ? opt_tune_file : TUNE_FILE;
+}
+
+static const char *tune_algo(void)
+{
+	if (opt_scrypt_chacha_84)
+		return "scrypt-chacha-84";
+	if (opt_scrypt_chacha)
+		return "scrypt-chacha";
+	if (opt_n_scrypt)
+		return "nscrypt";
+	return "scrypt";
+}
+
+/* Nfactor the scratchpads are first planned for */
+static int tune_nfactor(void)
+{
+	return scrypt_start_nfactor();
+}
+
+static void tune_apply(struct cgpu_info *cgpu, const struct tune_cfg *cfg)
+{
+	cgpu->opt_lg = cfg->lookup_gap;
+	cgpu->opt_tc = cfg->thread_concurrency;
+	cgpu->work_size = cfg->worksize;
+	cgpu->split_kernels = cfg->split_kernels;
+}
+
+static void tune_describe(char *buf, size_t len, const struct tune_cfg *cfg)
+{
+	snprintf(buf, len, "lookup gap %d, thread concurrency %zu, worksize %zu%s",
+		 cfg->lookup_gap, cfg->threads ? cfg->threads : cfg->thread_concurrency,
+		 cfg->worksize,
+		 cfg->split_kernels > 0 ? ", split" : cfg->split_kernels < 0 ? ", monolithic" : "");
+}
+
+static json_t *tune_load(void)
+{
+	json_error_t err;
+	json_t *root;
+
+#if JANSSON_MAJOR_VERSION > 1
+	root = json_load_file(tune_path(), 0, &err);
+#else
+	root = json_load_file(tune_path(), &err);
+#endif
+	if (!json_is_object(root)) {
+		if (root)
+			json_decref(root);
+		root = json_object();
+	}
+	if (!json_is_array(json_object_get(root, "tunes")))
+		json_object_set_new(root, "tunes", json_array());
+	return root;
+}
+
+static int tune_find(json_t *tunes, const char *name, int nfactor)
+{
+	size_t i;
+
+	for (i = 0; i < json_array_size(tunes); i++) {
+		json_t *val = json_array_get(tunes, i);
+		const char *dev = json_string_value(json_object_get(val, "device"));
+		const char *algo = json_string_value(json_object_get(val, "algorithm"));
+
+		if (dev && algo && !strcmp(dev, name) && !strcmp(algo, tune_algo()) &&
+		    json_integer_value(json_object_get(val, "nfactor")) == nfactor)
+			return i;
+	}
+	return -1;
+}
+
+static bool tune_lookup(const char *name, int nfactor, struct tune_cfg *cfg)
+{
+	json_t *root = tune_load();
+	json_t *tunes = json_object_get(root, "tunes");
+	int i = tune_find(tunes, name, nfactor);
+
+	if (i >= 0) {
+		json_t *val = json_array_get(tunes, i);
+
+		cfg->lookup_gap = json_integer_value(json_object_get(val, "lookup-gap"));
+		cfg->thread_concurrency = json_integer_value(json_object_get(val, "thread-concurrency"));
+		cfg->worksize = json_integer_value(json_object_get(val, "worksize"));
+		cfg->split_kernels = json_integer_value(json_object_get(val, "split-kernels"));
+		cfg->hashrate = json_number_value(json_object_get(val, "hashrate"));
+	}
+	json_decref(root);
+	return i >= 0 && cfg->lookup_gap > 0;
+}
+
+static void tune_store(const char *name, int nfactor, const struct tune_cfg *cfg)
+{
+	json_t *root = tune_load();
+	json_t *tunes = json_object_get(root, "tunes");
+	json_t *val = json_object();
+	int i = tune_find(tunes, name, nfactor);
+
+	json_object_set_new(val, "device", json_string(name));
+	json_object_set_new(val, "algorithm", json_string(tune_algo()));
+	json_object_set_new(val, "nfactor", json_integer(nfactor));
+	json_object_set_new(val, "lookup-gap", json_integer(cfg->lookup_gap));
+	json_object_set_new(val, "thread-concurrency", json_integer(cfg->thread_concurrency));
+	json_object_set_new(val, "worksize", json_integer(cfg->worksize));
+	json_object_set_new(val, "split-kernels", json_integer(cfg->split_kernels));
+	json_object_set_new(val, "hashrate", json_real(cfg->hashrate));
+	if (i >= 0)
+		json_array_set_new(tunes, i, val);
+	else
+		json_array_append_new(tunes, val);
+
+	if (json_dump_file(root, tune_path(), JSON_INDENT(1)))
+		applog(LOG_WARNING, "Failed to write tuning cache %s", tune_path());
+	json_decref(root);
+}
+
+#define TUNE_SET_ARG(var) status |= clSetKernelArg(kernel, num++, sizeof(var), (void *)&var)
+
+/* Sub-batched kernels take their first thread after the num arguments set.
+ * The queue may be out of order, so the launch waits on *chain, the launch
+ * before it, and replaces it as the one the next launch waits on. */
+static cl_int tune_enqueue(_clState *clState, cl_kernel kernel, cl_uint num, size_t threads,
+			   cl_event *chain)
+{
+	size_t offset[1] = { 0 }, global[1] = { threads }, local[1] = { clState->wsize };
+	cl_uint tid_base = 0;
+	cl_event event = NULL;
+	cl_int status;
+
+	if (clState->sub_batches > 1) {
+		status = clSetKernelArg(kernel, num, sizeof(tid_base), &tid_base);
+		if (status != CL_SUCCESS)
+			return status;
+	}
+	status = clEnqueueNDRangeKernel(clState->commandQueue, kernel, 1,
+					clState->goffset ? offset : NULL, global, local,
+					*chain ? 1 : 0, *chain ? chain : NULL, &event);
+	if (status != CL_SUCCESS)
+		return status;
+	if (*chain)
+		clReleaseEvent(*chain);
+	*chain = event;
+	return CL_SUCCESS;
+}
+
+/* One launch over the whole thread concurrency, the same argument order as
+ * queue_scrypt_kernel() and the split path of opencl_scanhash() */
+static bool tune_run(_clState *clState, size_t threads)
+{
+	cl_uint target = 0, nfactor = opt_scrypt_chacha ? clState->nfactor : tune_nfactor();
+	cl_kernel kernel;
+	cl_event chain = NULL;
+	cl_uint num;
+	cl_int status = 0;
+
+	if (clState->use_split_kernels) {
+		kernel = clState->kernel_part1;
+		num = 0;
+		TUNE_SET_ARG(clState->CLbuffer0);
+		TUNE_SET_ARG(clState->temp_X_buffer);
+		status |= tune_enqueue(clState, kernel, num, threads, &chain);
+
+		kernel = clState->kernel_part2;
+		num = 0;
+		TUNE_SET_ARG(clState->temp_X_buffer);
+		TUNE_SET_ARG(clState->temp_X2_buffer);
+		status |= scrypt_set_pad_args(clState, kernel, &num);
+		TUNE_SET_ARG(nfactor);
+		status |= tune_enqueue(clState, kernel, num, threads, &chain);
+
+		kernel = clState->kernel_part3;
+		num = 0;
+		TUNE_SET_ARG(clState->CLbuffer0);
+		TUNE_SET_ARG(clState->temp_X2_buffer);
+		TUNE_SET_ARG(clState->outputBuffer);
+		TUNE_SET_ARG(target);
+		status |= tune_enqueue(clState, kernel, num, threads, &chain);
+	} else {
+		kernel = clState->kernel;
+		num = 0;
+		TUNE_SET_ARG(clState->CLbuffer0);
+		TUNE_SET_ARG(clState->outputBuffer);
+		status |= scrypt_set_pad_args(clState, kernel, &num);
+		TUNE_SET_ARG(target);
+		if (clState->chosen_kernel == KL_N_SCRYPT || clState->chosen_kernel == KL_SCRYPT_CHACHA)
+			TUNE_SET_ARG(nfactor);
+		status |= tune_enqueue(clState, kernel, num, threads, &chain);
+	}
+	status |= clFinish(clState->commandQueue);
+	if (chain)
+		clReleaseEvent(chain);
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_INFO, "Error %d: tuning kernel launch failed", status);
+		return false;
+	}
+	return true;
+}
+
+/* Build cfg and time it, the hash rate ends up in cfg, 0 if it can't run */
+static void tune_trial(struct cgpu_info *cgpu, int nfactor, struct tune_cfg *cfg)
+{
+	struct timeval tv_start, tv_now;
+	unsigned char header[84];
+	double hashes = 0, secs = 0;
+	_clState *clState;
+	char name[256], desc[128];
+	size_t threads = 0;
+	int i;
+
+	cfg->hashrate = 0;
+	cfg->threads = 0;
+	tune_apply(cgpu, cfg);
+	clState = initCl(cgpu->virtual_gpu, name, sizeof(name), nfactor);
+	if (!clState) {
+		tune_describe(desc, sizeof(desc), cfg);
+		applog(LOG_INFO, "GPU %d: tuning %s failed to initialise", cgpu->device_id, desc);
+		return;
+	}
+	/* initCl() quietly replaces a worksize the device can't take */
+	if (!cfg->worksize || clState->wsize == cfg->worksize)
+		threads = clState->thread_concurrency / clState->wsize * clState->wsize;
+	cfg->worksize = clState->wsize;
+
+	for (i = 0; i < (int)sizeof(header); i++)
+		header[i] = i * 7 + 1;
+
+	if (threads && clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0, CL_TRUE, 0,
+					    opt_scrypt_chacha_84 ? 84 : 80, header, 0, NULL, NULL) == CL_SUCCESS &&
+	    /* The first launch pages in the scratchpads and isn't timed */
+	    tune_run(clState, threads)) {
+		cgtime(&tv_start);
+		do {
+			if (!tune_run(clState, threads)) {
+				hashes = 0;
+				break;
+			}
+			hashes += threads;
+			cgtime(&tv_now);
+			secs = tdiff(&tv_now, &tv_start);
+		} while (secs < opt_tune_time);
+		if (hashes)
+			cfg->hashrate = hashes / secs;
+		cfg->threads = threads;
+	}
+	releaseCl(clState);
+	free(clState);
+
+	tune_describe(desc, sizeof(desc), cfg);
+	applog(LOG_NOTICE, "GPU %d: tuning %s: %.1f hash/s", cgpu->device_id, desc, cfg->hashrate);
+}
+
+static void tune_try(struct cgpu_info *cgpu, int nfactor, struct tune_cfg *cfg,
+		     struct tune_cfg *best)
+{
+	tune_trial(cgpu, nfactor, cfg);
+	if (cfg->hashrate > best->hashrate)
+		*best = *cfg;
+}
+
+/* Apply the tuned settings for nfactor from the cache, or time the candidates
+ * if trials is set and there are none, or else go back to the command line
+ * settings. The GPU's plan must not be holding memory while trials run. */
+static void tune_device(struct cgpu_info *cgpu, int nfactor, bool trials)
+{
+	const struct tune_cfg given = tune_given[cgpu->device_id];
+	struct tune_cfg best, cfg;
+	char name[256], desc[128];
+	int i;
+
+	if (!clDeviceName(cgpu->virtual_gpu, name, sizeof(name))) {
+		applog(LOG_WARNING, "GPU %d: unable to get the device name, not tuning", cgpu->device_id);
+		tune_apply(cgpu, &given);
+		return;
+	}
+
+	if (tune_lookup(name, nfactor, &best)) {
+		/* Command line settings still win over the cache */
+		if (given.lookup_gap)
+			best.lookup_gap = given.lookup_gap;
+		if (given.thread_concurrency)
+			best.thread_concurrency = given.thread_concurrency;
+		if (given.worksize)
+			best.worksize = given.worksize;
+		if (given.split_kernels)
+			best.split_kernels = given.split_kernels;
+		best.threads = 0;
+		tune_apply(cgpu, &best);
+		tune_describe(desc, sizeof(desc), &best);
+		applog(LOG_NOTICE, "GPU %d: using tuned %s for %s Nfactor %d from %s",
+		       cgpu->device_id, desc, tune_algo(), nfactor, tune_path());
+		return;
+	}
+	/* Not the last Nfactor's tune, whose thread concurrency may not fit */
+	if (!trials) {
+		tune_apply(cgpu, &given);
+		return;
+	}
+
+	applog(LOG_NOTICE, "GPU %d: tuning %.64s %s Nfactor %d, %d seconds per setting",
+	       cgpu->device_id, name, tune_algo(), nfactor, opt_tune_time);
+
+	best = given;
+
+	if (!given.lookup_gap) {
+		for (i = 0; tune_lookup_gaps[i]; i++) {
+			cfg = best;
+			cfg.lookup_gap = tune_lookup_gaps[i];
+			tune_try(cgpu, nfactor, &cfg, &best);
+		}
+	} else {
+		cfg = best;
+		tune_try(cgpu, nfactor, &cfg, &best);
+	}
+
+	if (!given.worksize && best.hashrate > 0) {
+		for (i = 0; tune_worksizes[i]; i++) {
+			cfg = best;
+			cfg.worksize = tune_worksizes[i];
+			tune_try(cgpu, nfactor, &cfg, &best);
+		}
+	}
+
+	/* Fewer threads than fit can win when the scratchpads thrash the
+	 * memory controller */
+	if (!given.thread_concurrency && best.hashrate > 0) {
+		size_t full = best.threads;
+
+		for (i = 0; tune_tc_percent[i]; i++) {
+			cfg = best;
+			cfg.thread_concurrency = full * tune_tc_percent[i] / 100 / cfg.worksize * cfg.worksize;
+			if (cfg.thread_concurrency)
+				tune_try(cgpu, nfactor, &cfg, &best);
+		}
+	}
+
+	if (opt_scrypt_chacha_84 && best.hashrate > 0) {
+		cfg = best;
+		cfg.split_kernels = (cfg.split_kernels ? cfg.split_kernels > 0 : opt_scrypt_split_kernels) ? -1 : 1;
+		tune_try(cgpu, nfactor, &cfg, &best);
+	}
+
+	if (best.hashrate <= 0) {
+		applog(LOG_WARNING, "GPU %d: no tuning candidate ran, using the defaults", cgpu->device_id);
+		tune_apply(cgpu, &given);
+		return;
+	}
+
+	tune_apply(cgpu, &best);
+	tune_describe(desc, sizeof(desc), &best);
+	applog(LOG_NOTICE, "GPU %d: tuned %s, %.1f hash/s", cgpu->device_id, desc, best.hashrate);
+	best.threads = 0;
+	tune_store(name, nfactor, &best);
+}
+
+/* Pick the lookup gap, thread concurrency, worksize and kernel split for a GPU
+ * before its first initCl(), from the tuning cache or by timing candidates */
+void autotune_device(struct cgpu_info *cgpu)
+{
+	struct tune_cfg *given;
+
+	if (!opt_autotune || !opt_scrypt || cgpu->device_id >= MAX_GPUDEVICES ||
+	    tune_done[cgpu->device_id])
+		return;
+	tune_done[cgpu->device_id] = true;
+
+	given = &tune_given[cgpu->device_id];
+	memset(given, 0, sizeof(*given));
+	given->lookup_gap = cgpu->opt_lg;
+	given->thread_concurrency = cgpu->opt_tc;
+	given->worksize = cgpu->work_size;
+	given->split_kernels = cgpu->split_kernels;
+	tune_device(cgpu, tune_nfactor(), true);
+}
+
+/* The same for a GPU moving its plan to a new Nfactor. Without trials only a
+ * cached tune is applied, as the background plan build runs while the old
+ * plan still holds the GPU's memory. Trials are only run with one thread on
+ * the GPU, since other threads keep their plans until they swap too. */
+void autotune_nfactor(struct cgpu_info *cgpu, int nfactor, bool trials)
+{
+	if (!opt_autotune || !opt_scrypt || cgpu->device_id >= MAX_GPUDEVICES ||
+	    !tune_done[cgpu->device_id])
+		return;
+	tune_device(cgpu, nfactor, trials && cgpu->threads == 1);
+}
+#endif /* HAVE_OPENCL && USE_SCRYPT */
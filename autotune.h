@@ -0,0 +1,25 @@
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+
+#include "miner.h"
+
+#if defined(HAVE_OPENCL) && defined(USE_SCRYPT)
+extern bool opt_autotune;
+extern char *opt_tune_file;
+extern int opt_tune_time;
+
+extern void autotune_device(struct cgpu_info *cgpu);
+extern void autotune_nfactor(struct cgpu_info *cgpu, int nfactor, bool trials);
+
+#else /* HAVE_OPENCL && USE_SCRYPT */
+static inline void autotune_device(__maybe_unused struct cgpu_info *cgpu)
+{
+}
+
+static inline void autotune_nfactor(__maybe_unused struct cgpu_info *cgpu,
+				    __maybe_unused int nfactor, __maybe_unused bool trials)
+{
+}
+#endif /* HAVE_OPENCL && USE_SCRYPT */
+
+#endif /* __AUTOTUNE_H__ */
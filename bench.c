@@ -0,0 +1,340 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Offline scrypt-chacha benchmark. Instead of the SHA256 bitcoin block used
+ * by --benchmark, every work item is a deterministic 84 (or 80) byte header
+ * generated from a sequence number, with a chosen timestamp and an easy
+ * target so the devices keep producing shares. Each share is rehashed on the
+ * CPU like a real one, and the CPU verifier itself is checked against known
+ * answers before mining starts. On exit a JSON report of the steady state
+ * per device figures is written for regression tracking.
+ */
+
+#include "config.h"
+
+#ifdef USE_SCRYPT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "util.h"
+#include "scrypt-jane.h"
+#include "bench.h"
+
+/* Seconds of mining excluded from the steady state figures */
+#define BENCH_WARMUP	10
+
+/* Timestamp of the generated work, selects the Nfactor when --fixed-nfactor
+ * is 0 */
+unsigned int opt_bench_ntime = 1400000000;
+/* Share difficulty of the generated work, below 1 gives more shares */
+float opt_bench_diff = 1.0;
+int opt_bench_time;
+char *opt_bench_report;
+
+struct bench_dev {
+	struct latency_hist verify;
+	int valid, invalid;
+	double mhashes;
+	double kernel_secs[KS_MAX];
+	uint64_t kernel_runs[KS_MAX];
+};
+
+static struct bench_dev *bench_devs;
+static int bench_ndevs;
+static uint32_t bench_seq;
+static uint32_t bench_target;
+static struct timeval bench_tv_start, bench_tv_warm;
+static bool bench_warm, bench_quitting, bench_reported;
+static const char *bench_kat = "skipped";
+
+/* Known answers for sc_scrypt_regenhash on the sequence 0 header with
+ * timestamp BENCH_KAT_NTIME, hashes shown big endian */
+#define BENCH_KAT_NTIME	1400000000
+
+struct bench_kat {
+	int nfactor;
+	int size;
+	uint32_t nonce;
+	const char *hash;
+};
+
+static const struct bench_kat bench_kats[] = {
+	{  4, 84, 0x12345678, "e3d098c4539e61f8338dea3c0a5ebb373042a7aac9607d7374bc54ce10ca67f1" },
+	{  8, 84, 0x12345679, "83ac443c782220898f4afdbb7f4a15d98e2e54ba2212111356d7788b88b0e34c" },
+	{ 12, 84, 0x1234567a, "8390ca6be7c85ff07a4626532ccbf1885c6f402e14d2e5f9540c594e701ec2e8" },
+	{  4, 80, 0x12345678, "a34c3903afe937500e16cea7be066bdcf97ecb36067eeaa180a097532ea68a9b" },
+	{  8, 80, 0x12345679, "90d29b6f9c3f24f97ea06924590f39244d0e082ba5d6b053ae771963ed1f1b3d" },
+	{ 12, 80, 0x1234567a, "1a9d759bcd329eecd42675e0c9b38dd07e5a03b63fa73ec798e80c2c3c1e158d" },
+	{ 0, 0, 0, NULL }
+};
+
+static uint32_t bench_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/* work->data holds the header as byteswapped words, the same way the pools'
+ * work is stored, so the timestamp is swapped in here */
+static void bench_fill(struct work *work, uint32_t seq, unsigned int ntime)
+{
+	uint32_t *data = (uint32_t *)work->data;
+	uint32_t state = 0x9e3779b9 * (seq + 1);
+	int i;
+
+	memset(work->data, 0, sizeof(work->data));
+	data[0] = htobe32(2);
+	for (i = 1; i < 17; i++)
+		data[i] = bench_rand(&state);
+	data[17] = htobe32(ntime);
+	if (opt_scrypt_chacha_84) {
+		data[18] = 0;
+		data[19] = htobe32(0x1e0fffff);
+	} else
+		data[18] = htobe32(0x1e0fffff);
+}
+
+static bool bench_check_kats(void)
+{
+	int saved_nfactor = opt_fixed_nfactor;
+	bool saved_84 = opt_scrypt_chacha_84;
+	const struct bench_kat *kat;
+	struct pool pool;
+	struct work *work;
+	bool ret = true;
+
+	work = calloc(1, sizeof(*work));
+	if (unlikely(!work))
+		quit(1, "Failed to calloc work in bench_check_kats");
+	memset(&pool, 0, sizeof(pool));
+	work->pool = &pool;
+
+	for (kat = bench_kats; kat->hash; kat++) {
+		uint32_t *nonce, hash_be[8];
+		char *hexstr;
+
+		opt_fixed_nfactor = kat->nfactor;
+		opt_scrypt_chacha_84 = (kat->size == 84);
+		bench_fill(work, 0, BENCH_KAT_NTIME);
+		nonce = (uint32_t *)(work->data + (kat->size == 84 ? 80 : 76));
+		*nonce = htobe32(kat->nonce);
+		sc_scrypt_regenhash(work);
+
+		swab256(hash_be, work->hash);
+		hexstr = bin2hex((unsigned char *)hash_be, 32);
+		if (strcmp(hexstr, kat->hash)) {
+			applog(LOG_ERR, "Benchmark known answer failed for %d byte header at Nfactor %d: %s, expected %s",
+			       kat->size, kat->nfactor, hexstr, kat->hash);
+			ret = false;
+		}
+		free(hexstr);
+	}
+
+	opt_fixed_nfactor = saved_nfactor;
+	opt_scrypt_chacha_84 = saved_84;
+	free(work);
+	return ret;
+}
+
+void bench_init(void)
+{
+	double target;
+	int nfactor;
+
+	if (!opt_scrypt_chacha)
+		return;
+
+	target = 0x0000ffff / (opt_bench_diff > 0 ? opt_bench_diff : 1.0);
+	bench_target = target >= 0xffffffff ? 0xffffffff : (uint32_t)target;
+
+	if (!bench_check_kats())
+		quit(1, "CPU share verification does not match the known answers");
+	bench_kat = "pass";
+
+	nfactor = GetNfactor(opt_bench_ntime, sc_minn, sc_maxn, sc_starttime);
+	applog(LOG_NOTICE, "Benchmarking scrypt-chacha %d byte work at Nfactor %d, share target %08x",
+	       opt_scrypt_chacha_84 ? 84 : 80, nfactor, bench_target);
+}
+
+void bench_start(void)
+{
+	if (!opt_scrypt_chacha)
+		return;
+	bench_ndevs = total_devices;
+	bench_devs = calloc(bench_ndevs ? bench_ndevs : 1, sizeof(*bench_devs));
+	if (unlikely(!bench_devs))
+		quit(1, "Failed to calloc bench_devs");
+	cgtime(&bench_tv_start);
+}
+
+void bench_get_work(struct work *work)
+{
+	uint32_t seq = __sync_fetch_and_add(&bench_seq, 1);
+
+	bench_fill(work, seq, opt_bench_ntime);
+	memset(work->target, 0xff, sizeof(work->target));
+	*(uint32_t *)(work->target + 28) = htole32(bench_target);
+}
+
+void bench_verified(struct cgpu_info *cgpu, double us, bool valid)
+{
+	struct bench_dev *dev;
+
+	if (!bench_devs || cgpu->cgminer_id >= bench_ndevs)
+		return;
+	dev = &bench_devs[cgpu->cgminer_id];
+	latency_add(&dev->verify, us);
+	if (valid)
+		__sync_fetch_and_add(&dev->valid, 1);
+	else
+		__sync_fetch_and_add(&dev->invalid, 1);
+}
+
+static void *bench_quit_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+	RenameThread("benchquit");
+
+	applog(LOG_WARNING, "Benchmark ran for %d seconds as requested, exiting", opt_bench_time);
+	kill_work();
+	return NULL;
+}
+
+/* Called from the watchdog, takes the warm up baseline and ends the run */
+void bench_poll(void)
+{
+	struct timeval now;
+	pthread_t pth;
+	double secs;
+	int i;
+
+	if (!bench_devs)
+		return;
+
+	cgtime(&now);
+	secs = tdiff(&now, &bench_tv_start);
+
+	if (!bench_warm && secs >= BENCH_WARMUP) {
+		for (i = 0; i < bench_ndevs; i++) {
+			struct cgpu_info *cgpu = devices[i];
+			struct bench_dev *dev = &bench_devs[i];
+
+			dev->mhashes = cgpu->total_mhashes;
+#ifdef HAVE_OPENCL
+			memcpy(dev->kernel_secs, cgpu->kernel_secs, sizeof(dev->kernel_secs));
+			memcpy(dev->kernel_runs, cgpu->kernel_runs, sizeof(dev->kernel_runs));
+#endif
+		}
+		copy_time(&bench_tv_warm, &now);
+		bench_warm = true;
+	}
+
+	if (opt_bench_time && !bench_quitting && secs >= opt_bench_time) {
+		bench_quitting = true;
+		if (unlikely(pthread_create(&pth, NULL, bench_quit_thread, NULL)))
+			quit(1, "Failed to create bench_quit_thread");
+	}
+}
+
+static json_t *bench_verify_json(struct latency_hist *hist)
+{
+	json_t *val = json_object();
+
+	json_object_set_new(val, "count", json_integer(hist->count));
+	json_object_set_new(val, "mean_ms", json_real(hist->count ? hist->sum_us / 1000.0 / hist->count : 0));
+	json_object_set_new(val, "p50_ms", json_real(latency_percentile(hist, 50.0) / 1000.0));
+	json_object_set_new(val, "p99_ms", json_real(latency_percentile(hist, 99.0) / 1000.0));
+	json_object_set_new(val, "max_ms", json_real(hist->max_us / 1000.0));
+	return val;
+}
+
+/* Write the report, to --benchmark-report or stdout, once the miner threads
+ * have been stopped. Figures are from the end of the warm up if it completed,
+ * otherwise from the start. */
+void bench_report(void)
+{
+	json_t *root, *devs;
+	struct timeval now;
+	double secs, total_hs = 0;
+	int i;
+
+	if (!bench_devs || bench_reported)
+		return;
+	bench_reported = true;
+
+	cgtime(&now);
+	secs = tdiff(&now, bench_warm ? &bench_tv_warm : &bench_tv_start);
+	if (secs <= 0)
+		secs = 1;
+
+	root = json_object();
+	json_object_set_new(root, "miner", json_string(PACKAGE " " VERSION));
+	json_object_set_new(root, "header_bytes", json_integer(opt_scrypt_chacha_84 ? 84 : 80));
+	json_object_set_new(root, "nfactor", json_integer(GetNfactor(opt_bench_ntime, sc_minn, sc_maxn, sc_starttime)));
+	json_object_set_new(root, "ntime", json_integer(opt_bench_ntime));
+	json_object_set_new(root, "share_target", json_integer(bench_target));
+	json_object_set_new(root, "known_answers", json_string(bench_kat));
+	json_object_set_new(root, "elapsed", json_real(tdiff(&now, &bench_tv_start)));
+	json_object_set_new(root, "steady_state", bench_warm ? json_true() : json_false());
+	json_object_set_new(root, "measured", json_real(secs));
+
+	devs = json_array();
+	for (i = 0; i < bench_ndevs; i++) {
+		struct cgpu_info *cgpu = devices[i];
+		struct bench_dev *dev = &bench_devs[i];
+		json_t *val = json_object();
+		double hs;
+
+		hs = (cgpu->total_mhashes - dev->mhashes) * 1000000.0 / secs;
+		total_hs += hs;
+
+		json_object_set_new(val, "device", json_string(cgpu->drv->name));
+		json_object_set_new(val, "id", json_integer(cgpu->device_id));
+		json_object_set_new(val, "hashrate", json_real(hs));
+		json_object_set_new(val, "shares", json_integer(dev->valid));
+		json_object_set_new(val, "hw_errors", json_integer(dev->invalid));
+#ifdef HAVE_OPENCL
+		if (cgpu->drv->drv_id == DRIVER_OPENCL) {
+			json_t *kern = json_object();
+			int j;
+
+			for (j = 0; j < KS_MAX; j++) {
+				uint64_t runs = cgpu->kernel_runs[j] - dev->kernel_runs[j];
+
+				if (!runs)
+					continue;
+				json_object_set_new(kern, kernel_stage_names[j],
+					json_real((cgpu->kernel_secs[j] - dev->kernel_secs[j]) * 1000.0 / runs));
+			}
+			json_object_set_new(val, "kernel_ms", kern);
+		}
+#endif
+		json_object_set_new(val, "verify", bench_verify_json(&dev->verify));
+		json_array_append_new(devs, val);
+	}
+	json_object_set_new(root, "devices", devs);
+	json_object_set_new(root, "hashrate", json_real(total_hs));
+
+	if (opt_bench_report) {
+		if (json_dump_file(root, opt_bench_report, JSON_INDENT(1) | JSON_PRESERVE_ORDER))
+			applog(LOG_ERR, "Failed to write benchmark report to %s", opt_bench_report);
+	} else {
+		json_dumpf(root, stdout, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+		printf("\n");
+	}
+	json_decref(root);
+}
+
+#endif /* USE_SCRYPT */
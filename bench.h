@@ -0,0 +1,42 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "miner.h"
+
+#ifdef USE_SCRYPT
+extern unsigned int opt_bench_ntime;
+extern float opt_bench_diff;
+extern int opt_bench_time;
+extern char *opt_bench_report;
+
+extern void bench_init(void);
+extern void bench_start(void);
+extern void bench_get_work(struct work *work);
+extern void bench_verified(struct cgpu_info *cgpu, double us, bool valid);
+extern void bench_poll(void);
+extern void bench_report(void);
+
+#else /* USE_SCRYPT */
+static inline void bench_init(void)
+{
+}
+
+static inline void bench_start(void)
+{
+}
+
+static inline void bench_verified(__maybe_unused struct cgpu_info *cgpu,
+				  __maybe_unused double us, __maybe_unused bool valid)
+{
+}
+
+static inline void bench_poll(void)
+{
+}
+
+static inline void bench_report(void)
+{
+}
+#endif /* USE_SCRYPT */
+
+#endif /* __BENCH_H__ */
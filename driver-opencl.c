@@ -33,6 +33,11 @@
 #include "ocl.h"
 #include "adl.h"
 #include "util.h"
+#include "trace.h"
+#include "autotune.h"
+#include "nonce.h"
+#include "affinity.h"
+#include "dyntune.h"
 
 #ifdef USE_SCRYPT
 #include "scrypt-jane.h"
@@ -182,6 +187,77 @@ char *set_lookup_gap(char *arg)
 	return NULL;
 }
 
+const char *pad_layout_names[PL_MAX] = { "row", "interleave", "block" };
+
+static enum pad_layout select_pad_layout(const char *arg)
+{
+	int i;
+
+	for (i = 0; i < PL_MAX; i++) {
+		if (!strcmp(arg, pad_layout_names[i]))
+			return i;
+	}
+	return PL_MAX;
+}
+
+char *set_pad_layout(char *arg)
+{
+	enum pad_layout layout;
+	int i, device = 0;
+	char *nextptr;
+
+	nextptr = strtok(arg, ",");
+	if (nextptr == NULL)
+		return "Invalid parameters for set pad layout";
+	layout = select_pad_layout(nextptr);
+	if (layout == PL_MAX)
+		return "Invalid parameter to set pad layout";
+	gpus[device++].pad_layout = layout;
+
+	while ((nextptr = strtok(NULL, ",")) != NULL) {
+		layout = select_pad_layout(nextptr);
+		if (layout == PL_MAX)
+			return "Invalid parameter to set pad layout";
+
+		gpus[device++].pad_layout = layout;
+	}
+	if (device == 1) {
+		for (i = device; i < MAX_GPUDEVICES; i++)
+			gpus[i].pad_layout = gpus[0].pad_layout;
+	}
+
+	return NULL;
+}
+
+char *set_sub_batches(char *arg)
+{
+	int i, val = 0, device = 0;
+	char *nextptr;
+
+	nextptr = strtok(arg, ",");
+	if (nextptr == NULL)
+		return "Invalid parameters for set sub batches";
+	val = atoi(nextptr);
+	if (val < 1 || val > MAX_SUB_BATCHES)
+		return "Invalid value passed to set sub batches";
+
+	gpus[device++].sub_batches = val;
+
+	while ((nextptr = strtok(NULL, ",")) != NULL) {
+		val = atoi(nextptr);
+		if (val < 1 || val > MAX_SUB_BATCHES)
+			return "Invalid value passed to set sub batches";
+
+		gpus[device++].sub_batches = val;
+	}
+	if (device == 1) {
+		for (i = device; i < MAX_GPUDEVICES; i++)
+			gpus[i].sub_batches = gpus[0].sub_batches;
+	}
+
+	return NULL;
+}
+
 char *set_thread_concurrency(char *arg)
 {
 	int i, val = 0, device = 0;
@@ -1292,7 +1368,7 @@ static cl_int queue_scrypt_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
 	unsigned int num = 0;
 	cl_uint le_target;
 	cl_int status = 0;
-	uint32_t data[21];
+	uint32_t *data = clState->input_host;
 
 	int minn = sc_minn;
 	int maxn = sc_maxn;
@@ -1338,38 +1414,41 @@ static cl_int queue_scrypt_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
 
 	le_target = *(cl_uint *)(blk->work->target + 28);
 
+	/* The header is built in the pinned staging buffer and written without
+	 * waiting, the previous scan's write having finished before its kernels */
 	int buffer_size = opt_scrypt_chacha_84 ? 84 : 80;
 	if (!opt_scrypt_chacha) {
-		clState->cldata = blk->work->data;
+		memcpy(data, blk->work->data, buffer_size);
 	} else {
 		// Initialize the data array to zero
-		memset(data, 0, sizeof(data));
+		memset(data, 0, buffer_size);
 		applog(LOG_DEBUG, "Timestamp: %d, Nfactor: %d, Target: %08x", timestamp, nfactor, le_target);
 		if (opt_scrypt_chacha_84) {
 			sj_be32enc_vect(data, (const uint32_t *)blk->work->data, 21);
 		} else {
 			sj_be32enc_vect(data, (const uint32_t *)blk->work->data, 20);
 		}
-		clState->cldata = data;
 	}
+	clState->cldata = data;
 
-	status = clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0, true, 0, buffer_size, clState->cldata, 0, NULL,NULL);
+	if (clState->input_event) {
+		clReleaseEvent(clState->input_event);
+		clState->input_event = NULL;
+	}
+	status = clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0, CL_FALSE, 0, buffer_size, clState->cldata, 0, NULL, &clState->input_event);
 
 	CL_SET_ARG(clState->CLbuffer0);
 	CL_SET_ARG(clState->outputBuffer);
-	// Pass all padbuffer8 buffers (VRAM) for monolithic kernel
-	for (size_t i = 0; i < clState->num_padbuffers; i++) {
-		CL_SET_ARG(clState->padbuffer8[i]);
-	}
-	// Pass all padbuffer8_RAM buffers (system RAM) for monolithic kernel
-	for (size_t i = 0; i < clState->num_padbuffers_RAM; i++) {
-		CL_SET_ARG(clState->padbuffer8_RAM[i]);
-	}
+	// Pass the padbuffer table (system RAM, VRAM, second lookup gap) for monolithic kernel
+	status |= scrypt_set_pad_args(clState, *kernel, &num);
 	CL_SET_ARG(le_target);
 
-	// If using the N Scrypt kernel, pass in NFactor
-	if (clState->chosen_kernel == KL_N_SCRYPT)
+	// The N Scrypt and scrypt-chacha kernels take the work's NFactor
+	if (clState->chosen_kernel == KL_N_SCRYPT || clState->chosen_kernel == KL_SCRYPT_CHACHA)
 		CL_SET_ARG(nfactor);
+	/* Sub-batched kernels take their first thread last, run_sub_batches()
+	 * sets it for each launch */
+	clState->tid_args[0] = num;
 
 	return status;
 }
@@ -1485,7 +1564,10 @@ select_cgpu:
 		//free(clState);
 
 		applog(LOG_INFO, "Reinit GPU thread %d", thr_id);
-		clStates[thr_id] = initCl(virtual_gpu, name, sizeof(name));
+		/* Keep the plan the GPU was mining on, it may have been replanned
+		 * since it started */
+		clStates[thr_id] = initCl(virtual_gpu, name, sizeof(name),
+					  cgpu->plan_nfactor ? cgpu->plan_nfactor : scrypt_start_nfactor());
 		if (!clStates[thr_id]) {
 			applog(LOG_ERR, "Failed to reinit GPU thread %d", thr_id);
 			goto select_cgpu;
@@ -1570,6 +1652,13 @@ static void opencl_detect()
 
 	if (!opt_noadl)
 		init_adl(nDevs);
+
+	for (i = 0; i < nDevs; ++i) {
+		struct cgpu_info *cgpu = &gpus[i];
+
+		if (clDevicePCI(cgpu->virtual_gpu, cgpu->pci_addr, sizeof(cgpu->pci_addr)))
+			applog(LOG_INFO, "GPU %d: PCI %s", i, cgpu->pci_addr);
+	}
 }
 
 static void reinit_opencl_device(struct cgpu_info *gpu)
@@ -1613,6 +1702,11 @@ static void get_opencl_statline(char *buf, struct cgpu_info *gpu)
 //	tailsprintf(buf, " I:%2d", gpu->intensity);
 }
 
+/* Wait list for a scan's first kernels: the queue may be out of order, so
+ * they must not start before the header write into CLbuffer0 has landed */
+#define INPUT_WAIT(clState) ((clState)->input_event ? 1 : 0), \
+	((clState)->input_event ? &(clState)->input_event : NULL)
+
 struct opencl_thread_data {
 	cl_int (*queue_kernel_parameters)(_clState *, dev_blk_ctx *, cl_uint);
 	uint32_t *res;
@@ -1620,6 +1714,186 @@ struct opencl_thread_data {
 
 static uint32_t *blank_res;
 
+#ifdef USE_SCRYPT
+/* Re-planning a GPU's padbuffers when the scrypt-chacha Nfactor grows past
+ * the plan's, or has stayed below it a while. The
+ * program for the new Nfactor is built in the background while the old plan
+ * keeps mining, which leaves its binary in the cache, then each thread swaps
+ * its _clState between two scans. The schedule is looked REPLAN_AHEAD seconds
+ * ahead so its steps are usually built before any work needs them. */
+#define REPLAN_AHEAD 3600
+#define REPLAN_IDLE 600
+
+struct opencl_replan {
+	struct cgpu_info *cgpu;
+	int nfactor;		/* Being built, or built if ready */
+	int failed;		/* Last Nfactor that failed to build, 0 if none */
+	cl_ulong vram_held, ram_held;
+	bool running;
+	bool ready;
+};
+
+static struct opencl_replan replans[MAX_GPUDEVICES];
+static pthread_mutex_t replan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* When each thread last had work on its plan's own Nfactor */
+static time_t plan_used[MAX_GPUDEVICES];
+
+/* Nfactor of scrypt-chacha work ahead seconds after its timestamp, on its
+ * pool's schedule */
+static int work_nfactor(struct work *work, unsigned int ahead)
+{
+	struct pool *pool = work->pool;
+	unsigned int timestamp = bswap_32(*((unsigned int *)(work->data + 17*4)));
+
+	return GetNfactor(timestamp + ahead,
+			  pool->sc_minn ? *pool->sc_minn : sc_minn,
+			  pool->sc_maxn ? *pool->sc_maxn : sc_maxn,
+			  pool->sc_starttime ? *pool->sc_starttime : sc_starttime);
+}
+
+static void *replan_thread(void *userdata)
+{
+	struct opencl_replan *rp = userdata;
+	bool built;
+
+	pthread_detach(pthread_self());
+	RenameThread("replan");
+
+	/* A cached tune for the new Nfactor is built with, any trials wait
+	 * for the swap */
+	autotune_nfactor(rp->cgpu, rp->nfactor, false);
+	built = scrypt_build_plan(rp->cgpu->virtual_gpu, rp->nfactor, rp->vram_held, rp->ram_held);
+	if (built)
+		applog(LOG_NOTICE, "GPU %d: padbuffer plan for Nfactor %d is ready",
+		       rp->cgpu->device_id, rp->nfactor);
+	else
+		applog(LOG_ERR, "GPU %d: failed to plan padbuffers for Nfactor %d",
+		       rp->cgpu->device_id, rp->nfactor);
+
+	mutex_lock(&replan_lock);
+	rp->running = false;
+	rp->ready = built;
+	if (!built)
+		rp->failed = rp->nfactor;
+	mutex_unlock(&replan_lock);
+	return NULL;
+}
+
+/* Start building the plan for nfactor unless it is already built, being built
+ * or known not to build. Called with replan_lock held. */
+static void replan_start(struct cgpu_info *cgpu, _clState *clState, int nfactor)
+{
+	struct opencl_replan *rp = &replans[cgpu->virtual_gpu];
+	pthread_t pth;
+
+	if (rp->running || rp->failed == nfactor || (rp->ready && rp->nfactor == nfactor))
+		return;
+
+	rp->cgpu = cgpu;
+	rp->nfactor = nfactor;
+	rp->vram_held = clState->vram_held;
+	rp->ram_held = clState->ram_held;
+	rp->ready = false;
+	rp->running = true;
+	applog(LOG_NOTICE, "GPU %d: planning padbuffers for Nfactor %d in the background",
+	       cgpu->device_id, nfactor);
+	if (unlikely(pthread_create(&pth, NULL, replan_thread, rp))) {
+		applog(LOG_ERR, "GPU %d: failed to create replan thread", cgpu->device_id);
+		rp->running = false;
+		rp->failed = nfactor;
+	}
+}
+
+/* Switch thr to the plan for nfactor, built by replan_thread(). Returns false
+ * if it couldn't be, with the old plan back in place. */
+static bool replan_swap(struct thr_info *thr, int nfactor)
+{
+	const int thr_id = thr->id;
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct opencl_replan *rp = &replans[cgpu->virtual_gpu];
+	_clState *clState = clStates[thr_id];
+	const int old_nfactor = clState->nfactor;
+	char name[256] = "";
+	bool switched = true;
+
+	applog(LOG_NOTICE, "GPU %d: switching padbuffers from Nfactor %d to %d",
+	       cgpu->device_id, old_nfactor, nfactor);
+	releaseCl(clState);
+	free(clState);
+	autotune_nfactor(cgpu, nfactor, true);
+	clState = initCl(cgpu->virtual_gpu, name, sizeof(name), nfactor);
+	if (unlikely(!clState)) {
+		applog(LOG_ERR, "GPU %d: failed to switch to Nfactor %d, going back to %d",
+		       cgpu->device_id, nfactor, old_nfactor);
+		mutex_lock(&replan_lock);
+		rp->ready = false;
+		rp->failed = nfactor;
+		mutex_unlock(&replan_lock);
+		switched = false;
+		autotune_nfactor(cgpu, old_nfactor, false);
+		clState = initCl(cgpu->virtual_gpu, name, sizeof(name), old_nfactor);
+		if (unlikely(!clState))
+			quit(1, "GPU %d: failed to restore the Nfactor %d plan", cgpu->device_id, old_nfactor);
+	}
+	clStates[thr_id] = clState;
+	plan_used[thr_id] = time(NULL);
+	if (unlikely(clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
+					  output_buffersize(), blank_res, 0, NULL, NULL) != CL_SUCCESS))
+		quit(1, "GPU %d: clEnqueueWriteBuffer failed after switching plans", cgpu->device_id);
+	return switched;
+}
+
+/* Make sure thr's plan fits work's Nfactor. The kernels take the Nfactor as an
+ * argument, so work on any Nfactor up to the plan's mines on it as it is, and
+ * pools on different Nfactors can take turns without rebuilds. The plan only
+ * moves down once nothing has needed its own Nfactor for REPLAN_IDLE seconds.
+ * Returns false while work can't be mined yet, with *failed set if it won't
+ * be. */
+static bool opencl_replan(struct thr_info *thr, struct work *work, bool *failed)
+{
+	const int thr_id = thr->id;
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct opencl_replan *rp = &replans[cgpu->virtual_gpu];
+	_clState *clState = clStates[thr_id];
+	const int nfactor = work->nfactor, plan = clState->nfactor;
+	const time_t now = time(NULL);
+	bool ready = false;
+	int next;
+
+	if (likely(nfactor <= plan)) {
+		if (nfactor == plan || !plan_used[thr_id])
+			plan_used[thr_id] = now;
+		next = work_nfactor(work, REPLAN_AHEAD);
+		mutex_lock(&replan_lock);
+		if (next > plan)
+			replan_start(cgpu, clState, next);
+		else if (nfactor < plan && now - plan_used[thr_id] > REPLAN_IDLE) {
+			replan_start(cgpu, clState, nfactor);
+			ready = rp->ready && rp->nfactor == nfactor;
+		}
+		mutex_unlock(&replan_lock);
+		if (ready)
+			replan_swap(thr, nfactor);
+		return true;
+	}
+
+	mutex_lock(&replan_lock);
+	ready = rp->ready && rp->nfactor == nfactor;
+	*failed = rp->failed == nfactor;
+	if (!ready)
+		replan_start(cgpu, clState, nfactor);
+	mutex_unlock(&replan_lock);
+	if (!ready) {
+		if (!*failed)
+			nmsleep(100);
+		return false;
+	}
+	*failed = !replan_swap(thr, nfactor);
+	return !*failed;
+}
+#endif
+
 static bool opencl_thread_prepare(struct thr_info *thr)
 {
 	char name[256];
@@ -1629,7 +1903,7 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 	int virtual_gpu = cgpu->virtual_gpu;
 	int i = thr->id;
 	static bool failmessage = false;
-	int buffersize = opt_scrypt ? SCRYPT_BUFFERSIZE : BUFFERSIZE;
+	int buffersize = output_buffersize();
 
 	if (!blank_res)
 		blank_res = calloc(buffersize, 1);
@@ -1640,7 +1914,8 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 
 	strcpy(name, "");
 	applog(LOG_INFO, "Init GPU thread %i GPU %i virtual GPU %i", i, gpu, virtual_gpu);
-	clStates[i] = initCl(virtual_gpu, name, sizeof(name));
+	autotune_device(cgpu);
+	clStates[i] = initCl(virtual_gpu, name, sizeof(name), scrypt_start_nfactor());
 	if (!clStates[i]) {
 #ifdef HAVE_CURSES
 		if (use_curses)
@@ -1717,13 +1992,15 @@ static bool opencl_thread_init(struct thr_info *thr)
 	cl_int status = 0;
 	thrdata = calloc(1, sizeof(*thrdata));
 	thr->cgpu_data = thrdata;
-	int buffersize = opt_scrypt ? SCRYPT_BUFFERSIZE : BUFFERSIZE;
+	int buffersize = output_buffersize();
 
 	if (!thrdata) {
 		applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
 		return false;
 	}
 
+	affinity_gpu_thread(gpu);
+
 	switch (clState->chosen_kernel) {
 		case KL_POCLBM:
 			thrdata->queue_kernel_parameters = &queue_poclbm_kernel;
@@ -1773,9 +2050,11 @@ static bool opencl_thread_init(struct thr_info *thr)
 static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work *work)
 {
 #ifdef USE_SCRYPT
-	if (opt_scrypt)
+	if (opt_scrypt) {
 		work->blk.work = work;
-	else
+		if (opt_scrypt_chacha)
+			work->nfactor = work_nfactor(work, 0);
+	} else
 #endif
 		precalc_hash(&work->blk, (uint32_t *)(work->midstate), (uint32_t *)(work->data + 64));
 	return true;
@@ -1783,6 +2062,99 @@ static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work
 
 extern int opt_dynamic_interval;
 
+#ifdef USE_SCRYPT
+/* Runs a scan of threads from nonce as batches launches of each
+ * of nkernels kernels, over consecutive ranges of whole work groups. Each
+ * launch is passed the first thread of its range so it keeps to its own part
+ * of the padbuffers. The next sub-batch is always queued before waiting on
+ * the one before it, so the GPU is not left idle, and as each completes the
+ * thread checks in with the watchdog and stops queueing on a work restart.
+ * Returns the threads of the sub-batches that ran in *done and each kernel's
+ * profiled time in kernel_ns. */
+static cl_int run_sub_batches(struct thr_info *thr, _clState *clState, const cl_kernel *kernels,
+			      int nkernels, size_t nonce, size_t threads, size_t local, int batches,
+			      cl_ulong *kernel_ns, size_t *done)
+{
+	static const char *names[2][3] = { { "search" }, { "part1", "part2", "part3" } };
+	struct cgpu_info *gpu = thr->cgpu;
+	const size_t groups = threads / local;
+	const size_t per = (groups + batches - 1) / batches * local;
+	cl_event events[2][3];
+	size_t sizes[2], start = 0;
+	unsigned int queued = 0, completed = 0;
+	cl_int status, ret = CL_SUCCESS;
+	int k, slot;
+
+	*done = 0;
+	while (42) {
+		/* Keep two sub-batches queued */
+		while (queued - completed < 2 && start < threads && ret == CL_SUCCESS && !thr->work_restart) {
+			size_t offset = nonce + start, size = MIN(per, threads - start);
+			cl_uint base = start;
+
+			slot = queued & 1;
+			for (k = 0; k < nkernels; k++) {
+				status = clSetKernelArg(kernels[k], clState->tid_args[k], sizeof(cl_uint), &base);
+				/* The queue may be out of order: the first kernel waits
+				 * on the header, each part after on the one before */
+				if (status == CL_SUCCESS && !k)
+					status = clEnqueueNDRangeKernel(clState->commandQueue, kernels[k], 1, &offset,
+									&size, &local, INPUT_WAIT(clState), &events[slot][k]);
+				else if (status == CL_SUCCESS)
+					status = clEnqueueNDRangeKernel(clState->commandQueue, kernels[k], 1, &offset,
+									&size, &local, 1, &events[slot][k - 1], &events[slot][k]);
+				if (unlikely(status != CL_SUCCESS)) {
+					applog(LOG_ERR, "Error %d: Enqueueing sub-batch at thread %zu failed.", status, start);
+					ret = status;
+					break;
+				}
+			}
+			if (unlikely(k < nkernels)) {
+				/* Let what did get queued finish before dropping it */
+				clFinish(clState->commandQueue);
+				while (k--)
+					clReleaseEvent(events[slot][k]);
+				break;
+			}
+			clFlush(clState->commandQueue);
+			sizes[slot] = size;
+			start += size;
+			queued++;
+		}
+		if (completed == queued)
+			break;
+
+		slot = completed & 1;
+		status = clWaitForEvents(nkernels, events[slot]);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error %d: clWaitForEvents for sub-batch failed.", status);
+			ret = status;
+		}
+		for (k = 0; k < nkernels; k++) {
+			cl_ulong ev_start, ev_end;
+
+			if (status == CL_SUCCESS &&
+			    clGetEventProfilingInfo(events[slot][k], CL_PROFILING_COMMAND_START,
+						    sizeof(cl_ulong), &ev_start, NULL) == CL_SUCCESS &&
+			    clGetEventProfilingInfo(events[slot][k], CL_PROFILING_COMMAND_END,
+						    sizeof(cl_ulong), &ev_end, NULL) == CL_SUCCESS) {
+				kernel_ns[k] += ev_end - ev_start;
+				trace_device(gpu->device_id, names[nkernels > 1][k], ev_start, ev_end, trace_now());
+			}
+			clReleaseEvent(events[slot][k]);
+		}
+		if (status == CL_SUCCESS)
+			*done += sizes[slot];
+		completed++;
+		thread_reportin(thr);
+	}
+
+	if (*done < threads && ret == CL_SUCCESS)
+		applog(LOG_DEBUG, "GPU %d: work restart after %zu of %zu threads", gpu->device_id, *done, threads);
+	return ret;
+}
+#endif
+
 static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 				int64_t __maybe_unused max_nonce)
 {
@@ -1796,9 +2168,12 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	cl_int status;
 	size_t globalThreads[1];
 	size_t localThreads[1] = { clState->wsize };
+	size_t launch_tc;
+	int sub_batches = 1;
 	int64_t hashes;
 	int found = opt_scrypt ? SCRYPT_FOUND : FOUND;
-	int buffersize = opt_scrypt ? SCRYPT_BUFFERSIZE : BUFFERSIZE;
+	int buffersize = output_buffersize();
+	uint32_t *res;
 
 	// OpenCL profiling variables
 	cl_event kernel_event = NULL;
@@ -1817,8 +2192,24 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	struct timeval start_time, end_time;
 	gettimeofday(&start_time, NULL);
 
-	/* Windows' timer resolution is only 15ms so oversample 5x */
-	if (gpu->dynamic && (++gpu->intervals * dynamic_us) > 70000) {
+	// Hot path trace spans, all no-ops without --trace
+	uint64_t tr_scan = trace_now(), tr;
+
+#ifdef USE_SCRYPT
+	if (opt_scrypt_chacha) {
+		bool failed = false;
+
+		if (!opencl_replan(thr, work, &failed))
+			return failed ? -1 : 0;
+		clState = clStates[thr_id];
+		kernel = &clState->kernel;
+	}
+#endif
+
+	/* Windows' timer resolution is only 15ms so oversample 5x. Scrypt-chacha
+	 * launches are thread concurrency sized whatever the intensity, so the
+	 * launch size controller in dyntune.c takes over from this there. */
+	if (gpu->dynamic && !opt_scrypt_chacha && (++gpu->intervals * dynamic_us) > 70000) {
 		struct timeval tv_gpuend;
 		double gpu_us;
 
@@ -1835,10 +2226,23 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		gpu->intervals = 0;
 	}
 
-	set_threads_hashes(clState->vwidth, clState->compute_shaders, &hashes, globalThreads, localThreads[0], &gpu->intensity, &gpu->xintensity, &gpu->rawintensity, gpu->thread_concurrency);
+#ifdef USE_SCRYPT
+	if (clState->sub_batches > 1)
+		sub_batches = clState->sub_batches;
+#endif
+	launch_tc = clState->thread_concurrency;
+	if (launch_tc)
+		launch_tc = dyntune_threads(gpu, launch_tc, localThreads[0], &sub_batches);
+	set_threads_hashes(clState->vwidth, clState->compute_shaders, &hashes, globalThreads, localThreads[0], &gpu->intensity, &gpu->xintensity, &gpu->rawintensity, launch_tc);
 	if (hashes > gpu->max_hashes)
 		gpu->max_hashes = hashes;
 
+	/* Take this launch's nonces from the space shared with every other
+	 * thread hashing the same header. abandon_work() moves on once it
+	 * runs out. */
+	if (!nonce_claim(work, hashes))
+		return 0;
+
 	// Check if we should use split kernels
 	bool use_split = false;
 #ifdef USE_SCRYPT
@@ -1846,13 +2250,13 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 #endif
 	
 	if (use_split) {
-		// ===== SPLIT KERNEL EXECUTION (Sequential: wait, profile, then next) =====
-		cl_event event_part1 = NULL, event_part2 = NULL, event_part3 = NULL;
+		// ===== SPLIT KERNEL SETUP: input data and every part's arguments =====
 		unsigned int num = 0;
 		cl_uint le_target = *(cl_uint *)(work->target + 28);
+		cl_uint nfactor = work->nfactor;
 		
-		// Prepare input data (same as queue_scrypt_kernel does)
-		uint32_t data[21];
+		// Prepare input data in the staging buffer (same as queue_scrypt_kernel does)
+		uint32_t *data = clState->input_host;
 		int minn = sc_minn;
 		int maxn = sc_maxn;
 		long starttime = sc_starttime;
@@ -1883,10 +2287,11 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		
 		int buffer_size = opt_scrypt_chacha_84 ? 84 : 80;
 		if (!opt_scrypt_chacha) {
-			clState->cldata = work->blk.work->data;
+			memcpy(data, work->blk.work->data, buffer_size);
+			clState->cldata = data;
 		} else {
 			// Initialize the data array to zero
-			memset(data, 0, sizeof(data));
+			memset(data, 0, buffer_size);
 			applog(LOG_DEBUG, "Split kernel: Timestamp: %d, Nfactor: %d, Target: %08x", timestamp, sc_currentn, le_target);
 			if (opt_scrypt_chacha_84) {
 				sj_be32enc_vect(data, (const uint32_t *)work->blk.work->data, 21);
@@ -1897,31 +2302,114 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		}
 		
 		// Write input data to CLbuffer0 (CRITICAL: without this, kernels read garbage!)
-		status = clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0, true, 0, buffer_size, clState->cldata, 0, NULL, NULL);
+		tr = trace_now();
+		if (clState->input_event) {
+			clReleaseEvent(clState->input_event);
+			clState->input_event = NULL;
+		}
+		status = clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0, CL_FALSE, 0, buffer_size, clState->cldata, 0, NULL, &clState->input_event);
 		if (unlikely(status != CL_SUCCESS)) {
 			applog(LOG_ERR, "Error %d: clEnqueueWriteBuffer failed for split kernels.", status);
 			return -1;
 		}
+		trace_span("write", tr);
 		
-		// ===== PART 1: Launch, Wait, Profile =====
 		// Set arguments for Part 1: (input, temp_X)
 		num = 0;
 		status = clSetKernelArg(clState->kernel_part1, num++, sizeof(cl_mem), &clState->CLbuffer0);
 		status |= clSetKernelArg(clState->kernel_part1, num++, sizeof(cl_mem), &clState->temp_X_buffer);
+		clState->tid_args[0] = num;
 		if (unlikely(status != CL_SUCCESS)) {
 			applog(LOG_ERR, "Error %d: clSetKernelArg Part 1 failed.", status);
 			return -1;
 		}
 		
-		// Launch Part 1 (no wait list - we'll wait explicitly)
+		// Set arguments for Part 2: (temp_X input, temp_X2 output, padcache buffers)
+		num = 0;
+		status = clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_mem), &clState->temp_X_buffer);
+		status |= clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_mem), &clState->temp_X2_buffer);
+		// Pass the padbuffer table (system RAM, VRAM, second lookup gap)
+		status |= scrypt_set_pad_args(clState, clState->kernel_part2, &num);
+		status |= clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_uint), &nfactor);
+		clState->tid_args[1] = num;
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error %d: clSetKernelArg Part 2 failed.", status);
+			return -1;
+		}
+		
+		// Set arguments for Part 3: (input, temp_X2, output, target)
+		num = 0;
+		status = clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_mem), &clState->CLbuffer0);
+		status |= clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_mem), &clState->temp_X2_buffer);
+		status |= clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_mem), &clState->outputBuffer);
+		status |= clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_uint), &le_target);
+		clState->tid_args[2] = num;
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error %d: clSetKernelArg Part 3 failed.", status);
+			return -1;
+		}
+	} else {
+		status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error: clSetKernelArg of all params failed.");
+			return -1;
+		}
+	}
+
+#ifdef USE_SCRYPT
+	if (clState->sub_batches > 1) {
+		// ===== SUB-BATCHED EXECUTION (see --sub-batches) =====
+		const cl_kernel parts[3] = { clState->kernel_part1, clState->kernel_part2, clState->kernel_part3 };
+		cl_ulong kernel_ns[3] = { 0, 0, 0 };
+		size_t done;
+
+		tr = trace_now();
+		status = run_sub_batches(thr, clState, use_split ? parts : kernel, use_split ? 3 : 1,
+					 work->blk.nonce, globalThreads[0], localThreads[0], sub_batches,
+					 kernel_ns, &done);
+		if (unlikely(status != CL_SUCCESS))
+			return -1;
+		trace_span("sub-batch wait", tr);
+
+		if (use_split) {
+			part1_time = kernel_ns[0];
+			part2_time = kernel_ns[1];
+			part3_time = kernel_ns[2];
+			gpu->kernel_secs[KS_PART1] += part1_time / 1000000000.0;
+			gpu->kernel_secs[KS_PART2] += part2_time / 1000000000.0;
+			gpu->kernel_secs[KS_PART3] += part3_time / 1000000000.0;
+			gpu->kernel_runs[KS_PART1]++;
+			gpu->kernel_runs[KS_PART2]++;
+			gpu->kernel_runs[KS_PART3]++;
+		} else {
+			kernel_execution_time = kernel_ns[0];
+			gpu->kernel_secs[KS_SEARCH] += kernel_execution_time / 1000000000.0;
+			gpu->kernel_runs[KS_SEARCH]++;
+		}
+		applog(LOG_INFO, "GPU %d %d sub-batches completed %zu of %zu threads: %.3fms",
+		       gpu->device_id, sub_batches, done, globalThreads[0],
+		       (kernel_ns[0] + kernel_ns[1] + kernel_ns[2]) / 1000000.0);
+
+		/* Only the sub-batches that ran were hashed */
+		if (done < globalThreads[0])
+			hashes = (int64_t)done * clState->vwidth;
+	} else
+#endif
+	if (use_split) {
+		// ===== SPLIT KERNEL EXECUTION (Sequential: wait, profile, then next) =====
+		cl_event event_part1 = NULL, event_part2 = NULL, event_part3 = NULL;
+
+		// ===== PART 1: Launch, Wait, Profile =====
+		// Launch Part 1 once the header write has landed
+		tr = trace_now();
 		if (clState->goffset) {
 			size_t global_work_offset[1] = { work->blk.nonce };
 			status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel_part1, 1, 
 			                                global_work_offset, globalThreads, localThreads, 
-			                                0, NULL, &event_part1);
+			                                INPUT_WAIT(clState), &event_part1);
 		} else {
 			status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel_part1, 1, NULL,
-			                                globalThreads, localThreads, 0, NULL, &event_part1);
+			                                globalThreads, localThreads, INPUT_WAIT(clState), &event_part1);
 		}
 		if (unlikely(status != CL_SUCCESS)) {
 			applog(LOG_ERR, "Error %d: Enqueueing kernel Part 1 failed.", status);
@@ -1936,6 +2424,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			clReleaseEvent(event_part1);
 			return -1;
 		}
+		trace_span("part1 wait", tr);
 		
 		// Profile Part 1 immediately after completion
 		status = clGetEventProfilingInfo(event_part1, CL_PROFILING_COMMAND_START,
@@ -1946,6 +2435,9 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			if (status == CL_SUCCESS) {
 				part1_time = part1_end - part1_start;
 				double part1_ms = part1_time / 1000000.0;
+				gpu->kernel_secs[KS_PART1] += part1_time / 1000000000.0;
+				gpu->kernel_runs[KS_PART1]++;
+				trace_device(gpu->device_id, "part1", part1_start, part1_end, trace_now());
 				applog(LOG_INFO, "GPU %d Split Kernel Part 1 (PBKDF2) completed: %.3fms", gpu->device_id, part1_ms);
 			} else {
 				applog(LOG_WARNING, "GPU %d Split Kernel Part 1: Failed to get profiling end time", gpu->device_id);
@@ -1958,24 +2450,8 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		clReleaseEvent(event_part1);
 		
 		// ===== PART 2: Launch, Wait, Profile =====
-		// Set arguments for Part 2: (temp_X input, temp_X2 output, padcache buffers)
-		num = 0;
-		status = clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_mem), &clState->temp_X_buffer);
-		status |= clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_mem), &clState->temp_X2_buffer);
-		// Pass all padbuffer8 buffers (VRAM)
-		for (size_t i = 0; i < clState->num_padbuffers; i++) {
-			status |= clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_mem), &clState->padbuffer8[i]);
-		}
-		// Pass all padbuffer8_RAM buffers (system RAM)
-		for (size_t i = 0; i < clState->num_padbuffers_RAM; i++) {
-			status |= clSetKernelArg(clState->kernel_part2, num++, sizeof(cl_mem), &clState->padbuffer8_RAM[i]);
-		}
-		if (unlikely(status != CL_SUCCESS)) {
-			applog(LOG_ERR, "Error %d: clSetKernelArg Part 2 failed.", status);
-			return -1;
-		}
-		
 		// Launch Part 2 (no wait list - we'll wait explicitly)
+		tr = trace_now();
 		if (clState->goffset) {
 			size_t global_work_offset[1] = { work->blk.nonce };
 			status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel_part2, 1, 
@@ -1998,6 +2474,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			clReleaseEvent(event_part2);
 			return -1;
 		}
+		trace_span("part2 wait", tr);
 		
 		// Profile Part 2 immediately after completion
 		status = clGetEventProfilingInfo(event_part2, CL_PROFILING_COMMAND_START,
@@ -2008,6 +2485,9 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			if (status == CL_SUCCESS) {
 				part2_time = part2_end - part2_start;
 				double part2_ms = part2_time / 1000000.0;
+				gpu->kernel_secs[KS_PART2] += part2_time / 1000000000.0;
+				gpu->kernel_runs[KS_PART2]++;
+				trace_device(gpu->device_id, "part2", part2_start, part2_end, trace_now());
 				
 				// Calculate gap between Part 1 and Part 2
 				if (part1_end > 0 && part2_start > 0) {
@@ -2029,18 +2509,8 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		clReleaseEvent(event_part2);
 		
 		// ===== PART 3: Launch, Wait, Profile =====
-		// Set arguments for Part 3: (input, temp_X2, output, target)
-		num = 0;
-		status = clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_mem), &clState->CLbuffer0);
-		status |= clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_mem), &clState->temp_X2_buffer);
-		status |= clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_mem), &clState->outputBuffer);
-		status |= clSetKernelArg(clState->kernel_part3, num++, sizeof(cl_uint), &le_target);
-		if (unlikely(status != CL_SUCCESS)) {
-			applog(LOG_ERR, "Error %d: clSetKernelArg Part 3 failed.", status);
-			return -1;
-		}
-		
 		// Launch Part 3 (no wait list - we'll wait explicitly)
+		tr = trace_now();
 		if (clState->goffset) {
 			size_t global_work_offset[1] = { work->blk.nonce };
 			status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel_part3, 1, 
@@ -2063,6 +2533,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			clReleaseEvent(event_part3);
 			return -1;
 		}
+		trace_span("part3 wait", tr);
 		
 		// Profile Part 3 immediately after completion
 		status = clGetEventProfilingInfo(event_part3, CL_PROFILING_COMMAND_START,
@@ -2073,6 +2544,9 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			if (status == CL_SUCCESS) {
 				part3_time = part3_end - part3_start;
 				double part3_ms = part3_time / 1000000.0;
+				gpu->kernel_secs[KS_PART3] += part3_time / 1000000000.0;
+				gpu->kernel_runs[KS_PART3]++;
+				trace_device(gpu->device_id, "part3", part3_start, part3_end, trace_now());
 				
 				// Calculate gap between Part 2 and Part 3
 				if (part2_end > 0 && part3_start > 0) {
@@ -2099,13 +2573,8 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		applog(LOG_DEBUG, "Split kernels executed sequentially (Part 1 -> wait/profile -> Part 2 -> wait/profile -> Part 3 -> wait/profile)");
 	} else {
 		// ===== MONOLITHIC KERNEL EXECUTION =====
-		status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
-		if (unlikely(status != CL_SUCCESS)) {
-			applog(LOG_ERR, "Error: clSetKernelArg of all params failed.");
-			return -1;
-		}
-
 		// Enqueue kernel with profiling enabled
+		tr = trace_now();
 		if (clState->goffset) {
 			size_t global_work_offset[1];
 
@@ -2113,10 +2582,10 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			if (opt_scrypt_chacha)
 			applog(LOG_DEBUG, "Nonce: %u, Global work size: %lu, local work size: %lu", work->blk.nonce, (unsigned long)globalThreads[0], (unsigned long)localThreads[0]);
 			status = clEnqueueNDRangeKernel(clState->commandQueue, *kernel, 1, global_work_offset,
-							globalThreads, localThreads, 0, NULL, &kernel_event);
+							globalThreads, localThreads, INPUT_WAIT(clState), &kernel_event);
 		} else
 			status = clEnqueueNDRangeKernel(clState->commandQueue, *kernel, 1, NULL,
-							globalThreads, localThreads, 0, NULL, &kernel_event);
+							globalThreads, localThreads, INPUT_WAIT(clState), &kernel_event);
 		if (unlikely(status != CL_SUCCESS)) {
 			applog(LOG_ERR, "Error %d: Enqueueing kernel onto command queue. (clEnqueueNDRangeKernel)", status);
 			if (kernel_event) clReleaseEvent(kernel_event);
@@ -2130,6 +2599,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			clReleaseEvent(kernel_event);
 			return -1;
 		}
+		trace_span("search wait", tr);
 		
 		// Get end time for fallback timing
 		gettimeofday(&end_time, NULL);
@@ -2146,6 +2616,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 				if (status == CL_SUCCESS) {
 					kernel_execution_time = kernel_end_time - kernel_start_time;
 					profiling_success = true;
+					trace_device(gpu->device_id, "search", kernel_start_time, kernel_end_time, trace_now());
 				} else {
 					applog(LOG_WARNING, "GPU %d Monolithic Kernel: Failed to get profiling end time", gpu->device_id);
 				}
@@ -2161,6 +2632,9 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			kernel_execution_time = fallback_time_us * 1000; // Convert to nanoseconds
 		}
 		
+		gpu->kernel_secs[KS_SEARCH] += kernel_execution_time / 1000000000.0;
+		gpu->kernel_runs[KS_SEARCH]++;
+
 		// Log kernel completion time
 		double kernel_time_ms = kernel_execution_time / 1000000.0;
 		applog(LOG_INFO, "GPU %d Monolithic Kernel completed%s: %.3fms", 
@@ -2169,8 +2643,11 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 
 	// Enqueue read buffer with profiling
 	// Both split and monolithic kernels are already complete (we waited for them), so no wait needed
+	// Scrypt results land in the clState's pinned staging buffer, see staging_alloc()
+	res = clState->output_host ? clState->output_host : thrdata->res;
+	tr = trace_now();
 	status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
-				     buffersize, thrdata->res, 
+				     buffersize, res, 
 				     0, NULL, 
 				     &read_event);
 	if (unlikely(status != CL_SUCCESS)) {
@@ -2186,26 +2663,28 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 		applog(LOG_DEBUG, "Nonce: %u, Target: %08x", work->blk.nonce, target);
 	}
 	
-	/* The amount of work scanned can fluctuate when intensity changes
-	 * and since we do this one cycle behind, we increment the work more
-	 * than enough to prevent repeating work */
-	work->blk.nonce += gpu->max_hashes;
-	
-	/* Check for nonce range overflow to prevent wrapping to other GPU ranges */
-	if (total_devices > 1) {
-		uint32_t nonce_range = 0xFFFFFFFF / total_devices;
-		uint32_t max_nonce_for_gpu = (gpu->device_id + 1) * nonce_range - 1;
-		if (work->blk.nonce > max_nonce_for_gpu) {
-			applog(LOG_DEBUG, "GPU %d nonce range exhausted, resetting to start", gpu->device_id);
-			work->blk.nonce = gpu->device_id * nonce_range;
-		}
+	/* The results can be read as soon as the read completes */
+	status = clWaitForEvents(1, &read_event);
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error %d: clWaitForEvents for clEnqueueReadBuffer failed.", status);
+		if (kernel_event) clReleaseEvent(kernel_event);
+		clReleaseEvent(read_event);
+		return -1;
 	}
+	trace_span("read", tr);
 
-	/* This finish flushes the readbuffer set with CL_FALSE in clEnqueueReadBuffer */
-	clFinish(clState->commandQueue);
-
-	/* FOUND entry is used as a counter to say how many nonces exist */
-	if (thrdata->res[found]) {
+	if (opt_scrypt_chacha) {
+		/* The result ring is never cleared, only what it gained since the
+		 * last read is new */
+		if (res[RESULT_HEAD] != clState->result_tail) {
+			cgtime(&work->tv_kernel_done);
+			applog(LOG_DEBUG, "GPU %d found something?", gpu->device_id);
+			clState->result_tail = postcalc_ring_async(thr, work, res, clState->result_tail);
+		}
+	} else if (res[found]) {
+		/* FOUND entry is used as a counter to say how many nonces exist */
+		cgtime(&work->tv_kernel_done);
+		tr = trace_now();
 		/* Clear the buffer again */
 		status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
 					      buffersize, blank_res, 0, NULL, &write_event);
@@ -2217,10 +2696,11 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 			return -1;
 		}
 		applog(LOG_DEBUG, "GPU %d found something?", gpu->device_id);
-		postcalc_hash_async(thr, work, thrdata->res);
-		memset(thrdata->res, 0, buffersize);
+		postcalc_hash_async(thr, work, res);
+		memset(res, 0, buffersize);
 		/* This finish flushes the writebuffer set with CL_FALSE in clEnqueueWriteBuffer */
 		clFinish(clState->commandQueue);
+		trace_span("found", tr);
 	}
 
 	// Clean up events (after clFinish ensures all operations are complete)
@@ -2228,57 +2708,44 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	if (read_event) clReleaseEvent(read_event);
 	if (write_event) clReleaseEvent(write_event);
 
+	if (launch_tc) {
+		gettimeofday(&end_time, NULL);
+		dyntune_result(gpu, globalThreads[0], sub_batches, hashes,
+			       use_split ? part1_time + part2_time + part3_time : kernel_execution_time,
+			       (end_time.tv_sec - start_time.tv_sec) * 1000000 + (end_time.tv_usec - start_time.tv_usec));
+	}
+
+#ifdef USE_SCRYPT
+	/* Split the launch by where each thread's scratchpad lived, see
+	 * padbuffer_index() in the kernel. Second lookup gap threads are VRAM. */
+	if (opt_scrypt) {
+		const int64_t wsize = clState->wsize;
+		int64_t ram = clState->groups_ram * wsize;
+
+		if (opt_interleave_ram && clState->groups_ram) {
+			const int64_t groups = clState->groups_ram + clState->groups_vram;
+			int64_t launched = hashes / wsize;
+
+			if (launched > groups)
+				launched = groups;
+			ram = launched * (int64_t)clState->groups_ram / groups * wsize;
+		}
+		if (ram > hashes)
+			ram = hashes;
+		gpu->pad_hashes[PC_RAM] += ram;
+		gpu->pad_hashes[PC_VRAM] += hashes - ram;
+		if (opt_scrypt_chacha && work->nfactor <= MAX_NFACTOR)
+			gpu->nfactor_hashes[work->nfactor] += hashes;
+	}
+#endif
+
+	trace_span("scanhash", tr_scan);
 	return hashes;
 }
 
 static void opencl_thread_shutdown(struct thr_info *thr)
 {
-	const int thr_id = thr->id;
-	_clState *clState = clStates[thr_id];
-
-	// Release split kernels if they were created
-#ifdef USE_SCRYPT
-	if (clState->use_split_kernels) {
-		if (clState->kernel_part1) clReleaseKernel(clState->kernel_part1);
-		if (clState->kernel_part2) clReleaseKernel(clState->kernel_part2);
-		if (clState->kernel_part3) clReleaseKernel(clState->kernel_part3);
-		if (clState->temp_X_buffer) clReleaseMemObject(clState->temp_X_buffer);
-		if (clState->temp_X2_buffer) clReleaseMemObject(clState->temp_X2_buffer);
-		applog(LOG_DEBUG, "Released split kernel resources");
-	}
-	
-	// Release all padbuffer8 buffers (VRAM)
-	for (size_t i = 0; i < clState->num_padbuffers; i++) {
-		if (clState->padbuffer8[i]) {
-			clReleaseMemObject(clState->padbuffer8[i]);
-			clState->padbuffer8[i] = NULL;
-		}
-	}
-	if (clState->num_padbuffers > 0) {
-		applog(LOG_DEBUG, "Released %zu padbuffer8 buffer(s)", clState->num_padbuffers);
-	}
-	
-	// Release all padbuffer8_RAM buffers (system RAM)
-	for (size_t i = 0; i < clState->num_padbuffers_RAM; i++) {
-		if (clState->padbuffer8_RAM[i]) {
-			clReleaseMemObject(clState->padbuffer8_RAM[i]);
-			clState->padbuffer8_RAM[i] = NULL;
-		}
-	}
-	if (clState->num_padbuffers_RAM > 0) {
-		applog(LOG_DEBUG, "Released %zu padbuffer8_RAM buffer(s)", clState->num_padbuffers_RAM);
-	}
-	
-	// Release other scrypt buffers
-	if (clState->CLbuffer0) clReleaseMemObject(clState->CLbuffer0);
-	if (clState->outputBuffer) clReleaseMemObject(clState->outputBuffer);
-#endif
-	
-	// Release monolithic kernel
-	if (clState->kernel) clReleaseKernel(clState->kernel);
-	clReleaseProgram(clState->program);
-	clReleaseCommandQueue(clState->commandQueue);
-	clReleaseContext(clState->context);
+	releaseCl(clStates[thr->id]);
 }
 
 struct device_drv opencl_drv = {
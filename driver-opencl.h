@@ -24,8 +24,12 @@ extern char *set_worksize(char *arg);
 #ifdef USE_SCRYPT
 extern char *set_shaders(char *arg);
 extern char *set_lookup_gap(char *arg);
+extern const char *pad_layout_names[PL_MAX];
+extern char *set_pad_layout(char *arg);
 extern char *set_thread_concurrency(char *arg);
 extern char *set_buffer_size(char *arg);
+#define MAX_SUB_BATCHES 64
+extern char *set_sub_batches(char *arg);
 #endif
 extern char *set_kernel(char *arg);
 void manage_gpu(void);
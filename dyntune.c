@@ -0,0 +1,315 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Launch size controller for scrypt-chacha GPUs at dynamic intensity. The
+ * intensity nudging opencl_scanhash() does for other kernels means nothing
+ * here, every launch is thread concurrency sized, which memory fixes. Instead
+ * each size from an eighth of thread concurrency up to all of it is a
+ * candidate, measured by the hashes it does per second of profiled kernel
+ * time and by the wall time of the scans it makes. Starting from the full
+ * size the controller climbs towards whichever neighbour is faster while
+ * keeping scans under --scan-latency, settles on the best, and searches again
+ * every few minutes, when the measured rate drifts or when a replan changes
+ * thread concurrency. Kernels built for --sub-batches can split a scan into
+ * any number of launches, so once the size is found the count is climbed the
+ * same way over 1, 2, 4 ... up to the one given, at that size.
+ */
+
+#include "config.h"
+
+#if defined(HAVE_OPENCL) && defined(USE_SCRYPT)
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "dyntune.h"
+
+/* Longest scan the controller may choose, in ms, 0 for no limit */
+int opt_scan_latency;
+
+#define DT_STEPS	8		/* Candidates, in eighths of thread concurrency */
+#define DT_WINDOW_NS	2000000000ULL	/* Kernel time each measurement takes */
+#define DT_MIN_LAUNCHES	3
+#define DT_MARGIN	1.02		/* How much faster a smaller size must be */
+#define DT_RETUNE	300		/* Seconds settled before searching again */
+#define DT_DRIFT	0.9		/* Or sooner once the rate falls below this */
+#define DT_LEVELS	7		/* Sub-batch counts, 1 to 64 in powers of two */
+
+struct dt_sample {
+	uint64_t hashes;
+	uint64_t kernel_ns;
+	uint64_t scan_us;
+	unsigned int launches;
+	bool done;
+};
+
+struct dyntune {
+	enum dyntune_state state;
+	size_t max_threads, wsize;
+	int step;			/* 1 - DT_STEPS, the size in use */
+	int max_batches;		/* Sub-batches the kernels were built for, 1 if none */
+	int level;			/* Sub-batch count in use, see level_batches() */
+	bool batching;			/* Searching the sub-batch count, not the size */
+	struct dt_sample samples[DT_STEPS + 1];
+	struct dt_sample batch_samples[DT_LEVELS];
+	struct dt_sample settled;	/* Rolling window once settled */
+	double mhs, scan_ms;		/* Last completed measurement */
+	time_t settled_at;
+	unsigned int explores;
+};
+
+static struct dyntune tunes[MAX_GPUDEVICES];
+static pthread_mutex_t dyntune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t step_threads(const struct dyntune *dt, int step)
+{
+	size_t threads = dt->max_threads * step / DT_STEPS;
+
+	threads -= threads % dt->wsize;
+	if (threads < dt->wsize)
+		threads = dt->wsize;
+	if (threads > dt->max_threads)
+		threads = dt->max_threads;
+	return threads;
+}
+
+static int level_batches(const struct dyntune *dt, int level)
+{
+	return MIN(1 << level, dt->max_batches);
+}
+
+/* Level of the largest sub-batch count, the one given */
+static int top_level(const struct dyntune *dt)
+{
+	int level = 0;
+
+	while (level < DT_LEVELS - 1 && 1 << level < dt->max_batches)
+		level++;
+	return level;
+}
+
+static double sample_mhs(const struct dt_sample *s)
+{
+	return s->kernel_ns ? s->hashes * 1000.0 / s->kernel_ns : 0;
+}
+
+static double sample_scan_ms(const struct dt_sample *s)
+{
+	return s->launches ? s->scan_us / 1000.0 / s->launches : 0;
+}
+
+static bool sample_fits(const struct dt_sample *s)
+{
+	return !opt_scan_latency || sample_scan_ms(s) <= opt_scan_latency;
+}
+
+static bool sample_add(struct dt_sample *s, int64_t hashes, uint64_t kernel_ns, uint64_t scan_us)
+{
+	s->hashes += hashes;
+	s->kernel_ns += kernel_ns;
+	s->scan_us += scan_us;
+	s->launches++;
+	return s->kernel_ns >= DT_WINDOW_NS && s->launches >= DT_MIN_LAUNCHES;
+}
+
+/* Sample of the size and sub-batch count in use */
+static struct dt_sample *current_sample(struct dyntune *dt)
+{
+	return dt->batching ? &dt->batch_samples[dt->level] : &dt->samples[dt->step];
+}
+
+/* Search the size again from step, then the sub-batch count at that size */
+static void explore(struct dyntune *dt, int from)
+{
+	memset(dt->samples, 0, sizeof(dt->samples));
+	memset(dt->batch_samples, 0, sizeof(dt->batch_samples));
+	dt->state = DT_EXPLORING;
+	dt->batching = false;
+	dt->step = from;
+	dt->explores++;
+}
+
+/* Is candidate a better than b. Ones that keep scans under the latency target
+ * beat ones that don't, among those the lower latency wins, and otherwise the
+ * lower candidate has to be DT_MARGIN faster: bigger launches are cheaper to
+ * keep fed, and fewer sub-batches cost fewer launches. */
+static bool sample_better(const struct dt_sample *samples, int a, int b)
+{
+	const struct dt_sample *sa = &samples[a], *sb = &samples[b];
+
+	if (sample_fits(sa) != sample_fits(sb))
+		return sample_fits(sa);
+	if (!sample_fits(sa))
+		return sample_scan_ms(sa) < sample_scan_ms(sb);
+	if (a < b)
+		return sample_mhs(sa) > sample_mhs(sb) * DT_MARGIN;
+	return sample_mhs(sa) * DT_MARGIN >= sample_mhs(sb);
+}
+
+/* Hill climb over candidates lo - hi: the next to measure is an unmeasured
+ * neighbour of the best so far, or once both are known to be worse the best
+ * itself, with *found set */
+static int climb(const struct dt_sample *samples, int lo, int hi, bool *found)
+{
+	int i, best = -1;
+
+	for (i = hi; i >= lo; i--) {
+		if (samples[i].done && (best < 0 || sample_better(samples, i, best)))
+			best = i;
+	}
+	*found = false;
+	if (best > lo && !samples[best - 1].done)
+		return best - 1;
+	if (best < hi && !samples[best + 1].done)
+		return best + 1;
+	*found = true;
+	return best;
+}
+
+static void explore_next(struct cgpu_info *cgpu, struct dyntune *dt)
+{
+	const int top = top_level(dt);
+	bool found;
+
+	if (!dt->batching) {
+		dt->step = climb(dt->samples, 1, DT_STEPS, &found);
+		if (!found)
+			return;
+		if (top) {
+			/* The size's best was measured at the count in use */
+			dt->batch_samples[dt->level] = dt->samples[dt->step];
+			dt->batching = true;
+		}
+	}
+	if (dt->batching) {
+		dt->level = climb(dt->batch_samples, 0, top, &found);
+		if (!found)
+			return;
+	}
+
+	dt->state = DT_SETTLED;
+	dt->settled_at = time(NULL);
+	memset(&dt->settled, 0, sizeof(dt->settled));
+	dt->mhs = sample_mhs(current_sample(dt));
+	dt->scan_ms = sample_scan_ms(current_sample(dt));
+	applog(LOG_NOTICE, "GPU %d: settled on %zu of %zu threads per launch in %d sub-batches, %.3f MH/s, %.0f ms scans",
+	       cgpu->device_id, step_threads(dt, dt->step), dt->max_threads,
+	       level_batches(dt, dt->level), dt->mhs, dt->scan_ms);
+}
+
+/* Global work size for the next launch of a thread concurrency sized plan.
+ * *batches is the most sub-batches the kernels allow and comes back as the
+ * number to split it into. */
+size_t dyntune_threads(struct cgpu_info *cgpu, size_t max_threads, size_t wsize, int *batches)
+{
+	struct dyntune *dt;
+	size_t threads;
+
+	if (!cgpu->dynamic || !opt_scrypt_chacha || cgpu->device_id >= MAX_GPUDEVICES || !wsize)
+		return max_threads;
+	dt = &tunes[cgpu->device_id];
+
+	mutex_lock(&dyntune_lock);
+	if (dt->state == DT_OFF || dt->max_threads != max_threads || dt->wsize != wsize ||
+	    dt->max_batches != *batches) {
+		dt->max_threads = max_threads;
+		dt->wsize = wsize;
+		dt->max_batches = *batches;
+		dt->level = top_level(dt);
+		explore(dt, DT_STEPS);
+	}
+	threads = step_threads(dt, dt->step);
+	*batches = level_batches(dt, dt->level);
+	mutex_unlock_noyield(&dyntune_lock);
+
+	return threads;
+}
+
+/* Feeds back a launch of threads in batches sub-batches that did hashes in
+ * kernel_ns of profiled kernel time, within a scan taking scan_us */
+void dyntune_result(struct cgpu_info *cgpu, size_t threads, int batches, int64_t hashes,
+		    uint64_t kernel_ns, uint64_t scan_us)
+{
+	struct dyntune *dt;
+
+	if (!cgpu->dynamic || !opt_scrypt_chacha || cgpu->device_id >= MAX_GPUDEVICES || !kernel_ns)
+		return;
+	dt = &tunes[cgpu->device_id];
+
+	mutex_lock(&dyntune_lock);
+	/* Launches sized before the last change don't count */
+	if (dt->state == DT_OFF || threads != step_threads(dt, dt->step) ||
+	    batches != level_batches(dt, dt->level))
+		goto out;
+
+	if (dt->state == DT_EXPLORING) {
+		struct dt_sample *s = current_sample(dt);
+
+		if (sample_add(s, hashes, kernel_ns, scan_us)) {
+			s->done = true;
+			dt->mhs = sample_mhs(s);
+			dt->scan_ms = sample_scan_ms(s);
+			applog(LOG_DEBUG, "GPU %d: %zu threads per launch in %d sub-batches, %.3f MH/s, %.0f ms scans",
+			       cgpu->device_id, threads, batches, dt->mhs, dt->scan_ms);
+			explore_next(cgpu, dt);
+		}
+		goto out;
+	}
+
+	if (sample_add(&dt->settled, hashes, kernel_ns, scan_us)) {
+		double best = sample_mhs(current_sample(dt));
+
+		dt->mhs = sample_mhs(&dt->settled);
+		dt->scan_ms = sample_scan_ms(&dt->settled);
+		memset(&dt->settled, 0, sizeof(dt->settled));
+		if (dt->mhs < best * DT_DRIFT || time(NULL) - dt->settled_at > DT_RETUNE) {
+			applog(LOG_INFO, "GPU %d: %.3f MH/s against %.3f when settled, searching launch sizes again",
+			       cgpu->device_id, dt->mhs, best);
+			explore(dt, dt->step);
+		}
+	}
+out:
+	mutex_unlock_noyield(&dyntune_lock);
+}
+
+void dyntune_status(struct cgpu_info *cgpu, struct dyntune_status *status)
+{
+	struct dyntune *dt;
+
+	memset(status, 0, sizeof(*status));
+	if (cgpu->device_id >= MAX_GPUDEVICES || !cgpu->dynamic || !opt_scrypt_chacha)
+		return;
+	dt = &tunes[cgpu->device_id];
+
+	mutex_lock(&dyntune_lock);
+	status->state = dt->state;
+	if (dt->state != DT_OFF) {
+		status->threads = step_threads(dt, dt->step);
+		status->max_threads = dt->max_threads;
+		status->batches = level_batches(dt, dt->level);
+		status->max_batches = dt->max_batches;
+	}
+	status->mhs = dt->mhs;
+	status->scan_ms = dt->scan_ms;
+	status->explores = dt->explores;
+	mutex_unlock_noyield(&dyntune_lock);
+}
+
+const char *dyntune_state_str(enum dyntune_state state)
+{
+	switch (state) {
+		case DT_EXPLORING:
+			return "Exploring";
+		case DT_SETTLED:
+			return "Settled";
+		default:
+			return "Off";
+	}
+}
+
+#endif /* HAVE_OPENCL && USE_SCRYPT */
@@ -0,0 +1,41 @@
+#ifndef __DYNTUNE_H__
+#define __DYNTUNE_H__
+
+#include "miner.h"
+
+enum dyntune_state {
+	DT_OFF,
+	DT_EXPLORING,
+	DT_SETTLED,
+};
+
+struct dyntune_status {
+	enum dyntune_state state;
+	size_t threads;		/* Launch size in use */
+	size_t max_threads;	/* Thread concurrency it is chosen under */
+	int batches;		/* Sub-batches each scan is split into */
+	int max_batches;	/* Most sub-batches the kernels allow */
+	double mhs;		/* Kernel hashrate measured at that size */
+	double scan_ms;		/* Mean wall time of a scan at that size */
+	unsigned int explores;	/* Times the search has run */
+};
+
+#if defined(HAVE_OPENCL) && defined(USE_SCRYPT)
+extern int opt_scan_latency;
+
+extern size_t dyntune_threads(struct cgpu_info *cgpu, size_t max_threads, size_t wsize,
+			      int *batches);
+extern void dyntune_result(struct cgpu_info *cgpu, size_t threads, int batches, int64_t hashes,
+			   uint64_t kernel_ns, uint64_t scan_us);
+extern void dyntune_status(struct cgpu_info *cgpu, struct dyntune_status *status);
+extern const char *dyntune_state_str(enum dyntune_state state);
+
+#else /* HAVE_OPENCL && USE_SCRYPT */
+static inline size_t dyntune_threads(__maybe_unused struct cgpu_info *cgpu, size_t max_threads,
+				     __maybe_unused size_t wsize, __maybe_unused int *batches)
+{
+	return max_threads;
+}
+#endif /* HAVE_OPENCL && USE_SCRYPT */
+
+#endif /* __DYNTUNE_H__ */
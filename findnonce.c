@@ -18,7 +18,8 @@
 
 #include "findnonce.h"
 #include "scrypt.h"
-#include "scrypt-jane.h"
+#include "trace.h"
+#include "affinity.h"
 
 const uint32_t SHA256_K[64] = {
 	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
@@ -176,78 +177,79 @@ struct pc_data {
 	struct thr_info *thr;
 	struct work *work;
 	uint32_t res[SCRYPT_MAXBUFFERS];
+	uint32_t hash[RESULT_SLOTS];	/* Top hash word of each nonce from a result ring */
 	pthread_t pth;
 	int found;
+	bool ring;
 };
 
 static void *postcalc_hash(void *userdata)
 {
 	struct pc_data *pcd = (struct pc_data *)userdata;
 	struct thr_info *thr = pcd->thr;
-	unsigned int entry = 0;
-	int found = opt_scrypt ? SCRYPT_FOUND : FOUND;
+	const uint32_t target = *(uint32_t *)(pcd->work->target + 28);
+	int entry;
+	uint64_t tr_start;
 
 	pthread_detach(pthread_self());
 
-	/* To prevent corrupt values in FOUND from trying to read beyond the
-	 * end of the res[] array */
-	if (unlikely(pcd->res[found] & ~found)) {
-		applog(LOG_WARNING, "%s%d: invalid nonce count - HW error",
-				thr->cgpu->drv->name, thr->cgpu->device_id);
-		hw_errors++;
-		thr->cgpu->hw_errors++;
-		pcd->res[found] &= found;
+	RenameThread("postcalc");
+	affinity_gpu_verify(thr->cgpu);
+	tr_start = trace_now();
+
+	if (!pcd->ring) {
+		int found = opt_scrypt ? SCRYPT_FOUND : FOUND;
+
+		/* To prevent corrupt values in FOUND from trying to read beyond
+		 * the end of the res[] array */
+		if (unlikely(pcd->res[found] & ~found)) {
+			applog(LOG_WARNING, "%s%d: invalid nonce count - HW error",
+					thr->cgpu->drv->name, thr->cgpu->device_id);
+			hw_errors++;
+			thr->cgpu->hw_errors++;
+			pcd->res[found] &= found;
+		}
+		pcd->found = pcd->res[found];
 	}
 
-	for (entry = 0; entry < pcd->res[found]; entry++) {
+	for (entry = 0; entry < pcd->found; entry++) {
 		uint32_t nonce = pcd->res[entry];
 
-		//  If opt_scrypt_chacha is true, submit only the first nonce; other nonces are logged.
-		if (opt_scrypt_chacha) {
-			/* Log Data array and Nonce for scrypt-chacha */
-			uint32_t data[21]; // Max size for 84-byte header (21 uint32s)
-
-			/* Prepare data array like in sc_scrypt_regenhash */
-			if (opt_scrypt_chacha_84) {
-				sj_be32enc_vect(data, (const uint32_t *)pcd->work->data, 20);
-				data[20] = nonce;
-			} else {
-				sj_be32enc_vect(data, (const uint32_t *)pcd->work->data, 19);
-				data[19] = nonce;
-			}
-
-			/* Print data array as hex string */
-			int data_size = opt_scrypt_chacha_84 ? 84 : 80;  // 84 bytes or 80 bytes
-			char *data_hex = bin2hex((unsigned char *)data, data_size);
-
-			if (entry == 0) {
-				if (opt_scrypt_chacha_84) {
-					applog(LOG_DEBUG, "SUBMITTING, OCL NONCE %u found in slot %d - Data array: %s, Nonce: %u", nonce, entry, data_hex, data[20]);
-				} else {
-					applog(LOG_DEBUG, "SUBMITTING, OCL NONCE %u found in slot %d - Data array: %s, Nonce: %u", nonce, entry, data_hex, data[19]);
-				}
-				submit_nonce(thr, pcd->work, nonce);
-			} else {
-				if (opt_scrypt_chacha_84) {
-					applog(LOG_DEBUG, "LOGGING ONLY, OCL NONCE %u found in slot %d - Data array: %s, Nonce: %u", nonce, entry, data_hex, data[20]);
-				} else {
-					applog(LOG_DEBUG, "LOGGING ONLY, OCL NONCE %u found in slot %d - Data array: %s, Nonce: %u", nonce, entry, data_hex, data[19]);
-				}
+		if (pcd->ring) {
+			/* The kernel only keeps hashes under the target */
+			if (unlikely(pcd->hash[entry] > target)) {
+				applog(LOG_WARNING, "%s%d: nonce %u returned with hash %08x over target %08x - HW error",
+				       thr->cgpu->drv->name, thr->cgpu->device_id, nonce, pcd->hash[entry], target);
+				hw_errors++;
+				thr->cgpu->hw_errors++;
+				continue;
 			}
-
-			free(data_hex);
-		} else {
+			applog(LOG_DEBUG, "OCL NONCE %u found in slot %d, hash %08x", nonce, entry, pcd->hash[entry]);
+		} else
 			applog(LOG_DEBUG, "OCL NONCE %u found in slot %d", nonce, entry);
-			submit_nonce(thr, pcd->work, nonce);
-		}
+		submit_nonce(thr, pcd->work, nonce);
 	}
 
 	discard_work(pcd->work);
 	free(pcd);
 
+	trace_span("postcalc", tr_start);
 	return NULL;
 }
 
+static void postcalc_start(struct pc_data *pcd, struct thr_info *thr, struct work *work)
+{
+	pcd->thr = thr;
+	pcd->work = copy_work(work);
+	/* Mark work as submitted to trigger waiting for fresh work */
+	work->submitted = true;
+
+	if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
+		applog(LOG_ERR, "Failed to create postcalc_hash thread");
+		return;
+	}
+}
+
 void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
 {
 	struct pc_data *pcd = malloc(sizeof(struct pc_data));
@@ -258,16 +260,44 @@ void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
 		return;
 	}
 
-	pcd->thr = thr;
-	pcd->work = copy_work(work);
-	/* Mark work as submitted to trigger waiting for fresh work */
-	work->submitted = true;
 	buffersize = opt_scrypt ? SCRYPT_BUFFERSIZE : BUFFERSIZE;
 	memcpy(&pcd->res, res, buffersize);
+	pcd->ring = false;
+	postcalc_start(pcd, thr, work);
+}
 
-	if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
-		applog(LOG_ERR, "Failed to create postcalc_hash thread");
-		return;
+/* Submits the nonces a result ring gained since its count was tail, and
+ * returns the count to pass next time */
+uint32_t postcalc_ring_async(struct thr_info *thr, struct work *work, const uint32_t *ring,
+			     uint32_t tail)
+{
+	const uint32_t head = ring[RESULT_HEAD];
+	uint32_t count = head - tail, i;
+	struct pc_data *pcd;
+
+	if (!count)
+		return head;
+	if (unlikely(count > RESULT_SLOTS)) {
+		applog(LOG_WARNING, "%s%d: %u nonces found in one scan, only the last %d kept",
+		       thr->cgpu->drv->name, thr->cgpu->device_id, count, RESULT_SLOTS);
+		tail = head - RESULT_SLOTS;
+		count = RESULT_SLOTS;
+	}
+
+	pcd = malloc(sizeof(struct pc_data));
+	if (unlikely(!pcd)) {
+		applog(LOG_ERR, "Failed to malloc pc_data in postcalc_ring_async");
+		return head;
+	}
+	for (i = 0; i < count; i++) {
+		const uint32_t *entry = &ring[RESULT_ENTRY + ((tail + i) & (RESULT_SLOTS - 1)) * 2];
+
+		pcd->res[i] = entry[0];
+		pcd->hash[i] = entry[1];
 	}
+	pcd->found = count;
+	pcd->ring = true;
+	postcalc_start(pcd, thr, work);
+	return head;
 }
 #endif /* HAVE_OPENCL */
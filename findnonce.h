@@ -12,8 +12,29 @@
 #define SCRYPT_BUFFERSIZE (sizeof(uint32_t) * SCRYPT_MAXBUFFERS)
 #define SCRYPT_FOUND (0xFF)
 
+/* Scrypt-chacha kernels return found nonces in a ring: RESULT_HEAD counts
+ * every nonce found since the buffer was created and is never cleared, and
+ * nonce n and the top word of its hash are at RESULT_ENTRY + 2 * (n %
+ * RESULT_SLOTS). The host remembers the count it read last and takes only the
+ * entries after it. */
+#define RESULT_SLOTS (0x80)
+#define RESULT_HEAD (0)
+#define RESULT_ENTRY (2)
+#define RESULT_WORDS (RESULT_ENTRY + RESULT_SLOTS * 2)
+#define RESULT_BUFFERSIZE (sizeof(uint32_t) * RESULT_WORDS)
+
+/* Size of the output buffer for the kernels in use */
+static inline size_t output_buffersize(void)
+{
+	if (opt_scrypt_chacha)
+		return RESULT_BUFFERSIZE;
+	return opt_scrypt ? SCRYPT_BUFFERSIZE : BUFFERSIZE;
+}
+
 #ifdef HAVE_OPENCL
 extern void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data);
 extern void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res);
+extern uint32_t postcalc_ring_async(struct thr_info *thr, struct work *work, const uint32_t *ring,
+				    uint32_t tail);
 #endif /* HAVE_OPENCL */
 #endif /*__FINDNONCE_H__*/
@@ -11,12 +11,14 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <pthread.h>
 
 #include "logging.h"
 #include "miner.h"
 
 bool opt_debug = false;
 bool opt_log_output = false;
+bool opt_log_sync = false;
 
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
@@ -39,12 +41,7 @@ static void my_log_curses(int prio, const char *datetime, const char *str)
 	}
 }
 
-/* high-level logging function, based on global opt_log_level */
-
-/*
- * log function
- */
-void _applog(int prio, const char *str)
+static void log_write(int prio, const struct timeval *tv, const char *str, bool flush)
 {
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
@@ -55,12 +52,9 @@ void _applog(int prio, const char *str)
 #endif
 	else {
 		char datetime[64];
-		struct timeval tv = {0, 0};
 		struct tm *tm;
 
-		cgtime(&tv);
-
-		const time_t tmp_time = tv.tv_sec;
+		const time_t tmp_time = tv->tv_sec;
 		tm = localtime(&tmp_time);
 
 		sprintf(datetime, " [%d-%02d-%02d %02d:%02d:%02d] ",
@@ -74,9 +68,223 @@ void _applog(int prio, const char *str)
 		/* Only output to stderr if it's not going to the screen as well */
 		if (!isatty(fileno((FILE *)stderr))) {
 			fprintf(stderr, "%s%s\n", datetime, str);	/* atomic write to stderr */
-			fflush(stderr);
+			if (flush)
+				fflush(stderr);
 		}
 
 		my_log_curses(prio, datetime, str);
 	}
 }
+
+/*
+ * Asynchronous logging. Each thread that logs gets its own single producer,
+ * single consumer ring of records. The writer thread merges the rings in
+ * timestamp order and does the formatting and console/stderr/syslog output,
+ * so a miner thread only ever copies its message into the ring. When a ring
+ * is full the record is dropped and counted rather than blocking the caller.
+ * Rings are handed back when their thread exits and reused by new threads.
+ */
+#define LOG_RING_SIZE 256
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_WRITER_MS 10
+
+struct log_rec {
+	struct timeval tv;
+	int prio;
+	char str[LOGBUFSIZ];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	volatile int in_use;
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	volatile unsigned int dropped;
+	unsigned int dropped_seen;
+	struct log_rec rec[LOG_RING_SIZE];
+};
+
+static struct log_ring *log_rings;
+static pthread_key_t log_key;
+static pthread_t log_thread;
+static volatile bool log_running;
+static volatile bool log_done;
+static uint64_t log_dropped;
+
+static void log_ring_release(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	ring->in_use = 0;
+}
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring;
+
+	for (ring = log_rings; ring; ring = ring->next) {
+		if (__sync_bool_compare_and_swap(&ring->in_use, 0, 1))
+			goto out;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (unlikely(!ring))
+		return NULL;
+	ring->in_use = 1;
+	do {
+		ring->next = log_rings;
+	} while (!__sync_bool_compare_and_swap(&log_rings, ring->next, ring));
+out:
+	pthread_setspecific(log_key, ring);
+	return ring;
+}
+
+static bool log_push(int prio, const char *str)
+{
+	struct log_ring *ring = pthread_getspecific(log_key);
+	struct log_rec *rec;
+	unsigned int head;
+
+	if (!ring) {
+		ring = log_ring_get();
+		if (unlikely(!ring))
+			return false;
+	}
+
+	head = ring->head;
+	if (head - ring->tail >= LOG_RING_SIZE) {
+		ring->dropped++;
+		return true;
+	}
+	rec = &ring->rec[head & LOG_RING_MASK];
+	cgtime(&rec->tv);
+	rec->prio = prio;
+	strncpy(rec->str, str, sizeof(rec->str) - 1);
+	rec->str[sizeof(rec->str) - 1] = '\0';
+	__sync_synchronize();
+	ring->head = head + 1;
+	return true;
+}
+
+/* Write out everything queued so far, oldest record first across all rings */
+static void log_drain(void)
+{
+	struct log_ring *ring, *oldest;
+	struct log_rec *rec, *orec;
+	unsigned int dropped = 0;
+	int wrote = 0;
+
+	while (42) {
+		oldest = NULL;
+		orec = NULL;
+		for (ring = log_rings; ring; ring = ring->next) {
+			if (ring->tail == ring->head)
+				continue;
+			__sync_synchronize();
+			rec = &ring->rec[ring->tail & LOG_RING_MASK];
+			if (!orec || timercmp(&rec->tv, &orec->tv, <)) {
+				oldest = ring;
+				orec = rec;
+			}
+		}
+		if (!oldest)
+			break;
+		log_write(orec->prio, &orec->tv, orec->str, false);
+		__sync_synchronize();
+		oldest->tail++;
+		wrote++;
+	}
+
+	for (ring = log_rings; ring; ring = ring->next) {
+		unsigned int now = ring->dropped;
+
+		dropped += now - ring->dropped_seen;
+		ring->dropped_seen = now;
+	}
+	if (dropped) {
+		char tmp42[LOGBUFSIZ];
+		struct timeval tv;
+
+		log_dropped += dropped;
+		cgtime(&tv);
+		snprintf(tmp42, sizeof(tmp42), "Logging fell behind, dropped %u messages", dropped);
+		log_write(LOG_WARNING, &tv, tmp42, false);
+		wrote++;
+	}
+
+	if (wrote)
+		fflush(stderr);
+}
+
+static void *log_writer(void __maybe_unused *userdata)
+{
+	RenameThread("logwriter");
+
+	while (log_running) {
+		log_drain();
+		nmsleep(LOG_WRITER_MS);
+	}
+	log_drain();
+	log_done = true;
+
+	return NULL;
+}
+
+void log_start(void)
+{
+	if (log_running)
+		return;
+	if (unlikely(pthread_key_create(&log_key, log_ring_release))) {
+		applog(LOG_WARNING, "Failed to create log key, logging synchronously");
+		return;
+	}
+	log_done = false;
+	log_running = true;
+	if (unlikely(pthread_create(&log_thread, NULL, log_writer, NULL))) {
+		log_running = false;
+		applog(LOG_WARNING, "Failed to create log writer thread, logging synchronously");
+	}
+}
+
+/* Flush the rings and return to synchronous logging. The writer is given a
+ * bounded time to finish in case it is stuck behind a lock the caller holds */
+void log_stop(void)
+{
+	int i;
+
+	if (!log_running)
+		return;
+	log_running = false;
+	for (i = 0; i < 100 && !log_done; i++)
+		nmsleep(LOG_WRITER_MS);
+	if (log_done)
+		pthread_join(log_thread, NULL);
+}
+
+uint64_t log_drops(void)
+{
+	uint64_t dropped = log_dropped;
+	struct log_ring *ring;
+
+	/* Include drops the writer has not reported yet */
+	for (ring = log_rings; ring; ring = ring->next)
+		dropped += ring->dropped - ring->dropped_seen;
+	return dropped;
+}
+
+/* high-level logging function, based on global opt_log_level */
+
+/*
+ * log function
+ */
+void _applog(int prio, const char *str)
+{
+	struct timeval tv = {0, 0};
+
+	/* Errors are written immediately since they often precede an exit */
+	if (log_running && prio != LOG_ERR && log_push(prio, str))
+		return;
+
+	cgtime(&tv);
+	log_write(prio, &tv, str, true);
+}
@@ -4,6 +4,7 @@
 #include "config.h"
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
@@ -21,6 +22,7 @@ enum {
 extern bool opt_debug;
 extern bool opt_log_output;
 extern bool opt_realquiet;
+extern bool opt_log_sync;
 extern bool want_per_device_stats;
 
 /* global log_level, messages with lower or equal prio are logged */
@@ -29,6 +31,9 @@ extern int opt_log_level;
 #define LOGBUFSIZ 256
 
 extern void _applog(int prio, const char *str);
+extern void log_start(void);
+extern void log_stop(void);
+extern uint64_t log_drops(void);
 
 #define applog(prio, fmt, ...) do { \
 	if (opt_debug || prio != LOG_DEBUG) { \
@@ -0,0 +1,475 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Serves the miner counters over HTTP in the OpenMetrics text format so they
+ * can be scraped by Prometheus. The page is rendered from the hashmeter
+ * snapshots once per log interval and every scrape is answered from that
+ * pre-rendered buffer, so scraping never touches the live counters.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "compat.h"
+#include "miner.h"
+#include "util.h"
+#include "metrics.h"
+#include "work-pool.h"
+
+#define METRICS_QUEUE	16
+#define METRICS_REQSIZ	1024
+#define METRICS_RECV_MS	500	/* How long a client gets to send its request */
+
+static const char *metrics_header =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+	"Connection: close\r\n"
+	"Content-Length: %lu\r\n"
+	"\r\n";
+
+struct metrics_buf {
+	char *buf;
+	size_t len;
+	size_t siz;
+};
+
+static void mb_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (42) {
+		va_start(ap, fmt);
+		n = vsnprintf(mb->buf + mb->len, mb->siz - mb->len, fmt, ap);
+		va_end(ap);
+
+		if (unlikely(n < 0))
+			return;
+		if (mb->len + n < mb->siz)
+			break;
+
+		mb->siz = (mb->len + n + 1) * 2;
+		mb->buf = realloc(mb->buf, mb->siz);
+		if (unlikely(!mb->buf))
+			quit(1, "Failed to realloc metrics buffer");
+	}
+	mb->len += n;
+}
+
+/* Label values may not contain unescaped quotes, backslashes or newlines */
+static void mb_label(struct metrics_buf *mb, const char *str)
+{
+	for (; str && *str; str++) {
+		switch (*str) {
+			case '\\':
+				mb_printf(mb, "\\\\");
+				break;
+			case '"':
+				mb_printf(mb, "\\\"");
+				break;
+			case '\n':
+				mb_printf(mb, "\\n");
+				break;
+			default:
+				mb_printf(mb, "%c", *str);
+				break;
+		}
+	}
+}
+
+static void mb_family(struct metrics_buf *mb, const char *name, const char *type, const char *help)
+{
+	mb_printf(mb, "# TYPE yacminer_%s %s\n", name, type);
+	mb_printf(mb, "# HELP yacminer_%s %s\n", name, help);
+}
+
+static void render_devices(struct metrics_buf *mb)
+{
+	struct cgpu_snapshot *snaps;
+	int i, j, devs = total_devices;
+
+	if (!devs)
+		return;
+
+	snaps = calloc(devs, sizeof(*snaps));
+	if (unlikely(!snaps))
+		quit(1, "Failed to calloc metrics device snapshots");
+	for (i = 0; i < devs; i++)
+		get_cgpu_snapshot(get_devices(i), &snaps[i]);
+
+#define DEVLABEL(i) get_devices(i)->drv->name, get_devices(i)->device_id
+
+	mb_family(mb, "device_hashrate", "gauge", "Rolling hashrate over the log interval in hashes per second");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_device_hashrate{device=\"%s%d\"} %.0f\n",
+			  DEVLABEL(i), snaps[i].rolling * 1000000.0);
+
+	mb_family(mb, "device_hashes", "counter", "Hashes completed");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_device_hashes_total{device=\"%s%d\"} %.0f\n",
+			  DEVLABEL(i), snaps[i].total_mhashes * 1000000.0);
+
+	mb_family(mb, "device_accepted", "counter", "Shares accepted");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_device_accepted_total{device=\"%s%d\"} %d\n",
+			  DEVLABEL(i), snaps[i].accepted);
+
+	mb_family(mb, "device_rejected", "counter", "Shares rejected");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_device_rejected_total{device=\"%s%d\"} %d\n",
+			  DEVLABEL(i), snaps[i].rejected);
+
+	mb_family(mb, "device_hardware_errors", "counter", "Nonces that failed CPU verification");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_device_hardware_errors_total{device=\"%s%d\"} %d\n",
+			  DEVLABEL(i), snaps[i].hw_errors);
+
+	mb_family(mb, "fresh_work_switches", "counter", "Times a device moved to the next work after finding a share");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_fresh_work_switches_total{device=\"%s%d\"} %"PRIu64"\n",
+			  DEVLABEL(i), snaps[i].fresh_work_switches);
+
+	mb_family(mb, "fresh_work_wait_seconds", "counter", "Time spent waiting for the next work after finding a share");
+	for (i = 0; i < devs; i++)
+		mb_printf(mb, "yacminer_fresh_work_wait_seconds_total{device=\"%s%d\"} %.6f\n",
+			  DEVLABEL(i), snaps[i].fresh_work_wait);
+
+	mb_family(mb, "kernel_seconds", "counter", "Time spent executing each OpenCL kernel");
+	for (i = 0; i < devs; i++) {
+		for (j = 0; j < KS_MAX; j++) {
+			if (!snaps[i].kernel_runs[j])
+				continue;
+			mb_printf(mb, "yacminer_kernel_seconds_total{device=\"%s%d\",kernel=\"%s\"} %.6f\n",
+				  DEVLABEL(i), kernel_stage_names[j], snaps[i].kernel_secs[j]);
+		}
+	}
+
+	mb_family(mb, "kernel_runs", "counter", "OpenCL kernel invocations");
+	for (i = 0; i < devs; i++) {
+		for (j = 0; j < KS_MAX; j++) {
+			if (!snaps[i].kernel_runs[j])
+				continue;
+			mb_printf(mb, "yacminer_kernel_runs_total{device=\"%s%d\",kernel=\"%s\"} %"PRIu64"\n",
+				  DEVLABEL(i), kernel_stage_names[j], snaps[i].kernel_runs[j]);
+		}
+	}
+
+#if defined(HAVE_OPENCL) && defined(USE_SCRYPT)
+	/* The padbuffer plan is fixed once the device is initialised so it is
+	 * read directly */
+	mb_family(mb, "padbuffer_bytes", "gauge", "Scrypt scratchpad memory allocated");
+	for (i = 0; i < devs; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		if (cgpu->drv->drv_id != DRIVER_OPENCL)
+			continue;
+		mb_printf(mb, "yacminer_padbuffer_bytes{device=\"%s%d\",memory=\"vram\"} %lu\n",
+			  DEVLABEL(i), (unsigned long)cgpu->padbuffer_vram);
+		mb_printf(mb, "yacminer_padbuffer_bytes{device=\"%s%d\",memory=\"ram\"} %lu\n",
+			  DEVLABEL(i), (unsigned long)cgpu->padbuffer_ram);
+	}
+
+	mb_family(mb, "padbuffer_hashes", "counter", "Hashes completed by where their scratchpad lived");
+	for (i = 0; i < devs; i++) {
+		if (get_devices(i)->drv->drv_id != DRIVER_OPENCL)
+			continue;
+		for (j = 0; j < PC_MAX; j++)
+			mb_printf(mb, "yacminer_padbuffer_hashes_total{device=\"%s%d\",memory=\"%s\"} %"PRIu64"\n",
+				  DEVLABEL(i), pad_class_names[j], snaps[i].pad_hashes[j]);
+	}
+
+	mb_family(mb, "nfactor_hashes", "counter", "Hashes completed by the Nfactor of their work");
+	for (i = 0; i < devs; i++) {
+		if (get_devices(i)->drv->drv_id != DRIVER_OPENCL)
+			continue;
+		for (j = 0; j <= MAX_NFACTOR; j++)
+			if (snaps[i].nfactor_hashes[j])
+				mb_printf(mb, "yacminer_nfactor_hashes_total{device=\"%s%d\",nfactor=\"%d\"} %"PRIu64"\n",
+					  DEVLABEL(i), j, snaps[i].nfactor_hashes[j]);
+	}
+
+	mb_family(mb, "plan_nfactor", "gauge", "Largest Nfactor the padbuffers are planned for");
+	for (i = 0; i < devs; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		if (cgpu->drv->drv_id != DRIVER_OPENCL)
+			continue;
+		mb_printf(mb, "yacminer_plan_nfactor{device=\"%s%d\"} %d\n", DEVLABEL(i), cgpu->plan_nfactor);
+	}
+
+	mb_family(mb, "padbuffers", "gauge", "Scrypt scratchpad buffers allocated");
+	for (i = 0; i < devs; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		if (cgpu->drv->drv_id != DRIVER_OPENCL)
+			continue;
+		mb_printf(mb, "yacminer_padbuffers{device=\"%s%d\",memory=\"vram\"} %d\n",
+			  DEVLABEL(i), cgpu->num_padbuffers);
+		mb_printf(mb, "yacminer_padbuffers{device=\"%s%d\",memory=\"ram\"} %d\n",
+			  DEVLABEL(i), cgpu->num_padbuffers_ram);
+	}
+#endif
+#undef DEVLABEL
+
+	free(snaps);
+}
+
+/* The labels every per-pool family carries, without the braces */
+static void pool_labels(struct metrics_buf *mb, struct pool *pool)
+{
+	mb_printf(mb, "pool=\"%d\",url=\"", pool->pool_no);
+	mb_label(mb, pool->rpc_url);
+	mb_printf(mb, "\"");
+}
+
+static void pool_label(struct metrics_buf *mb, struct pool *pool)
+{
+	mb_printf(mb, "{");
+	pool_labels(mb, pool);
+	mb_printf(mb, "}");
+}
+
+static const double latency_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void render_latency(struct metrics_buf *mb)
+{
+	int i, j, k;
+
+	mb_family(mb, "share_latency_seconds", "summary", "Time taken by each stage of a share from device result to pool response");
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->removed)
+			continue;
+
+		for (j = 0; j < SS_MAX; j++) {
+			struct latency_hist *hist = &pool->latency[j];
+
+			for (k = 0; k < (int)(sizeof(latency_quantiles) / sizeof(latency_quantiles[0])); k++) {
+				mb_printf(mb, "yacminer_share_latency_seconds{");
+				pool_labels(mb, pool);
+				mb_printf(mb, ",stage=\"%s\",quantile=\"%g\"} %.6f\n",
+					  share_stage_names[j], latency_quantiles[k],
+					  latency_percentile(hist, latency_quantiles[k] * 100.0) / 1000000.0);
+			}
+			mb_printf(mb, "yacminer_share_latency_seconds_sum{");
+			pool_labels(mb, pool);
+			mb_printf(mb, ",stage=\"%s\"} %.6f\n", share_stage_names[j], hist->sum_us / 1000000.0);
+			mb_printf(mb, "yacminer_share_latency_seconds_count{");
+			pool_labels(mb, pool);
+			mb_printf(mb, ",stage=\"%s\"} %"PRIu64"\n", share_stage_names[j], hist->count);
+		}
+	}
+}
+
+static void render_pools(struct metrics_buf *mb)
+{
+	struct pool_snapshot snap;
+	int i;
+
+	mb_family(mb, "pool_accepted", "counter", "Shares accepted by the pool");
+	for (i = 0; i < total_pools; i++) {
+		if (pools[i]->removed)
+			continue;
+		get_pool_snapshot(pools[i], &snap);
+		mb_printf(mb, "yacminer_pool_accepted_total");
+		pool_label(mb, pools[i]);
+		mb_printf(mb, " %d\n", snap.accepted);
+	}
+
+	mb_family(mb, "pool_rejected", "counter", "Shares rejected by the pool");
+	for (i = 0; i < total_pools; i++) {
+		if (pools[i]->removed)
+			continue;
+		get_pool_snapshot(pools[i], &snap);
+		mb_printf(mb, "yacminer_pool_rejected_total");
+		pool_label(mb, pools[i]);
+		mb_printf(mb, " %d\n", snap.rejected);
+	}
+
+	mb_family(mb, "pool_stale", "counter", "Shares discarded or submitted as stale");
+	for (i = 0; i < total_pools; i++) {
+		if (pools[i]->removed)
+			continue;
+		get_pool_snapshot(pools[i], &snap);
+		mb_printf(mb, "yacminer_pool_stale_total");
+		pool_label(mb, pools[i]);
+		mb_printf(mb, " %u\n", snap.stale_shares);
+	}
+
+	render_latency(mb);
+}
+
+static void render_metrics(struct metrics_buf *mb)
+{
+	struct stats_snapshot snap;
+	struct work_pool_stats wps;
+
+	get_stats_snapshot(&snap);
+	mb->len = 0;
+
+	mb_family(mb, "elapsed_seconds", "gauge", "Time since mining started");
+	mb_printf(mb, "yacminer_elapsed_seconds %.0f\n", snap.total_secs);
+	mb_family(mb, "hashes", "counter", "Hashes completed by all devices");
+	mb_printf(mb, "yacminer_hashes_total %.0f\n", snap.total_mhashes_done * 1000000.0);
+	mb_family(mb, "accepted", "counter", "Shares accepted");
+	mb_printf(mb, "yacminer_accepted_total %d\n", snap.total_accepted);
+	mb_family(mb, "rejected", "counter", "Shares rejected");
+	mb_printf(mb, "yacminer_rejected_total %d\n", snap.total_rejected);
+	mb_family(mb, "stale", "counter", "Stale shares");
+	mb_printf(mb, "yacminer_stale_total %d\n", snap.total_stale);
+	mb_family(mb, "hardware_errors", "counter", "Nonces that failed CPU verification");
+	mb_printf(mb, "yacminer_hardware_errors_total %d\n", snap.hw_errors);
+	work_pool_stats(&wps);
+	mb_family(mb, "work_pool_gets", "counter", "Work structs handed out by where they came from");
+	mb_printf(mb, "yacminer_work_pool_gets_total{source=\"cache\"} %"PRIu64"\n", wps.cached);
+	mb_printf(mb, "yacminer_work_pool_gets_total{source=\"depot\"} %"PRIu64"\n", wps.depot);
+	mb_printf(mb, "yacminer_work_pool_gets_total{source=\"calloc\"} %"PRIu64"\n", wps.allocated);
+	mb_family(mb, "work_strings", "counter", "Work strings by whether they fitted in the work's own storage");
+	mb_printf(mb, "yacminer_work_strings_total{storage=\"inline\"} %"PRIu64"\n", wps.str_inline);
+	mb_printf(mb, "yacminer_work_strings_total{storage=\"heap\"} %"PRIu64"\n", wps.str_heap);
+	mb_family(mb, "nfactor", "gauge", "Current scrypt-chacha Nfactor");
+	mb_printf(mb, "yacminer_nfactor %u\n", sc_currentn);
+
+	render_devices(mb);
+	render_pools(mb);
+
+	mb_printf(mb, "# EOF\n");
+}
+
+static void metrics_reply(SOCKETTYPE c, struct metrics_buf *mb)
+{
+	char req[METRICS_REQSIZ];
+	char hdr[256];
+	struct timeval timeout;
+	fd_set rd;
+	size_t sent;
+	int n;
+
+	/* The exporter serves one client at a time, so one that connects and
+	 * sends nothing must not hold up every scrape after it */
+	timeout.tv_sec = 0;
+	timeout.tv_usec = METRICS_RECV_MS * 1000;
+	FD_ZERO(&rd);
+	FD_SET(c, &rd);
+	n = select(c + 1, &rd, NULL, NULL, &timeout);
+	if (n <= 0) {
+		applog(LOG_DEBUG, "Metrics: no request within %dms, dropping client", METRICS_RECV_MS);
+		return;
+	}
+
+	/* The request itself is irrelevant, every path gets the metrics */
+	n = recv(c, req, sizeof(req) - 1, 0);
+	if (SOCKETFAIL(n)) {
+		applog(LOG_DEBUG, "Metrics: recv failed: %s", SOCKERRMSG);
+		return;
+	}
+
+	n = snprintf(hdr, sizeof(hdr), metrics_header, (unsigned long)mb->len);
+	if (SOCKETFAIL(send(c, hdr, n, 0)))
+		return;
+
+	for (sent = 0; sent < mb->len; sent += n) {
+		n = send(c, mb->buf + sent, mb->len - sent, 0);
+		if (SOCKETFAIL(n) || n == 0) {
+			applog(LOG_DEBUG, "Metrics: send failed: %s", SOCKERRMSG);
+			return;
+		}
+	}
+}
+
+void metrics(int __maybe_unused thr_id)
+{
+	struct metrics_buf mb = { NULL, 0, 0 };
+	struct sockaddr_in serv;
+	struct timeval last, now;
+	SOCKETTYPE sock, c;
+
+	if (!opt_metrics_port) {
+		applog(LOG_DEBUG, "Metrics exporter not enabled");
+		return;
+	}
+
+	/* As with the API, give curl time to have called WSAStartup() */
+	nmsleep(opt_log_interval * 1000);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == INVSOCK) {
+		applog(LOG_ERR, "Metrics socket failed (%s)", SOCKERRMSG);
+		return;
+	}
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	if (opt_metrics_network)
+		serv.sin_addr.s_addr = htonl(INADDR_ANY);
+	else
+		serv.sin_addr.s_addr = inet_addr("127.0.0.1");
+	serv.sin_port = htons(opt_metrics_port);
+
+#ifndef WIN32
+	int optval = 1;
+
+	if (SOCKETFAIL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "Metrics setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+#endif
+
+	if (SOCKETFAIL(bind(sock, (struct sockaddr *)(&serv), sizeof(serv)))) {
+		applog(LOG_ERR, "Metrics bind to port %d failed (%s)", opt_metrics_port, SOCKERRMSG);
+		CLOSESOCKET(sock);
+		return;
+	}
+
+	if (SOCKETFAIL(listen(sock, METRICS_QUEUE))) {
+		applog(LOG_ERR, "Metrics listen failed (%s)", SOCKERRMSG);
+		CLOSESOCKET(sock);
+		return;
+	}
+
+	applog(LOG_WARNING, "Metrics exporter running on %s port %d",
+	       opt_metrics_network ? "all addresses" : "127.0.0.1", opt_metrics_port);
+
+	render_metrics(&mb);
+	cgtime(&last);
+
+	while (42) {
+		struct timeval timeout;
+		fd_set rd;
+		int ret;
+
+		FD_ZERO(&rd);
+		FD_SET(sock, &rd);
+		timeout.tv_sec = opt_log_interval;
+		timeout.tv_usec = 0;
+		ret = select(sock + 1, &rd, NULL, NULL, &timeout);
+
+		/* Only rerender once the hashmeter has had a chance to publish
+		 * a new snapshot */
+		cgtime(&now);
+		if (now.tv_sec - last.tv_sec >= opt_log_interval) {
+			render_metrics(&mb);
+			copy_time(&last, &now);
+		}
+
+		if (ret <= 0)
+			continue;
+
+		c = accept(sock, NULL, NULL);
+		if (SOCKETFAIL(c)) {
+			applog(LOG_DEBUG, "Metrics accept failed (%s)", SOCKERRMSG);
+			continue;
+		}
+		metrics_reply(c, &mb);
+		CLOSESOCKET(c);
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+
+extern int opt_metrics_port;
+extern bool opt_metrics_network;
+
+extern void metrics(int thr_id);
+
+#endif /* __METRICS_H__ */
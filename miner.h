@@ -373,6 +373,15 @@ enum cl_kernels {
 	KL_SCRYPT_CHACHA,
 };
 
+/* How scrypt_ROMix arranges the scratchpad, passed to the kernel as
+ * PAD_LAYOUT */
+enum pad_layout {
+	PL_ROW,
+	PL_INTERLEAVE,
+	PL_BLOCK,
+	PL_MAX,
+};
+
 enum dev_reason {
 	REASON_THREAD_FAIL_INIT,
 	REASON_THREAD_ZERO_HASH,
@@ -433,6 +442,82 @@ struct cgminer_pool_stats {
 	uint64_t net_bytes_received;
 };
 
+/* OpenCL kernel invocations timed per device */
+enum kernel_stage {
+	KS_PART1,
+	KS_PART2,
+	KS_PART3,
+	KS_SEARCH,
+	KS_MAX
+};
+
+#define MIN_NFACTOR 4
+#define MIN_NFACTOR_STR "4"
+#define MAX_NFACTOR 40
+#define MAX_NFACTOR_STR "40"
+
+/* Where the scrypt scratchpad of a hash lived, for the hashes counted per
+ * padbuffer class */
+enum pad_class {
+	PC_VRAM,
+	PC_RAM,
+	PC_MAX
+};
+
+/* Copies of the counters in cgpu_info and pool taken by the hashmeter so the
+ * API can report them without touching the live structures */
+struct cgpu_snapshot {
+	int accepted;
+	int rejected;
+	int hw_errors;
+	int diff1;
+	double rolling;
+	double total_mhashes;
+	double diff_accepted;
+	double diff_rejected;
+	double last_share_diff;
+	int last_share_pool;
+	time_t last_share_pool_time;
+	time_t last_device_valid_work;
+	uint64_t fresh_work_switches;
+	double fresh_work_wait;
+	double kernel_secs[KS_MAX];
+	uint64_t kernel_runs[KS_MAX];
+	uint64_t pad_hashes[PC_MAX];
+	uint64_t nfactor_hashes[MAX_NFACTOR + 1];
+};
+
+struct pool_snapshot {
+	int accepted, rejected;
+	int diff1;
+	unsigned int getwork_requested;
+	unsigned int stale_shares;
+	unsigned int discarded_work;
+	unsigned int getfail_occasions;
+	unsigned int remotefail_occasions;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	double last_share_diff;
+	time_t last_share_time;
+	uint64_t best_diff;
+};
+
+struct stats_snapshot {
+	double total_secs;
+	double total_mhashes_done;
+	unsigned int found_blocks;
+	int total_getworks;
+	int total_accepted, total_rejected, total_diff1;
+	int hw_errors;
+	int total_discarded, total_stale;
+	unsigned int total_go, total_ro;
+	unsigned int local_work;
+	unsigned int new_blocks;
+	double total_diff_accepted, total_diff_rejected, total_diff_stale;
+	uint64_t best_diff;
+};
+
 struct cgpu_info {
 	int cgminer_id;
 	struct device_drv *drv;
@@ -497,6 +582,7 @@ struct cgpu_info {
 	bool mapped;
 	int virtual_gpu;
 	int virtual_adl;
+	char pci_addr[16];	/* dddd:bb:dd.f, empty if the driver won't say */
 	int intensity;
 	int xintensity;
 	int rawintensity;
@@ -510,11 +596,21 @@ struct cgpu_info {
 
 #ifdef USE_SCRYPT
 	int opt_lg, lookup_gap;
+	enum pad_layout pad_layout;
 	size_t opt_tc, thread_concurrency, buffer_size;
+	int split_kernels;	/* 0 follows --scrypt-monolithic-kernels, 1 split, -1 monolithic */
+	int sub_batches;	/* Launches each scan is split into, see --sub-batches */
 	size_t shaders;
+	int num_padbuffers, num_padbuffers_ram;
+	cl_ulong padbuffer_vram, padbuffer_ram;
+	int plan_nfactor;	/* Largest Nfactor the padbuffers fit */
 #endif
 	struct timeval tv_gpustart;
 	int intervals;
+	double kernel_secs[KS_MAX];
+	uint64_t kernel_runs[KS_MAX];
+	uint64_t pad_hashes[PC_MAX];
+	uint64_t nfactor_hashes[MAX_NFACTOR + 1];	/* Hashes by the Nfactor of their work */
 #endif
 
 	bool new_work;
@@ -542,6 +638,8 @@ struct cgpu_info {
 	time_t last_share_pool_time;
 	double last_share_diff;
 	time_t last_device_valid_work;
+	uint64_t fresh_work_switches;	/* Moved to next work after a share */
+	double fresh_work_wait;		/* Seconds spent waiting for it */
 
 	time_t device_last_well;
 	time_t device_last_not_well;
@@ -566,12 +664,21 @@ struct cgpu_info {
 	bool shutdown;
 
 	struct timeval dev_start_tv;
+
+	struct cgpu_snapshot snap;
 };
 
 extern bool add_cgpu(struct cgpu_info*);
 
+struct tq_cell;
+
+/* See thread-q.c */
 struct thread_q {
-	struct list_head	q;
+	struct tq_cell		*ring;
+	unsigned int		mask;
+	volatile unsigned int	head;
+	volatile unsigned int	tail;
+	volatile int		sleepers;
 
 	bool frozen;
 
@@ -597,6 +704,7 @@ struct thr_info {
 	double	rolling;
 
 	bool	work_restart;
+	struct work *next_work;	/* Prefetched for hash_sole_work() */
 };
 
 struct string_elist {
@@ -853,6 +961,41 @@ static inline void cg_wunlock(cglock_t *lock)
 	mutex_unlock(&lock->mutex);
 }
 
+/* Sequence lock for data with a single writer that is read often. Readers
+ * never block the writer, they retry their copy if a write was in progress
+ * or completed while they were reading. */
+typedef struct seqlock {
+	volatile unsigned int seq;
+} seqlock_t;
+
+static inline void seq_write_begin(seqlock_t *lock)
+{
+	lock->seq++;
+	__sync_synchronize();
+}
+
+static inline void seq_write_end(seqlock_t *lock)
+{
+	__sync_synchronize();
+	lock->seq++;
+}
+
+static inline unsigned int seq_read_begin(seqlock_t *lock)
+{
+	unsigned int seq;
+
+	while ((seq = lock->seq) & 1)
+		;
+	__sync_synchronize();
+	return seq;
+}
+
+static inline bool seq_read_retry(seqlock_t *lock, unsigned int seq)
+{
+	__sync_synchronize();
+	return lock->seq != seq;
+}
+
 struct pool;
 
 extern bool opt_protocol;
@@ -897,6 +1040,7 @@ extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     struct pool *pool, bool);
 extern const char *proxytype(curl_proxytype proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
+extern void __bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
@@ -912,6 +1056,7 @@ extern bool fulltest(const unsigned char *hash, const unsigned char *target);
 
 extern int opt_queue;
 extern int opt_scantime;
+extern int opt_fresh_work_wait;
 extern int opt_expiry;
 
 extern int sc_minn;
@@ -936,6 +1081,9 @@ extern pthread_mutex_t restart_lock;
 extern pthread_cond_t restart_cond;
 
 extern void thread_reportin(struct thr_info *thr);
+extern void get_stats_snapshot(struct stats_snapshot *snap);
+extern void get_cgpu_snapshot(struct cgpu_info *cgpu, struct cgpu_snapshot *snap);
+extern void get_pool_snapshot(struct pool *pool, struct pool_snapshot *snap);
 extern void clear_stratum_shares(struct pool *pool);
 extern void set_target(unsigned char *dest_target, double diff);
 extern int restart_wait(unsigned int mstime);
@@ -978,10 +1126,6 @@ extern bool add_pool_details(struct pool *pool, bool live, char *url, char *user
 #define MAX_RAWINTENSITY 2147483647
 #define MAX_RAWINTENSITY_STR "2147483647"
 
-#define MIN_NFACTOR 4
-#define MIN_NFACTOR_STR "4"
-#define MAX_NFACTOR 40
-#define MAX_NFACTOR_STR "40"
 #define MAX_STARTTIME 2147483647
 #define MAX_STARTTIME_STR "2147483647"
 
@@ -1004,6 +1148,8 @@ extern bool opt_scrypt_chacha_84;
 extern bool opt_scrypt_split_kernels;
 extern bool opt_use_system_ram;  // Use system RAM for additional padbuffer8_RAM buffers
 extern bool opt_limit_ram_buffer;  // Limit RAM buffer size to max_alloc
+extern bool opt_mixed_lookup_gap;  // Fill leftover VRAM with smaller lookup gap groups
+extern bool opt_interleave_ram;  // Spread system RAM padbuffer groups among the VRAM ones
 extern int opt_reserve_vram;  // Reserve VRAM in MB (0 = disabled)
 extern int opt_reserve_ram;  // Reserve system RAM in MB per GPU (default: 50 MB)
 extern int opt_fixed_nfactor;
@@ -1108,9 +1254,50 @@ struct stratum_work {
 	double diff;
 };
 
+/* Immutable snapshot of a pool's current stratum job, published on every
+ * notify, difficulty change and subscribe. See stratum_job_get(). */
+struct stratum_job {
+	int refs;
+	char *job_id;
+	char *ntime;
+	char *nonce1;
+	double diff;
+	int n2size;
+
+	unsigned char *coinbase;	/* nonce2 is zero at nonce2_off */
+	size_t cb_len;
+	size_t nonce2_off;
+	unsigned char *merkle;		/* 32 bytes per branch */
+	int merkles;
+
+	unsigned char header[128];	/* Up to the padding, merkle root zero */
+	size_t header_len;
+	size_t merkle_off;
+	bool header_ok;
+};
+
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Stages of a share's life timed for each pool:
+ * found   - device result read back until the nonce is being checked
+ * verify  - CPU rehash of the nonce
+ * queue   - verified until sent to the pool
+ * network - sent until the pool's response is received
+ * total   - device result (or nonce check) until the response */
+enum share_stage {
+	SS_FOUND,
+	SS_VERIFY,
+	SS_QUEUE,
+	SS_NETWORK,
+	SS_TOTAL,
+	SS_MAX
+};
+
+extern const char *share_stage_names[SS_MAX];
+extern const char *kernel_stage_names[KS_MAX];
+extern const char *pad_class_names[PC_MAX];
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -1198,6 +1385,10 @@ struct pool {
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	struct stratum_job * volatile job;
+	volatile unsigned int job_epoch;
+	volatile int job_readers[2];
+	uint32_t job_nonce2;	/* Next nonce2 for every snapshot of the job, atomic */
 	pthread_t stratum_sthread;
 	pthread_t stratum_rthread;
 	pthread_mutex_t stratum_lock;
@@ -1221,6 +1412,9 @@ struct pool {
 	int gbt_txns;
 	int coinbase_len;
 	struct timeval tv_lastwork;
+
+	struct pool_snapshot snap;
+	struct latency_hist latency[SS_MAX];
 };
 
 #define GETWORK_MODE_TESTPOOL 'T'
@@ -1230,6 +1424,9 @@ struct pool {
 #define GETWORK_MODE_STRATUM 'S'
 #define GETWORK_MODE_GBT 'G'
 
+/* Inline storage for a work's stratum strings */
+#define WORK_STRBUF 128
+
 struct work {
 	unsigned char	data[128];
 	unsigned char	midstate[32];
@@ -1245,6 +1442,9 @@ struct work {
 	int		rolls;
 
 	dev_blk_ctx	blk;
+	int		nfactor;	/* scrypt-chacha Nfactor, from the pool's schedule */
+	struct nonce_space *nonce_space;	/* Shared with threads hashing the same header */
+	bool		nonce_exhausted;
 
 	struct thr_info	*thr;
 	int		thr_id;
@@ -1274,6 +1474,10 @@ struct work {
 	char		*gbt_coinbase;
 	int		gbt_txns;
 
+	/* Holds the strings above when they fit, see work-pool.c */
+	char		strbuf[WORK_STRBUF];
+	int		strbuf_len;
+
 	unsigned int	work_block;
 	int		id;
 	UT_hash_handle	hh;
@@ -1289,7 +1493,10 @@ struct work {
 	struct timeval	tv_getwork_reply;
 	struct timeval	tv_cloned;
 	struct timeval	tv_work_start;
+	struct timeval	tv_kernel_done;
 	struct timeval	tv_work_found;
+	struct timeval	tv_verified;
+	struct timeval	tv_submitted;
 	char		getwork_mode;
 };
 
@@ -0,0 +1,117 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Nonce space shared by every mining thread hashing the same block header.
+ * Instead of each device taking a fixed 1/total_devices slice, threads claim
+ * consecutive chunks sized to their own launches with an atomic fetch-add, so
+ * faster devices cover proportionally more of the space, disabled devices
+ * waste none of it, no two threads hash the same nonce and a work item is
+ * only given up once the whole 32 bit space has been handed out.
+ *
+ * Attaching and detaching a work item takes a mutex, once per work item.
+ * Claims on the hot path are lock free.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "util.h"
+#include "nonce.h"
+
+/* Header bytes before the nonce of an 80 byte header. 84 byte chacha
+ * headers only add nBits after these, which can't differ on its own. */
+#define NONCE_KEYLEN	76
+#define NONCE_SPACE	(1ULL << 32)
+
+struct nonce_space {
+	unsigned char header[NONCE_KEYLEN];
+	uint64_t next;		/* Next unclaimed nonce, atomic */
+	int refs;
+	time_t released;
+	UT_hash_handle hh;
+};
+
+static struct nonce_space *nonce_spaces;
+static pthread_mutex_t nonce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Forget spaces nobody has held for longer than work can live, by which time
+ * the same header can no longer be handed out */
+static void prune_spaces(time_t now)
+{
+	struct nonce_space *ns, *tmp;
+
+	HASH_ITER(hh, nonce_spaces, ns, tmp) {
+		if (!ns->refs && now - ns->released > opt_expiry) {
+			HASH_DEL(nonce_spaces, ns);
+			free(ns);
+		}
+	}
+}
+
+/* Join the nonce space of work's header, creating it if this is the first
+ * thread to hash it */
+void nonce_space_attach(struct work *work)
+{
+	struct nonce_space *ns;
+
+	work->nonce_exhausted = false;
+	mutex_lock(&nonce_lock);
+	prune_spaces(time(NULL));
+	HASH_FIND(hh, nonce_spaces, work->data, NONCE_KEYLEN, ns);
+	if (!ns) {
+		ns = calloc(1, sizeof(struct nonce_space));
+		if (unlikely(!ns))
+			quit(1, "Failed to calloc nonce_space");
+		memcpy(ns->header, work->data, NONCE_KEYLEN);
+		HASH_ADD(hh, nonce_spaces, header, NONCE_KEYLEN, ns);
+	}
+	ns->refs++;
+	mutex_unlock(&nonce_lock);
+	work->nonce_space = ns;
+}
+
+void nonce_space_detach(struct work *work)
+{
+	struct nonce_space *ns = work->nonce_space;
+
+	if (!ns)
+		return;
+	work->nonce_space = NULL;
+	mutex_lock(&nonce_lock);
+	ns->refs--;
+	ns->released = time(NULL);
+	/* Nothing is left to claim, so a header that comes round again, as
+	 * benchmark work's always does, starts on a fresh space */
+	if (!ns->refs && ns->next >= NONCE_SPACE) {
+		HASH_DEL(nonce_spaces, ns);
+		free(ns);
+	}
+	mutex_unlock(&nonce_lock);
+}
+
+/* Claim the next count nonces of work's header, setting work->blk.nonce to
+ * the first. Returns false and flags the work exhausted once fewer than
+ * count are left, rather than wrap onto nonces already hashed. */
+bool nonce_claim(struct work *work, uint32_t count)
+{
+	struct nonce_space *ns = work->nonce_space;
+	uint64_t start;
+
+	if (unlikely(!ns))
+		return true;
+	start = __sync_fetch_and_add(&ns->next, (uint64_t)count);
+	if (start + count > NONCE_SPACE) {
+		work->nonce_exhausted = true;
+		return false;
+	}
+	work->blk.nonce = start;
+	return true;
+}
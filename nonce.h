@@ -0,0 +1,13 @@
+#ifndef __NONCE_H__
+#define __NONCE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct work;
+
+extern void nonce_space_attach(struct work *work);
+extern void nonce_space_detach(struct work *work);
+extern bool nonce_claim(struct work *work, uint32_t count);
+
+#endif /* __NONCE_H__ */
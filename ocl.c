@@ -33,6 +33,23 @@
 
 #include "findnonce.h"
 #include "ocl.h"
+#include "driver-opencl.h"
+#include "affinity.h"
+
+/* PCI location queries, not every cl_ext.h has them */
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+#define CL_DEVICE_PCI_BUS_INFO_KHR	0x410F
+#endif
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+#define CL_DEVICE_TOPOLOGY_AMD		0x4037
+#endif
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+#define CL_DEVICE_PCI_BUS_ID_NV		0x4008
+#define CL_DEVICE_PCI_SLOT_ID_NV	0x4009
+#endif
+#ifndef CL_DEVICE_PCI_DOMAIN_ID_NV
+#define CL_DEVICE_PCI_DOMAIN_ID_NV	0x400A
+#endif
 
 int opt_platform_id = -1;
 
@@ -95,6 +112,53 @@ static int count_enabled_opencl_devices(void) {
 	return count;
 }
 
+#ifdef USE_SCRYPT
+/* 128 byte chunks each thread takes in a padbuffer for ipt stored items. The
+ * block layout pads every thread's run by one chunk, otherwise the runs are a
+ * power of two apart and all start on the same memory channel. */
+size_t scrypt_pad_chunks(enum pad_layout layout, size_t ipt)
+{
+	return layout == PL_BLOCK ? ipt + 1 : ipt;
+}
+
+/* Groups in padbuffer i of a kind holding groups in total, groups_per_buffer
+ * to each buffer but the last */
+size_t scrypt_padbuffer_groups(size_t groups, size_t groups_per_buffer, size_t i)
+{
+	const size_t left = groups - groups_per_buffer * i;
+
+	return left < groups_per_buffer ? left : groups_per_buffer;
+}
+
+/* Set a ROMix kernel's padbuffer arguments from *num on, in the order of the
+ * kernel's PADBUFFERS table: system RAM buffers, VRAM buffers, then the
+ * second lookup gap buffer if there is one */
+cl_int scrypt_set_pad_args(_clState *clState, cl_kernel kernel, cl_uint *num)
+{
+	cl_int status = CL_SUCCESS;
+	size_t i;
+
+	for (i = 0; i < clState->num_padbuffers_RAM; i++)
+		status |= clSetKernelArg(kernel, (*num)++, sizeof(cl_mem), &clState->padbuffer8_RAM[i]);
+	for (i = 0; i < clState->num_padbuffers; i++)
+		status |= clSetKernelArg(kernel, (*num)++, sizeof(cl_mem), &clState->padbuffer8[i]);
+	if (clState->groups_lg2)
+		status |= clSetKernelArg(kernel, (*num)++, sizeof(cl_mem), &clState->padbuffer8_lg2);
+	return status;
+}
+
+/* Split groups over as few buffers of at most max_groups as will do, with the
+ * same number in each but the last so the kernel finds a thread's buffer by
+ * division. Returns the number of buffers. */
+static size_t split_padbuffers(size_t groups, size_t max_groups, size_t *groups_per_buffer)
+{
+	const size_t buffers = (groups - 1) / max_groups + 1;
+
+	*groups_per_buffer = (groups - 1) / buffers + 1;
+	return (groups - 1) / *groups_per_buffer + 1;
+}
+#endif
+
 // Calculate available system RAM per GPU
 // Returns available RAM in bytes per GPU (distributed equally among all GPUs)
 // Reads from /proc/meminfo first, falls back to sysinfo if unavailable
@@ -193,12 +257,9 @@ static bool configure_vram_padbuffers(struct cgpu_info *cgpu,
 				      size_t each_group_size,
 				      size_t num_groups_for_vram,
 				      cl_ulong remaining_vram,
-				      bool use_multiple_buffers,
 				      unsigned int gpu,
 				      cl_ulong *total_padbuffer_mem_out)
 {
-	size_t optimal_groups_per_buffer_vram[5] = {0, 0, 0, 0, 0};
-	size_t optimal_num_buffers_vram = 0;
 	cl_ulong total_padbuffer_mem = 0;
 	size_t max_groups_per_buffer = cgpu->max_alloc / each_group_size;
 	applog(LOG_INFO, "GPU %d: max_groups_per_buffer: %zu, cgpu->max_alloc: %lu, each_group_size: %zu",
@@ -209,50 +270,24 @@ static bool configure_vram_padbuffers(struct cgpu_info *cgpu,
 		return false;
 	}
 
-	if (use_multiple_buffers && num_groups_for_vram > 0) {
-		const size_t max_vram_buffers = 5;
-		size_t required_buffers = (num_groups_for_vram + max_groups_per_buffer - 1) / max_groups_per_buffer;
-
-		if (required_buffers == 0)
-			required_buffers = 1;
-
-		if (required_buffers > max_vram_buffers) {
-			applog(LOG_WARNING, "GPU %d: Required buffers (%zu) exceeds maximum supported buffers (%zu)", gpu, required_buffers, max_vram_buffers);
-			required_buffers = max_vram_buffers;
+	clState->num_padbuffers = 0;
+	clState->groups_per_buffer = 0;
+	clState->groups_vram = num_groups_for_vram;
+	if (num_groups_for_vram > 0) {
+		clState->num_padbuffers = split_padbuffers(num_groups_for_vram, max_groups_per_buffer,
+							   &clState->groups_per_buffer);
+		if (clState->num_padbuffers > clState->max_padbuffers) {
+			applog(LOG_ERR, "GPU %d: %zu VRAM padbuffers needed, the kernel can take at most %zu",
+			       gpu, clState->num_padbuffers, clState->max_padbuffers);
+			return false;
 		}
-
-		optimal_num_buffers_vram = required_buffers;
-
-		size_t groups_remaining = num_groups_for_vram;
-		for (size_t i = 0; i < optimal_num_buffers_vram; i++) {
-			if (groups_remaining == 0) {
-				optimal_groups_per_buffer_vram[i] = 0;
-				continue;
-			}
-
-			size_t remaining_buffers = optimal_num_buffers_vram - i;
-			size_t assign = (groups_remaining / remaining_buffers) + ((groups_remaining % remaining_buffers) > 0);
-
-			if (assign > max_groups_per_buffer)
-				assign = max_groups_per_buffer;
-
-			optimal_groups_per_buffer_vram[i] = assign;
-			groups_remaining -= assign;
-		}
-	} else {
-		optimal_groups_per_buffer_vram[0] = num_groups_for_vram;
+		total_padbuffer_mem = (cl_ulong)each_group_size * num_groups_for_vram;
 	}
 
-	clState->num_padbuffers = optimal_num_buffers_vram;
-	for (int i = 0; i < optimal_num_buffers_vram; i++) {
-		clState->groups_per_buffer[i] = optimal_groups_per_buffer_vram[i];
-		// Calculate total memory used by padbuffer8 buffers
-		total_padbuffer_mem += each_group_size * optimal_groups_per_buffer_vram[i];
-	}
-
-	applog(LOG_DEBUG, "GPU %d: Calculated buffer config: %zu buffers, groups per buffer: [%zu, %zu, %zu, %zu, %zu]",
-	       gpu, clState->num_padbuffers,
-	       clState->groups_per_buffer[0], clState->groups_per_buffer[1], clState->groups_per_buffer[2], clState->groups_per_buffer[3], clState->groups_per_buffer[4]);
+	applog(LOG_DEBUG, "GPU %d: Calculated buffer config: %zu buffers, %zu groups per buffer, %zu in the last",
+	       gpu, clState->num_padbuffers, clState->groups_per_buffer,
+	       clState->num_padbuffers ? scrypt_padbuffer_groups(num_groups_for_vram, clState->groups_per_buffer,
+								 clState->num_padbuffers - 1) : 0);
 
 	// Calculate remaining unused memory
 	const cl_ulong unused_mem = (remaining_vram > total_padbuffer_mem) ? (remaining_vram - total_padbuffer_mem) : 0;
@@ -272,6 +307,71 @@ static bool configure_vram_padbuffers(struct cgpu_info *cgpu,
 	return true;
 }
 
+/* Relative ROMix work per hash at a lookup gap, in ChunkMix calls per N: N to
+ * fill the scratchpad, N to read it back and on average (gap - 1) / 2 more per
+ * read to rebuild the entries that were skipped */
+static double romix_cost(int lookup_gap)
+{
+	return 2.0 + (lookup_gap - 1) / 2.0;
+}
+
+/* With one lookup gap the VRAM left after the last whole group is wasted.
+ * Spend it on moving some of the VRAM groups to a smaller lookup gap, which
+ * needs more memory per group but less recompute, keeping the thread count.
+ * Every smaller gap is tried and the one with the least estimated ROMix work,
+ * i.e. the highest estimated hashrate, wins. The groups end up in their own
+ * buffer, padbuffer8_lg2. */
+static void configure_mixed_lookup_gap(struct cgpu_info *cgpu,
+				       _clState *clState,
+				       unsigned long bsize,
+				       size_t each_group_size,
+				       size_t num_groups_for_vram,
+				       cl_ulong remaining_vram,
+				       unsigned int gpu)
+{
+	const cl_ulong leftover = remaining_vram - (cl_ulong)num_groups_for_vram * each_group_size;
+	const double single_cost = romix_cost(clState->lookup_gap) * num_groups_for_vram;
+	double best_cost = single_cost;
+	int lookup_gap;
+
+	clState->groups_lg2 = 0;
+	for (lookup_gap = 1; lookup_gap < clState->lookup_gap; lookup_gap++) {
+		const size_t ipt = bsize / lookup_gap + (bsize % lookup_gap > 0);
+		const size_t pad_stride = scrypt_pad_chunks(cgpu->pad_layout, ipt);
+		const size_t group_size = 128 * pad_stride * clState->wsize;
+		size_t groups;
+		double cost;
+
+		if (group_size <= each_group_size)
+			continue;
+		groups = leftover / (group_size - each_group_size);
+		if (groups > num_groups_for_vram)
+			groups = num_groups_for_vram;
+		if (groups > cgpu->max_alloc / group_size)
+			groups = cgpu->max_alloc / group_size;
+		if (!groups)
+			continue;
+
+		cost = romix_cost(lookup_gap) * groups + romix_cost(clState->lookup_gap) * (num_groups_for_vram - groups);
+		if (cost < best_cost) {
+			best_cost = cost;
+			clState->groups_lg2 = groups;
+			clState->group_size_lg2 = group_size;
+			clState->pad_stride2 = pad_stride;
+			clState->lookup_gap2 = lookup_gap;
+		}
+	}
+
+	if (clState->groups_lg2) {
+		applog(LOG_INFO, "GPU %d: Mixed lookup gap, %zu of %zu VRAM groups use lookup gap %d instead of %d, estimated %.1f%% faster",
+		       gpu, clState->groups_lg2, num_groups_for_vram, clState->lookup_gap2, clState->lookup_gap,
+		       (single_cost / best_cost - 1.0) * 100.0);
+	} else {
+		applog(LOG_INFO, "GPU %d: Mixed lookup gap, not enough leftover VRAM (%lu bytes) for a smaller lookup gap group",
+		       gpu, (unsigned long)leftover);
+	}
+}
+
 static bool configure_ram_padbuffers(struct cgpu_info *cgpu,
 				     _clState *clState,
 				     size_t each_group_size,
@@ -280,15 +380,9 @@ static bool configure_ram_padbuffers(struct cgpu_info *cgpu,
 				     unsigned int gpu,
 				     cl_ulong *total_ram_mem_out)
 {
-	const size_t max_ram_buffers = 2;
-	size_t optimal_num_buffers_ram = 0;
-	size_t optimal_groups_per_buffer_ram[2] = {0, 0};
 	cl_ulong total_ram_mem = 0;
 
-	size_t groups_covered_by_vram = 0;
-	for (int i = 0; i < clState->num_padbuffers; i++)
-		groups_covered_by_vram += clState->groups_per_buffer[i];
-
+	const size_t groups_covered_by_vram = clState->groups_lg2 + clState->groups_vram;
 	const size_t num_groups_for_ram = number_groups - groups_covered_by_vram;
 	if (num_groups_for_ram == 0) {
 		applog(LOG_WARNING, "GPU %d: No groups remaining to cover with system RAM", gpu);
@@ -318,53 +412,28 @@ static bool configure_ram_padbuffers(struct cgpu_info *cgpu,
 			gpu, each_group_size);
 	}
 
-	size_t required_ram_buffers = (num_groups_for_ram + max_groups_per_ram_buffer - 1) / max_groups_per_ram_buffer;
-	if (required_ram_buffers == 0)
-		required_ram_buffers = 1;
-
-	if (required_ram_buffers > max_ram_buffers) {
-		applog(LOG_WARNING, "GPU %d: Required RAM buffers (%zu) exceeds maximum supported buffers (%zu)", gpu, required_ram_buffers, max_ram_buffers);
-		required_ram_buffers = max_ram_buffers;
-	}
-
-	optimal_num_buffers_ram = required_ram_buffers;
-
-	size_t ram_groups_remaining = num_groups_for_ram;
-	for (size_t i = 0; i < optimal_num_buffers_ram; i++) {
-		if (ram_groups_remaining == 0) {
-			optimal_groups_per_buffer_ram[i] = 0;
-			continue;
-		}
-
-		size_t remaining_buffers = optimal_num_buffers_ram - i;
-		size_t assign = (ram_groups_remaining / remaining_buffers) + ((ram_groups_remaining % remaining_buffers) > 0);
-
-		if (assign > max_groups_per_ram_buffer)
-			assign = max_groups_per_ram_buffer;
-
-		optimal_groups_per_buffer_ram[i] = assign;
-		ram_groups_remaining -= assign;
-	}
-
-	clState->num_padbuffers_RAM = optimal_num_buffers_ram;
-	for (int i = 0; i < optimal_num_buffers_ram; i++) {
-		clState->groups_per_buffer_RAM[i] = optimal_groups_per_buffer_ram[i];
-		// Calculate total memory used by padbuffer8_RAM buffers
-		total_ram_mem += (cl_ulong)each_group_size * optimal_groups_per_buffer_ram[i];
+	clState->num_padbuffers_RAM = split_padbuffers(num_groups_for_ram, max_groups_per_ram_buffer,
+						       &clState->groups_per_buffer_RAM);
+	if (clState->num_padbuffers + clState->num_padbuffers_RAM > clState->max_padbuffers) {
+		applog(LOG_ERR, "GPU %d: %zu VRAM and %zu system RAM padbuffers needed, the kernel can take at most %zu",
+		       gpu, clState->num_padbuffers, clState->num_padbuffers_RAM, clState->max_padbuffers);
+		return false;
 	}
+	clState->groups_ram = num_groups_for_ram;
+	total_ram_mem = (cl_ulong)each_group_size * num_groups_for_ram;
 
 	const cl_ulong unused_ram = (available_system_ram > total_ram_mem) ? (available_system_ram - total_ram_mem) : 0;
 
-	applog(LOG_DEBUG, "GPU %d: Calculated padbuffer8_RAM config: %zu buffers, groups per buffer: [%zu, %zu]",
-	       gpu, clState->num_padbuffers_RAM,
-	       clState->groups_per_buffer_RAM[0], clState->groups_per_buffer_RAM[1]);
+	applog(LOG_DEBUG, "GPU %d: Calculated padbuffer8_RAM config: %zu buffers, %zu groups per buffer, %zu in the last",
+	       gpu, clState->num_padbuffers_RAM, clState->groups_per_buffer_RAM,
+	       scrypt_padbuffer_groups(num_groups_for_ram, clState->groups_per_buffer_RAM, clState->num_padbuffers_RAM - 1));
 
 	if (unused_ram > 0) {
 		applog(LOG_INFO, "GPU %d: padbuffer8_RAM buffers use %lu MB, %lu MB remaining unused (%.1f%% utilization)",
 		       gpu, (unsigned long)(total_ram_mem / (1024 * 1024)),
 		       (unsigned long)(unused_ram / (1024 * 1024)),
 		       (double)(total_ram_mem * 100.0 / available_system_ram));
-	} else if (optimal_num_buffers_ram > 0) {
+	} else {
 		applog(LOG_INFO, "GPU %d: padbuffer8_RAM buffers use %lu MB (100%% utilization)",
 		       gpu, (unsigned long)(total_ram_mem / (1024 * 1024)));
 	}
@@ -450,6 +519,96 @@ int clDevicesNum(void) {
 	return most_devices;
 }
 
+/* Name of a GPU on the selected platform without setting up a context, for
+ * keying things like the tuning cache before initCl() */
+bool clDeviceName(unsigned int gpu, char *name, size_t nameSize)
+{
+	cl_platform_id *platforms;
+	cl_device_id *devices;
+	cl_uint numPlatforms;
+	cl_uint numDevices;
+	cl_int status;
+
+	status = clGetPlatformIDs(0, NULL, &numPlatforms);
+	if (status != CL_SUCCESS || opt_platform_id < 0 || opt_platform_id >= (int)numPlatforms)
+		return false;
+
+	platforms = (cl_platform_id *)alloca(numPlatforms*sizeof(cl_platform_id));
+	status = clGetPlatformIDs(numPlatforms, platforms, NULL);
+	if (status != CL_SUCCESS)
+		return false;
+
+	status = clGetDeviceIDs(platforms[opt_platform_id], CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
+	if (status != CL_SUCCESS || gpu >= numDevices)
+		return false;
+
+	devices = (cl_device_id *)alloca(numDevices*sizeof(cl_device_id));
+	status = clGetDeviceIDs(platforms[opt_platform_id], CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
+	if (status != CL_SUCCESS)
+		return false;
+
+	status = clGetDeviceInfo(devices[gpu], CL_DEVICE_NAME, nameSize, name, NULL);
+	return status == CL_SUCCESS;
+}
+
+/* PCI address of a GPU on the selected platform in sysfs form, from the
+ * Khronos, AMD or NVIDIA query, whichever the driver answers */
+bool clDevicePCI(unsigned int gpu, char *addr, size_t addrSize)
+{
+	cl_platform_id *platforms;
+	cl_device_id *devices;
+	cl_uint numPlatforms;
+	cl_uint numDevices;
+	cl_uint info[6];
+	cl_int status;
+
+	status = clGetPlatformIDs(0, NULL, &numPlatforms);
+	if (status != CL_SUCCESS || opt_platform_id < 0 || opt_platform_id >= (int)numPlatforms)
+		return false;
+
+	platforms = (cl_platform_id *)alloca(numPlatforms*sizeof(cl_platform_id));
+	status = clGetPlatformIDs(numPlatforms, platforms, NULL);
+	if (status != CL_SUCCESS)
+		return false;
+
+	status = clGetDeviceIDs(platforms[opt_platform_id], CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
+	if (status != CL_SUCCESS || gpu >= numDevices)
+		return false;
+
+	devices = (cl_device_id *)alloca(numDevices*sizeof(cl_device_id));
+	status = clGetDeviceIDs(platforms[opt_platform_id], CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
+	if (status != CL_SUCCESS)
+		return false;
+
+	/* cl_khr_pci_bus_info: domain, bus, device, function */
+	status = clGetDeviceInfo(devices[gpu], CL_DEVICE_PCI_BUS_INFO_KHR, 4 * sizeof(cl_uint), info, NULL);
+	if (status == CL_SUCCESS) {
+		snprintf(addr, addrSize, "%04x:%02x:%02x.%x", info[0], info[1], info[2], info[3]);
+		return true;
+	}
+
+	/* cl_device_topology_amd: type 1 is PCIe with bus, device and function
+	 * in its last three bytes */
+	status = clGetDeviceInfo(devices[gpu], CL_DEVICE_TOPOLOGY_AMD, sizeof(info), info, NULL);
+	if (status == CL_SUCCESS && info[0] == 1) {
+		const unsigned char *raw = (const unsigned char *)info;
+
+		snprintf(addr, addrSize, "0000:%02x:%02x.%x", raw[21], raw[22], raw[23]);
+		return true;
+	}
+
+	status = clGetDeviceInfo(devices[gpu], CL_DEVICE_PCI_BUS_ID_NV, sizeof(cl_uint), &info[1], NULL);
+	if (status == CL_SUCCESS &&
+	    clGetDeviceInfo(devices[gpu], CL_DEVICE_PCI_SLOT_ID_NV, sizeof(cl_uint), &info[2], NULL) == CL_SUCCESS) {
+		if (clGetDeviceInfo(devices[gpu], CL_DEVICE_PCI_DOMAIN_ID_NV, sizeof(cl_uint), &info[0], NULL) != CL_SUCCESS)
+			info[0] = 0;
+		snprintf(addr, addrSize, "%04x:%02x:%02x.%x", info[0], info[1], info[2] >> 3, info[2] & 7);
+		return true;
+	}
+
+	return false;
+}
+
 static int advance(char **area, unsigned *remaining, const char *marker)
 {
 	char *find = memmem(*area, *remaining, marker, strlen(marker));
@@ -507,7 +666,62 @@ void patch_opcodes(char *w, unsigned remaining)
 	applog(LOG_DEBUG, "Patched a total of %i BFI_INT instructions", patched);
 }
 
-_clState *initCl(unsigned int gpu, char *name, size_t nameSize)
+/* Nfactor to plan the scratchpads for before any work is seen, the fixed one
+ * or where the default schedule is now. Work on another Nfactor re-plans. */
+int scrypt_start_nfactor(void)
+{
+	if (opt_scrypt_chacha)
+		return GetNfactor(time(NULL), sc_minn, sc_maxn, sc_starttime);
+	return opt_n_scrypt ? 10 : 9;
+}
+
+#ifdef USE_SCRYPT
+/* Host memory to stage size bytes of transfers through, kept for the life of
+ * clState: a CL_MEM_ALLOC_HOST_PTR buffer mapped once, which the driver can
+ * DMA to and from without copying through its own bounce buffer first, or
+ * plain memory when the platform won't map one. Either stays valid while a
+ * non-blocking transfer from or to it is queued. */
+static uint32_t *staging_alloc(_clState *clState, size_t size, cl_mem *pinned)
+{
+	uint32_t *host;
+	cl_int status;
+
+	*pinned = clCreateBuffer(clState->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &status);
+	if (status == CL_SUCCESS) {
+		host = clEnqueueMapBuffer(clState->commandQueue, *pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+					  0, size, 0, NULL, NULL, &status);
+		if (status == CL_SUCCESS) {
+			memset(host, 0, size);
+			return host;
+		}
+		clReleaseMemObject(*pinned);
+	}
+	applog(LOG_DEBUG, "Error %d: mapping a %zu byte pinned staging buffer, using host memory", status, size);
+	*pinned = NULL;
+	host = calloc(size, 1);
+	if (unlikely(!host))
+		quit(1, "Failed to calloc in staging_alloc");
+	return host;
+}
+
+static void staging_free(_clState *clState, cl_mem pinned, uint32_t *host)
+{
+	if (!host)
+		return;
+	if (pinned) {
+		clEnqueueUnmapMemObject(clState->commandQueue, pinned, host, 0, NULL, NULL);
+		clFinish(clState->commandQueue);
+		clReleaseMemObject(pinned);
+	} else
+		free(host);
+}
+#endif
+
+/* With build_only the program is built, which leaves its binary in the cache,
+ * but no buffers are created. vram_held and ram_held are what the plan being
+ * replaced holds, free again by the time this one is allocated. */
+static _clState *init_cl(unsigned int gpu, char *name, size_t nameSize, int nfactor,
+			 bool build_only, cl_ulong vram_held, cl_ulong ram_held)
 {
 	_clState *clState = calloc(1, sizeof(_clState));
 	bool patchbfi = false, prog_built = false;
@@ -702,6 +916,19 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	}
 	applog(LOG_DEBUG, "Max mem alloc size is %lu", (long unsigned int)(cgpu->max_alloc));
 
+#ifdef USE_SCRYPT
+	/* Every padbuffer is a kernel argument. Besides them the ROMix kernels
+	 * take at most three buffers and the target. */
+	size_t max_parameter_size;
+	status = clGetDeviceInfo(devices[gpu], CL_DEVICE_MAX_PARAMETER_SIZE, sizeof(size_t), (void *)&max_parameter_size, NULL);
+	if (status != CL_SUCCESS) {
+		applog(LOG_DEBUG, "Error %d: Failed to clGetDeviceInfo when trying to get CL_DEVICE_MAX_PARAMETER_SIZE", status);
+		max_parameter_size = 256;
+	}
+	clState->max_padbuffers = max_parameter_size / sizeof(cl_ulong) - 4;
+	applog(LOG_DEBUG, "Max parameter size is %zu, room for %zu padbuffers", max_parameter_size, clState->max_padbuffers);
+#endif
+
 	// Try AMD free memory extension first (more accurate for allocation decisions)
 	// CL_DEVICE_GLOBAL_FREE_MEMORY_AMD returns array of 4 size_t values (free memory in KB)
 	// Use first element (largest free memory block), convert KB to bytes
@@ -712,6 +939,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		if (status == CL_SUCCESS && free_mem[0] > 0) {
 			cgpu->global_mem_size = (cl_ulong)free_mem[0] * 1024;
 			use_amd_free_mem = true;
+			cgpu->global_mem_size += vram_held;
 			applog(LOG_DEBUG, "AMD free memory (KB): [%zu, %zu, %zu, %zu], using %lu bytes", 
 			       free_mem[0], free_mem[1], free_mem[2], free_mem[3], 
 			       (long unsigned int)(cgpu->global_mem_size));
@@ -740,7 +968,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	 */
 	char binaryfilename[255];
 	char filename[255];
-	char numbuf[16];
+	char numbuf[64];
 
 	if (cgpu->kernel == KL_NONE) {
 		if (opt_scrypt) {
@@ -847,6 +1075,13 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		clState->vwidth == 1 && clState->hasOpenCL11plus) || opt_scrypt)
 			clState->goffset = true;
 
+#ifdef USE_SCRYPT
+	/* Sub-batches rely on global_work_offset for their nonces */
+	clState->sub_batches = 1;
+	if (clState->chosen_kernel == KL_SCRYPT_CHACHA && clState->goffset && cgpu->sub_batches > 1)
+		clState->sub_batches = cgpu->sub_batches;
+#endif
+
 	if (cgpu->work_size && cgpu->work_size <= clState->max_work_size)
 		clState->wsize = cgpu->work_size;
 	else if (opt_scrypt_chacha)
@@ -864,27 +1099,29 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	if (opt_scrypt) {
 		if (!cgpu->opt_lg) {
 			applog(LOG_NOTICE, "GPU %d: selecting lookup gap of 32", gpu);
-			cgpu->lookup_gap = 32;
+			clState->lookup_gap = 32;
 		} else
-			cgpu->lookup_gap = cgpu->opt_lg;
+			clState->lookup_gap = cgpu->opt_lg;
 
 		unsigned long bsize;
-		if (opt_scrypt_chacha && opt_fixed_nfactor > 0)
-			bsize = 1 << (opt_fixed_nfactor + 1);
+		if (opt_scrypt_chacha)
+			bsize = 1UL << (nfactor + 1);
 		else if (opt_n_scrypt)
 			bsize = 2048;
 		else
 			bsize = 1024;
-		const size_t ipt = (bsize / cgpu->lookup_gap + (bsize % cgpu->lookup_gap > 0));
+		clState->nfactor = nfactor;
+		const size_t ipt = (bsize / clState->lookup_gap + (bsize % clState->lookup_gap > 0));
 
 
 		// Calculate remaining vram after other buffers (conservative estimate)
 		const size_t CLbuffer0_size = 128;
-		const size_t outputBuffer_size = SCRYPT_BUFFERSIZE;
+		const size_t outputBuffer_size = output_buffersize();
 		// Estimate temp buffers (will be created later if split kernels enabled)
 		size_t temp_X_size = 0;
 		size_t temp_X2_size = temp_X_size;
 		if (clState->use_split_kernels) {
+			/* Sized by the current plan's, this one's isn't known yet */
 			temp_X_size = cgpu->thread_concurrency * 8 * sizeof(cl_uint4);
 			temp_X2_size = temp_X_size;
 		}
@@ -919,12 +1156,13 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		} else {
 			remaining_vram = 0;
 		}
-		const bool use_multiple_buffers = (remaining_vram > cgpu->max_alloc);
 
 		// Calculate available system RAM per GPU if use-system-ram is enabled
 		cl_ulong available_system_ram = 0;
 		if (opt_use_system_ram) {
 			available_system_ram = get_available_system_ram_per_gpu();
+			if (available_system_ram)
+				available_system_ram += ram_held;
 			if (available_system_ram == 0) {
 				applog(LOG_ERR, "GPU %d: Failed to get available system RAM, disabling system RAM buffers", gpu);
 				opt_use_system_ram = false;
@@ -938,16 +1176,19 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		}
 		
 		// Calculate item size, group size, and number of groups
-		const size_t each_item_size = 128 * ipt;
+		clState->pad_stride = scrypt_pad_chunks(cgpu->pad_layout, ipt);
+		const size_t each_item_size = 128 * clState->pad_stride;
+		applog(LOG_INFO, "GPU %d: %s scratchpad layout, %zu bytes per thread", gpu,
+		       pad_layout_names[cgpu->pad_layout], each_item_size);
 		const size_t each_group_size = each_item_size * clState->wsize;
 		size_t number_groups;
 		if (!cgpu->opt_tc) {
 			// Calculate number_groups and thread_concurrency based on total_available_mem
 			number_groups = (remaining_vram / each_group_size) + (available_system_ram / each_group_size);
-			cgpu->thread_concurrency = number_groups * clState->wsize;
+			clState->thread_concurrency = number_groups * clState->wsize;
 		} else {
-			cgpu->thread_concurrency = cgpu->opt_tc;
-			number_groups = cgpu->thread_concurrency / clState->wsize;
+			clState->thread_concurrency = cgpu->opt_tc;
+			number_groups = clState->thread_concurrency / clState->wsize;
 		}
 		const cl_ulong total_groups_size = (cl_ulong)number_groups * each_group_size;
 
@@ -969,28 +1210,31 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		}
 
 		// Calculate optimal buffer configuration for multiple padbuffer8 buffers
-		// Initialize padbuffer8 array
+		clState->padbuffer8 = NULL;
 		clState->num_padbuffers = 0;
-		for (int i = 0; i < 5; i++) {
-			clState->padbuffer8[i] = NULL;
-			clState->groups_per_buffer[i] = 0;
-		}
+		clState->groups_vram = 0;
 		const size_t max_groups_for_vram = remaining_vram / each_group_size;
 		const size_t num_groups_for_vram = (number_groups > max_groups_for_vram) ? max_groups_for_vram : number_groups;
 
+		// Move some VRAM groups to a smaller lookup gap in the leftover VRAM if asked to
+		clState->padbuffer8_lg2 = NULL;
+		clState->groups_lg2 = 0;
+		if (opt_mixed_lookup_gap && clState->chosen_kernel == KL_SCRYPT_CHACHA)
+			configure_mixed_lookup_gap(cgpu, clState, bsize, each_group_size, num_groups_for_vram,
+						   remaining_vram, gpu);
+		const cl_ulong lg2_mem = (cl_ulong)clState->groups_lg2 * clState->group_size_lg2;
+
 		// Find the optimal number of buffers and groups per buffer for VRAM
 		cl_ulong total_padbuffer_mem = 0;
-		if (!configure_vram_padbuffers(cgpu, clState, each_group_size, num_groups_for_vram,
-					       remaining_vram, use_multiple_buffers, gpu, &total_padbuffer_mem)) {
+		if (!configure_vram_padbuffers(cgpu, clState, each_group_size, num_groups_for_vram - clState->groups_lg2,
+					       remaining_vram - lg2_mem, gpu, &total_padbuffer_mem)) {
 			return NULL;
 		}
 
 		// Calculate padbuffer8_RAM buffers (system RAM) if enabled
+		clState->padbuffer8_RAM = NULL;
 		clState->num_padbuffers_RAM = 0;
-		for (int i = 0; i < 2; i++) {
-			clState->padbuffer8_RAM[i] = NULL;
-			clState->groups_per_buffer_RAM[i] = 0;
-		}
+		clState->groups_ram = 0;
 
 		cl_ulong total_ram_mem = 0;
 		if (opt_use_system_ram && available_system_ram > 0) {
@@ -1001,19 +1245,16 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		}
 
 		// Final validation: ensure total groups and memory allocations match expectations
-		size_t total_groups_allocated = 0;
-		for (int i = 0; i < clState->num_padbuffers; i++)
-			total_groups_allocated += clState->groups_per_buffer[i];
-		for (int i = 0; i < clState->num_padbuffers_RAM; i++)
-			total_groups_allocated += clState->groups_per_buffer_RAM[i];
+		size_t total_groups_allocated = clState->groups_lg2 + clState->groups_vram + clState->groups_ram;
 
-		cl_ulong total_mem_allocated = total_padbuffer_mem + total_ram_mem;
+		cl_ulong total_mem_allocated = total_padbuffer_mem + total_ram_mem + lg2_mem;
+		const cl_ulong total_mem_expected = total_groups_size + lg2_mem - (cl_ulong)clState->groups_lg2 * each_group_size;
 
-		if (total_groups_allocated != number_groups || total_mem_allocated != total_groups_size) {
+		if (total_groups_allocated != number_groups || total_mem_allocated != total_mem_expected) {
 			applog(LOG_ERR, "GPU %d: Inconsistent buffer allocation detected (groups: %zu vs %zu, bytes: %lu vs %lu)",
 			       gpu,
 			       total_groups_allocated, (size_t)number_groups,
-			       (unsigned long)total_mem_allocated, (unsigned long)total_groups_size);
+			       (unsigned long)total_mem_allocated, (unsigned long)total_mem_expected);
 			return NULL;
 		}
 	}
@@ -1049,16 +1290,31 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		strcat(binaryfilename, "g");
 	if (opt_scrypt) {
 #ifdef USE_SCRYPT
-		sprintf(numbuf, "lg%utc%u", cgpu->lookup_gap, (unsigned int)cgpu->thread_concurrency);
+		snprintf(numbuf, sizeof(numbuf), "lg%utc%upl%d", clState->lookup_gap, (unsigned int)clState->thread_concurrency,
+			(int)cgpu->pad_layout);
+		strcat(binaryfilename, numbuf);
+		if (opt_scrypt_chacha) {
+			snprintf(numbuf, sizeof(numbuf), "n%drs%d", nfactor, RESULT_SLOTS);
+			strcat(binaryfilename, numbuf);
+		}
+		snprintf(numbuf, sizeof(numbuf), "pb%ur%u", (unsigned int)clState->num_padbuffers, (unsigned int)clState->num_padbuffers_RAM);
 		strcat(binaryfilename, numbuf);
+		if (opt_interleave_ram && clState->num_padbuffers_RAM)
+			strcat(binaryfilename, "i");
+		if (clState->groups_lg2) {
+			snprintf(numbuf, sizeof(numbuf), "mg%dx%u", clState->lookup_gap2, (unsigned int)clState->groups_lg2);
+			strcat(binaryfilename, numbuf);
+		}
+		if (clState->sub_batches > 1)
+			strcat(binaryfilename, "sb");
 #endif
 	} else {
-		sprintf(numbuf, "v%d", clState->vwidth);
+		snprintf(numbuf, sizeof(numbuf), "v%d", clState->vwidth);
 		strcat(binaryfilename, numbuf);
 	}
-	sprintf(numbuf, "w%d", (int)clState->wsize);
+	snprintf(numbuf, sizeof(numbuf), "w%d", (int)clState->wsize);
 	strcat(binaryfilename, numbuf);
-	sprintf(numbuf, "l%d", (int)sizeof(long));
+	snprintf(numbuf, sizeof(numbuf), "l%d", (int)sizeof(long));
 	strcat(binaryfilename, numbuf);
 	strcat(binaryfilename, ".bin");
 
@@ -1123,25 +1379,45 @@ build:
 #ifdef USE_SCRYPT
 	if (opt_scrypt)
 	{
-		// Calculate threads per buffer for ROMix indexing (VRAM buffers)
-		size_t threads_per_buffer[5];
-		threads_per_buffer[0] = clState->groups_per_buffer[0] * clState->wsize;
-		threads_per_buffer[1] = clState->groups_per_buffer[1] * clState->wsize;
-		threads_per_buffer[2] = clState->groups_per_buffer[2] * clState->wsize;
-		threads_per_buffer[3] = clState->groups_per_buffer[3] * clState->wsize;
-		threads_per_buffer[4] = clState->groups_per_buffer[4] * clState->wsize;
-		
-		// Calculate threads per buffer for ROMix indexing (system RAM buffers)
-		size_t threads_per_buffer_ram[2];
-		threads_per_buffer_ram[0] = clState->groups_per_buffer_RAM[0] * clState->wsize;
-		threads_per_buffer_ram[1] = clState->groups_per_buffer_RAM[1] * clState->wsize;
-		
-		sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d -D NUM_PADBUFFERS=%zu -D THREADS_PER_BUFFER_0=%zu -D THREADS_PER_BUFFER_1=%zu -D THREADS_PER_BUFFER_2=%zu -D THREADS_PER_BUFFER_3=%zu -D THREADS_PER_BUFFER_4=%zu -D NUM_PADBUFFERS_RAM=%zu -D THREADS_PER_BUFFER_RAM_0=%zu -D THREADS_PER_BUFFER_RAM_1=%zu",
-			cgpu->lookup_gap, (unsigned int)cgpu->thread_concurrency, (int)clState->wsize,
-			clState->num_padbuffers,
-			threads_per_buffer[0], threads_per_buffer[1], threads_per_buffer[2], threads_per_buffer[3], threads_per_buffer[4],
-			clState->num_padbuffers_RAM,
-			threads_per_buffer_ram[0], threads_per_buffer_ram[1]);
+		char *padbuffers;
+		size_t i;
+
+		/* One PADBUFFERS entry per buffer, RAM first, see scrypt_set_pad_args() */
+		padbuffers = calloc(clState->num_padbuffers_RAM + clState->num_padbuffers, 16);
+		if (unlikely(!padbuffers))
+			quit(1, "Failed to calloc padbuffers in initCl");
+		for (i = 0; i < clState->num_padbuffers_RAM + clState->num_padbuffers; i++)
+			sprintf(padbuffers + strlen(padbuffers), "X(%zu)", i);
+
+		CompilerOptions = realloc(CompilerOptions, 1024 + strlen(padbuffers));
+		if (unlikely(!CompilerOptions))
+			quit(1, "Failed to realloc CompilerOptions in initCl");
+		sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d -D PADBUFFERS(X)=%s "
+			"-D NUM_PADBUFFERS=%zu -D THREADS_PER_BUFFER=%zu -D THREADS_VRAM=%zu "
+			"-D NUM_PADBUFFERS_RAM=%zu -D THREADS_PER_BUFFER_RAM=%zu -D THREADS_RAM=%zu -D PAD_LAYOUT=%d -D PAD_STRIDE=%zu",
+			clState->lookup_gap, (unsigned int)clState->thread_concurrency, (int)clState->wsize, padbuffers,
+			clState->num_padbuffers, clState->groups_per_buffer * clState->wsize,
+			clState->groups_vram * clState->wsize,
+			clState->num_padbuffers_RAM, clState->groups_per_buffer_RAM * clState->wsize,
+			clState->groups_ram * clState->wsize,
+			(int)cgpu->pad_layout, clState->pad_stride);
+		free(padbuffers);
+		if (opt_scrypt_chacha)
+			sprintf(CompilerOptions + strlen(CompilerOptions), " -D N=%lu -D RESULT_SLOTS=%d",
+				1UL << (nfactor + 1), RESULT_SLOTS);
+		if (opt_interleave_ram && clState->num_padbuffers_RAM)
+			strcat(CompilerOptions, " -D INTERLEAVE_RAM");
+		if (clState->sub_batches > 1)
+			strcat(CompilerOptions, " -D SUB_BATCHES");
+		if (clState->groups_lg2) {
+			const size_t threads_lg2 = clState->groups_lg2 * clState->wsize;
+
+			sprintf(CompilerOptions + strlen(CompilerOptions),
+				" -D LOOKUP_GAP2=%d -D THREADS_LG2=%zu -D THREADS_LG2_START=%zu -D PAD_STRIDE2=%zu",
+				clState->lookup_gap2, threads_lg2,
+				(size_t)(clState->thread_concurrency / clState->wsize) * clState->wsize - threads_lg2,
+				clState->pad_stride2);
+		}
 	}
 	else
 #endif
@@ -1336,7 +1612,9 @@ built:
 	// Determine if we should use split kernels
 	clState->use_split_kernels = false;
 #ifdef USE_SCRYPT
-	if (opt_scrypt_split_kernels && opt_scrypt_chacha_84) {
+	bool split = cgpu->split_kernels ? cgpu->split_kernels > 0 : opt_scrypt_split_kernels;
+
+	if (split && opt_scrypt_chacha_84) {
 		clState->use_split_kernels = true;
 		applog(LOG_INFO, "Using split kernel mode for reduced register pressure");
 	}
@@ -1382,28 +1660,36 @@ built:
 		}
 	}
 
+	if (build_only)
+		return clState;
+
 #ifdef USE_SCRYPT
 	if (opt_scrypt) {
 		// Buffer configuration was already calculated earlier, now create the buffers
 		unsigned long bsize;
-		if (opt_scrypt_chacha && opt_fixed_nfactor > 0)
-			bsize = 1 << (opt_fixed_nfactor + 1);
+		if (opt_scrypt_chacha)
+			bsize = 1UL << (nfactor + 1);
 		else if (opt_n_scrypt)
 			bsize = 2048;
 		else
 			bsize = 1024;
 
-		size_t ipt = (bsize / cgpu->lookup_gap + (bsize % cgpu->lookup_gap > 0));
-		size_t each_item_size = 128 * ipt;
+		size_t ipt = (bsize / clState->lookup_gap + (bsize % clState->lookup_gap > 0));
+		size_t each_item_size = 128 * scrypt_pad_chunks(cgpu->pad_layout, ipt);
 		size_t each_group_size = each_item_size * clState->wsize;
 
-		applog(LOG_INFO, "GPU %d: Creating %zu padbuffer8 buffer(s), groups per buffer: [%zu, %zu, %zu, %zu, %zu]",
-		       gpu, clState->num_padbuffers,
-		       clState->groups_per_buffer[0], clState->groups_per_buffer[1], clState->groups_per_buffer[2], clState->groups_per_buffer[3], clState->groups_per_buffer[4]);
+		clState->padbuffer8 = calloc(clState->num_padbuffers, sizeof(cl_mem));
+		clState->padbuffer8_RAM = calloc(clState->num_padbuffers_RAM, sizeof(cl_mem));
+		if (unlikely((clState->num_padbuffers && !clState->padbuffer8) ||
+			     (clState->num_padbuffers_RAM && !clState->padbuffer8_RAM)))
+			quit(1, "Failed to calloc padbuffer tables in initCl");
+
+		applog(LOG_INFO, "GPU %d: Creating %zu padbuffer8 buffer(s), %zu groups per buffer",
+		       gpu, clState->num_padbuffers, clState->groups_per_buffer);
 
 		// Create all padbuffer8 buffers (VRAM)
 		for (size_t i = 0; i < clState->num_padbuffers; i++) {
-			size_t buf_size = each_group_size * clState->groups_per_buffer[i];
+			size_t buf_size = each_group_size * scrypt_padbuffer_groups(clState->groups_vram, clState->groups_per_buffer, i);
 			clState->padbuffer8[i] = clCreateBuffer(clState->context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
 			
 			if (status != CL_SUCCESS || !clState->padbuffer8[i]) {
@@ -1423,16 +1709,45 @@ built:
 		
 		applog(LOG_INFO, "Created %zu padbuffer8 buffer(s) using device memory", 
 		       clState->num_padbuffers);
+		clState->vram_held = (cl_ulong)each_group_size * clState->groups_vram +
+				     (cl_ulong)clState->group_size_lg2 * clState->groups_lg2;
+		clState->ram_held = (cl_ulong)each_group_size * clState->groups_ram;
+		/* Only a plan that is mining shows on the GPU, a build_only one
+		 * may be built while the current plan still is */
+		cgpu->plan_nfactor = nfactor;
+		cgpu->lookup_gap = clState->lookup_gap;
+		cgpu->thread_concurrency = clState->thread_concurrency;
+		cgpu->num_padbuffers = clState->num_padbuffers;
+		cgpu->num_padbuffers_ram = clState->num_padbuffers_RAM;
+		cgpu->padbuffer_vram = clState->vram_held;
+		cgpu->padbuffer_ram = clState->ram_held;
+
+		if (clState->groups_lg2) {
+			size_t buf_size = clState->group_size_lg2 * clState->groups_lg2;
+
+			clState->padbuffer8_lg2 = clCreateBuffer(clState->context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
+			if (status != CL_SUCCESS || !clState->padbuffer8_lg2) {
+				applog(LOG_ERR, "Error %d: clCreateBuffer (padbuffer8_lg2) failed, size: %zu bytes", status, buf_size);
+				for (size_t j = 0; j < clState->num_padbuffers; j++) {
+					if (clState->padbuffer8[j]) {
+						clReleaseMemObject(clState->padbuffer8[j]);
+						clState->padbuffer8[j] = NULL;
+					}
+				}
+				return NULL;
+			}
+			applog(LOG_INFO, "Created padbuffer8_lg2: %zu bytes (%zu MB) for %zu groups at lookup gap %d",
+			       buf_size, buf_size / (1024 * 1024), clState->groups_lg2, clState->lookup_gap2);
+		}
 
 		// Create padbuffer8_RAM buffers (system RAM) if enabled
 		if (opt_use_system_ram && clState->num_padbuffers_RAM > 0) {
-			applog(LOG_INFO, "GPU %d: Creating %zu padbuffer8_RAM buffer(s), groups per buffer: [%zu, %zu]",
-			       gpu, clState->num_padbuffers_RAM,
-			       clState->groups_per_buffer_RAM[0], clState->groups_per_buffer_RAM[1]);
+			applog(LOG_INFO, "GPU %d: Creating %zu padbuffer8_RAM buffer(s), %zu groups per buffer",
+			       gpu, clState->num_padbuffers_RAM, clState->groups_per_buffer_RAM);
 			
 			// Create all padbuffer8_RAM buffers using CL_MEM_ALLOC_HOST_PTR for system RAM
 			for (size_t i = 0; i < clState->num_padbuffers_RAM; i++) {
-				size_t buf_size = each_group_size * clState->groups_per_buffer_RAM[i];
+				size_t buf_size = each_group_size * scrypt_padbuffer_groups(clState->groups_ram, clState->groups_per_buffer_RAM, i);
 				// Safety check: ensure buffer size doesn't exceed max_alloc (only if opt_limit_ram_buffer is enabled)
 				if (opt_limit_ram_buffer && buf_size > cgpu->max_alloc) {
 					applog(LOG_ERR, "GPU %d: padbuffer8_RAM[%zu] size (%zu bytes) exceeds max_alloc (%lu bytes)", 
@@ -1489,13 +1804,19 @@ built:
 			applog(LOG_ERR, "Error %d: clCreateBuffer (CLbuffer0)", status);
 			return NULL;
 		}
-		clState->outputBuffer = clCreateBuffer(clState->context, CL_MEM_WRITE_ONLY, SCRYPT_BUFFERSIZE, NULL, &status);
+		clState->outputBuffer = clCreateBuffer(clState->context, CL_MEM_READ_WRITE, output_buffersize(), NULL, &status);
+		if (status != CL_SUCCESS) {
+			applog(LOG_ERR, "Error %d: clCreateBuffer (outputBuffer)", status);
+			return NULL;
+		}
+		clState->input_host = staging_alloc(clState, 128, &clState->input_pinned);
+		clState->output_host = staging_alloc(clState, output_buffersize(), &clState->output_pinned);
 		
 		// Create temp_X and temp_X2 buffers for split kernels if enabled
 		if (clState->use_split_kernels) {
 			// temp_X and temp_X2 need to hold 8 uint4 values per thread
 			// Size = thread_concurrency * 8 * sizeof(cl_uint4)
-			size_t temp_X_size = cgpu->thread_concurrency * 8 * sizeof(cl_uint4);
+			size_t temp_X_size = clState->thread_concurrency * 8 * sizeof(cl_uint4);
 			applog(LOG_INFO, "Creating temp_X buffer of %lu bytes (%lu MB) for split kernels",
 			       (unsigned long)temp_X_size, (unsigned long)(temp_X_size / (1024 * 1024)));
 			
@@ -1534,5 +1855,94 @@ built:
 
 	return clState;
 }
+
+/* Buffers are created from the GPU's NUMA node when it is placed, see
+ * affinity.c */
+_clState *initCl(unsigned int gpu, char *name, size_t nameSize, int nfactor)
+{
+	struct affinity_saved saved;
+	_clState *clState;
+
+	affinity_gpu_enter(&gpus[gpu], &saved);
+	clState = init_cl(gpu, name, nameSize, nfactor, false, 0, 0);
+	affinity_gpu_leave(&saved);
+	return clState;
+}
+
+#ifdef USE_SCRYPT
+/* Build the program for a plan at nfactor ahead of switching to it, so
+ * initCl() then finds its binary in the cache */
+bool scrypt_build_plan(unsigned int gpu, int nfactor, cl_ulong vram_held, cl_ulong ram_held)
+{
+	char name[256] = "";
+	_clState *clState = init_cl(gpu, name, sizeof(name), nfactor, true, vram_held, ram_held);
+
+	if (!clState)
+		return false;
+	releaseCl(clState);
+	free(clState);
+	return true;
+}
+#endif
+
+/* Release everything initCl() created, the _clState itself is left to the
+ * caller */
+void releaseCl(_clState *clState)
+{
+	// Release split kernels if they were created
+#ifdef USE_SCRYPT
+	if (clState->use_split_kernels) {
+		if (clState->kernel_part1) clReleaseKernel(clState->kernel_part1);
+		if (clState->kernel_part2) clReleaseKernel(clState->kernel_part2);
+		if (clState->kernel_part3) clReleaseKernel(clState->kernel_part3);
+		if (clState->temp_X_buffer) clReleaseMemObject(clState->temp_X_buffer);
+		if (clState->temp_X2_buffer) clReleaseMemObject(clState->temp_X2_buffer);
+		applog(LOG_DEBUG, "Released split kernel resources");
+	}
+	
+	// Release all padbuffer8 buffers (VRAM)
+	for (size_t i = 0; clState->padbuffer8 && i < clState->num_padbuffers; i++) {
+		if (clState->padbuffer8[i]) {
+			clReleaseMemObject(clState->padbuffer8[i]);
+			clState->padbuffer8[i] = NULL;
+		}
+	}
+	free(clState->padbuffer8);
+	clState->padbuffer8 = NULL;
+	if (clState->num_padbuffers > 0) {
+		applog(LOG_DEBUG, "Released %zu padbuffer8 buffer(s)", clState->num_padbuffers);
+	}
+	
+	// Release all padbuffer8_RAM buffers (system RAM)
+	for (size_t i = 0; clState->padbuffer8_RAM && i < clState->num_padbuffers_RAM; i++) {
+		if (clState->padbuffer8_RAM[i]) {
+			clReleaseMemObject(clState->padbuffer8_RAM[i]);
+			clState->padbuffer8_RAM[i] = NULL;
+		}
+	}
+	free(clState->padbuffer8_RAM);
+	clState->padbuffer8_RAM = NULL;
+	if (clState->num_padbuffers_RAM > 0) {
+		applog(LOG_DEBUG, "Released %zu padbuffer8_RAM buffer(s)", clState->num_padbuffers_RAM);
+	}
+	if (clState->padbuffer8_lg2) {
+		clReleaseMemObject(clState->padbuffer8_lg2);
+		clState->padbuffer8_lg2 = NULL;
+	}
+	
+	// Release other scrypt buffers
+	if (clState->CLbuffer0) clReleaseMemObject(clState->CLbuffer0);
+	if (clState->outputBuffer) clReleaseMemObject(clState->outputBuffer);
+	if (clState->input_event) clReleaseEvent(clState->input_event);
+	staging_free(clState, clState->input_pinned, clState->input_host);
+	staging_free(clState, clState->output_pinned, clState->output_host);
+#endif
+	
+	// Release monolithic kernel
+	if (clState->kernel) clReleaseKernel(clState->kernel);
+	clReleaseProgram(clState->program);
+	clReleaseCommandQueue(clState->commandQueue);
+	clReleaseContext(clState->context);
+}
 #endif /* HAVE_OPENCL */
 
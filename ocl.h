@@ -20,14 +20,32 @@ typedef struct {
 	cl_command_queue commandQueue;
 	cl_program program;
 	cl_mem outputBuffer;
+	cl_mem output_pinned;  // Pinned staging outputBuffer is read back through, NULL if plain memory
+	uint32_t *output_host;  // Its mapping, where each scan's results land, NULL to use the thread's
+	cl_event input_event;  // Last header write into CLbuffer0, which the scan's kernels wait on
 #ifdef USE_SCRYPT
 	cl_mem CLbuffer0;
-	cl_mem padbuffer8[5];  // Multiple buffers (up to 5) for better memory utilization
-	size_t num_padbuffers;  // Number of padbuffer8 buffers (1-5)
-	size_t groups_per_buffer[5];  // Number of groups per buffer
-	cl_mem padbuffer8_RAM[2];  // System RAM buffers (up to 2) for additional memory
-	size_t num_padbuffers_RAM;  // Number of padbuffer8_RAM buffers (0-2)
-	size_t groups_per_buffer_RAM[2];  // Number of groups per buffer for system RAM
+	cl_mem input_pinned;  // Pinned staging CLbuffer0 is written from, NULL if plain memory
+	uint32_t *input_host;  // Its mapping, where each scan's header is built
+	cl_mem *padbuffer8;  // VRAM padbuffers, as many as max_alloc calls for
+	size_t num_padbuffers;  // Number of padbuffer8 buffers
+	size_t groups_per_buffer;  // Groups in each padbuffer8 buffer but the last, which holds the rest
+	size_t groups_vram;  // Groups in all padbuffer8 buffers
+	cl_mem *padbuffer8_RAM;  // System RAM buffers for additional memory
+	size_t num_padbuffers_RAM;  // Number of padbuffer8_RAM buffers
+	size_t groups_per_buffer_RAM;  // Groups in each padbuffer8_RAM buffer but the last
+	size_t groups_ram;  // Groups in all padbuffer8_RAM buffers
+	size_t max_padbuffers;  // Padbuffers that fit in the kernels' argument space
+	size_t pad_stride;  // 128 byte chunks per thread in a padbuffer, PAD_STRIDE in the kernel
+	cl_mem padbuffer8_lg2;  // VRAM buffer for the groups on the second lookup gap (--mixed-lookup-gap)
+	size_t groups_lg2;  // Number of groups on the second lookup gap, 0 if not mixed
+	size_t group_size_lg2;  // Bytes per group on the second lookup gap
+	size_t pad_stride2;  // PAD_STRIDE2 in the kernel
+	int lookup_gap;  // Lookup gap the padbuffers are planned for
+	int lookup_gap2;
+	int nfactor;  // Nfactor the padbuffers and kernels are planned for (scrypt-chacha)
+	cl_ulong vram_held;  // Bytes of VRAM held by the padbuffers
+	cl_ulong ram_held;  // Bytes of system RAM held by the padbuffers
 	void * cldata;
 	// Split kernel support
 	cl_kernel kernel_part1;
@@ -36,6 +54,9 @@ typedef struct {
 	cl_mem temp_X_buffer;   // Intermediate buffer for split kernels (Part 1 output)
 	cl_mem temp_X2_buffer;  // Intermediate buffer for split kernels (Part 2 output)
 	bool use_split_kernels;
+	int sub_batches;  // Launches a scan is split into, 1 if not sub-batched (--sub-batches)
+	cl_uint tid_args[3];  // Index of the tid_base argument of search or each part
+	cl_uint result_tail;  // Result ring count when last read, see findnonce.h
 #endif
 	bool hasBitAlign;
 	bool hasOpenCL11plus;
@@ -45,11 +66,22 @@ typedef struct {
 	size_t max_work_size;
 	size_t wsize;
 	size_t compute_shaders;
+	size_t thread_concurrency;  // Threads the kernels were built for (scrypt)
 	enum cl_kernels chosen_kernel;
 } _clState;
 
 extern char *file_contents(const char *filename, int *length);
 extern int clDevicesNum(void);
-extern _clState *initCl(unsigned int gpu, char *name, size_t nameSize);
+extern bool clDeviceName(unsigned int gpu, char *name, size_t nameSize);
+extern bool clDevicePCI(unsigned int gpu, char *addr, size_t addrSize);
+extern int scrypt_start_nfactor(void);
+extern _clState *initCl(unsigned int gpu, char *name, size_t nameSize, int nfactor);
+extern void releaseCl(_clState *clState);
+#ifdef USE_SCRYPT
+extern bool scrypt_build_plan(unsigned int gpu, int nfactor, cl_ulong vram_held, cl_ulong ram_held);
+extern size_t scrypt_pad_chunks(enum pad_layout layout, size_t ipt);
+extern size_t scrypt_padbuffer_groups(size_t groups, size_t groups_per_buffer, size_t i);
+extern cl_int scrypt_set_pad_args(_clState *clState, cl_kernel kernel, cl_uint *num);
+#endif
 #endif /* HAVE_OPENCL */
 #endif /* __OCL_H__ */
@@ -0,0 +1,278 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Standalone check and benchmark for the CPU hashing code. scrypt-jane.c is
+ * included directly so its internals can be timed on their own, scrypt.c
+ * and sha2.c are linked as they are, and the few miner globals they touch
+ * come from scrypt-stubs.c. Run without arguments it checks known answers and
+ * returns non zero on any mismatch (make check), with --bench it also times
+ * whole hashes for each Nfactor, ChunkMix and the Keccak permutation
+ * (make bench).
+ */
+
+#include "scrypt-jane.c"
+
+#include <sys/time.h>
+
+#include "scrypt.h"
+#include "sha2.h"
+
+#define SB_MIN_NFACTOR	4
+#define SB_MAX_NFACTOR	22
+
+/* Keccak-512 of the empty string */
+static const char *sb_keccak_kat =
+	"0eab42de4c3ceb9235fc91acffe746b29c29a8c366b7c60e4e67c466f36a4304"
+	"c00fa9caf9d87976ba469bcbe06713b435f091ef2769fb160cdab33d3670680e";
+
+/* FIPS 180-2 test vectors */
+static const struct {
+	const char *in;
+	const char *hash;
+} sb_sha2_kats[] = {
+	{ "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+};
+
+/* scrypt(N=1024, r=1, p=1) of the 80 byte test header, as raw bytes */
+static const char *sb_scrypt_kat =
+	"242c1db11b49e8e8447c4fab1fc3d8f5d2aa4d34adf7b1b374b721f26c08bbfa";
+
+/* scrypt-chacha of the 80 and 84 byte test headers, as raw bytes. Entries
+ * up to Nfactor 14 were checked against an independent implementation, the
+ * larger ones guard against regressions. */
+static const struct {
+	int nfactor;
+	int size;
+	const char *hash;
+} sb_chacha_kats[] = {
+	{  4, 80, "c1cde70bf5440ab9fdab2763c75bed3899f2a0360652d442486a22ea3de1a7f5" },
+	{  5, 80, "a38f9327ff7d7732fde561ea4204ea805e77999d3155b0d4458c001f1eb0deaf" },
+	{  6, 80, "84ab33e2aaee80d1ceb90c3d295c3e82337aaf0b21bbe957074cf509615073eb" },
+	{  7, 80, "c5ecd88d5930115e3d43e8123b4c67852ac3e2dce62c6644221e10bd7969faac" },
+	{  8, 80, "c47ba9e958e73c186843525311ad3bfbfececcf655602e276d361164a29d4faa" },
+	{  9, 80, "e347e14b35dd1dc3ab38b2b6bfe2464e80657ccd4ceed66d4c52f4a2313c9ad1" },
+	{ 10, 80, "f96e84da44196c6cd2f8c2f235b02c95ec4422c64ef21b4359bbb0467e446cd6" },
+	{ 11, 80, "138e6d594c67636ae7484dfea06d0eccd9209cebee4c4387231bd0dc59f4347a" },
+	{ 12, 80, "d8efd1bb650d18c601b7523226f295301121fb93bc5fe52cc7ed6bc2efdf0d8c" },
+	{ 13, 80, "4a0a4f08c298595fd1aea5d27c0d500559c2662d322ce53043113ba6b5ba28e6" },
+	{ 14, 80, "c6ef6c54d24662a41918ab9b854a67ef49fbde14c08be869acb246ddd749a897" },
+	{ 15, 80, "d252c000a8b832575c6c4de6a58d460efdd05c466ba9770a4ed15e560afe02a9" },
+	{ 16, 80, "099e28ebc4ad2f7f1af9edb296fadeb40d499cf62a0459c12d7e47fe6270f60a" },
+	{ 17, 80, "d2a922f64f99bc91fb104616133a969fe5c8b54313fb83e789ca196abc197559" },
+	{ 18, 80, "8d87d9d34b6ed440a8676ad7c027494d6b9c06007c933ecebc6b17f6711cc4e6" },
+	{ 19, 80, "f4454f22009daa69bf2e01b2fce690fa0c403e4df7e9779e9b656b059ca89683" },
+	{ 20, 80, "6a73c9bae06d368b12a73ffde9974c70905184b109d7eb0609ab0f9d7c8f63b6" },
+	{ 21, 80, "85f8077810ba19891cfd61ce2fd5188c063786fff969d49641462cb8f863efae" },
+	{ 22, 80, "1edeb22a3376c4d5306013993b83e378cc581f8eca6378df1c22c0f3693b2825" },
+	{  4, 84, "f072053fe3d454ff752b23f1cd0f61cb380653a1e0aab2b34ad672a448289c29" },
+	{  5, 84, "07779deb4ba5b935c2f6bab5d7da200b7bdc66646d0225b35cb91b6c9216b6d1" },
+	{  6, 84, "3132fc03ccad6309638ab95c2ac8994fbcd9caaf00f3cec7c45dfb41bdf60ec6" },
+	{  7, 84, "19ccce0be9ca2b0b68276388ead0d8629b782a7f0f3ccb48e7c2e4b2c2f0d32f" },
+	{  8, 84, "29b9b27adb351e74fa3db14523bc340102863178584067accc2599f7a6556038" },
+	{  9, 84, "e73c1e496140780a05af3a5c98a455ac354c70f126ee56b69ee78ef0ec159795" },
+	{ 10, 84, "a9fc7d86daaf3830785af6baa58d60abb62582149e71f7e29f025e4344a17259" },
+	{ 11, 84, "1d3f341a99607125fca33ec820cbc705eac576f1e9729bfbe551b267d576f5c9" },
+	{ 12, 84, "e308141e2949c1c25f77e2180f07767c23d5a71066abe6321058671a68761d56" },
+	{ 13, 84, "8282d0647592cd1c001fa0eec40bc8d0999f4d0c56641cc8cab7aad3e88bd2b8" },
+	{ 14, 84, "dfdd885fd295822410a1f1cf288fa3e991b86003d6248607c10b9350d1275763" },
+	{ 15, 84, "f12bf2db7b9b5a8d2be0dbf8ed713c196b916bd2c4d89ac9bc3b981a9b457729" },
+	{ 16, 84, "674e62ae9f6e8a75e97bbb7d12419b116417e7a0a5fe29b2edf76e13f4845ac9" },
+	{ 17, 84, "8d62f7ba8cf7d84a0713ab1e29bd231d3cdf179a9c66dd0a2e89df0bbc2c2a30" },
+	{ 18, 84, "5bf034461dede0079dd54643aa1715ba52de1f870291d0d264a96c8e76da1f9e" },
+	{ 19, 84, "92b2d6043b5f32cd8a67bd081da5115fb60b9221c862a1f917e8cb5b8eb939ad" },
+	{ 20, 84, "35f560bbcd819af7ad0131571613e9004c14d8285ae2793646280ef011aad3ec" },
+	{ 21, 84, "a20bb12aef4949f4a7e0e686788fa7a34f22e13fde826e91a38f50d408921d8e" },
+	{ 22, 84, "fe53ae895c361b77ef1405182bbdeaca441ea1a81ff08d42b7cd53d05170cfcb" },
+};
+
+static double sb_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void sb_header(uint8_t *hdr, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		hdr[i] = i * 7 + 1;
+}
+
+static bool sb_compare(const char *what, const uint8_t *hash, size_t len, const char *expect)
+{
+	char *hex = bin2hex(hash, len);
+	bool ok = !strcmp(hex, expect);
+
+	if (!ok)
+		printf("FAIL %s\n  got    %s\n  expect %s\n", what, hex, expect);
+	free(hex);
+	return ok;
+}
+
+static int sb_check_keccak(void)
+{
+	sj_scrypt_hash_state S;
+	sj_scrypt_hash_digest digest;
+
+	sj_scrypt_hash_init(&S);
+	sj_scrypt_hash_finish(&S, digest);
+	return !sb_compare("keccak-512", digest, sizeof(digest), sb_keccak_kat);
+}
+
+static int sb_check_sha2(void)
+{
+	unsigned char hash[32];
+	int i, fails = 0;
+
+	for (i = 0; i < (int)(sizeof(sb_sha2_kats) / sizeof(sb_sha2_kats[0])); i++) {
+		sha2((const unsigned char *)sb_sha2_kats[i].in, strlen(sb_sha2_kats[i].in), hash);
+		fails += !sb_compare("sha256", hash, 32, sb_sha2_kats[i].hash);
+	}
+	return fails;
+}
+
+/* scrypt_regenhash byte swaps the work words before hashing, so swap the
+ * header words first and the hash comes out as plain scrypt of the header */
+static int sb_check_scrypt(void)
+{
+	struct pool pool;
+	struct work work;
+	uint32_t hdr[20];
+	int i;
+
+	memset(&pool, 0, sizeof(pool));
+	memset(&work, 0, sizeof(work));
+	work.pool = &pool;
+	sb_header((uint8_t *)hdr, 80);
+	for (i = 0; i < 20; i++)
+		((uint32_t *)work.data)[i] = swab32(hdr[i]);
+
+	opt_scrypt_chacha_84 = false;
+	scrypt_regenhash(&work);
+	return !sb_compare("scrypt", work.hash, 32, sb_scrypt_kat);
+}
+
+static int sb_check_chacha(int max_nfactor)
+{
+	uint8_t hdr[84], hash[32];
+	char what[32];
+	int i, fails = 0;
+
+	for (i = 0; i < (int)(sizeof(sb_chacha_kats) / sizeof(sb_chacha_kats[0])); i++) {
+		int nfactor = sb_chacha_kats[i].nfactor, size = sb_chacha_kats[i].size;
+
+		if (nfactor > max_nfactor)
+			continue;
+		sb_header(hdr, size);
+		sj_scrypt(hdr, size, hdr, size, nfactor, 0, 0, hash, 32);
+		snprintf(what, sizeof(what), "chacha N%d/%d", nfactor, size);
+		fails += !sb_compare(what, hash, 32, sb_chacha_kats[i].hash);
+	}
+	return fails;
+}
+
+static void sb_bench_chacha(int max_nfactor)
+{
+	uint8_t hdr[84], hash[32];
+	int nfactor, size;
+
+	for (size = 80; size <= 84; size += 4) {
+		sb_header(hdr, size);
+		for (nfactor = SB_MIN_NFACTOR; nfactor <= max_nfactor; nfactor++) {
+			double start = sb_now(), secs;
+			int hashes = 0;
+
+			do {
+				sj_scrypt(hdr, size, hdr, size, nfactor, 0, 0, hash, 32);
+				hashes++;
+				secs = sb_now() - start;
+			} while (secs < 0.5);
+			printf("chacha N%-2d %d bytes: %12.1f hashes/s\n", nfactor, size, hashes / secs);
+		}
+	}
+}
+
+static void sb_bench_chunkmix(void)
+{
+	sj_scrypt_mix_word_t SJ_MM16 B[2][SJ_SCRYPT_BLOCK_WORDS * 2];
+	const int loops = 1 << 20;
+	double start, secs;
+	int i;
+
+	memset(B, 0x5a, sizeof(B));
+	start = sb_now();
+	for (i = 0; i < loops; i++)
+		sj_scrypt_ChunkMix(B[~i & 1], B[i & 1], NULL, 1);
+	secs = sb_now() - start;
+	printf("ChunkMix r=1: %.1f ns\n", secs * 1e9 / loops);
+}
+
+static void sb_bench_keccak(void)
+{
+	uint8_t in[SJ_SCRYPT_HASH_BLOCK_SIZE];
+	sj_scrypt_hash_state S;
+	const int loops = 1 << 20;
+	double start, secs;
+	int i;
+
+	memset(in, 0x5a, sizeof(in));
+	sj_scrypt_hash_init(&S);
+	start = sb_now();
+	for (i = 0; i < loops; i++)
+		sj_keccak_block(&S, in);
+	secs = sb_now() - start;
+	printf("Keccak-f[1600]: %.0f permutations/s\n", loops / secs);
+}
+
+static void sb_usage(const char *name)
+{
+	printf("Usage: %s [--bench] [--max-nfactor N]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int max_nfactor = SB_MAX_NFACTOR;
+	bool bench = false;
+	int i, fails = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--bench"))
+			bench = true;
+		else if (!strcmp(argv[i], "--max-nfactor") && i + 1 < argc)
+			max_nfactor = atoi(argv[++i]);
+		else {
+			sb_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (max_nfactor < SB_MIN_NFACTOR || max_nfactor > SB_MAX_NFACTOR) {
+		printf("Nfactor must be between %d and %d\n", SB_MIN_NFACTOR, SB_MAX_NFACTOR);
+		return 1;
+	}
+
+	fails += sb_check_keccak();
+	fails += sb_check_sha2();
+	fails += sb_check_scrypt();
+	fails += sb_check_chacha(max_nfactor);
+	if (fails) {
+		printf("%d known answer checks failed\n", fails);
+		return 1;
+	}
+	printf("All known answer checks passed\n");
+
+	if (bench) {
+		sb_bench_keccak();
+		sb_bench_chunkmix();
+		sb_bench_chacha(max_nfactor);
+	}
+	return 0;
+}
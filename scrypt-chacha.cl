@@ -9,7 +9,12 @@
 
 	Public Domain or MIT License, whichever is easier
 */
+/* The miner and scrypt-cl-check pass N for the largest Nfactor the padbuffers
+ * are planned for. The kernels take the work's own Nfactor as an argument, so
+ * one plan mines every Nfactor up to it. */
+#ifndef N
 #define N 4194304
+#endif
 
 #define SCRYPT_HASH "Keccak-512"
 #define SCRYPT_HASH_DIGEST_SIZE 64
@@ -822,17 +827,78 @@ scrypt_ChunkMix_inplace_local(__private uint4 *restrict B/*[chunkWords]*/) {
 }
 
 #define Coord(x,y,z) x+y*(x ## SIZE)+z*(y ## SIZE)*(x ## SIZE)
-// z+x*(z ## SIZE)+y*(x ## SIZE)*(z ## SIZE) = z+x*zSIZE+y*xSIZE*zSIZE
-#define CO Coord(z,x,y)
 
-// x*ySIZE*zSIZE+y*zSIZE+z
-// z+y*(z ## SIZE)+x*(y ## SIZE)*(z ## SIZE)
-// #define CO Coord(z,y,x)
+/* Scratchpad layout, see enum pad_layout in miner.h:
+ * 0 row:        z+x*zSIZE+y*xSIZE*zSIZE, each thread's chunk for one y together
+ * 1 interleave: x+z*xSIZE+y*zSIZE*xSIZE, the same uint4 of every thread side by side
+ * 2 block:      z+y*zSIZE+x*PAD_STRIDE*zSIZE, every thread owns PAD_STRIDE
+ *               contiguous 128 byte chunks, so each lookup is one aligned chunk */
+#ifndef PAD_LAYOUT
+#define PAD_LAYOUT 0
+#endif
+#ifndef PAD_STRIDE
+#define PAD_STRIDE (N/LOOKUP_GAP+(N%LOOKUP_GAP>0)+1)
+#endif
+
+/* Mixed lookup gap: the last THREADS_LG2 threads of a launch, starting at
+ * THREADS_LG2_START, keep their scratchpads in padcache_lg2 with LOOKUP_GAP2
+ * instead, to use VRAM the LOOKUP_GAP groups leave over */
+#ifndef THREADS_LG2
+#define THREADS_LG2 0
+#endif
+#if THREADS_LG2 > 0 && !defined(PAD_STRIDE2)
+#define PAD_STRIDE2 (N/LOOKUP_GAP2+(N%LOOKUP_GAP2>0)+1)
+#endif
+
+/* Padbuffer table. The host passes PADBUFFERS(X) as X(0)X(1)..., one entry
+ * per buffer: the NUM_PADBUFFERS_RAM system RAM buffers first, then the
+ * NUM_PADBUFFERS VRAM buffers. It is expanded once into kernel arguments and
+ * once into a table of pointers. Every buffer of a kind holds
+ * THREADS_PER_BUFFER(_RAM) threads except the last, which holds what is left
+ * of THREADS_VRAM (THREADS_RAM), so a thread finds its buffer with a single
+ * division however many there are. */
+#ifndef PADBUFFERS
+#define PADBUFFERS(X) X(0)
+#define NUM_PADBUFFERS 1
+#define THREADS_PER_BUFFER CONCURRENT_THREADS
+#define THREADS_VRAM CONCURRENT_THREADS
+#endif
+#ifndef NUM_PADBUFFERS_RAM
+#define NUM_PADBUFFERS_RAM 0
+#endif
+#ifndef THREADS_RAM
+#define THREADS_RAM 0
+#endif
+#define PAD_ARG(n) , __global uchar * restrict padcache##n
+#define PAD_ENTRY(n) padcache##n,
+
+/* Sub-batched scans, see --sub-batches. The host splits a scan into several
+ * launches over consecutive ranges of threads and passes each the index of
+ * its first thread, so every launch works in its own part of the padbuffers
+ * and temp_X instead of all starting at thread 0. */
+#ifdef SUB_BATCHES
+#define TID_BASE_ARG , const uint tid_base
+#define TID_BASE tid_base
+#else
+#define TID_BASE_ARG
+#define TID_BASE 0
+#endif
+
+#if (PAD_LAYOUT == 1)
+#define CO Coord(x,z,y)
+#elif (PAD_LAYOUT == 2)
+#define CO (z+y*zSIZE+x*pad_stride*zSIZE)
+#else
+#define CO Coord(z,x,y)
+#endif
 
+/* lookup_gap and pad_stride are always compile time constants at the call
+ * sites, so each inlined copy is specialised like the old macro version. n is
+ * the work's N, at most N, and only uses the front of each thread's region. */
 static void
-scrypt_ROMix(__private uint4 *restrict X/*[chunkWords]*/, __global uint4 *restrict lookup/*[N * chunkWords]*/, const uint gid, const uint xSIZE_override) {
+scrypt_ROMix(__private uint4 *restrict X/*[chunkWords]*/, __global uint4 *restrict lookup/*[N * chunkWords]*/, const uint gid, const uint xSIZE_override,
+	     const uint lookup_gap, const uint pad_stride, const uint n) {
 	const uint zSIZE = 8;
-	const uint ySIZE = (N/LOOKUP_GAP+(N%LOOKUP_GAP>0));
 	const uint xSIZE = xSIZE_override;
 	const uint x = gid % xSIZE;
 	uint i, j, y, z;
@@ -845,7 +911,7 @@ scrypt_ROMix(__private uint4 *restrict X/*[chunkWords]*/, __global uint4 *restri
 	/* TACA: Normal scrypt: Store every iteration */
 	/* TACA: With LOOKUP_GAP: Store every LOOKUP_GAP iterations */
 	/* 2: for i = 0 to N - 1 do */
-	for (y = 0; y < N / LOOKUP_GAP; y++) {
+	for (y = 0; y < n / lookup_gap; y++) {
 		/* 3: V_i = X */
 		/* TACA: Store X in scratchpad */
 		#pragma unroll
@@ -855,34 +921,32 @@ scrypt_ROMix(__private uint4 *restrict X/*[chunkWords]*/, __global uint4 *restri
 		}
 
 		/* TACA: Mix X LOOKUP_GAP times before next store */
-		for (j = 0; j < LOOKUP_GAP; j++) {
+		for (j = 0; j < lookup_gap; j++) {
 			/* 4: X = H(X) */
 			scrypt_ChunkMix_inplace_local(X);
 		}
 	}
 
-#if (N % LOOKUP_GAP > 0)
-       if (N % LOOKUP_GAP > 0) {
-               y = N / LOOKUP_GAP;
+       if (n % lookup_gap > 0) {
+               y = n / lookup_gap;
 
                #pragma unroll
                for (z = 0; z < zSIZE; z++) {
                        lookup[CO] = X[z];
                }
 
-               for (j = 0; j < N % LOOKUP_GAP; j++) {
+               for (j = 0; j < n % lookup_gap; j++) {
                        scrypt_ChunkMix_inplace_local(X);
                }
        }
-#endif
 
 	/* TACA: Scratchpad Access Phase */
 	/* 6: for i = 0 to N - 1 do */
-	for (i = 0; i < N; i++) {
+	for (i = 0; i < n; i++) {
 		/* TACA: Random index which stored value to read*/
 		/* 7: j = Integerify(X) % N */
-		j = X[4].x & (N - 1);
-		y = j / LOOKUP_GAP;
+		j = X[4].x & (n - 1);
+		y = j / lookup_gap;
 
 		/* TACA: Load from scratchpad */
 		#pragma unroll
@@ -891,20 +955,20 @@ scrypt_ROMix(__private uint4 *restrict X/*[chunkWords]*/, __global uint4 *restri
 		}
 
 		/* TACA: Reconstruct missing iterations */
-#if (LOOKUP_GAP == 1)
-		/* TACA: No reconstruction needed */
-#elif (LOOKUP_GAP == 2)
-		/* TACA: One extra mix */
-		if (j & 1) {
-			scrypt_ChunkMix_inplace_local(W);
-		}
-#else
-		/* TACA: Multiple extra mixes */
-		uint c = j % LOOKUP_GAP;
-		for (uint k = 0; k < c; k++) {
-			scrypt_ChunkMix_inplace_local(W);
+		if (lookup_gap == 1) {
+			/* TACA: No reconstruction needed */
+		} else if (lookup_gap == 2) {
+			/* TACA: One extra mix */
+			if (j & 1) {
+				scrypt_ChunkMix_inplace_local(W);
+			}
+		} else {
+			/* TACA: Multiple extra mixes */
+			uint c = j % lookup_gap;
+			for (uint k = 0; k < c; k++) {
+				scrypt_ChunkMix_inplace_local(W);
+			}
 		}
-#endif
 
 		/* 8: X = H(X ^ V_j) */
 		scrypt_ChunkMix_inplace_Bxor_local(X, W);
@@ -914,36 +978,69 @@ scrypt_ROMix(__private uint4 *restrict X/*[chunkWords]*/, __global uint4 *restri
 	/* implicit */
 }
 
+/* Index of thread tid's padbuffer in the PADBUFFERS table, with the thread's
+ * slot in it and the number of threads it holds. The system RAM groups come
+ * first, or with INTERLEAVE_RAM are spread evenly among the VRAM groups:
+ * group g is a RAM group when g * RAM groups / all groups, the number of RAM
+ * groups before it, goes up at g + 1. Either way a work-group is all RAM or
+ * all VRAM. */
+inline uint padbuffer_index(uint tid, uint *slot, uint *xSIZE)
+{
+	uint buffer;
+
+#if NUM_PADBUFFERS_RAM > 0
+#ifdef INTERLEAVE_RAM
+	const uint group = tid / WORKSIZE;
+	const ulong ram_groups = THREADS_RAM / WORKSIZE, groups = (THREADS_RAM + THREADS_VRAM) / WORKSIZE;
+	const uint ram_before = (uint)(group * ram_groups / groups);
+	const bool ram = (uint)((group + 1) * ram_groups / groups) > ram_before;
+
+	tid = (ram ? ram_before : group - ram_before) * WORKSIZE + tid % WORKSIZE;
+#else
+	const bool ram = tid < THREADS_RAM;
+#endif
+	if (ram) {
+		buffer = tid / THREADS_PER_BUFFER_RAM;
+		*slot = tid - buffer * THREADS_PER_BUFFER_RAM;
+		*xSIZE = min((uint)THREADS_PER_BUFFER_RAM, (uint)THREADS_RAM - buffer * THREADS_PER_BUFFER_RAM);
+		return buffer;
+	}
+#ifndef INTERLEAVE_RAM
+	tid -= THREADS_RAM;
+#endif
+#endif
+	buffer = tid / THREADS_PER_BUFFER;
+	*slot = tid - buffer * THREADS_PER_BUFFER;
+	*xSIZE = min((uint)THREADS_PER_BUFFER, (uint)THREADS_VRAM - buffer * THREADS_PER_BUFFER);
+	return NUM_PADBUFFERS_RAM + buffer;
+}
+
 __constant uint ES[2] = { 0x00FF00FF, 0xFF00FF00 };
-#define FOUND (0xFF)
-// Use atomic increment to safely handle multiple threads writing nonces
-#define SETFOUND(Xnonce) do { \
-	uint idx = atomic_inc(&output[FOUND]); \
-	output[idx] = Xnonce; \
+/* Found nonces go into a ring of RESULT_SLOTS nonce and hash prefix pairs
+ * after a count of every nonce ever found, which the host never clears and
+ * reads back to know which entries are new, see findnonce.h */
+#ifndef RESULT_SLOTS
+#define RESULT_SLOTS 128
+#endif
+#define RESULT_HEAD 0
+#define RESULT_ENTRY 2
+#define SETFOUND(Xnonce, Xhash) do { \
+	uint idx = atomic_inc(&output[RESULT_HEAD]) & (RESULT_SLOTS - 1); \
+	output[RESULT_ENTRY + idx * 2] = Xnonce; \
+	output[RESULT_ENTRY + idx * 2 + 1] = Xhash; \
 } while(0)
 #define EndianSwap(n) (rotate(n & Es2[0].x, 24U)|rotate(n & Es2[0].y, 8U))
 
 // Kernel for 80-byte block header
-// Supports multiple padbuffer8 buffers for better memory utilization
+// Takes the same padbuffer table as search84
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
 __kernel void search(__global const uint4 * restrict input,
 volatile __global uint * restrict output
-#if NUM_PADBUFFERS >= 1
-, __global uchar * restrict padcache0
-#endif
-#if NUM_PADBUFFERS >= 2
-, __global uchar * restrict padcache1
+PADBUFFERS(PAD_ARG)
+#if THREADS_LG2 > 0
+, __global uchar * restrict padcache_lg2
 #endif
-#if NUM_PADBUFFERS >= 3
-, __global uchar * restrict padcache2
-#endif
-#if NUM_PADBUFFERS >= 4
-, __global uchar * restrict padcache3
-#endif
-#if NUM_PADBUFFERS >= 5
-, __global uchar * restrict padcache4
-#endif
-, const uint target)
+, const uint target, const uint nfactor TID_BASE_ARG)
 {
 	uint4 password[5];
 	uint4 X[8];
@@ -960,118 +1057,43 @@ volatile __global uint * restrict output
 	/* 1: X = PBKDF2(password, salt) */
 	scrypt_pbkdf2_128B(password, password, X);
 
-	// Determine which padbuffer to use based on relative thread ID
-	// Calculate relative gid within the work batch first
-	// This works correctly with global_work_offset because get_group_id/get_local_id
-	// are relative to the work batch, not absolute
-	const uint group_id = get_group_id(0);
-	uint relative_gid = group_id * WORKSIZE + get_local_id(0);
-	__global uchar * padcache = (__global uchar *)0;
-	uint buffer_xSIZE = 0;
-	
-#if NUM_PADBUFFERS == 1
-	padcache = padcache0;
-	buffer_xSIZE = THREADS_PER_BUFFER_0;
-#elif NUM_PADBUFFERS == 2
-	if (relative_gid < THREADS_PER_BUFFER_0) {
-		padcache = padcache0;
-		buffer_xSIZE = THREADS_PER_BUFFER_0;
-	} else {
-		padcache = padcache1;
-		buffer_xSIZE = THREADS_PER_BUFFER_1;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0;
-	}
-#elif NUM_PADBUFFERS == 3
-	if (relative_gid < THREADS_PER_BUFFER_0) {
-		padcache = padcache0;
-		buffer_xSIZE = THREADS_PER_BUFFER_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-		padcache = padcache1;
-		buffer_xSIZE = THREADS_PER_BUFFER_1;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0;
-	} else {
-		padcache = padcache2;
-		buffer_xSIZE = THREADS_PER_BUFFER_2;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-	}
-#elif NUM_PADBUFFERS == 4
-	if (relative_gid < THREADS_PER_BUFFER_0) {
-		padcache = padcache0;
-		buffer_xSIZE = THREADS_PER_BUFFER_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-		padcache = padcache1;
-		buffer_xSIZE = THREADS_PER_BUFFER_1;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-		padcache = padcache2;
-		buffer_xSIZE = THREADS_PER_BUFFER_2;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-	} else {
-		padcache = padcache3;
-		buffer_xSIZE = THREADS_PER_BUFFER_3;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2;
-	}
-#elif NUM_PADBUFFERS == 5
-	if (relative_gid < THREADS_PER_BUFFER_0) {
-		padcache = padcache0;
-		buffer_xSIZE = THREADS_PER_BUFFER_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-		padcache = padcache1;
-		buffer_xSIZE = THREADS_PER_BUFFER_1;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-		padcache = padcache2;
-		buffer_xSIZE = THREADS_PER_BUFFER_2;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-	} else if (relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3) {
-		padcache = padcache3;
-		buffer_xSIZE = THREADS_PER_BUFFER_3;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2;
-	} else {
-		padcache = padcache4;
-		buffer_xSIZE = THREADS_PER_BUFFER_4;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2 - THREADS_PER_BUFFER_3;
-	}
+	/* 2: X = ROMix(X) in the thread's padbuffer. tid is relative to the
+	 * scan, so this works with global_work_offset as well */
+	const uint tid = TID_BASE + get_group_id(0) * WORKSIZE + get_local_id(0);
+	__global uchar *const pads[] = { PADBUFFERS(PAD_ENTRY) };
+
+#if THREADS_LG2 > 0
+	/* The second lookup gap region comes after every other buffer */
+	if (tid >= THREADS_LG2_START)
+		scrypt_ROMix(X, (__global uint4 *)padcache_lg2, tid - THREADS_LG2_START,
+			     THREADS_LG2, LOOKUP_GAP2, PAD_STRIDE2, 2U << nfactor);
+	else
 #endif
+	{
+		uint slot, xSIZE;
+		const uint buffer = padbuffer_index(tid, &slot, &xSIZE);
 
-	/* 2: X = ROMix(X) */
-	scrypt_ROMix(X, (__global uint4 *)padcache, relative_gid, buffer_xSIZE);
+		scrypt_ROMix(X, (__global uint4 *)pads[buffer], slot, xSIZE, LOOKUP_GAP, PAD_STRIDE, 2U << nfactor);
+	}
 
 	/* 3: Out = PBKDF2(password, X) */
 	scrypt_pbkdf2_32B(password, X, (uint4 *)output_hash);
 	
 	bool result = (output_hash[7] <= target);
 	if (result)
-		SETFOUND(gid);
+		SETFOUND(gid, output_hash[7]);
 }
 
 // New kernel for 84-byte block header (with 8-byte timestamp)
-// Supports multiple padbuffer8 buffers (VRAM) and padbuffer8_RAM buffers (system RAM) for better memory utilization
+// Takes any number of padbuffer8 (VRAM) and padbuffer8_RAM (system RAM) buffers, see PADBUFFERS
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
 __kernel void search84(__global const uint4 * restrict input,
 volatile __global uint * restrict output
-#if NUM_PADBUFFERS >= 1
-, __global uchar * restrict padcache0
-#endif
-#if NUM_PADBUFFERS >= 2
-, __global uchar * restrict padcache1
+PADBUFFERS(PAD_ARG)
+#if THREADS_LG2 > 0
+	, __global uchar * restrict padcache_lg2
 #endif
-#if NUM_PADBUFFERS >= 3
-, __global uchar * restrict padcache2
-#endif
-#if NUM_PADBUFFERS >= 4
-, __global uchar * restrict padcache3
-#endif
-#if NUM_PADBUFFERS >= 5
-, __global uchar * restrict padcache4
-#endif
-#if NUM_PADBUFFERS_RAM >= 1
-	, __global uchar * restrict padcache_ram0
-#endif
-#if NUM_PADBUFFERS_RAM >= 2
-	, __global uchar * restrict padcache_ram1
-#endif
-, const uint target)
+, const uint target, const uint nfactor TID_BASE_ARG)
 {
 	uint4 password[6];  // Need 6 uint4 for 84 bytes (84/16 = 5.25, so 6 uint4)
 	uint4 X[8];
@@ -1090,127 +1112,31 @@ volatile __global uint * restrict output
 	/* 1: X = PBKDF2(password, salt) - using 84-byte version */
 	scrypt_pbkdf2_128B_84(password, password, X);
 
-	// Determine which padbuffer to use based on relative thread ID
-	// Calculate relative gid within the work batch first
-	// This works correctly with global_work_offset because get_group_id/get_local_id
-	// are relative to the work batch, not absolute
-	const uint group_id = get_group_id(0);
-	uint relative_gid = group_id * WORKSIZE + get_local_id(0);
-	__global uchar * padcache = (__global uchar *)0;
-	uint buffer_xSIZE = 0;
-	
-	// Calculate total threads in system RAM buffers (prioritized first)
-	uint total_ram_threads = 0;
-#if NUM_PADBUFFERS_RAM == 1
-	total_ram_threads = THREADS_PER_BUFFER_RAM_0;
-#elif NUM_PADBUFFERS_RAM == 2
-	total_ram_threads = THREADS_PER_BUFFER_RAM_0 + THREADS_PER_BUFFER_RAM_1;
-#endif
-	
-	// First check system RAM buffers (prioritized)
-#if NUM_PADBUFFERS_RAM == 1
-	if (relative_gid < THREADS_PER_BUFFER_RAM_0) {
-		padcache = padcache_ram0;
-		buffer_xSIZE = THREADS_PER_BUFFER_RAM_0;
-	}
-#elif NUM_PADBUFFERS_RAM == 2
-	if (relative_gid < THREADS_PER_BUFFER_RAM_0) {
-		padcache = padcache_ram0;
-		buffer_xSIZE = THREADS_PER_BUFFER_RAM_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_RAM_0 + THREADS_PER_BUFFER_RAM_1) {
-		padcache = padcache_ram1;
-		buffer_xSIZE = THREADS_PER_BUFFER_RAM_1;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_RAM_0;
-	}
-#endif
-	
-	// If not in system RAM buffers, check VRAM buffers
-#if NUM_PADBUFFERS >= 1
-	if (padcache == (__global uchar *)0 && relative_gid >= total_ram_threads) {
-		uint vram_relative_gid = relative_gid - total_ram_threads;
-#if NUM_PADBUFFERS == 1
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		}
-#elif NUM_PADBUFFERS == 2
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		}
-#elif NUM_PADBUFFERS == 3
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-			padcache = padcache2;
-			buffer_xSIZE = THREADS_PER_BUFFER_2;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-		}
-#elif NUM_PADBUFFERS == 4
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-			padcache = padcache2;
-			buffer_xSIZE = THREADS_PER_BUFFER_2;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3) {
-			padcache = padcache3;
-			buffer_xSIZE = THREADS_PER_BUFFER_3;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2;
-		}
-#elif NUM_PADBUFFERS == 5
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-			padcache = padcache2;
-			buffer_xSIZE = THREADS_PER_BUFFER_2;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3) {
-			padcache = padcache3;
-			buffer_xSIZE = THREADS_PER_BUFFER_3;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3 + THREADS_PER_BUFFER_4) {
-			padcache = padcache4;
-			buffer_xSIZE = THREADS_PER_BUFFER_4;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2 - THREADS_PER_BUFFER_3;
-		}
-#endif
-	}
+	/* 2: X = ROMix(X) in the thread's padbuffer. tid is relative to the
+	 * scan, so this works with global_work_offset as well */
+	const uint tid = TID_BASE + get_group_id(0) * WORKSIZE + get_local_id(0);
+	__global uchar *const pads[] = { PADBUFFERS(PAD_ENTRY) };
+
+#if THREADS_LG2 > 0
+	/* The second lookup gap region comes after every other buffer */
+	if (tid >= THREADS_LG2_START)
+		scrypt_ROMix(X, (__global uint4 *)padcache_lg2, tid - THREADS_LG2_START,
+			     THREADS_LG2, LOOKUP_GAP2, PAD_STRIDE2, 2U << nfactor);
+	else
 #endif
+	{
+		uint slot, xSIZE;
+		const uint buffer = padbuffer_index(tid, &slot, &xSIZE);
 
-	/* 2: X = ROMix(X) */
-	scrypt_ROMix(X, (__global uint4 *)padcache, relative_gid, buffer_xSIZE);
+		scrypt_ROMix(X, (__global uint4 *)pads[buffer], slot, xSIZE, LOOKUP_GAP, PAD_STRIDE, 2U << nfactor);
+	}
 
 	/* 3: Out = PBKDF2(password, X) */
 	scrypt_pbkdf2_32B_84(password, X, (uint4 *)output_hash);
 	
 	bool result = (output_hash[7] <= target);
 	if (result)
-		SETFOUND(gid);
+		SETFOUND(gid, output_hash[7]);
 }
 
 /* ========================================================================
@@ -1252,14 +1178,15 @@ volatile __global uint * restrict output
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
 __kernel void search84_part1(
 	__global const uint4 * restrict input,
-	__global uint4 * restrict temp_X)  // Temporary storage for X
+	__global uint4 * restrict temp_X  // Temporary storage for X
+	TID_BASE_ARG)
 {
 	uint4 password[6]; // Need 6 uint4 for 84 bytes (84/16 = 5.25, so 6 uint4)
 	uint4 X[8];
 	const uint gid = get_global_id(0);
 	// Calculate local work item index (0 to num_work_items-1) for temp_X buffer indexing
 	// This works correctly even when global_work_offset is used
-	const uint tid = get_group_id(0) * get_local_size(0) + get_local_id(0);
+	const uint tid = TID_BASE + get_group_id(0) * get_local_size(0) + get_local_id(0);
 	
 	// Load password (84 bytes)
 	password[0] = input[0];  // bytes 0-15
@@ -1286,39 +1213,24 @@ __kernel void search84_part1(
 
 // Part 2: ROMix
 // Computes: X → X', loads X from temp_X, stores result to temp_X2
-// Supports multiple padbuffer8 buffers (VRAM) and padbuffer8_RAM buffers (system RAM) for better memory utilization
+// Takes any number of padbuffer8 (VRAM) and padbuffer8_RAM (system RAM) buffers, see PADBUFFERS
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
 __kernel void search84_part2(
 	__global const uint4 * restrict temp_X,      // X from part1 (read-only)
 	__global uint4 * restrict temp_X2            // X' after ROMix (write-only)
-#if NUM_PADBUFFERS >= 1
-	, __global uchar * restrict padcache0
-#endif
-#if NUM_PADBUFFERS >= 2
-	, __global uchar * restrict padcache1
-#endif
-#if NUM_PADBUFFERS >= 3
-	, __global uchar * restrict padcache2
-#endif
-#if NUM_PADBUFFERS >= 4
-	, __global uchar * restrict padcache3
-#endif
-#if NUM_PADBUFFERS >= 5
-	, __global uchar * restrict padcache4
-#endif
-#if NUM_PADBUFFERS_RAM >= 1
-	, __global uchar * restrict padcache_ram0
-#endif
-#if NUM_PADBUFFERS_RAM >= 2
-	, __global uchar * restrict padcache_ram1
+	PADBUFFERS(PAD_ARG)
+#if THREADS_LG2 > 0
+	, __global uchar * restrict padcache_lg2
 #endif
+	, const uint nfactor
+	TID_BASE_ARG
 )
 {
 	uint4 X[8];
 	const uint gid = get_global_id(0);
 	// Calculate local work item index (0 to num_work_items-1) for buffer indexing
 	// This works correctly even when global_work_offset is used
-	const uint tid = get_group_id(0) * get_local_size(0) + get_local_id(0);
+	const uint tid = TID_BASE + get_group_id(0) * get_local_size(0) + get_local_id(0);
 	const uint offset = tid * 8;
 	
 	// Load X from global memory (from Part 1)
@@ -1327,121 +1239,22 @@ __kernel void search84_part2(
 		X[i] = temp_X[offset + i];
 	}
 	
-	// Determine which padbuffer to use based on relative thread ID
-	// Calculate relative gid within the work batch first
-	// This works correctly with global_work_offset because get_group_id/get_local_id
-	// are relative to the work batch, not absolute
-	const uint group_id = get_group_id(0);
-	uint relative_gid = group_id * WORKSIZE + get_local_id(0);
-	__global uchar * padcache = (__global uchar *)0;
-	uint buffer_xSIZE = 0;
-	
-	// Calculate total threads in system RAM buffers (prioritized first)
-	uint total_ram_threads = 0;
-#if NUM_PADBUFFERS_RAM == 1
-	total_ram_threads = THREADS_PER_BUFFER_RAM_0;
-#elif NUM_PADBUFFERS_RAM == 2
-	total_ram_threads = THREADS_PER_BUFFER_RAM_0 + THREADS_PER_BUFFER_RAM_1;
-#endif
-	
-	// First check system RAM buffers (prioritized)
-#if NUM_PADBUFFERS_RAM == 1
-	if (relative_gid < THREADS_PER_BUFFER_RAM_0) {
-		padcache = padcache_ram0;
-		buffer_xSIZE = THREADS_PER_BUFFER_RAM_0;
-	}
-#elif NUM_PADBUFFERS_RAM == 2
-	if (relative_gid < THREADS_PER_BUFFER_RAM_0) {
-		padcache = padcache_ram0;
-		buffer_xSIZE = THREADS_PER_BUFFER_RAM_0;
-	} else if (relative_gid < THREADS_PER_BUFFER_RAM_0 + THREADS_PER_BUFFER_RAM_1) {
-		padcache = padcache_ram1;
-		buffer_xSIZE = THREADS_PER_BUFFER_RAM_1;
-		relative_gid = relative_gid - THREADS_PER_BUFFER_RAM_0;
-	}
-#endif
-	
-	// If not in system RAM buffers, check VRAM buffers
-#if NUM_PADBUFFERS >= 1
-	if (padcache == (__global uchar *)0 && relative_gid >= total_ram_threads) {
-		uint vram_relative_gid = relative_gid - total_ram_threads;
-#if NUM_PADBUFFERS == 1
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		}
-#elif NUM_PADBUFFERS == 2
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		}
-#elif NUM_PADBUFFERS == 3
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-			padcache = padcache2;
-			buffer_xSIZE = THREADS_PER_BUFFER_2;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-		}
-#elif NUM_PADBUFFERS == 4
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-			padcache = padcache2;
-			buffer_xSIZE = THREADS_PER_BUFFER_2;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3) {
-			padcache = padcache3;
-			buffer_xSIZE = THREADS_PER_BUFFER_3;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2;
-		}
-#elif NUM_PADBUFFERS == 5
-		if (vram_relative_gid < THREADS_PER_BUFFER_0) {
-			padcache = padcache0;
-			buffer_xSIZE = THREADS_PER_BUFFER_0;
-			relative_gid = vram_relative_gid;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1) {
-			padcache = padcache1;
-			buffer_xSIZE = THREADS_PER_BUFFER_1;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2) {
-			padcache = padcache2;
-			buffer_xSIZE = THREADS_PER_BUFFER_2;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3) {
-			padcache = padcache3;
-			buffer_xSIZE = THREADS_PER_BUFFER_3;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2;
-		} else if (vram_relative_gid < THREADS_PER_BUFFER_0 + THREADS_PER_BUFFER_1 + THREADS_PER_BUFFER_2 + THREADS_PER_BUFFER_3 + THREADS_PER_BUFFER_4) {
-			padcache = padcache4;
-			buffer_xSIZE = THREADS_PER_BUFFER_4;
-			relative_gid = vram_relative_gid - THREADS_PER_BUFFER_0 - THREADS_PER_BUFFER_1 - THREADS_PER_BUFFER_2 - THREADS_PER_BUFFER_3;
-		}
+	/* 2: X = ROMix(X) in the thread's padbuffer */
+	__global uchar *const pads[] = { PADBUFFERS(PAD_ENTRY) };
+
+#if THREADS_LG2 > 0
+	/* The second lookup gap region comes after every other buffer */
+	if (tid >= THREADS_LG2_START)
+		scrypt_ROMix(X, (__global uint4 *)padcache_lg2, tid - THREADS_LG2_START,
+			     THREADS_LG2, LOOKUP_GAP2, PAD_STRIDE2, 2U << nfactor);
+	else
 #endif
+	{
+		uint slot, xSIZE;
+		const uint buffer = padbuffer_index(tid, &slot, &xSIZE);
+
+		scrypt_ROMix(X, (__global uint4 *)pads[buffer], slot, xSIZE, LOOKUP_GAP, PAD_STRIDE, 2U << nfactor);
 	}
-#endif
-	
-	// ROMix (the heavy computation)
-	/* 2: X = ROMix(X) */
-	scrypt_ROMix(X, (__global uint4 *)padcache, relative_gid, buffer_xSIZE);
 	
 	// Store updated X to separate buffer (avoids overwriting Part 1's output)
 	// This write to a new location may improve performance vs overwriting temp_X
@@ -1460,7 +1273,8 @@ __kernel void search84_part3(
 	__global const uint4 * restrict input,
 	__global const uint4 * restrict temp_X2,  // X from part2 (ROMix output)
 	volatile __global uint * restrict output,
-	const uint target)
+	const uint target
+	TID_BASE_ARG)
 {
 	uint4 password[6]; // Need 6 uint4 for 84 bytes (84/16 = 5.25, so 6 uint4)
 	uint4 X[8];
@@ -1468,7 +1282,7 @@ __kernel void search84_part3(
 	const uint gid = get_global_id(0);
 	// Calculate local work item index (0 to num_work_items-1) for temp_X buffer indexing
 	// This works correctly even when global_work_offset is used
-	const uint tid = get_group_id(0) * get_local_size(0) + get_local_id(0);
+	const uint tid = TID_BASE + get_group_id(0) * get_local_size(0) + get_local_id(0);
 	const uint offset = tid * 8;
 	
 	// Load password (84 bytes)
@@ -1493,7 +1307,7 @@ __kernel void search84_part3(
 	// Check result
 	bool result = (output_hash[7] <= target);
 	if (result)
-		SETFOUND(gid);
+		SETFOUND(gid, output_hash[7]);
 	
 	// Kernel ends: password[6], X[8], output_hash[8] freed
 }
@@ -0,0 +1,838 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Host side check for the scrypt-chacha OpenCL kernels. Each variant of the
+ * build options (lookup gap, worksize, VRAM and system RAM padbuffers,
+ * scratchpad layout, an optional second lookup gap for the last work
+ * groups, system RAM groups optionally interleaved among the VRAM ones) is
+ * compiled with a small N on any OpenCL platform, PoCL on the CPU included,
+ * and search, search84 and the search84_part1/2/3 split are run over a nonce
+ * range. Every nonce is hashed with scrypt-jane.c as well: the found nonces
+ * must be exactly those under the target, and the split kernels' PBKDF2 and
+ * ROMix intermediates must match word for word. Each kernel is then timed,
+ * along with the scratchpad bandwidth that works out to.
+ * Exits 77 (skipped) when there is no OpenCL platform to run on.
+ */
+
+#include "scrypt-jane.c"
+
+#include <sys/time.h>
+
+#ifdef HAVE_OPENCL
+#ifdef __APPLE_CC__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+#define CLC_SKIP		77
+#define CLC_MAX_LIST		8
+#define CLC_MAX_PADBUFFERS	16
+#define CLC_MAX_PADBUFFERS_RAM	8
+/* The result ring of findnonce.h: a count, then nonce and hash prefix pairs */
+#define CLC_RESULT_SLOTS	128
+#define CLC_RESULT_ENTRY	2
+#define CLC_OUTPUT_WORDS	(CLC_RESULT_ENTRY + CLC_RESULT_SLOTS * 2)
+#define CLC_OUTPUT_SIZE		(sizeof(uint32_t) * CLC_OUTPUT_WORDS)
+#define CLC_CHUNK_BYTES		128
+#define CLC_MAX_ERRORS		4
+
+struct clc_list {
+	int n;
+	int val[CLC_MAX_LIST];
+};
+
+static int clc_platform, clc_device;
+static int clc_nfactor = 6;
+static int clc_plan_nfactor;
+static int clc_nonces = 2048;
+static int clc_groups = 2;
+static int clc_rounds = 8;
+static int clc_lookup_gap2;
+static int clc_interleave_ram;
+static const char *clc_kernel = "scrypt-chacha.cl";
+static struct clc_list clc_lookup_gap = { 2, { 1, 3 } };
+static struct clc_list clc_worksize = { 1, { 32 } };
+static struct clc_list clc_padbuffers = { 2, { 2, 6 } };
+static struct clc_list clc_padbuffers_ram = { 2, { 0, 1 } };
+static struct clc_list clc_pad_layout = { PL_MAX, { PL_ROW, PL_INTERLEAVE, PL_BLOCK } };
+
+static const char *clc_pad_layout_names[PL_MAX] = { "row", "interleave", "block" };
+
+/* scrypt-jane's view of one nonce: X after the first PBKDF2, X after ROMix
+ * and the hash word the kernels compare against the target */
+struct clc_ref {
+	uint32_t nonce;
+	uint8_t X[CLC_CHUNK_BYTES];
+	uint8_t X2[CLC_CHUNK_BYTES];
+	uint32_t hash7;
+};
+
+static double clc_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* The same test header as scrypt-bench, with the nonce in the last word */
+static void clc_header(uint8_t *hdr, int size, uint32_t nonce)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		hdr[i] = i * 7 + 1;
+	SJ_U32TO8_LE(hdr + size - 4, nonce);
+}
+
+static void clc_reference(struct clc_ref *ref, int size, uint32_t nonce, sj_scrypt_mix_word_t *V)
+{
+	sj_scrypt_mix_word_t SJ_MM16 X[CLC_CHUNK_BYTES / 4], Y[CLC_CHUNK_BYTES / 4];
+	uint8_t pw[84], hash[32];
+
+	clc_header(pw, size, nonce);
+	sj_scrypt_pbkdf2(pw, size, pw, size, (uint8_t *)X, CLC_CHUNK_BYTES);
+	memcpy(ref->X, X, CLC_CHUNK_BYTES);
+	sj_scrypt_ROMix(X, Y, V, 1 << (clc_nfactor + 1), 1);
+	memcpy(ref->X2, X, CLC_CHUNK_BYTES);
+	sj_scrypt_pbkdf2(pw, size, (uint8_t *)X, CLC_CHUNK_BYTES, hash, 32);
+	ref->nonce = nonce;
+	ref->hash7 = SJ_U8TO32_LE(hash + 28);
+}
+
+static int clc_cmp_uint(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* A target that the lowest half of the batch meets, but never more than
+ * RESULT_SLOTS / 2 nonces so the result ring can't overflow. Batches over 128
+ * threads therefore have only their 64 lowest hashes under it, a smaller
+ * share the larger the batch. */
+static uint32_t clc_target(const struct clc_ref *refs, int count)
+{
+	uint32_t *h = malloc(sizeof(uint32_t) * count), target;
+	int i, k = count / 2;
+
+	if (unlikely(!h))
+		quit(1, "Failed to malloc in clc_target");
+	for (i = 0; i < count; i++)
+		h[i] = refs[i].hash7;
+	qsort(h, count, sizeof(uint32_t), clc_cmp_uint);
+	if (k > CLC_RESULT_SLOTS / 2)
+		k = CLC_RESULT_SLOTS / 2;
+	if (k < 1)
+		k = 1;
+	target = h[k - 1];
+	free(h);
+	return target;
+}
+
+static bool clc_parse_list(struct clc_list *list, const char *arg, int min, int max)
+{
+	char *copy = strdup(arg), *tok, *save;
+
+	list->n = 0;
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		int val = atoi(tok);
+
+		if (list->n == CLC_MAX_LIST || val < min || val > max) {
+			free(copy);
+			return false;
+		}
+		list->val[list->n++] = val;
+	}
+	free(copy);
+	return list->n > 0;
+}
+
+static bool clc_parse_layouts(struct clc_list *list, const char *arg)
+{
+	char *copy = strdup(arg), *tok, *save;
+	int i;
+
+	list->n = 0;
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < PL_MAX; i++) {
+			if (!strcmp(tok, clc_pad_layout_names[i]))
+				break;
+		}
+		if (list->n == CLC_MAX_LIST || i == PL_MAX) {
+			free(copy);
+			return false;
+		}
+		list->val[list->n++] = i;
+	}
+	free(copy);
+	return list->n > 0;
+}
+
+static void clc_usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "  --kernel <file>            Kernel source (default: scrypt-chacha.cl)\n"
+	       "  --platform <n>             OpenCL platform (default: 0)\n"
+	       "  --device <n>               Device on the platform (default: 0)\n"
+	       "  --nfactor <n>              Nfactor to check, 1-14 (default: 6)\n"
+	       "  --plan-nfactor <n>         Nfactor to build and size the padbuffers for, 1-14 (default: --nfactor)\n"
+	       "  --nonces <n>               Nonces to check per kernel (default: 2048)\n"
+	       "  --groups <n>               Work groups per padbuffer, one fewer in the last VRAM one (default: 2)\n"
+	       "  --rounds <n>               Timed launches per kernel (default: 8)\n"
+	       "  --lookup-gap <list>        LOOKUP_GAP values (default: 1,3)\n"
+	       "  --lookup-gap2 <n>          LOOKUP_GAP2 for --groups more groups, 0 is off (default: 0)\n"
+	       "  --worksize <list>          WORKSIZE values (default: 32)\n"
+	       "  --padbuffers <list>        NUM_PADBUFFERS values, 1-16 (default: 2,6)\n"
+	       "  --padbuffers-ram <list>    NUM_PADBUFFERS_RAM values, 0-8 (default: 0,1)\n"
+	       "  --pad-layout <list>        Scratchpad layouts (default: row,interleave,block)\n"
+	       "  --interleave-ram <n>       1 spreads RAM groups among the VRAM ones (default: 0)\n",
+	       name);
+}
+
+static bool clc_parse_args(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *opt = argv[i], *arg = i + 1 < argc ? argv[i + 1] : NULL;
+		bool ok = true;
+
+		if (!arg)
+			return false;
+		if (!strcmp(opt, "--kernel"))
+			clc_kernel = arg;
+		else if (!strcmp(opt, "--platform"))
+			clc_platform = atoi(arg);
+		else if (!strcmp(opt, "--device"))
+			clc_device = atoi(arg);
+		else if (!strcmp(opt, "--nfactor"))
+			ok = (clc_nfactor = atoi(arg)) >= 1 && clc_nfactor <= 14;
+		else if (!strcmp(opt, "--plan-nfactor"))
+			ok = (clc_plan_nfactor = atoi(arg)) >= 1 && clc_plan_nfactor <= 14;
+		else if (!strcmp(opt, "--nonces"))
+			ok = (clc_nonces = atoi(arg)) > 0;
+		else if (!strcmp(opt, "--groups"))
+			ok = (clc_groups = atoi(arg)) > 0;
+		else if (!strcmp(opt, "--rounds"))
+			ok = (clc_rounds = atoi(arg)) > 0;
+		else if (!strcmp(opt, "--lookup-gap"))
+			ok = clc_parse_list(&clc_lookup_gap, arg, 1, 64);
+		else if (!strcmp(opt, "--lookup-gap2"))
+			ok = (clc_lookup_gap2 = atoi(arg)) >= 0 && clc_lookup_gap2 <= 64;
+		else if (!strcmp(opt, "--worksize"))
+			ok = clc_parse_list(&clc_worksize, arg, 1, 1024);
+		else if (!strcmp(opt, "--padbuffers"))
+			ok = clc_parse_list(&clc_padbuffers, arg, 1, CLC_MAX_PADBUFFERS);
+		else if (!strcmp(opt, "--padbuffers-ram"))
+			ok = clc_parse_list(&clc_padbuffers_ram, arg, 0, CLC_MAX_PADBUFFERS_RAM);
+		else if (!strcmp(opt, "--pad-layout"))
+			ok = clc_parse_layouts(&clc_pad_layout, arg);
+		else if (!strcmp(opt, "--interleave-ram"))
+			ok = (clc_interleave_ram = atoi(arg)) >= 0 && clc_interleave_ram <= 1;
+		else
+			ok = false;
+		if (!ok)
+			return false;
+		i++;
+	}
+	return true;
+}
+
+#ifdef HAVE_OPENCL
+struct clc_variant {
+	int lookup_gap;
+	int worksize;
+	int padbuffers;
+	int padbuffers_ram;
+	int pad_layout;
+	size_t buffer_threads;
+	size_t threads_vram, threads_ram, threads;
+	size_t pad_stride;
+	int lookup_gap2;
+	size_t lg2_threads;
+	size_t pad_stride2;
+
+	cl_program program;
+	cl_kernel search, search84, part1, part2, part3;
+	cl_mem input, output, temp_X, temp_X2;
+	cl_mem pad[CLC_MAX_PADBUFFERS], pad_ram[CLC_MAX_PADBUFFERS_RAM];
+	cl_mem pad_lg2;
+};
+
+static cl_context clc_context;
+static cl_command_queue clc_queue;
+static cl_device_id clc_devid;
+static char *clc_source;
+static sj_scrypt_mix_word_t *clc_V;
+
+static char *clc_read_source(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	char *source;
+	long len;
+
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	source = calloc(len + 1, 1);
+	if (source && fread(source, 1, len, f) != (size_t)len) {
+		free(source);
+		source = NULL;
+	}
+	fclose(f);
+	return source;
+}
+
+static int clc_open(void)
+{
+	cl_platform_id platforms[16];
+	cl_device_id devices[16];
+	cl_uint nplatforms = 0, ndevices = 0;
+	char name[256];
+	cl_int status;
+
+	status = clGetPlatformIDs(16, platforms, &nplatforms);
+	if (status != CL_SUCCESS || !nplatforms) {
+		printf("No OpenCL platforms found, skipping\n");
+		return CLC_SKIP;
+	}
+	if (clc_platform >= (int)nplatforms) {
+		printf("Platform %d not found, %u available\n", clc_platform, nplatforms);
+		return 1;
+	}
+	status = clGetDeviceIDs(platforms[clc_platform], CL_DEVICE_TYPE_ALL, 16, devices, &ndevices);
+	if (status != CL_SUCCESS || clc_device >= (int)ndevices) {
+		printf("Device %d not found on platform %d\n", clc_device, clc_platform);
+		return 1;
+	}
+	clc_devid = devices[clc_device];
+
+	clGetPlatformInfo(platforms[clc_platform], CL_PLATFORM_NAME, sizeof(name), name, NULL);
+	printf("Platform %d: %s\n", clc_platform, name);
+	clGetDeviceInfo(clc_devid, CL_DEVICE_NAME, sizeof(name), name, NULL);
+	printf("Device %d: %s\n", clc_device, name);
+
+	clc_context = clCreateContext(NULL, 1, &clc_devid, NULL, NULL, &status);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: Creating Context (clCreateContext)\n", status);
+		return 1;
+	}
+	clc_queue = clCreateCommandQueue(clc_context, clc_devid, 0, &status);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: Creating Command Queue (clCreateCommandQueue)\n", status);
+		return 1;
+	}
+	return 0;
+}
+
+static void clc_release(struct clc_variant *v)
+{
+	int i;
+
+	if (v->search) clReleaseKernel(v->search);
+	if (v->search84) clReleaseKernel(v->search84);
+	if (v->part1) clReleaseKernel(v->part1);
+	if (v->part2) clReleaseKernel(v->part2);
+	if (v->part3) clReleaseKernel(v->part3);
+	if (v->program) clReleaseProgram(v->program);
+	if (v->input) clReleaseMemObject(v->input);
+	if (v->output) clReleaseMemObject(v->output);
+	if (v->temp_X) clReleaseMemObject(v->temp_X);
+	if (v->temp_X2) clReleaseMemObject(v->temp_X2);
+	if (v->pad_lg2) clReleaseMemObject(v->pad_lg2);
+	for (i = 0; i < CLC_MAX_PADBUFFERS; i++) {
+		if (v->pad[i])
+			clReleaseMemObject(v->pad[i]);
+	}
+	for (i = 0; i < CLC_MAX_PADBUFFERS_RAM; i++) {
+		if (v->pad_ram[i])
+			clReleaseMemObject(v->pad_ram[i]);
+	}
+}
+
+static cl_kernel clc_create_kernel(struct clc_variant *v, const char *name)
+{
+	cl_int status;
+	cl_kernel kernel = clCreateKernel(v->program, name, &status);
+
+	if (status != CL_SUCCESS) {
+		printf("Error %d: Creating Kernel %s (clCreateKernel)\n", status, name);
+		return NULL;
+	}
+	return kernel;
+}
+
+/* Nfactor the kernels are built and the padbuffers sized for, never below the
+ * one checked, which the kernels take as an argument */
+static int clc_plan(void)
+{
+	return clc_plan_nfactor > clc_nfactor ? clc_plan_nfactor : clc_nfactor;
+}
+
+/* Build the program with the same defines ocl.c uses: buffer_threads in
+ * every padbuffer but the last VRAM one, which holds what is left, and the
+ * LOOKUP_GAP2 threads, if any, after all of them */
+static bool clc_build(struct clc_variant *v)
+{
+	const uint32_t n = 1 << (clc_plan() + 1);
+	const size_t pad_bytes = CLC_CHUNK_BYTES * v->pad_stride * v->buffer_threads;
+	char options[2048], padbuffers[8 * (CLC_MAX_PADBUFFERS + CLC_MAX_PADBUFFERS_RAM) + 1] = "";
+	cl_int status;
+	int i;
+
+	for (i = 0; i < v->padbuffers_ram + v->padbuffers; i++)
+		sprintf(padbuffers + strlen(padbuffers), "X(%d)", i);
+	snprintf(options, sizeof(options),
+		 "-D N=%u -D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%u -D WORKSIZE=%d -D PADBUFFERS(X)=%s "
+		 "-D NUM_PADBUFFERS=%d -D THREADS_PER_BUFFER=%zu -D THREADS_VRAM=%zu "
+		 "-D NUM_PADBUFFERS_RAM=%d -D THREADS_PER_BUFFER_RAM=%zu -D THREADS_RAM=%zu "
+		 "-D PAD_LAYOUT=%d -D PAD_STRIDE=%zu",
+		 n, v->lookup_gap, (unsigned int)v->threads, v->worksize, padbuffers,
+		 v->padbuffers, v->buffer_threads, v->threads_vram,
+		 v->padbuffers_ram, v->buffer_threads, v->threads_ram,
+		 v->pad_layout, v->pad_stride);
+	if (v->lg2_threads)
+		snprintf(options + strlen(options), sizeof(options) - strlen(options),
+			 " -D LOOKUP_GAP2=%d -D THREADS_LG2=%zu -D THREADS_LG2_START=%zu -D PAD_STRIDE2=%zu",
+			 v->lookup_gap2, v->lg2_threads, v->threads - v->lg2_threads, v->pad_stride2);
+	if (clc_interleave_ram && v->padbuffers_ram)
+		snprintf(options + strlen(options), sizeof(options) - strlen(options), " -D INTERLEAVE_RAM");
+
+	v->program = clCreateProgramWithSource(clc_context, 1, (const char **)&clc_source, NULL, &status);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: Loading source (clCreateProgramWithSource)\n", status);
+		return false;
+	}
+	status = clBuildProgram(v->program, 1, &clc_devid, options, NULL, NULL);
+	if (status != CL_SUCCESS) {
+		size_t len = 0;
+		char *log;
+
+		printf("Error %d: Building Program (clBuildProgram)\n", status);
+		clGetProgramBuildInfo(v->program, clc_devid, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+		log = malloc(len + 1);
+		if (log) {
+			clGetProgramBuildInfo(v->program, clc_devid, CL_PROGRAM_BUILD_LOG, len, log, NULL);
+			log[len] = '\0';
+			printf("%s\n", log);
+			free(log);
+		}
+		return false;
+	}
+
+	if (!(v->search = clc_create_kernel(v, "search")) ||
+	    !(v->search84 = clc_create_kernel(v, "search84")) ||
+	    !(v->part1 = clc_create_kernel(v, "search84_part1")) ||
+	    !(v->part2 = clc_create_kernel(v, "search84_part2")) ||
+	    !(v->part3 = clc_create_kernel(v, "search84_part3")))
+		return false;
+
+	v->input = clCreateBuffer(clc_context, CL_MEM_READ_ONLY, CLC_CHUNK_BYTES, NULL, &status);
+	if (status == CL_SUCCESS)
+		v->output = clCreateBuffer(clc_context, CL_MEM_READ_WRITE, CLC_OUTPUT_SIZE, NULL, &status);
+	if (status == CL_SUCCESS)
+		v->temp_X = clCreateBuffer(clc_context, CL_MEM_READ_WRITE, v->threads * CLC_CHUNK_BYTES, NULL, &status);
+	if (status == CL_SUCCESS)
+		v->temp_X2 = clCreateBuffer(clc_context, CL_MEM_READ_WRITE, v->threads * CLC_CHUNK_BYTES, NULL, &status);
+	for (i = 0; i < v->padbuffers && status == CL_SUCCESS; i++) {
+		size_t last = v->threads_vram - i * v->buffer_threads;
+
+		v->pad[i] = clCreateBuffer(clc_context, CL_MEM_READ_WRITE,
+					   last < v->buffer_threads ? CLC_CHUNK_BYTES * v->pad_stride * last : pad_bytes,
+					   NULL, &status);
+	}
+	for (i = 0; i < v->padbuffers_ram && status == CL_SUCCESS; i++)
+		v->pad_ram[i] = clCreateBuffer(clc_context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, pad_bytes, NULL, &status);
+	if (v->lg2_threads && status == CL_SUCCESS)
+		v->pad_lg2 = clCreateBuffer(clc_context, CL_MEM_READ_WRITE,
+					    CLC_CHUNK_BYTES * v->pad_stride2 * v->lg2_threads, NULL, &status);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: clCreateBuffer failed, padbuffer size: %zu bytes\n", status, pad_bytes);
+		return false;
+	}
+	return true;
+}
+
+/* The padbuffer table in the order scrypt_set_pad_args() in ocl.c sets it */
+static cl_int clc_set_pads(struct clc_variant *v, cl_kernel kernel, cl_uint *num)
+{
+	cl_int status = CL_SUCCESS;
+	int i;
+
+	for (i = 0; i < v->padbuffers_ram; i++)
+		status |= clSetKernelArg(kernel, (*num)++, sizeof(cl_mem), &v->pad_ram[i]);
+	for (i = 0; i < v->padbuffers; i++)
+		status |= clSetKernelArg(kernel, (*num)++, sizeof(cl_mem), &v->pad[i]);
+	if (v->lg2_threads)
+		status |= clSetKernelArg(kernel, (*num)++, sizeof(cl_mem), &v->pad_lg2);
+	return status;
+}
+
+/* Arguments that stay fixed for the variant, the target comes after the pads
+ * and is set per launch */
+static bool clc_set_args(struct clc_variant *v)
+{
+	cl_int status = CL_SUCCESS;
+	cl_uint num, nfactor = clc_nfactor;
+
+	num = 0;
+	status |= clSetKernelArg(v->search, num++, sizeof(cl_mem), &v->input);
+	status |= clSetKernelArg(v->search, num++, sizeof(cl_mem), &v->output);
+	status |= clc_set_pads(v, v->search, &num);
+	num++;
+	status |= clSetKernelArg(v->search, num++, sizeof(cl_uint), &nfactor);
+
+	num = 0;
+	status |= clSetKernelArg(v->search84, num++, sizeof(cl_mem), &v->input);
+	status |= clSetKernelArg(v->search84, num++, sizeof(cl_mem), &v->output);
+	status |= clc_set_pads(v, v->search84, &num);
+	num++;
+	status |= clSetKernelArg(v->search84, num++, sizeof(cl_uint), &nfactor);
+
+	num = 0;
+	status |= clSetKernelArg(v->part1, num++, sizeof(cl_mem), &v->input);
+	status |= clSetKernelArg(v->part1, num++, sizeof(cl_mem), &v->temp_X);
+
+	num = 0;
+	status |= clSetKernelArg(v->part2, num++, sizeof(cl_mem), &v->temp_X);
+	status |= clSetKernelArg(v->part2, num++, sizeof(cl_mem), &v->temp_X2);
+	status |= clc_set_pads(v, v->part2, &num);
+	status |= clSetKernelArg(v->part2, num++, sizeof(cl_uint), &nfactor);
+
+	num = 0;
+	status |= clSetKernelArg(v->part3, num++, sizeof(cl_mem), &v->input);
+	status |= clSetKernelArg(v->part3, num++, sizeof(cl_mem), &v->temp_X2);
+	status |= clSetKernelArg(v->part3, num++, sizeof(cl_mem), &v->output);
+
+	if (status != CL_SUCCESS) {
+		printf("Error %d: clSetKernelArg failed\n", status);
+		return false;
+	}
+	return true;
+}
+
+static bool clc_set_target(cl_kernel kernel, cl_uint index, uint32_t target)
+{
+	cl_uint le_target = target;
+	cl_int status = clSetKernelArg(kernel, index, sizeof(cl_uint), &le_target);
+
+	if (status != CL_SUCCESS) {
+		printf("Error %d: clSetKernelArg (target) failed\n", status);
+		return false;
+	}
+	return true;
+}
+
+static bool clc_launch(struct clc_variant *v, cl_kernel kernel, uint32_t base, size_t threads)
+{
+	size_t offset = base, local = v->worksize;
+	cl_int status;
+
+	status = clEnqueueNDRangeKernel(clc_queue, kernel, 1, &offset, &threads, &local, 0, NULL, NULL);
+	if (status == CL_SUCCESS)
+		status = clFinish(clc_queue);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: Enqueueing kernel onto command queue (clEnqueueNDRangeKernel)\n", status);
+		return false;
+	}
+	return true;
+}
+
+static bool clc_write_input(struct clc_variant *v, int size)
+{
+	uint8_t data[CLC_CHUNK_BYTES];
+	uint32_t zero[CLC_OUTPUT_WORDS];
+	cl_int status;
+
+	memset(data, 0, sizeof(data));
+	memset(zero, 0, sizeof(zero));
+	clc_header(data, size, 0);
+	status = clEnqueueWriteBuffer(clc_queue, v->input, true, 0, sizeof(data), data, 0, NULL, NULL);
+	if (status == CL_SUCCESS)
+		status = clEnqueueWriteBuffer(clc_queue, v->output, true, 0, sizeof(zero), zero, 0, NULL, NULL);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: clEnqueueWriteBuffer failed\n", status);
+		return false;
+	}
+	return true;
+}
+
+/* The found nonces must be exactly the reference nonces at or under the
+ * target, in any order, each with its reference hash prefix */
+static int clc_check_found(struct clc_variant *v, const char *name, const struct clc_ref *refs,
+			   int count, uint32_t target)
+{
+	uint32_t out[CLC_OUTPUT_WORDS], found_nonces[CLC_RESULT_SLOTS], expect[CLC_RESULT_SLOTS];
+	int i, j, found, nexpect = 0, errors = 0;
+	cl_int status;
+
+	status = clEnqueueReadBuffer(clc_queue, v->output, true, 0, sizeof(out), out, 0, NULL, NULL);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: clEnqueueReadBuffer failed\n", status);
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		if (refs[i].hash7 <= target && nexpect < CLC_RESULT_SLOTS)
+			expect[nexpect++] = refs[i].nonce;
+	}
+	found = out[0];
+	if (found > CLC_RESULT_SLOTS) {
+		printf("  %s: output overflow, %d nonces found\n", name, found);
+		return 1;
+	}
+	for (i = 0; i < found; i++) {
+		const uint32_t nonce = out[CLC_RESULT_ENTRY + i * 2], hash7 = out[CLC_RESULT_ENTRY + i * 2 + 1];
+
+		found_nonces[i] = nonce;
+		for (j = 0; j < count && refs[j].nonce != nonce; j++)
+			;
+		if (j < count && refs[j].hash7 != hash7) {
+			printf("  %s: nonce %u returned hash %08x, expected %08x\n", name, nonce,
+			       hash7, refs[j].hash7);
+			errors++;
+		}
+	}
+	qsort(found_nonces, found, sizeof(uint32_t), clc_cmp_uint);
+	qsort(expect, nexpect, sizeof(uint32_t), clc_cmp_uint);
+	if (found != nexpect)
+		errors++;
+	for (i = 0; i < found && i < nexpect; i++) {
+		if (found_nonces[i] != expect[i])
+			errors++;
+	}
+	if (errors)
+		printf("  %s: nonces %u-%u found %d, expected %d under target %08x\n", name,
+		       refs[0].nonce, refs[count - 1].nonce, found, nexpect, target);
+	return errors;
+}
+
+/* Compare an intermediate X buffer of the split kernels with scrypt-jane */
+static int clc_check_chunks(struct clc_variant *v, const char *name, cl_mem buf,
+			    const struct clc_ref *refs, int count, bool romix)
+{
+	uint8_t *X = malloc((size_t)count * CLC_CHUNK_BYTES);
+	int i, errors = 0;
+	cl_int status;
+
+	if (unlikely(!X))
+		quit(1, "Failed to malloc in clc_check_chunks");
+	status = clEnqueueReadBuffer(clc_queue, buf, true, 0, (size_t)count * CLC_CHUNK_BYTES, X, 0, NULL, NULL);
+	if (status != CL_SUCCESS) {
+		printf("Error %d: clEnqueueReadBuffer failed\n", status);
+		free(X);
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		const uint8_t *expect = romix ? refs[i].X2 : refs[i].X;
+
+		if (memcmp(X + (size_t)i * CLC_CHUNK_BYTES, expect, CLC_CHUNK_BYTES)) {
+			if (errors < CLC_MAX_ERRORS)
+				printf("  %s: mismatch at nonce %u\n", name, refs[i].nonce);
+			errors++;
+		}
+	}
+	free(X);
+	return errors;
+}
+
+/* Check one header size over --nonces nonces, batch by batch */
+static int clc_check(struct clc_variant *v, int size, size_t threads)
+{
+	struct clc_ref *refs = calloc(threads, sizeof(struct clc_ref));
+	int errors = 0, target_index = 2 + v->padbuffers + v->padbuffers_ram + (v->lg2_threads > 0);
+	uint32_t base;
+
+	if (unlikely(!refs))
+		quit(1, "Failed to calloc in clc_check");
+
+	for (base = 0; base < (uint32_t)clc_nonces && errors < CLC_MAX_ERRORS; base += threads) {
+		uint32_t target;
+		size_t i;
+
+		for (i = 0; i < threads; i++)
+			clc_reference(&refs[i], size, base + i, clc_V);
+		target = clc_target(refs, threads);
+
+		if (size == 80) {
+			if (!clc_write_input(v, size) || !clc_set_target(v->search, target_index, target) ||
+			    !clc_launch(v, v->search, base, threads)) {
+				errors++;
+				break;
+			}
+			errors += clc_check_found(v, "search", refs, threads, target);
+			continue;
+		}
+
+		if (!clc_write_input(v, size) || !clc_set_target(v->search84, target_index, target) ||
+		    !clc_launch(v, v->search84, base, threads)) {
+			errors++;
+			break;
+		}
+		errors += clc_check_found(v, "search84", refs, threads, target);
+
+		if (!clc_write_input(v, size) || !clc_set_target(v->part3, 3, target) ||
+		    !clc_launch(v, v->part1, base, threads)) {
+			errors++;
+			break;
+		}
+		errors += clc_check_chunks(v, "search84_part1", v->temp_X, refs, threads, false);
+		if (!clc_launch(v, v->part2, base, threads)) {
+			errors++;
+			break;
+		}
+		errors += clc_check_chunks(v, "search84_part2", v->temp_X2, refs, threads, true);
+		if (!clc_launch(v, v->part3, base, threads)) {
+			errors++;
+			break;
+		}
+		errors += clc_check_found(v, "search84_part3", refs, threads, target);
+	}
+	free(refs);
+	return errors;
+}
+
+/* Hashes per second over --rounds back to back launches, with a target
+ * nothing meets so the output buffer never fills */
+static double clc_time(struct clc_variant *v, int size, size_t threads, bool split)
+{
+	cl_kernel kernel = size == 80 ? v->search : v->search84;
+	cl_uint index = 2 + v->padbuffers + v->padbuffers_ram + (v->lg2_threads > 0);
+	double start;
+	int r;
+
+	if (!clc_write_input(v, size) || !clc_set_target(split ? v->part3 : kernel, split ? 3 : index, 0))
+		return 0;
+	start = clc_now();
+	for (r = 0; r < clc_rounds; r++) {
+		uint32_t base = r * threads;
+
+		if (split) {
+			if (!clc_launch(v, v->part1, base, threads) || !clc_launch(v, v->part2, base, threads) ||
+			    !clc_launch(v, v->part3, base, threads))
+				return 0;
+		} else if (!clc_launch(v, kernel, base, threads))
+			return 0;
+	}
+	return (double)clc_rounds * threads / (clc_now() - start);
+}
+
+/* Scratchpad traffic per hash is one store per stored item and one 128 byte
+ * read per ROMix step, the extra mixing for lookup gaps is not counted */
+static void clc_report(const char *name, int errors, double rate, double hash_bytes)
+{
+	printf("  %-16s %s %12.1f hashes/s %8.2f GB/s\n", name, errors ? "FAIL" : "ok  ",
+	       rate, rate * hash_bytes / 1e9);
+}
+
+static int clc_run_variant(struct clc_variant *v)
+{
+	const uint32_t n = 1 << (clc_nfactor + 1), plan_n = 1 << (clc_plan() + 1);
+	size_t ysize = n / v->lookup_gap + (n % v->lookup_gap > 0);
+	size_t plan_ysize = plan_n / v->lookup_gap + (plan_n % v->lookup_gap > 0);
+	double hash_bytes = (double)CLC_CHUNK_BYTES * (ysize + n);
+	int errors80, errors84;
+
+	/* Same footprint as scrypt_pad_chunks() in ocl.c */
+	v->pad_stride = v->pad_layout == PL_BLOCK ? plan_ysize + 1 : plan_ysize;
+	/* The last VRAM buffer a group short, as ocl.c leaves it when the groups
+	 * do not split evenly */
+	v->threads_vram = v->buffer_threads * v->padbuffers - (clc_groups > 1 ? v->worksize : 0);
+	v->threads_ram = v->buffer_threads * v->padbuffers_ram;
+	v->threads = v->threads_vram + v->threads_ram + v->lg2_threads;
+	if (v->lg2_threads) {
+		size_t ysize2 = plan_n / v->lookup_gap2 + (plan_n % v->lookup_gap2 > 0);
+
+		v->pad_stride2 = v->pad_layout == PL_BLOCK ? ysize2 + 1 : ysize2;
+	}
+	printf("lookup-gap %d, worksize %d, padbuffers %d+%d RAM, %zu threads each, %zu in all, %s layout",
+	       v->lookup_gap, v->worksize, v->padbuffers, v->padbuffers_ram, v->buffer_threads, v->threads,
+	       clc_pad_layout_names[v->pad_layout]);
+	if (v->lg2_threads)
+		printf(", lookup-gap2 %d for %zu threads", v->lookup_gap2, v->lg2_threads);
+	if (clc_interleave_ram && v->padbuffers_ram)
+		printf(", RAM groups interleaved");
+	printf("\n");
+	if (!clc_build(v) || !clc_set_args(v))
+		return 1;
+
+	errors80 = clc_check(v, 80, v->threads);
+	errors84 = clc_check(v, 84, v->threads);
+	clc_report("search", errors80, clc_time(v, 80, v->threads, false), hash_bytes);
+	clc_report("search84", errors84, clc_time(v, 84, v->threads, false), hash_bytes);
+	clc_report("search84 split", errors84, clc_time(v, 84, v->threads, true), hash_bytes);
+	return errors80 + errors84;
+}
+
+static int clc_run(void)
+{
+	int a, b, c, d, e, ret, failed = 0, variants = 0;
+
+	ret = clc_open();
+	if (ret)
+		return ret;
+	clc_source = clc_read_source(clc_kernel);
+	if (!clc_source) {
+		printf("Unable to read kernel source %s\n", clc_kernel);
+		return 1;
+	}
+	clc_V = malloc((size_t)CLC_CHUNK_BYTES << (clc_nfactor + 1));
+	if (unlikely(!clc_V))
+		quit(1, "Failed to malloc in clc_run");
+
+	for (a = 0; a < clc_lookup_gap.n; a++)
+	for (b = 0; b < clc_worksize.n; b++)
+	for (c = 0; c < clc_padbuffers.n; c++)
+	for (d = 0; d < clc_padbuffers_ram.n; d++)
+	for (e = 0; e < clc_pad_layout.n; e++) {
+		struct clc_variant v;
+
+		memset(&v, 0, sizeof(v));
+		v.lookup_gap = clc_lookup_gap.val[a];
+		v.worksize = clc_worksize.val[b];
+		v.padbuffers = clc_padbuffers.val[c];
+		v.padbuffers_ram = clc_padbuffers_ram.val[d];
+		v.pad_layout = clc_pad_layout.val[e];
+		v.buffer_threads = (size_t)clc_groups * v.worksize;
+		v.lookup_gap2 = clc_lookup_gap2;
+		v.lg2_threads = clc_lookup_gap2 ? v.buffer_threads : 0;
+		if (clc_run_variant(&v))
+			failed++;
+		clc_release(&v);
+		variants++;
+	}
+
+	free(clc_V);
+	free(clc_source);
+	clReleaseCommandQueue(clc_queue);
+	clReleaseContext(clc_context);
+	if (failed) {
+		printf("%d of %d variants failed\n", failed, variants);
+		return 1;
+	}
+	printf("All %d variants match scrypt-jane\n", variants);
+	return 0;
+}
+#else /* HAVE_OPENCL */
+static int clc_run(void)
+{
+	printf("Built without OpenCL, skipping\n");
+	return CLC_SKIP;
+}
+#endif /* HAVE_OPENCL */
+
+int main(int argc, char *argv[])
+{
+	if (!clc_parse_args(argc, argv)) {
+		clc_usage(argv[0]);
+		return 1;
+	}
+	return clc_run();
+}
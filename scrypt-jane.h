@@ -5,6 +5,7 @@
 
 #ifdef USE_SCRYPT
 extern void sj_scrypt_regenhash(struct work *work);
+extern void sc_scrypt_regenhash(struct work *work);
 
 extern void sj_be32enc_vect(uint32_t *dst, const uint32_t *src, uint32_t len);
 
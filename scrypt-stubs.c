@@ -0,0 +1,53 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * The miner globals and helpers used by the hashing code, for the check and
+ * benchmark programs that build it without the rest of the miner.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "miner.h"
+
+bool opt_debug, opt_log_output, use_syslog;
+int opt_log_level = LOG_NOTICE;
+bool opt_scrypt_chacha_84 = true;
+bool opt_n_scrypt;
+int opt_fixed_nfactor;
+int sc_minn = 4, sc_maxn = 30;
+long sc_starttime = 1367991200;
+
+void _applog(int prio, const char *str)
+{
+	if (prio <= LOG_WARNING)
+		fprintf(stderr, "%s\n", str);
+}
+
+char *bin2hex(const unsigned char *p, size_t len)
+{
+	char *s = malloc(len * 2 + 1);
+	size_t i;
+
+	if (unlikely(!s))
+		quit(1, "Failed to malloc in bin2hex");
+	for (i = 0; i < len; i++)
+		sprintf(s + i * 2, "%02x", p[i]);
+	return s;
+}
+
+void _quit(int status)
+{
+	exit(status);
+}
+
+unsigned char GetNfactor(__maybe_unused unsigned int nTimestamp, __maybe_unused int minn,
+			 __maybe_unused int maxn, __maybe_unused long starttime)
+{
+	return opt_fixed_nfactor;
+}
@@ -0,0 +1,179 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Thread queues. Each queue is a bounded multi producer, multi consumer ring
+ * of pointers in which every cell carries a sequence number saying whether it
+ * is ready to be pushed to or popped from for the current lap, so pushes and
+ * pops are a compare and swap on the head or tail and allocate nothing.
+ *
+ * The mutex and condition variable only put poppers to sleep on an empty
+ * queue. Pushers take the mutex only when a popper is asleep. getq uses them
+ * as the staged work lock and never holds items itself.
+ *
+ * A push onto a full queue waits for room rather than fail, so callers keep
+ * the semantics of the unbounded list this replaced.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "miner.h"
+
+#define TQ_SIZE	1024	/* Power of 2 */
+
+struct tq_cell {
+	volatile unsigned int seq;
+	void *data;
+};
+
+struct thread_q *tq_new(void)
+{
+	struct thread_q *tq;
+	unsigned int i;
+
+	tq = calloc(1, sizeof(*tq));
+	if (!tq)
+		return NULL;
+
+	tq->ring = calloc(TQ_SIZE, sizeof(struct tq_cell));
+	if (!tq->ring) {
+		free(tq);
+		return NULL;
+	}
+	for (i = 0; i < TQ_SIZE; i++)
+		tq->ring[i].seq = i;
+	tq->mask = TQ_SIZE - 1;
+	pthread_mutex_init(&tq->mutex, NULL);
+	pthread_cond_init(&tq->cond, NULL);
+
+	return tq;
+}
+
+void tq_free(struct thread_q *tq)
+{
+	if (!tq)
+		return;
+
+	pthread_cond_destroy(&tq->cond);
+	pthread_mutex_destroy(&tq->mutex);
+	free(tq->ring);
+
+	memset(tq, 0, sizeof(*tq));	/* poison */
+	free(tq);
+}
+
+static void tq_freezethaw(struct thread_q *tq, bool frozen)
+{
+	mutex_lock(&tq->mutex);
+	tq->frozen = frozen;
+	pthread_cond_broadcast(&tq->cond);
+	mutex_unlock(&tq->mutex);
+}
+
+void tq_freeze(struct thread_q *tq)
+{
+	tq_freezethaw(tq, true);
+}
+
+void tq_thaw(struct thread_q *tq)
+{
+	tq_freezethaw(tq, false);
+}
+
+/* A cell is free to push to when its sequence equals the head, and holds an
+ * item to pop when it is one past the tail */
+static bool tq_trypush(struct thread_q *tq, void *data)
+{
+	unsigned int pos = tq->head;
+	struct tq_cell *cell;
+	int dif;
+
+	for (;;) {
+		cell = &tq->ring[pos & tq->mask];
+		dif = (int)(cell->seq - pos);
+		if (!dif) {
+			if (__sync_bool_compare_and_swap(&tq->head, pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return false;
+		pos = tq->head;
+	}
+	cell->data = data;
+	__sync_synchronize();
+	cell->seq = pos + 1;
+	return true;
+}
+
+static bool tq_trypop(struct thread_q *tq, void **data)
+{
+	unsigned int pos = tq->tail;
+	struct tq_cell *cell;
+	int dif;
+
+	for (;;) {
+		cell = &tq->ring[pos & tq->mask];
+		dif = (int)(cell->seq - (pos + 1));
+		if (!dif) {
+			if (__sync_bool_compare_and_swap(&tq->tail, pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return false;
+		pos = tq->tail;
+	}
+	__sync_synchronize();
+	*data = cell->data;
+	__sync_synchronize();
+	cell->seq = pos + tq->mask + 1;
+	return true;
+}
+
+bool tq_push(struct thread_q *tq, void *data)
+{
+	if (unlikely(tq->frozen))
+		return false;
+	while (unlikely(!tq_trypush(tq, data))) {
+		if (tq->frozen)
+			return false;
+		sched_yield();
+	}
+
+	/* Pairs with the barrier in tq_pop() so either the popper sees the
+	 * item or we see it going to sleep */
+	__sync_synchronize();
+	if (tq->sleepers) {
+		mutex_lock(&tq->mutex);
+		pthread_cond_signal(&tq->cond);
+		mutex_unlock_noyield(&tq->mutex);
+	}
+	return true;
+}
+
+/* Pop the oldest item, sleeping until one is pushed, the queue is frozen or
+ * abstime passes. Returns NULL in the last two cases. */
+void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+{
+	void *rval = NULL;
+	int rc = 0;
+
+	if (tq_trypop(tq, &rval))
+		return rval;
+
+	mutex_lock(&tq->mutex);
+	tq->sleepers++;
+	__sync_synchronize();
+	while (!tq_trypop(tq, &rval) && !tq->frozen && !rc) {
+		if (abstime)
+			rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+		else
+			rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+	}
+	tq->sleepers--;
+	mutex_unlock(&tq->mutex);
+
+	return rval;
+}
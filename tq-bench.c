@@ -0,0 +1,306 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Standalone check and benchmark for the thread queues. Producer threads push
+ * items to consumer threads, once through the ring in thread-q.c, included
+ * directly, and once through the mutex protected list with one calloc per
+ * item that it replaced, kept here for comparison. Each run reports items/s
+ * and percentiles of the time each push took, which is what a thread handing
+ * work on waits for; push to pop times would mostly measure how full the
+ * queue ran. Run without arguments it makes short runs and returns non zero
+ * if any item is lost or popped twice (make check), with --bench it makes
+ * longer runs at several thread counts (make bench).
+ */
+
+#include "thread-q.c"
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "elist.h"
+
+/* The list queue thread-q.c replaced */
+struct lq_ent {
+	void			*data;
+	struct list_head	q_node;
+};
+
+struct list_q {
+	struct list_head	q;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+};
+
+static void *lq_new(void)
+{
+	struct list_q *lq = calloc(1, sizeof(*lq));
+
+	if (unlikely(!lq))
+		quit(1, "Failed to calloc list_q");
+	INIT_LIST_HEAD(&lq->q);
+	pthread_mutex_init(&lq->mutex, NULL);
+	pthread_cond_init(&lq->cond, NULL);
+	return lq;
+}
+
+static void lq_free(void *q)
+{
+	struct list_q *lq = q;
+
+	pthread_cond_destroy(&lq->cond);
+	pthread_mutex_destroy(&lq->mutex);
+	free(lq);
+}
+
+static bool lq_push(void *q, void *data)
+{
+	struct list_q *lq = q;
+	struct lq_ent *ent;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		return false;
+	ent->data = data;
+	INIT_LIST_HEAD(&ent->q_node);
+
+	mutex_lock(&lq->mutex);
+	list_add_tail(&ent->q_node, &lq->q);
+	pthread_cond_signal(&lq->cond);
+	mutex_unlock(&lq->mutex);
+	return true;
+}
+
+static void *lq_pop(void *q)
+{
+	struct list_q *lq = q;
+	struct lq_ent *ent;
+	void *rval = NULL;
+
+	mutex_lock(&lq->mutex);
+	if (list_empty(&lq->q) && pthread_cond_wait(&lq->cond, &lq->mutex))
+		goto out;
+	if (list_empty(&lq->q))
+		goto out;
+	ent = list_entry(lq->q.next, struct lq_ent, q_node);
+	rval = ent->data;
+	list_del(&ent->q_node);
+	free(ent);
+out:
+	mutex_unlock(&lq->mutex);
+	return rval;
+}
+
+static void *rq_new(void)
+{
+	struct thread_q *tq = tq_new();
+
+	if (unlikely(!tq))
+		quit(1, "Failed to tq_new");
+	return tq;
+}
+
+static void rq_free(void *q)
+{
+	tq_free(q);
+}
+
+static bool rq_push(void *q, void *data)
+{
+	return tq_push(q, data);
+}
+
+static void *rq_pop(void *q)
+{
+	return tq_pop(q, NULL);
+}
+
+struct tb_queue {
+	const char *name;
+	void *(*new)(void);
+	void (*free)(void *q);
+	bool (*push)(void *q, void *data);
+	void *(*pop)(void *q);
+};
+
+static const struct tb_queue tb_queues[] = {
+	{ "ring", rq_new, rq_free, rq_push, rq_pop },
+	{ "list", lq_new, lq_free, lq_push, lq_pop },
+};
+
+struct tb_item {
+	unsigned int id;
+	int pops;
+};
+
+struct tb_run {
+	const struct tb_queue *ops;
+	void *q;
+	struct tb_item *items;
+	struct tb_item stop;
+	uint64_t *lat;
+	int per_producer;
+};
+
+struct tb_thread {
+	struct tb_run *run;
+	int first;
+	pthread_t pth;
+};
+
+static uint64_t tb_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+static void *tb_producer(void *arg)
+{
+	struct tb_thread *t = arg;
+	struct tb_run *run = t->run;
+	int i;
+
+	for (i = 0; i < run->per_producer; i++) {
+		struct tb_item *item = &run->items[t->first + i];
+		uint64_t start = tb_now();
+
+		if (unlikely(!run->ops->push(run->q, item)))
+			quit(1, "%s push failed", run->ops->name);
+		run->lat[item->id] = tb_now() - start;
+	}
+	return NULL;
+}
+
+static void *tb_consumer(void *arg)
+{
+	struct tb_thread *t = arg;
+	struct tb_run *run = t->run;
+	struct tb_item *item;
+
+	for (;;) {
+		item = run->ops->pop(run->q);
+		if (!item)
+			continue;
+		if (item == &run->stop)
+			break;
+		__sync_fetch_and_add(&item->pops, 1);
+	}
+	return NULL;
+}
+
+static int tb_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double tb_percentile(const uint64_t *sorted, int n, double pct)
+{
+	int i = (int)(n * pct / 100);
+
+	if (i >= n)
+		i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+/* Returns the number of items lost or popped more than once */
+static int tb_run_queue(const struct tb_queue *ops, int producers, int consumers, int per_producer)
+{
+	const int total = producers * per_producer;
+	struct tb_thread *threads;
+	struct tb_run run;
+	uint64_t start, secs_ns;
+	int i, bad = 0;
+
+	memset(&run, 0, sizeof(run));
+	run.ops = ops;
+	run.q = ops->new();
+	run.per_producer = per_producer;
+	run.items = calloc(total, sizeof(struct tb_item));
+	run.lat = calloc(total, sizeof(uint64_t));
+	threads = calloc(producers + consumers, sizeof(struct tb_thread));
+	if (unlikely(!run.items || !run.lat || !threads))
+		quit(1, "Failed to calloc in tb_run_queue");
+	for (i = 0; i < total; i++)
+		run.items[i].id = i;
+
+	start = tb_now();
+	for (i = 0; i < producers + consumers; i++) {
+		threads[i].run = &run;
+		threads[i].first = i * per_producer;
+		if (unlikely(pthread_create(&threads[i].pth, NULL,
+					    i < producers ? tb_producer : tb_consumer, &threads[i])))
+			quit(1, "Failed to create queue bench thread");
+	}
+	for (i = 0; i < producers; i++)
+		pthread_join(threads[i].pth, NULL);
+	for (i = 0; i < consumers; i++)
+		ops->push(run.q, &run.stop);
+	for (i = producers; i < producers + consumers; i++)
+		pthread_join(threads[i].pth, NULL);
+	secs_ns = tb_now() - start;
+
+	for (i = 0; i < total; i++)
+		bad += run.items[i].pops != 1;
+	qsort(run.lat, total, sizeof(uint64_t), tb_cmp);
+	printf("%s %2dx%-2d: %7.2f Mitems/s  push us p50 %7.2f p99 %8.2f p99.9 %8.2f max %9.2f%s\n",
+	       ops->name, producers, consumers, total / (secs_ns / 1e9) / 1e6,
+	       tb_percentile(run.lat, total, 50), tb_percentile(run.lat, total, 99),
+	       tb_percentile(run.lat, total, 99.9), run.lat[total - 1] / 1000.0,
+	       bad ? "  ITEMS LOST OR DUPLICATED" : "");
+
+	ops->free(run.q);
+	free(threads);
+	free(run.lat);
+	free(run.items);
+	return bad;
+}
+
+static void tb_usage(const char *name)
+{
+	printf("Usage: %s [--bench]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int check_threads[][2] = { { 1, 1 }, { 4, 4 } };
+	static const int bench_threads[][2] = { { 1, 1 }, { 2, 2 }, { 4, 4 }, { 8, 8 }, { 8, 1 }, { 1, 8 } };
+	const int (*threads)[2] = check_threads;
+	int runs = sizeof(check_threads) / sizeof(check_threads[0]);
+	int per_producer = 50000;
+	int i, q, fails = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--bench")) {
+			threads = bench_threads;
+			runs = sizeof(bench_threads) / sizeof(bench_threads[0]);
+			per_producer = 500000;
+		} else {
+			tb_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < runs; i++) {
+		for (q = 0; q < (int)(sizeof(tb_queues) / sizeof(tb_queues[0])); q++)
+			fails += tb_run_queue(&tb_queues[q], threads[i][0], threads[i][1], per_producer);
+	}
+	if (fails) {
+		printf("%d items lost or popped more than once\n", fails);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Hot path timing trace. With --trace every thread records completed spans
+ * (name, start, duration) into its own fixed size ring, overwriting the
+ * oldest entries, so the rings always hold the last few seconds of activity.
+ * OpenCL profiling times are mapped onto the host clock and recorded on one
+ * track per GPU. On request the rings are written out in the Chrome trace
+ * event format, which chrome://tracing and Perfetto can load.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "util.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE	8192
+#define TRACE_RING_MASK	(TRACE_RING_SIZE - 1)
+#define TRACE_NAMESIZ	16
+#define TRACE_TID_BASE	1000
+
+bool opt_trace;
+
+struct trace_rec {
+	const char *name;
+	uint64_t ts;
+	uint64_t dur;
+	int dev;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	volatile int in_use;
+	int tid;
+	char name[TRACE_NAMESIZ];
+	volatile uint64_t head;
+	struct trace_rec rec[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *trace_rings;
+static int trace_tids;
+static pthread_key_t trace_key;
+static uint64_t trace_epoch;
+static volatile bool trace_dump_pending;
+
+/* Host minus device clock in ns for each GPU, INT64_MAX until first seen */
+static volatile int64_t trace_clk_off[MAX_GPUDEVICES];
+
+static uint64_t trace_clock(void)
+{
+	struct timeval tv;
+
+	cgtime(&tv);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void trace_ring_release(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	ring->in_use = 0;
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring = pthread_getspecific(trace_key);
+
+	if (likely(ring))
+		return ring;
+
+	for (ring = trace_rings; ring; ring = ring->next) {
+		if (__sync_bool_compare_and_swap(&ring->in_use, 0, 1))
+			goto out;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (unlikely(!ring))
+		return NULL;
+	ring->in_use = 1;
+	ring->tid = TRACE_TID_BASE + __sync_fetch_and_add(&trace_tids, 1);
+	do {
+		ring->next = trace_rings;
+	} while (!__sync_bool_compare_and_swap(&trace_rings, ring->next, ring));
+out:
+	strcpy(ring->name, "thread");
+	pthread_setspecific(trace_key, ring);
+	return ring;
+}
+
+static void trace_add(const char *name, uint64_t ts, uint64_t dur, int dev)
+{
+	struct trace_ring *ring = trace_ring_get();
+	struct trace_rec *rec;
+	uint64_t head;
+
+	if (unlikely(!ring))
+		return;
+	head = ring->head;
+	rec = &ring->rec[head & TRACE_RING_MASK];
+	rec->name = name;
+	rec->ts = ts;
+	rec->dur = dur;
+	rec->dev = dev;
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
+void trace_init(void)
+{
+	int i;
+
+	if (!opt_trace)
+		return;
+	if (unlikely(pthread_key_create(&trace_key, trace_ring_release))) {
+		applog(LOG_WARNING, "Failed to create trace key, tracing disabled");
+		opt_trace = false;
+		return;
+	}
+	for (i = 0; i < MAX_GPUDEVICES; i++)
+		trace_clk_off[i] = INT64_MAX;
+	trace_epoch = trace_clock();
+}
+
+/* Start time for a span, in microseconds since tracing started */
+uint64_t trace_now(void)
+{
+	if (!opt_trace)
+		return 0;
+	return trace_clock() - trace_epoch;
+}
+
+void trace_span(const char *name, uint64_t start)
+{
+	uint64_t now;
+
+	if (!opt_trace)
+		return;
+	now = trace_now();
+	trace_add(name, start, now > start ? now - start : 0, -1);
+}
+
+/* Record a device side span from OpenCL profiling counters. host is
+ * trace_now() taken just after the command was seen to complete, so the
+ * smallest host - end difference seen is the best estimate of the offset
+ * between the two clocks. */
+void trace_device(int dev, const char *name, uint64_t start_ns, uint64_t end_ns, uint64_t host)
+{
+	int64_t off, cur, start;
+
+	if (!opt_trace || dev < 0 || dev >= MAX_GPUDEVICES || end_ns < start_ns)
+		return;
+
+	off = (int64_t)(host * 1000) - (int64_t)end_ns;
+	do {
+		cur = trace_clk_off[dev];
+		if (off >= cur)
+			break;
+	} while (!__sync_bool_compare_and_swap(&trace_clk_off[dev], cur, off));
+	if (off > cur)
+		off = cur;
+
+	start = ((int64_t)start_ns + off) / 1000;
+	if (start < 0)
+		start = 0;
+	trace_add(name, start, (end_ns - start_ns) / 1000, dev);
+}
+
+void trace_thread_name(const char *name)
+{
+	struct trace_ring *ring;
+
+	if (!opt_trace)
+		return;
+	ring = trace_ring_get();
+	if (ring) {
+		strncpy(ring->name, name, TRACE_NAMESIZ - 1);
+		ring->name[TRACE_NAMESIZ - 1] = '\0';
+	}
+}
+
+static void trace_dump_ring(FILE *f, struct trace_ring *ring, struct trace_rec *buf, int *events)
+{
+	uint64_t head, first, last, i;
+
+	head = ring->head;
+	__sync_synchronize();
+	first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for (i = first; i < head; i++)
+		buf[i & TRACE_RING_MASK] = ring->rec[i & TRACE_RING_MASK];
+	__sync_synchronize();
+
+	/* Anything the thread may have overwritten while we copied is stale */
+	last = ring->head;
+	if (last >= TRACE_RING_SIZE && first <= last - TRACE_RING_SIZE)
+		first = last - TRACE_RING_SIZE + 1;
+
+	for (i = first; i < head; i++) {
+		struct trace_rec *rec = &buf[i & TRACE_RING_MASK];
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%"PRIu64",\"dur\":%"PRIu64"}",
+			rec->name, rec->dev < 0 ? "host" : "gpu",
+			rec->dev < 0 ? ring->tid : rec->dev, rec->ts, rec->dur);
+		(*events)++;
+	}
+}
+
+/* Write the rings out as Chrome trace JSON, returning the number of events
+ * written or -1 on failure. GPU tracks use the device id as tid, host threads
+ * start at TRACE_TID_BASE. */
+int trace_dump(const char *filename)
+{
+	struct trace_ring *ring;
+	struct trace_rec *buf;
+	int events = 0;
+	FILE *f;
+	int i;
+
+	if (!opt_trace)
+		return -1;
+
+	buf = malloc(sizeof(struct trace_rec) * TRACE_RING_SIZE);
+	if (unlikely(!buf))
+		return -1;
+	f = fopen(filename, "w");
+	if (!f) {
+		free(buf);
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s %s\"}}",
+		PACKAGE, VERSION);
+	for (i = 0; i < nDevs && i < MAX_GPUDEVICES; i++) {
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"name\":\"GPU %d\"}}", i, i);
+	}
+	for (ring = trace_rings; ring; ring = ring->next) {
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s %d\"}}", ring->tid, ring->name, ring->tid);
+	}
+	for (ring = trace_rings; ring; ring = ring->next)
+		trace_dump_ring(f, ring, buf, &events);
+	fprintf(f, "\n]}\n");
+
+	free(buf);
+	if (fclose(f))
+		return -1;
+	return events;
+}
+
+void trace_default_file(char *filename, size_t len)
+{
+	snprintf(filename, len, "%s-trace-%ld.json", PACKAGE, (long)time(NULL));
+}
+
+/* Safe to call from a signal handler, the dump itself happens in trace_poll */
+void trace_request_dump(void)
+{
+	trace_dump_pending = true;
+}
+
+void trace_poll(void)
+{
+	char filename[64];
+	int events;
+
+	if (!trace_dump_pending)
+		return;
+	trace_dump_pending = false;
+
+	trace_default_file(filename, sizeof(filename));
+	events = trace_dump(filename);
+	if (events < 0)
+		applog(LOG_WARNING, "Failed to write trace to %s", filename);
+	else
+		applog(LOG_NOTICE, "Wrote %d trace events to %s", events, filename);
+}
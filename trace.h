@@ -0,0 +1,20 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+extern bool opt_trace;
+
+extern void trace_init(void);
+extern uint64_t trace_now(void);
+extern void trace_span(const char *name, uint64_t start);
+extern void trace_device(int dev, const char *name, uint64_t start_ns, uint64_t end_ns, uint64_t host);
+extern void trace_thread_name(const char *name);
+extern void trace_default_file(char *filename, size_t len);
+extern int trace_dump(const char *filename);
+extern void trace_request_dump(void);
+extern void trace_poll(void);
+
+#endif /* __TRACE_H__ */
@@ -41,6 +41,7 @@
 #include "elist.h"
 #include "compat.h"
 #include "util.h"
+#include "trace.h"
 
 bool successful_connect = false;
 struct timeval nettime;
@@ -65,11 +66,6 @@ struct header_info {
 	bool		hadexpire;
 };
 
-struct tq_ent {
-	void			*data;
-	struct list_head	q_node;
-};
-
 static void databuf_free(struct data_buffer *db)
 {
 	if (!db)
@@ -574,12 +570,25 @@ char *get_proxy(char *url, struct pool *pool)
 	return url;
 }
 
+/* Writes the hex string of a binary value of arbitrary length to s, which
+ * must have room for len * 2 + 1 bytes */
+void __bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		s[i * 2] = hex[p[i] >> 4];
+		s[i * 2 + 1] = hex[p[i] & 0xf];
+	}
+	s[len * 2] = '\0';
+}
+
 /* Returns a malloced array string of a binary value of arbitrary length. The
  * array is rounded up to a 4 byte size to appease architectures that need
  * aligned array  sizes */
 char *bin2hex(const unsigned char *p, size_t len)
 {
-	unsigned int i;
 	ssize_t slen;
 	char *s;
 
@@ -590,8 +599,7 @@ char *bin2hex(const unsigned char *p, size_t len)
 	if (unlikely(!s))
 		quit(1, "Failed to calloc in bin2hex");
 
-	for (i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	__bin2hex(s, p, len);
 
 	return s;
 }
@@ -677,113 +685,6 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 	return rc;
 }
 
-struct thread_q *tq_new(void)
-{
-	struct thread_q *tq;
-
-	tq = calloc(1, sizeof(*tq));
-	if (!tq)
-		return NULL;
-
-	INIT_LIST_HEAD(&tq->q);
-	pthread_mutex_init(&tq->mutex, NULL);
-	pthread_cond_init(&tq->cond, NULL);
-
-	return tq;
-}
-
-void tq_free(struct thread_q *tq)
-{
-	struct tq_ent *ent, *iter;
-
-	if (!tq)
-		return;
-
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
-	pthread_cond_destroy(&tq->cond);
-	pthread_mutex_destroy(&tq->mutex);
-
-	memset(tq, 0, sizeof(*tq));	/* poison */
-	free(tq);
-}
-
-static void tq_freezethaw(struct thread_q *tq, bool frozen)
-{
-	mutex_lock(&tq->mutex);
-	tq->frozen = frozen;
-	pthread_cond_signal(&tq->cond);
-	mutex_unlock(&tq->mutex);
-}
-
-void tq_freeze(struct thread_q *tq)
-{
-	tq_freezethaw(tq, true);
-}
-
-void tq_thaw(struct thread_q *tq)
-{
-	tq_freezethaw(tq, false);
-}
-
-bool tq_push(struct thread_q *tq, void *data)
-{
-	struct tq_ent *ent;
-	bool rc = true;
-
-	ent = calloc(1, sizeof(*ent));
-	if (!ent)
-		return false;
-
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
-
-	mutex_lock(&tq->mutex);
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
-		free(ent);
-		rc = false;
-	}
-	pthread_cond_signal(&tq->cond);
-	mutex_unlock(&tq->mutex);
-
-	return rc;
-}
-
-void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
-{
-	struct tq_ent *ent;
-	void *rval = NULL;
-	int rc;
-
-	mutex_lock(&tq->mutex);
-	if (!list_empty(&tq->q))
-		goto pop;
-
-	if (abstime)
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	else
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
-
-	list_del(&ent->q_node);
-	free(ent);
-out:
-	mutex_unlock(&tq->mutex);
-
-	return rval;
-}
-
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	cgsem_init(&thr->sem);
@@ -901,6 +802,79 @@ double tdiff(struct timeval *end, struct timeval *start)
 	return end->tv_sec - start->tv_sec + (end->tv_usec - start->tv_usec) / 1000000.0;
 }
 
+static int latency_bucket(uint32_t us)
+{
+	int msb, shift;
+
+	if (us < LATENCY_SUB_BUCKETS)
+		return us;
+	msb = 31 - __builtin_clz(us);
+	shift = msb - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + (us >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+/* Returns the highest value that maps to the bucket */
+static uint32_t latency_bucket_max(int bucket)
+{
+	int shift;
+
+	if (bucket < LATENCY_SUB_BUCKETS)
+		return bucket;
+	shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	return (((uint32_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS)) << shift) +
+		(1U << shift) - 1;
+}
+
+/* Can be called concurrently from any thread */
+void latency_add(struct latency_hist *hist, double us)
+{
+	uint32_t val, max;
+
+	if (us < 0)
+		us = 0;
+	val = us > 0xffffffff ? 0xffffffff : (uint32_t)us;
+
+	__sync_fetch_and_add(&hist->counts[latency_bucket(val)], 1);
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&hist->sum_us, val);
+	do {
+		max = hist->max_us;
+		if (val <= max)
+			break;
+	} while (!__sync_bool_compare_and_swap(&hist->max_us, max, val));
+}
+
+/* Returns the value in microseconds that pct percent of samples are at or
+ * below, to the precision of the bucket they fall in */
+uint32_t latency_percentile(struct latency_hist *hist, double pct)
+{
+	uint64_t total = 0, target, seen = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		total += hist->counts[i];
+	if (!total)
+		return 0;
+
+	target = (uint64_t)(total * pct / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= target) {
+			uint32_t val = latency_bucket_max(i);
+
+			return val < hist->max_us ? val : hist->max_us;
+		}
+	}
+	return hist->max_us;
+}
+
+void latency_reset(struct latency_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
+
 bool extract_sockaddr(struct pool *pool, char *url)
 {
 	char *url_begin, *url_end, *ipv6_begin, *ipv6_end, *port_start = NULL;
@@ -1195,6 +1169,107 @@ static char *json_array_string(json_t *val, unsigned int entry)
 	return NULL;
 }
 
+/* Work generation and stale checks read the current job from an immutable
+ * snapshot instead of pool->swork, so they never take data_lock. A reader
+ * counts itself into one of two epochs for the few instructions it takes to
+ * grab a reference. A writer swaps in the new job, moves readers on to the
+ * other epoch and waits for the old epoch to drain before dropping the old
+ * job, which is freed once its last reader puts it. */
+static void stratum_job_free(struct stratum_job *job)
+{
+	free(job->job_id);
+	free(job->ntime);
+	free(job->nonce1);
+	free(job->coinbase);
+	free(job->merkle);
+	free(job);
+}
+
+struct stratum_job *stratum_job_get(struct pool *pool)
+{
+	struct stratum_job *job;
+	unsigned int epoch;
+
+	for (;;) {
+		epoch = pool->job_epoch;
+		__sync_fetch_and_add(&pool->job_readers[epoch & 1], 1);
+		if (likely(epoch == pool->job_epoch))
+			break;
+		__sync_fetch_and_sub(&pool->job_readers[epoch & 1], 1);
+	}
+	job = pool->job;
+	if (job)
+		__sync_fetch_and_add(&job->refs, 1);
+	__sync_fetch_and_sub(&pool->job_readers[epoch & 1], 1);
+
+	return job;
+}
+
+void stratum_job_put(struct stratum_job *job)
+{
+	if (job && !__sync_sub_and_fetch(&job->refs, 1))
+		stratum_job_free(job);
+}
+
+/* Builds a job from pool->swork, nonce1 and n2size and makes it current.
+ * Must be entered under data_lock write. */
+static void stratum_publish(struct pool *pool, bool clean)
+{
+	struct stratum_work *swork = &pool->swork;
+	struct stratum_job *job, *old = pool->job;
+	unsigned int epoch;
+	char *hex;
+	int i;
+
+	if (!swork->job_id || !pool->nonce1)
+		return;
+
+	job = calloc(1, sizeof(*job));
+	if (unlikely(!job))
+		quit(1, "Failed to calloc stratum_job in stratum_publish");
+	job->refs = 1;
+	job->job_id = strdup(swork->job_id);
+	job->ntime = strdup(swork->ntime);
+	job->nonce1 = strdup(pool->nonce1);
+	job->diff = swork->diff;
+	job->n2size = pool->n2size;
+	/* The counter lives on the pool so a re-publish of the same job keeps
+	 * counting while readers of the old snapshot still take from it. Start
+	 * afresh only when the pool asks to. */
+	if (clean)
+		pool->job_nonce2 = 0;
+
+	job->nonce2_off = swork->cb1_len + pool->n1_len;
+	job->cb_len = job->nonce2_off + pool->n2size + swork->cb2_len;
+	job->coinbase = calloc(job->cb_len, 1);
+	job->merkle = calloc(swork->merkles ? swork->merkles : 1, 32);
+	hex = calloc(swork->header_len, 1);
+	if (unlikely(!job->coinbase || !job->merkle || !hex))
+		quit(1, "Failed to calloc stratum_job buffers in stratum_publish");
+	hex2bin(job->coinbase, swork->coinbase1, swork->cb1_len);
+	hex2bin(job->coinbase + swork->cb1_len, pool->nonce1, pool->n1_len);
+	hex2bin(job->coinbase + job->nonce2_off + pool->n2size, swork->coinbase2, swork->cb2_len);
+	for (i = 0; i < swork->merkles; i++)
+		hex2bin(job->merkle + i * 32, swork->merkle[i], 32);
+	job->merkles = swork->merkles;
+
+	sprintf(hex, "%s%s%064d%s%s%s", swork->bbversion, swork->prev_hash, 0,
+		swork->ntime, swork->nbit, "00000000");
+	job->merkle_off = (strlen(swork->bbversion) + strlen(swork->prev_hash)) / 2;
+	job->header_len = MIN(strlen(hex) / 2, sizeof(job->header));
+	job->header_ok = hex2bin(job->header, hex, job->header_len);
+	free(hex);
+
+	pool->job = job;
+	__sync_synchronize();
+	epoch = pool->job_epoch;
+	pool->job_epoch = epoch + 1;
+	__sync_synchronize();
+	while (pool->job_readers[epoch & 1])
+		sched_yield();
+	stratum_job_put(old);
+}
+
 static bool parse_notify(struct pool *pool, json_t *val)
 {
 	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
@@ -1264,8 +1339,6 @@ static bool parse_notify(struct pool *pool, json_t *val)
 			pool->swork.merkle[i] = json_array_string(arr, i);
 	}
 	pool->swork.merkles = merkles;
-	if (clean)
-		pool->nonce2 = 0;
 	pool->swork.header_len = strlen(pool->swork.bbversion) +
 				 strlen(pool->swork.prev_hash) +
 				 strlen(pool->swork.ntime) +
@@ -1275,6 +1348,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	/* workpadding */	 96;
 	pool->swork.header_len = pool->swork.header_len * 2 + 1;
 	align_len(&pool->swork.header_len);
+	stratum_publish(pool, clean);
 	cg_wunlock(&pool->data_lock);
 
 	if (opt_protocol) {
@@ -1309,6 +1383,7 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	cg_wlock(&pool->data_lock);
 	old_diff = pool->swork.diff;
 	pool->swork.diff = diff;
+	stratum_publish(pool, false);
 	cg_wunlock(&pool->data_lock);
 
 	if (old_diff != diff) {
@@ -1706,6 +1781,8 @@ resend:
 	pool->nonce1 = nonce1;
 	pool->n1_len = strlen(nonce1) / 2;
 	pool->n2size = n2size;
+	pool->swork.diff = 1;
+	stratum_publish(pool, false);
 	cg_wunlock(&pool->data_lock);
 
 	if (sessionid)
@@ -1720,7 +1797,6 @@ out:
 		if (!pool->stratum_url)
 			pool->stratum_url = pool->sockaddr_url;
 		pool->stratum_active = true;
-		pool->swork.diff = 1;
 		if (opt_protocol) {
 			applog(LOG_DEBUG, "Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d",
 			       pool->pool_no, pool->nonce1, pool->n2size);
@@ -1866,6 +1942,7 @@ void RenameThread(const char* name)
 	// Prevent warnings for unused parameters...
 	(void)name;
 #endif
+	trace_thread_name(name);
 }
 
 /* cgminer specific wrappers for true unnamed semaphore usage on platforms
@@ -2,6 +2,7 @@
 #define __UTIL_H__
 
 #include <semaphore.h>
+#include <stdint.h>
 
 #if defined(unix) || defined(__APPLE__)
 	#include <errno.h>
@@ -64,6 +65,20 @@ typedef struct cgsem cgsem_t;
 typedef sem_t cgsem_t;
 #endif
 
+/* Log-linear latency histogram in microseconds. Values are bucketed with
+ * LATENCY_SUB_BITS of precision per power of two (12.5%), similar to an
+ * HdrHistogram, and updates are lock free. */
+#define LATENCY_SUB_BITS	3
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS		((32 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_hist {
+	uint32_t counts[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint32_t max_us;
+};
+
 struct thr_info;
 struct pool;
 enum dev_reason;
@@ -80,9 +95,14 @@ bool time_less(struct timeval *a, struct timeval *b);
 void copy_time(struct timeval *dest, const struct timeval *src);
 double us_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
+void latency_add(struct latency_hist *hist, double us);
+uint32_t latency_percentile(struct latency_hist *hist, double pct);
+void latency_reset(struct latency_hist *hist);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
+struct stratum_job *stratum_job_get(struct pool *pool);
+void stratum_job_put(struct stratum_job *job);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(struct pool *pool, char *url);
 bool auth_stratum(struct pool *pool);
@@ -0,0 +1,251 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ *
+ * Caching allocator for struct work. Freed work goes onto a small per thread
+ * cache and is handed back out by the next make_work() on that thread. Work
+ * is mostly made on one thread (getwork, stratum, the stage thread) and
+ * freed on another (mining and submit threads), so caches that grow past
+ * WORK_CACHE_MAX pass a batch to a shared depot, and empty ones refill from
+ * it, taking the depot lock once per batch rather than once per work.
+ *
+ * The job_id, nonce1, nonce2, ntime and GBT coinbase strings are carved out
+ * of WORK_STRBUF bytes of storage inside the work itself when they fit, so
+ * generating, cloning and submitting stratum work allocates nothing once the
+ * caches are warm.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "work-pool.h"
+
+#define WORK_CACHE_MAX	64	/* Per thread, before a batch goes to the depot */
+#define WORK_DEPOT_BATCH 32
+#define WORK_DEPOT_MAX	1024	/* Beyond which work is freed */
+
+/* Free work is linked through its first bytes */
+#define WORK_NEXT(work)	(*(struct work **)(work))
+
+struct work_cache {
+	struct work *head;
+	int count;
+};
+
+static pthread_key_t work_key;
+static bool work_key_ok;
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work *depot;
+static int depot_count;
+
+static uint64_t stat_cached, stat_depot, stat_allocated;
+static uint64_t stat_str_inline, stat_str_heap;
+
+/* Move up to count work from the head of *from onto *to */
+static int work_list_move(struct work **from, struct work **to, int count)
+{
+	struct work *work;
+	int moved = 0;
+
+	while (moved < count && *from) {
+		work = *from;
+		*from = WORK_NEXT(work);
+		WORK_NEXT(work) = *to;
+		*to = work;
+		moved++;
+	}
+	return moved;
+}
+
+static void depot_put(struct work **list, int count)
+{
+	struct work *work;
+	int moved;
+
+	mutex_lock(&depot_lock);
+	moved = work_list_move(list, &depot, MIN(count, WORK_DEPOT_MAX - depot_count));
+	depot_count += moved;
+	mutex_unlock(&depot_lock);
+
+	while (moved < count && *list) {
+		work = *list;
+		*list = WORK_NEXT(work);
+		free(work);
+		moved++;
+	}
+}
+
+/* Returns what a thread leaves in its cache to the depot when it exits */
+static void work_cache_release(void *arg)
+{
+	struct work_cache *cache = arg;
+
+	depot_put(&cache->head, cache->count);
+	free(cache);
+}
+
+void work_pool_init(void)
+{
+	if (unlikely(pthread_key_create(&work_key, work_cache_release)))
+		applog(LOG_WARNING, "Failed to create work cache key, work will not be cached");
+	else
+		work_key_ok = true;
+}
+
+static struct work_cache *work_cache(void)
+{
+	struct work_cache *cache;
+
+	if (unlikely(!work_key_ok))
+		return NULL;
+	cache = pthread_getspecific(work_key);
+	if (unlikely(!cache)) {
+		cache = calloc(1, sizeof(*cache));
+		if (unlikely(!cache))
+			return NULL;
+		pthread_setspecific(work_key, cache);
+	}
+	return cache;
+}
+
+/* Returns zeroed work */
+struct work *work_pool_get(void)
+{
+	struct work_cache *cache = work_cache();
+	struct work *work;
+
+	if (likely(cache)) {
+		if (cache->count) {
+			__sync_fetch_and_add(&stat_cached, 1);
+			goto cached;
+		}
+		mutex_lock(&depot_lock);
+		cache->count = work_list_move(&depot, &cache->head, WORK_DEPOT_BATCH);
+		depot_count -= cache->count;
+		mutex_unlock(&depot_lock);
+		if (cache->count) {
+			__sync_fetch_and_add(&stat_depot, 1);
+			goto cached;
+		}
+	}
+
+	__sync_fetch_and_add(&stat_allocated, 1);
+	work = calloc(1, sizeof(struct work));
+	if (unlikely(!work))
+		quit(1, "Failed to calloc work in work_pool_get");
+	return work;
+
+cached:
+	work = cache->head;
+	cache->head = WORK_NEXT(work);
+	cache->count--;
+	memset(work, 0, sizeof(struct work));
+	return work;
+}
+
+/* Takes work that has been through clean_work() */
+void work_pool_put(struct work *work)
+{
+	struct work_cache *cache = work_cache();
+	struct work *batch = NULL;
+
+	if (unlikely(!cache)) {
+		free(work);
+		return;
+	}
+
+	WORK_NEXT(work) = cache->head;
+	cache->head = work;
+	if (++cache->count <= WORK_CACHE_MAX)
+		return;
+
+	cache->count -= work_list_move(&cache->head, &batch, WORK_DEPOT_BATCH);
+	depot_put(&batch, WORK_DEPOT_BATCH);
+}
+
+static bool work_str_inline(const struct work *work, const char *s)
+{
+	return s >= work->strbuf && s < work->strbuf + WORK_STRBUF;
+}
+
+/* Room for len bytes in work's string storage, or NULL */
+static char *work_stralloc(struct work *work, size_t len)
+{
+	char *s;
+
+	if (len > (size_t)(WORK_STRBUF - work->strbuf_len)) {
+		__sync_fetch_and_add(&stat_str_heap, 1);
+		return NULL;
+	}
+	__sync_fetch_and_add(&stat_str_inline, 1);
+	s = work->strbuf + work->strbuf_len;
+	work->strbuf_len += len;
+	return s;
+}
+
+char *work_strdup(struct work *work, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *dup = work_stralloc(work, len);
+
+	if (!dup) {
+		dup = strdup(s);
+		if (unlikely(!dup))
+			quit(1, "Failed to strdup in work_strdup");
+		return dup;
+	}
+	memcpy(dup, s, len);
+	return dup;
+}
+
+char *work_bin2hex(struct work *work, const unsigned char *p, size_t len)
+{
+	char *s = work_stralloc(work, len * 2 + 1);
+
+	if (!s)
+		return bin2hex(p, len);
+	__bin2hex(s, p, len);
+	return s;
+}
+
+void work_strfree(struct work *work, char *s)
+{
+	if (!work_str_inline(work, s))
+		free(s);
+}
+
+static char *work_strcopy(struct work *work, const struct work *base, const char *s)
+{
+	if (!s)
+		return NULL;
+	if (work_str_inline(base, s)) {
+		__sync_fetch_and_add(&stat_str_inline, 1);
+		return work->strbuf + (s - base->strbuf);
+	}
+	return work_strdup(work, s);
+}
+
+/* Gives work, a memcpy of base, its own copies of base's strings */
+void work_copy_strs(struct work *work, const struct work *base)
+{
+	work->job_id = work_strcopy(work, base, base->job_id);
+	work->nonce1 = work_strcopy(work, base, base->nonce1);
+	work->nonce2 = work_strcopy(work, base, base->nonce2);
+	work->ntime = work_strcopy(work, base, base->ntime);
+	work->gbt_coinbase = work_strcopy(work, base, base->gbt_coinbase);
+}
+
+void work_pool_stats(struct work_pool_stats *stats)
+{
+	stats->cached = stat_cached;
+	stats->depot = stat_depot;
+	stats->allocated = stat_allocated;
+	stats->str_inline = stat_str_inline;
+	stats->str_heap = stat_str_heap;
+}
@@ -0,0 +1,27 @@
+#ifndef __WORK_POOL_H__
+#define __WORK_POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct work;
+
+struct work_pool_stats {
+	uint64_t cached;	/* Work structs reused from a thread's cache */
+	uint64_t depot;		/* Reused after refilling the cache from the depot */
+	uint64_t allocated;	/* Work structs that had to be calloced */
+	uint64_t str_inline;	/* Strings held in the work's own storage */
+	uint64_t str_heap;	/* Strings too long for it */
+};
+
+extern void work_pool_init(void);
+extern struct work *work_pool_get(void);
+extern void work_pool_put(struct work *work);
+extern char *work_strdup(struct work *work, const char *s);
+extern char *work_bin2hex(struct work *work, const unsigned char *p, size_t len);
+extern void work_strfree(struct work *work, char *s);
+extern void work_copy_strs(struct work *work, const struct work *base);
+extern void work_pool_stats(struct work_pool_stats *stats);
+
+#endif /* __WORK_POOL_H__ */
@@ -52,6 +52,14 @@
 #include "bench_block.h"
 #include "scrypt.h"
 #include "scrypt-jane.h"
+#include "metrics.h"
+#include "trace.h"
+#include "bench.h"
+#include "autotune.h"
+#include "dyntune.h"
+#include "nonce.h"
+#include "work-pool.h"
+#include "affinity.h"
 
 #ifdef USE_AVALON
 #include "driver-avalon.h"
@@ -92,6 +100,7 @@ const int opt_cutofftemp = 95;
 int opt_log_interval = 5;
 int opt_queue = 1;
 int opt_scantime = 120;
+int opt_fresh_work_wait;
 int opt_expiry = 120;
 static const bool opt_time = true;
 unsigned long long global_hashrate;
@@ -116,6 +125,8 @@ bool opt_scrypt_chacha_84=true;
 bool opt_scrypt_split_kernels=true;
 bool opt_use_system_ram=false;  // Use system RAM for additional padbuffer8_RAM buffers
 bool opt_limit_ram_buffer=false;  // Limit RAM buffer size to max_alloc
+bool opt_mixed_lookup_gap=false;  // Fill leftover VRAM with smaller lookup gap groups
+bool opt_interleave_ram=false;  // Spread system RAM padbuffer groups among the VRAM ones
 int opt_reserve_vram=0;  // Reserve VRAM in MB (0 = disabled)
 int opt_reserve_ram=1024;  // Reserve system RAM in MB per GPU (default: 1024 MB)
 int opt_fixed_nfactor=21;
@@ -159,6 +170,8 @@ char *opt_api_description = PACKAGE_STRING;
 int opt_api_port = 4028;
 bool opt_api_listen;
 bool opt_api_network;
+int opt_metrics_port;
+bool opt_metrics_network;
 bool opt_delaynet;
 bool opt_disable_pool;
 char *opt_icarus_options = NULL;
@@ -193,6 +206,7 @@ static int input_thr_id;
 #endif
 int gpur_thr_id;
 static int api_thr_id;
+static int metrics_thr_id;
 #ifdef USE_USBUTILS
 static int usbres_thr_id;
 static int hotplug_thr_id;
@@ -227,7 +241,6 @@ pthread_mutex_t restart_lock;
 pthread_cond_t restart_cond;
 
 pthread_cond_t gws_cond;
-pthread_cond_t fresh_work_cond;
 static bool fresh_work_requested = false;
 
 double total_mhashes_done;
@@ -248,6 +261,30 @@ unsigned int found_blocks;
 unsigned int local_work;
 unsigned int total_go, total_ro;
 
+/* Counters published for the API, written only under hash_lock */
+static seqlock_t stats_seq;
+static struct stats_snapshot stats_snap;
+
+const char *share_stage_names[SS_MAX] = {
+	"Found",
+	"Verify",
+	"Queue",
+	"Network",
+	"Total",
+};
+
+const char *kernel_stage_names[KS_MAX] = {
+	"part1",
+	"part2",
+	"part3",
+	"search",
+};
+
+const char *pad_class_names[PC_MAX] = {
+	"vram",
+	"ram",
+};
+
 struct pool **pools;
 static struct pool *currentpool = NULL;
 
@@ -603,6 +640,11 @@ static char *set_int_1_to_65535(const char *arg, int *i)
 	return set_int_range(arg, i, 1, 65535);
 }
 
+static char *set_int_0_to_65535(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 65535);
+}
+
 static char *set_int_0_to_10(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 0, 10);
@@ -1114,6 +1156,9 @@ unsigned char GetNfactor(unsigned int nTimestamp, int minn, int maxn, long start
 
 /* These options are available from config file or commandline */
 static struct opt_table opt_config_table[] = {
+	OPT_WITH_ARG("--affinity",
+		     set_affinity, NULL, NULL,
+		     "Place GPU miner threads and buffers on the GPU's NUMA node: none or auto (from sysfs PCI locality)"),
 	OPT_WITH_ARG("--api-allow",
 		     set_api_allow, NULL, NULL,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
@@ -1145,7 +1190,21 @@ static struct opt_table opt_config_table[] = {
 		     "Change multipool strategy from failover to even share balance"),
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
-			"Run cgminer in benchmark mode - produces no shares"),
+			"Run cgminer in benchmark mode - scrypt-chacha mines generated work, otherwise produces no shares"),
+#ifdef USE_SCRYPT
+	OPT_WITH_ARG("--benchmark-diff",
+		     opt_set_floatval, opt_show_floatval, &opt_bench_diff,
+		     "Share difficulty of scrypt-chacha benchmark work, below 1 for more shares"),
+	OPT_WITH_ARG("--benchmark-ntime",
+		     opt_set_uintval, opt_show_uintval, &opt_bench_ntime,
+		     "Timestamp of scrypt-chacha benchmark work, selects the Nfactor with --fixed-nfactor 0"),
+	OPT_WITH_ARG("--benchmark-report",
+		     opt_set_charp, NULL, &opt_bench_report,
+		     "File to write the JSON benchmark report to on exit, default: standard output"),
+	OPT_WITH_ARG("--benchmark-time",
+		     set_int_0_to_9999, opt_show_intval, &opt_bench_time,
+		     "Seconds to run the benchmark for before exiting, 0 = until stopped"),
+#endif
 #if defined(USE_BITFORCE)
 	OPT_WITHOUT_ARG("--bfl-range",
 			opt_set_bool, &opt_bfl_noncerange,
@@ -1187,7 +1246,13 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--fix-protocol",
 			opt_set_bool, &opt_fix_protocol,
 			"Do not redirect to a different getwork protocol (eg. stratum)"),
+	OPT_WITH_ARG("--fresh-work-wait",
+		     set_int_0_to_9999, opt_show_intval, &opt_fresh_work_wait,
+		     "Milliseconds to wait for new work after finding a share if none is ready, 0 = keep hashing the current work"),
 #ifdef HAVE_OPENCL
+	OPT_WITH_ARG("--gpu-cpus",
+		     set_gpu_cpus, NULL, NULL,
+		     "CPUs for each GPU's miner threads - one list for all or separate by commas for per card, ranges joined by : (e.g. 0-3:8-11,4-7:12-15)"),
 	OPT_WITH_ARG("--gpu-dyninterval",
 		     set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
 		     "Set the refresh interval in ms for GPUs using dynamic intensity"),
@@ -1232,6 +1297,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--lookup-gap",
 		     set_lookup_gap, NULL, NULL,
 		     "Set GPU lookup gap for scrypt mining, comma separated"),
+	OPT_WITH_ARG("--pad-layout",
+		     set_pad_layout, NULL, NULL,
+		     "Set GPU scratchpad layout for scrypt mining (row, interleave or block), comma separated"),
 #endif
 	OPT_WITH_ARG("--intensity|-I",
 		     set_intensity, NULL, NULL,
@@ -1291,6 +1359,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
+	OPT_WITHOUT_ARG("--log-sync",
+			opt_set_bool, &opt_log_sync,
+			"Write log messages from the calling thread instead of the background log writer"),
 	OPT_WITHOUT_ARG("--lowmem",
 			opt_set_bool, &opt_lowmem,
 			"Minimise caching of shares for low memory applications"),
@@ -1299,6 +1370,12 @@ static struct opt_table opt_config_table[] = {
 		     opt_set_charp, NULL, &opt_stderr_cmd,
 		     "Use custom pipe cmd for output messages"),
 #endif // defined(unix)
+	OPT_WITH_ARG("--metrics-port",
+		     set_int_0_to_65535, opt_show_intval, &opt_metrics_port,
+		     "Port to serve OpenMetrics/Prometheus counters on over HTTP, 0 = disabled"),
+	OPT_WITHOUT_ARG("--metrics-network",
+			opt_set_bool, &opt_metrics_network,
+			"Allow the metrics exporter (if enabled) to listen on any address, default: only 127.0.0.1"),
 	OPT_WITHOUT_ARG("--net-delay",
 			opt_set_bool, &opt_delaynet,
 			"Impose small delays in networking to not overload slow routers"),
@@ -1397,12 +1474,30 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--scrypt-chacha-84",
 			set_scrypt_chacha_84, NULL,
 			"Use the scrypt-chacha algorithm for mining with 84-byte block headers (8-byte timestamp)"),
+	OPT_WITHOUT_ARG("--auto-tune",
+			opt_set_bool, &opt_autotune,
+			"Time lookup gap, thread concurrency, worksize and kernel split choices on each GPU and cache the fastest"),
+	OPT_WITH_ARG("--tune-file",
+		     opt_set_charp, NULL, &opt_tune_file,
+		     "Tuning cache used by --auto-tune, default: yacminer.tune"),
+	OPT_WITH_ARG("--tune-time",
+		     set_int_1_to_65535, opt_show_intval, &opt_tune_time,
+		     "Seconds each --auto-tune candidate is timed for"),
+	OPT_WITH_ARG("--scan-latency",
+		     set_int_0_to_9999, opt_show_intval, &opt_scan_latency,
+		     "Longest scan in ms the scrypt-chacha launch size controller may pick at dynamic intensity, 0 = no limit"),
 	OPT_WITHOUT_ARG("--scrypt-monolithic-kernels",
 			opt_set_invbool, &opt_scrypt_split_kernels,
 			"Disable split kernels and use monolithic kernels instead (for scrypt-chacha-84 only)"),
 	OPT_WITHOUT_ARG("--use-system-ram",
 			opt_set_bool, &opt_use_system_ram,
 			"Use system RAM for additional padbuffer8_RAM buffers (distributed equally among GPUs)"),
+	OPT_WITHOUT_ARG("--interleave-ram-groups",
+			opt_set_bool, &opt_interleave_ram,
+			"Spread --use-system-ram work-groups evenly among the VRAM ones instead of running them first"),
+	OPT_WITHOUT_ARG("--mixed-lookup-gap",
+			opt_set_bool, &opt_mixed_lookup_gap,
+			"Use leftover VRAM to run some work-groups at a smaller lookup gap (scrypt-chacha only)"),
 	OPT_WITHOUT_ARG("--limit-ram-buffer",
 			opt_set_bool, &opt_limit_ram_buffer,
 			"Limit RAM buffer size to max_alloc (disabled by default)"),
@@ -1429,6 +1524,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--starttime",
 			set_starttime, NULL, NULL,
 			"Set nStartTime for mining scrypt-jane and N-Scrypt coins"),
+	OPT_WITH_ARG("--sub-batches",
+		     set_sub_batches, NULL, NULL,
+		     "Launches to split each scrypt-chacha scan into, 1-64, comma separated (default: 1)"),
 #endif
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
@@ -1464,6 +1562,9 @@ static struct opt_table opt_config_table[] = {
 		     set_thread_concurrency, NULL, NULL,
 		     "Set GPU thread concurrency for scrypt mining, comma separated"),
 #endif
+	OPT_WITHOUT_ARG("--trace",
+			opt_set_bool, &opt_trace,
+			"Record hot path timings for Chrome trace export (API tracedump or SIGUSR1)"),
 	OPT_WITH_ARG("--url|-o",
 		     set_url, NULL, NULL,
 		     "URL for bitcoin JSON-RPC server"),
@@ -1755,10 +1856,7 @@ static void calc_midstate(struct work *work)
 
 static struct work *make_work(void)
 {
-	struct work *work = calloc(1, sizeof(struct work));
-
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
+	struct work *work = work_pool_get();
 
 	cg_wlock(&control_lock);
 	work->id = total_work++;
@@ -1771,20 +1869,21 @@ static struct work *make_work(void)
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
-	free(work->nonce2);
-	free(work->ntime);
-	free(work->gbt_coinbase);
-	free(work->nonce1);
+	work_strfree(work, work->job_id);
+	work_strfree(work, work->nonce2);
+	work_strfree(work, work->ntime);
+	work_strfree(work, work->gbt_coinbase);
+	work_strfree(work, work->nonce1);
 	memset(work, 0, sizeof(struct work));
 }
 
 /* All dynamically allocated work structs should be freed here to not leak any
- * ram from arrays allocated within the work struct */
+ * ram from arrays allocated within the work struct. The struct itself goes
+ * back to the work pool for reuse. */
 void free_work(struct work *work)
 {
 	clean_work(work);
-	free(work);
+	work_pool_put(work);
 }
 
 /* Generate a GBT coinbase from the existing GBT variables stored. Must be
@@ -1958,13 +2057,13 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 
 	memcpy(work->target, pool->gbt_target, 32);
 
-	work->gbt_coinbase = bin2hex(pool->gbt_coinbase, pool->coinbase_len);
+	work->gbt_coinbase = work_bin2hex(work, pool->gbt_coinbase, pool->coinbase_len);
 
 	/* For encoding the block data on submission */
 	work->gbt_txns = pool->gbt_txns + 1;
 
 	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
+		work->job_id = work_strdup(work, pool->gbt_workid);
 	cg_runlock(&pool->gbt_lock);
 
 	memcpy(work->data + 4 + 32, merkleroot, 32);
@@ -2602,6 +2701,34 @@ static void reject_pool(struct pool *pool)
 static void restart_threads(void);
 static void wake_gws(void);
 
+/* Records how long each stage of a share took once the pool has replied */
+static void record_share_latency(const struct work *work)
+{
+	struct latency_hist *latency = work->pool->latency;
+	struct timeval now, *start;
+
+	cgtime(&now);
+
+	if (work->tv_kernel_done.tv_sec && work->tv_work_found.tv_sec)
+		latency_add(&latency[SS_FOUND], us_tdiff((struct timeval *)&work->tv_work_found,
+							  (struct timeval *)&work->tv_kernel_done));
+	if (work->tv_work_found.tv_sec && work->tv_verified.tv_sec)
+		latency_add(&latency[SS_VERIFY], us_tdiff((struct timeval *)&work->tv_verified,
+							   (struct timeval *)&work->tv_work_found));
+	if (work->tv_verified.tv_sec && work->tv_submitted.tv_sec)
+		latency_add(&latency[SS_QUEUE], us_tdiff((struct timeval *)&work->tv_submitted,
+							  (struct timeval *)&work->tv_verified));
+	if (work->tv_submitted.tv_sec)
+		latency_add(&latency[SS_NETWORK], us_tdiff(&now, (struct timeval *)&work->tv_submitted));
+
+	if (work->tv_kernel_done.tv_sec)
+		start = (struct timeval *)&work->tv_kernel_done;
+	else
+		start = (struct timeval *)&work->tv_work_found;
+	if (start->tv_sec)
+		latency_add(&latency[SS_TOTAL], us_tdiff(&now, start));
+}
+
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
@@ -2613,6 +2740,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 	struct cgpu_info *cgpu;
 
 	cgpu = get_thr_cgpu(work->thr_id);
+	record_share_latency(work);
 
 	if (json_is_true(res) || (work->gbt && json_is_null(res))) {
 		mutex_lock(&stats_lock);
@@ -2817,6 +2945,7 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 	s = realloc_strcat(s, "\n");
 
 	cgtime(&tv_submit);
+	copy_time(&work->tv_submitted, &tv_submit);
 	/* issue JSON-RPC request */
 	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
 	cgtime(&tv_submit_reply);
@@ -3064,6 +3193,11 @@ static void get_benchmark_work(struct work *work)
 	size_t work_size = sizeof(bench_block);
 	size_t min_size = (work_size < bench_size ? work_size : bench_size);
 	memset(work, 0, sizeof(*work));
+#ifdef USE_SCRYPT
+	if (opt_scrypt_chacha)
+		bench_get_work(work);
+	else
+#endif
 	memcpy(work, &bench_block, min_size);
 	work->mandatory = true;
 	work->pool = pools[0];
@@ -3238,6 +3372,10 @@ static void __kill_work(void)
 	thr = &control_thr[api_thr_id];
 	thr_info_cancel(thr);
 
+	applog(LOG_DEBUG, "Killing off metrics thread");
+	thr = &control_thr[metrics_thr_id];
+	thr_info_cancel(thr);
+
 #ifdef USE_USBUTILS
 	/* Release USB resources in case it's a restart
 	 * and not a QUIT */
@@ -3295,6 +3433,13 @@ static void sighandler(int __maybe_unused sig)
 	kill_work();
 }
 
+#ifndef WIN32
+static void trace_sighandler(int __maybe_unused sig)
+{
+	trace_request_dump();
+}
+#endif
+
 /* Called with pool_lock held. Recruit an extra curl if none are available for
  * this pool. */
 static void recruit_curl(struct pool *pool)
@@ -3418,16 +3563,8 @@ void __copy_work(struct work *work, struct work *base_work)
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
-	if (base_work->nonce2)
-		work->nonce2 = strdup(base_work->nonce2);
-	if (base_work->ntime)
-		work->ntime = strdup(base_work->ntime);
-	if (base_work->gbt_coinbase)
-		work->gbt_coinbase = strdup(base_work->gbt_coinbase);
+	work->nonce_space = NULL;
+	work_copy_strs(work, base_work);
 }
 
 /* Generates a copy of an existing work struct, creating fresh heap allocations
@@ -3525,6 +3662,7 @@ static bool stale_work(struct work *work, bool share)
 	pool = work->pool;
 
 	if (!share && pool->has_stratum) {
+		struct stratum_job *job;
 		bool same_job;
 
 		if (!pool->stratum_active || !pool->stratum_notify) {
@@ -3532,12 +3670,9 @@ static bool stale_work(struct work *work, bool share)
 			return true;
 		}
 
-		same_job = true;
-
-		cg_rlock(&pool->data_lock);
-		if (strcmp(work->job_id, pool->swork.job_id))
-			same_job = false;
-		cg_runlock(&pool->data_lock);
+		job = stratum_job_get(pool);
+		same_job = job && !strcmp(work->job_id, job->job_id);
+		stratum_job_put(job);
 
 		if (!same_job) {
 			applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
@@ -3641,10 +3776,13 @@ static void *submit_work_thread(void *userdata)
 	struct pool *pool = work->pool;
 	bool resubmit = false;
 	struct curl_ent *ce;
+	uint64_t tr;
 
 	pthread_detach(pthread_self());
 
 	RenameThread("submit_work");
+	affinity_service_thread();
+	tr = trace_now();
 
 	applog(LOG_DEBUG, "Creating extra submit work thread");
 
@@ -3675,6 +3813,7 @@ static void *submit_work_thread(void *userdata)
 	}
 	push_curl_entry(ce, pool);
 
+	trace_span("submit_work", tr);
 	return NULL;
 }
 
@@ -4079,11 +4218,8 @@ static bool hash_push(struct work *work)
 		HASH_SORT(staged_work, tv_sort);
 		
 		/* Discard any stale work from the queue when fresh work is added */
-		applog(LOG_DEBUG, "Fresh work staged, discarding stale work and signaling fresh_work_cond");
+		applog(LOG_DEBUG, "Fresh work staged, discarding stale work");
 		discard_stale_locked();
-		
-		/* Signal that fresh work is now available in the queue */
-		pthread_cond_signal(&fresh_work_cond);
 	} else
 		rc = false;
 	pthread_cond_broadcast(&getq->cond);
@@ -4103,6 +4239,7 @@ static void *stage_thread(void *userdata)
 
 	while (ok) {
 		struct work *work = NULL;
+		uint64_t tr;
 
 		applog(LOG_DEBUG, "Popping work to stage thread");
 
@@ -4112,6 +4249,7 @@ static void *stage_thread(void *userdata)
 			ok = false;
 			break;
 		}
+		tr = trace_now();
 		work->work_block = work_block;
 
 		test_work_current(work);
@@ -4122,6 +4260,7 @@ static void *stage_thread(void *userdata)
 			applog(LOG_WARNING, "Failed to hash_push in stage_thread");
 			continue;
 		}
+		trace_span("stage", tr);
 	}
 
 	tq_freeze(mythr->q);
@@ -4337,6 +4476,14 @@ void write_config(FILE *fcfg)
 		for(i = 0; i < nDevs; i++)
 			fprintf(fcfg, "%s%d", i > 0 ? "," : "",
 				(int)gpus[i].opt_lg);
+		fputs("\",\n\"pad-layout\" : \"", fcfg);
+		for(i = 0; i < nDevs; i++)
+			fprintf(fcfg, "%s%s", i > 0 ? "," : "",
+				pad_layout_names[gpus[i].pad_layout]);
+		fputs("\",\n\"sub-batches\" : \"", fcfg);
+		for(i = 0; i < nDevs; i++)
+			fprintf(fcfg, "%s%d", i > 0 ? "," : "",
+				gpus[i].sub_batches > 1 ? gpus[i].sub_batches : 1);
 
 		// check to see that we have devices, and if so, check the first one to see if bs is used
 		if ((nDevs > 0) && (gpus[0].buffer_size > 0))
@@ -4411,6 +4558,7 @@ void write_config(FILE *fcfg)
 			if (opt->type & OPT_HASARG &&
 			   ((void *)opt->cb_arg == (void *)set_int_0_to_9999 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_65535 ||
+			   (void *)opt->cb_arg == (void *)set_int_0_to_65535 ||
 			   (void *)opt->cb_arg == (void *)set_int_0_to_10 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_10) && opt->desc != opt_hidden)
 				fprintf(fcfg, ",\n\"%s\" : \"%d\"", p+2, *(int *)opt->u.arg);
@@ -4499,7 +4647,7 @@ void zero_bestshare(void)
 
 void zero_stats(void)
 {
-	int i;
+	int i, j;
 
 	cgtime(&total_tv_start);
 	total_mhashes_done = 0;
@@ -4535,6 +4683,8 @@ void zero_stats(void)
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
 		pool->last_share_diff = 0;
+		for (j = 0; j < SS_MAX; j++)
+			latency_reset(&pool->latency[j]);
 	}
 
 	zero_bestshare();
@@ -4939,6 +5089,23 @@ static void *input_thread(void __maybe_unused *userdata)
 }
 #endif
 
+static void *metrics_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+
+	pthread_detach(pthread_self());
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	RenameThread("metrics");
+	affinity_service_thread();
+
+	metrics(metrics_thr_id);
+
+	PTH(mythr) = 0L;
+
+	return NULL;
+}
+
 static void *api_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
@@ -4947,6 +5114,7 @@ static void *api_thread(void *userdata)
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
 	RenameThread("api");
+	affinity_service_thread();
 
 	api(api_thr_id);
 
@@ -4973,6 +5141,112 @@ static inline void thread_reportout(struct thr_info *thr)
 	thr->cgpu->device_last_well = time(NULL);
 }
 
+/* Copy the live counters into the snapshots read by the API. Must be called
+ * with hash_lock held so there is only ever one writer. */
+static void refresh_stats_snapshot(void)
+{
+	int i;
+
+	seq_write_begin(&stats_seq);
+
+	stats_snap.total_secs = total_secs;
+	stats_snap.total_mhashes_done = total_mhashes_done;
+	stats_snap.found_blocks = found_blocks;
+	stats_snap.total_getworks = total_getworks;
+	stats_snap.total_accepted = total_accepted;
+	stats_snap.total_rejected = total_rejected;
+	stats_snap.total_diff1 = total_diff1;
+	stats_snap.hw_errors = hw_errors;
+	stats_snap.total_discarded = total_discarded;
+	stats_snap.total_stale = total_stale;
+	stats_snap.total_go = total_go;
+	stats_snap.total_ro = total_ro;
+	stats_snap.local_work = local_work;
+	stats_snap.new_blocks = new_blocks;
+	stats_snap.total_diff_accepted = total_diff_accepted;
+	stats_snap.total_diff_rejected = total_diff_rejected;
+	stats_snap.total_diff_stale = total_diff_stale;
+	stats_snap.best_diff = best_diff;
+
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+		struct cgpu_snapshot *snap = &cgpu->snap;
+
+		snap->accepted = cgpu->accepted;
+		snap->rejected = cgpu->rejected;
+		snap->hw_errors = cgpu->hw_errors;
+		snap->diff1 = cgpu->diff1;
+		snap->rolling = cgpu->rolling;
+		snap->total_mhashes = cgpu->total_mhashes;
+		snap->diff_accepted = cgpu->diff_accepted;
+		snap->diff_rejected = cgpu->diff_rejected;
+		snap->last_share_diff = cgpu->last_share_diff;
+		snap->last_share_pool = cgpu->last_share_pool;
+		snap->last_share_pool_time = cgpu->last_share_pool_time;
+		snap->last_device_valid_work = cgpu->last_device_valid_work;
+		snap->fresh_work_switches = cgpu->fresh_work_switches;
+		snap->fresh_work_wait = cgpu->fresh_work_wait;
+#ifdef HAVE_OPENCL
+		memcpy(snap->kernel_secs, cgpu->kernel_secs, sizeof(snap->kernel_secs));
+		memcpy(snap->kernel_runs, cgpu->kernel_runs, sizeof(snap->kernel_runs));
+		memcpy(snap->pad_hashes, cgpu->pad_hashes, sizeof(snap->pad_hashes));
+		memcpy(snap->nfactor_hashes, cgpu->nfactor_hashes, sizeof(snap->nfactor_hashes));
+#endif
+	}
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		struct pool_snapshot *snap = &pool->snap;
+
+		snap->accepted = pool->accepted;
+		snap->rejected = pool->rejected;
+		snap->diff1 = pool->diff1;
+		snap->getwork_requested = pool->getwork_requested;
+		snap->stale_shares = pool->stale_shares;
+		snap->discarded_work = pool->discarded_work;
+		snap->getfail_occasions = pool->getfail_occasions;
+		snap->remotefail_occasions = pool->remotefail_occasions;
+		snap->diff_accepted = pool->diff_accepted;
+		snap->diff_rejected = pool->diff_rejected;
+		snap->diff_stale = pool->diff_stale;
+		snap->last_share_diff = pool->last_share_diff;
+		snap->last_share_time = pool->last_share_time;
+		snap->best_diff = pool->best_diff;
+	}
+
+	seq_write_end(&stats_seq);
+}
+
+void get_stats_snapshot(struct stats_snapshot *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = seq_read_begin(&stats_seq);
+		memcpy(snap, &stats_snap, sizeof(*snap));
+	} while (seq_read_retry(&stats_seq, seq));
+}
+
+void get_cgpu_snapshot(struct cgpu_info *cgpu, struct cgpu_snapshot *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = seq_read_begin(&stats_seq);
+		memcpy(snap, &cgpu->snap, sizeof(*snap));
+	} while (seq_read_retry(&stats_seq, seq));
+}
+
+void get_pool_snapshot(struct pool *pool, struct pool_snapshot *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = seq_read_begin(&stats_seq);
+		memcpy(snap, &pool->snap, sizeof(*snap));
+	} while (seq_read_retry(&stats_seq, seq));
+}
+
 static void hashmeter(int thr_id, struct timeval *diff,
 		      uint64_t hashes_done)
 {
@@ -5073,6 +5347,7 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		total_diff1 / total_secs * 60, found_blocks);
 
 	local_mhashes_done = 0;
+	refresh_stats_snapshot();
 out_unlock:
 	mutex_unlock(&hash_lock);
 
@@ -5324,11 +5599,13 @@ static void *stratum_rthread(void *userdata)
 
 	snprintf(threadname, 16, "StratumR/%d", pool->pool_no);
 	RenameThread(threadname);
+	affinity_service_thread();
 
 	while (42) {
 		struct timeval timeout;
 		int sel_ret;
 		fd_set rd;
+		uint64_t tr;
 		char *s;
 
 		if (unlikely(pool->removed))
@@ -5398,6 +5675,7 @@ static void *stratum_rthread(void *userdata)
 		 * has not had its idle flag cleared */
 		stratum_resumed(pool);
 
+		tr = trace_now();
 		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
 			applog(LOG_INFO, "Unknown stratum msg: %s", s);
 		free(s);
@@ -5419,6 +5697,7 @@ static void *stratum_rthread(void *userdata)
 				applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
 			free_work(work);
 		}
+		trace_span("stratum recv", tr);
 	}
 
 out:
@@ -5437,6 +5716,7 @@ static void *stratum_sthread(void *userdata)
 
 	snprintf(threadname, 16, "StratumS/%d", pool->pool_no);
 	RenameThread(threadname);
+	affinity_service_thread();
 
 	pool->stratum_q = tq_new();
 	if (!pool->stratum_q)
@@ -5447,6 +5727,7 @@ static void *stratum_sthread(void *userdata)
 		uint32_t *hash32, nonce;
 		struct work *work;
 		bool submitted;
+		uint64_t tr;
 		char *noncehex;
 		char s[1024];
 
@@ -5486,7 +5767,10 @@ static void *stratum_sthread(void *userdata)
 		while (time(NULL) < sshare->sshare_time + 120) {
 			bool sessionid_match;
 
+			cgtime(&work->tv_submitted);
+			tr = trace_now();
 			if (likely(stratum_send(pool, s, strlen(s)))) {
+				trace_span("stratum send", tr);
 				if (pool_tclear(pool, &pool->submit_fail))
 						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
@@ -5752,16 +6036,38 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s alive", pool->pool_no, pool->rpc_url);
 }
 
-static struct work *hash_pop(void)
+/* Pop staged work, waiting up to ms milliseconds for some to be staged, or for
+ * as long as it takes if ms is negative. Returns NULL if none turned up. */
+static struct work *hash_pop(int ms)
 {
 	struct work *work = NULL, *tmp;
+	struct timespec abstime;
 	int hc;
 
+	if (ms > 0) {
+		struct timeval now, then, wait;
+
+		wait.tv_sec = ms / 1000;
+		wait.tv_usec = (ms % 1000) * 1000;
+		cgtime(&now);
+		timeradd(&now, &wait, &then);
+		abstime.tv_sec = then.tv_sec;
+		abstime.tv_nsec = then.tv_usec * 1000;
+	}
+
 	mutex_lock(stgd_lock);
-	while (!getq->frozen && !HASH_COUNT(staged_work))
-		pthread_cond_wait(&getq->cond, stgd_lock);
+	while (!getq->frozen && !HASH_COUNT(staged_work)) {
+		if (ms < 0)
+			pthread_cond_wait(&getq->cond, stgd_lock);
+		else if (!ms || pthread_cond_timedwait(&getq->cond, stgd_lock, &abstime) == ETIMEDOUT)
+			break;
+	}
 
 	hc = HASH_COUNT(staged_work);
+	if (ms >= 0 && !hc) {
+		mutex_unlock(stgd_lock);
+		return NULL;
+	}
 	/* Find clone work if possible, to allow masters to be reused */
 	if (hc > staged_rollable) {
 		HASH_ITER(hh, staged_work, work, tmp) {
@@ -5871,83 +6177,72 @@ void set_target(unsigned char *dest_target, double diff)
 
 /* Generates stratum based work based on the most recent notify information
  * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
+ * other means to detect when the pool has died in stratum_thread. The job is
+ * an immutable snapshot, see stratum_job_get(), so no lock is taken. */
 static void gen_stratum_work(struct pool *pool, struct work *work)
 {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
-	char *header, *merkle_hash;
-	uint32_t *data32, *swap32;
-	size_t alloc_len;
+	unsigned char cb_stack[512], *coinbase, merkle_root[32], merkle_sha[64];
+	struct stratum_job *job = stratum_job_get(pool);
+	uint32_t *data32, *swap32, nonce2;
 	int i;
 
-	/* Use intermediate lock to update the one pool variable */
-	cg_ilock(&pool->data_lock);
+	if (unlikely(!job))
+		quit(1, "Pool %d has no stratum job to generate work from", pool->pool_no);
 
 	/* Generate coinbase */
-	work->nonce2 = bin2hex((const unsigned char *)&pool->nonce2, pool->n2size);
-	pool->nonce2++;
-
-	/* Downgrade to a read lock to read off the pool variables */
-	cg_dlock(&pool->data_lock);
-	alloc_len = pool->swork.cb_len;
-	align_len(&alloc_len);
-	coinbase = calloc(alloc_len, 1);
-	if (unlikely(!coinbase))
-		quit(1, "Failed to calloc coinbase in gen_stratum_work");
-	hex2bin(coinbase, pool->swork.coinbase1, pool->swork.cb1_len);
-	hex2bin(coinbase + pool->swork.cb1_len, pool->nonce1, pool->n1_len);
-	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len, work->nonce2, pool->n2size);
-	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len + pool->n2size, pool->swork.coinbase2, pool->swork.cb2_len);
+	coinbase = cb_stack;
+	if (unlikely(job->cb_len > sizeof(cb_stack))) {
+		coinbase = malloc(job->cb_len);
+		if (unlikely(!coinbase))
+			quit(1, "Failed to malloc coinbase in gen_stratum_work");
+	}
+	memcpy(coinbase, job->coinbase, job->cb_len);
+	nonce2 = __sync_fetch_and_add(&pool->job_nonce2, 1);
+	memcpy(coinbase + job->nonce2_off, &nonce2, MIN(job->n2size, (int)sizeof(nonce2)));
+	work->nonce2 = work_bin2hex(work, coinbase + job->nonce2_off, job->n2size);
 
 	/* Generate merkle root */
-	gen_hash(coinbase, merkle_root, pool->swork.cb_len);
-	free(coinbase);
+	gen_hash(coinbase, merkle_root, job->cb_len);
+	if (coinbase != cb_stack)
+		free(coinbase);
 	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < pool->swork.merkles; i++) {
-		unsigned char merkle_bin[32];
-
-		hex2bin(merkle_bin, pool->swork.merkle[i], 32);
-		memcpy(merkle_sha + 32, merkle_bin, 32);
+	for (i = 0; i < job->merkles; i++) {
+		memcpy(merkle_sha + 32, job->merkle + i * 32, 32);
 		gen_hash(merkle_sha, merkle_root, 64);
 		memcpy(merkle_sha, merkle_root, 32);
 	}
 	data32 = (uint32_t *)merkle_sha;
 	swap32 = (uint32_t *)merkle_root;
 	flip32(swap32, data32);
-	merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
-
-	header = calloc(pool->swork.header_len, 1);
-	if (unlikely(!header))
-		quit(1, "Failed to calloc header in gen_stratum_work");
-	sprintf(header, "%s%s%s%s%s%s%s",
-		pool->swork.bbversion,
-		pool->swork.prev_hash,
-		merkle_hash,
-		pool->swork.ntime,
-		pool->swork.nbit,
-		"00000000", /* nonce */
-		workpadding);
+
+	/* Version, prev hash, merkle root, ntime, nbits and nonce, then the
+	 * padding up to 128 bytes */
+	if (unlikely(!job->header_ok || job->header_len + 48 < 128))
+		quit(1, "Failed to convert header to data in gen_stratum_work");
+	memcpy(work->data, job->header, job->header_len);
+	memcpy(work->data + job->merkle_off, merkle_root, 32);
+	hex2bin(work->data + job->header_len, workpadding, 128 - job->header_len);
 
 	/* Store the stratum work diff to check it still matches the pool's
 	 * stratum diff when submitting shares */
-	work->sdiff = pool->swork.diff;
+	work->sdiff = job->diff;
 
 	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->nonce1 = strdup(pool->nonce1);
-	work->ntime = strdup(pool->swork.ntime);
-	cg_runlock(&pool->data_lock);
+	work->job_id = work_strdup(work, job->job_id);
+	work->nonce1 = work_strdup(work, job->nonce1);
+	work->ntime = work_strdup(work, job->ntime);
+	stratum_job_put(job);
 
-	applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-	applog(LOG_DEBUG, "Generated stratum header %s", header);
-	applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
+	if (opt_debug) {
+		char merkle_hash[65], *header = bin2hex(work->data, 128);
 
-	free(merkle_hash);
+		__bin2hex(merkle_hash, merkle_root, 32);
+		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
+		applog(LOG_DEBUG, "Generated stratum header %s", header);
+		applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
+		free(header);
+	}
 
-	/* Convert hex data to binary data for work */
-	if (unlikely(!hex2bin(work->data, header, 128)))
-		quit(1, "Failed to convert header to data in gen_stratum_work");
-	free(header);
 	calc_midstate(work);
 
 	set_target(work->target, work->sdiff);
@@ -5967,11 +6262,17 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 
 static struct work *get_work(struct thr_info *thr, const int thr_id)
 {
-	struct work *work = NULL;
+	struct work *work = thr->next_work;
+
+	thr->next_work = NULL;
+	if (work && stale_work(work, false)) {
+		discard_work(work);
+		work = NULL;
+	}
 
 	applog(LOG_DEBUG, "Popping work from get queue to get work");
 	while (!work) {
-		work = hash_pop();
+		work = hash_pop(-1);
 		if (stale_work(work, false)) {
 			discard_work(work);
 			work = NULL;
@@ -5995,6 +6296,24 @@ static void submit_work_async(struct work *work_in, struct timeval *tv_work_foun
 	if (tv_work_found)
 		copy_time(&work->tv_work_found, tv_work_found);
 
+	if (opt_benchmark) {
+		struct cgpu_info *cgpu = get_thr_cgpu(work->thr_id);
+
+		/* There is nowhere to submit benchmark shares to so count
+		 * them as accepted once they have passed verification */
+		mutex_lock(&stats_lock);
+		cgpu->accepted++;
+		total_accepted++;
+		pool->accepted++;
+		cgpu->diff_accepted += work->work_difficulty;
+		total_diff_accepted += work->work_difficulty;
+		pool->diff_accepted += work->work_difficulty;
+		mutex_unlock(&stats_lock);
+
+		free_work(work);
+		return;
+	}
+
 	if (stale_work(work, true)) {
 		if (opt_submit_stale)
 			applog(LOG_NOTICE, "Pool %d stale share detected, submitting as user requested", pool->pool_no);
@@ -6065,10 +6384,15 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	/* Do one last check before attempting to submit the work */
 	rebuild_hash(work);
 	flip32(hash2_32, work->hash);
+	cgtime(&work->tv_verified);
 
 	diff1targ = le32toh(*(uint32_t *)(work->target + 28));
 	applog(LOG_DEBUG, "Target validation: hash=%08x target=%08x", be32toh(hash2_32[7]), diff1targ);
 	
+	if (opt_benchmark)
+		bench_verified(thr->cgpu, us_tdiff(&work->tv_verified, &tv_work_found),
+			       be32toh(hash2_32[7]) <= diff1targ);
+
 	if (be32toh(hash2_32[7]) > diff1targ) {
 		applog(LOG_INFO, "%s%d: invalid nonce - HW error",
 		       thr->cgpu->drv->name, thr->cgpu->device_id);
@@ -6094,33 +6418,63 @@ out:
 	return ret;
 }
 
-static inline bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes, struct cgpu_info *cgpu)
+/* Have thr's next work ready for get_work(), waiting up to ms milliseconds
+ * for some to be staged */
+static bool prefetch_work(struct thr_info *thr, int ms)
 {
-	uint32_t max_nonce;
+	struct work *work;
 
-	if (total_devices > 1) {
-		uint32_t nonce_range = 0xFFFFFFFF / total_devices;
-		max_nonce = (cgpu->device_id + 1) * nonce_range - 1;
-	} else {
-		max_nonce = MAXTHREADS;
+	while (!thr->next_work) {
+		work = hash_pop(ms);
+		if (!work)
+			return false;
+		if (stale_work(work, false)) {
+			discard_work(work);
+			wake_gws();
+			continue;
+		}
+		thr->next_work = work;
 	}
+	return true;
+}
+
+static inline bool abandon_work(struct thr_info *mythr, struct work *work, struct timeval *wdiff, uint64_t hashes)
+{
+	struct cgpu_info *cgpu = mythr->cgpu;
 
 	if (wdiff->tv_sec > opt_scantime ||
-	    work->blk.nonce >= max_nonce - hashes ||
+	    work->nonce_exhausted ||
+	    work->blk.nonce >= MAXTHREADS - hashes ||
 	    hashes >= 0xfffffffe ||
 	    stale_work(work, false))
 		return true;
 	
-	/* If work is submitted, wait for fresh work to be available */
+	/* Once a share is found move on to the next work, which is normally
+	 * already prefetched. If none is ready wait up to --fresh-work-wait ms
+	 * for some, and otherwise keep hashing this work until it is. */
 	if (work->submitted) {
-		applog(LOG_DEBUG, "Work submitted, waiting for fresh work");
-		mutex_lock(stgd_lock);
-		pthread_cond_wait(&fresh_work_cond, stgd_lock);
-		mutex_unlock(stgd_lock);
-		applog(LOG_DEBUG, "Fresh work signal received, abandoning current work");
-		return true;
+		struct timeval tv_start, tv_end;
+		bool ready;
+
+		if (mythr->next_work || !opt_fresh_work_wait)
+			ready = prefetch_work(mythr, 0);
+		else {
+			cgtime(&tv_start);
+			ready = prefetch_work(mythr, opt_fresh_work_wait);
+			cgtime(&tv_end);
+			mutex_lock(&stats_lock);
+			cgpu->fresh_work_wait += tdiff(&tv_end, &tv_start);
+			mutex_unlock(&stats_lock);
+		}
+		if (ready) {
+			applog(LOG_DEBUG, "Work submitted, switching to the next work");
+			mutex_lock(&stats_lock);
+			cgpu->fresh_work_switches++;
+			mutex_unlock(&stats_lock);
+			return true;
+		}
 	}
-	
+
 	return false;
 }
 
@@ -6166,16 +6520,10 @@ static void hash_sole_work(struct thr_info *mythr)
 		cgpu->new_work = true;
 
 		cgtime(&tv_workstart);
-		/* Divide nonce space among GPUs to prevent duplicate work */
-		if (total_devices > 1) {
-			uint32_t nonce_range = 0xFFFFFFFF / total_devices;
-			work->blk.nonce = cgpu->device_id * nonce_range;
-			applog(LOG_DEBUG, "GPU %d assigned nonce range: %u to %u", 
-			       cgpu->device_id, work->blk.nonce, 
-			       work->blk.nonce + nonce_range - 1);
-		} else {
-			work->blk.nonce = 0;
-		}
+		work->blk.nonce = 0;
+		/* Drivers that scan in chunks claim them with nonce_claim() from
+		 * the space shared by every thread hashing this header */
+		nonce_space_attach(work);
 		cgpu->max_hashes = 0;
 		if (!drv->prepare_work(mythr, work)) {
 			applog(LOG_ERR, "work prepare failed, exiting "
@@ -6306,9 +6654,17 @@ static void hash_sole_work(struct thr_info *mythr)
 				mt_disable(mythr, thr_id, drv);
 
 			sdiff.tv_sec = sdiff.tv_usec = 0;
-		} while (!abandon_work(work, &wdiff, cgpu->max_hashes, cgpu));
+			/* Keep the next work ready so a found share never
+			 * waits on the pool */
+			prefetch_work(mythr, 0);
+		} while (!abandon_work(mythr, work, &wdiff, cgpu->max_hashes));
+		nonce_space_detach(work);
 		free_work(work);
 	}
+	if (mythr->next_work) {
+		discard_work(mythr->next_work);
+		mythr->next_work = NULL;
+	}
 	cgpu->deven = DEV_DISABLED;
 }
 
@@ -6626,6 +6982,7 @@ static void *longpoll_thread(void *userdata)
 
 	snprintf(threadname, 16, "longpoll/%d", cp->pool_no);
 	RenameThread(threadname);
+	affinity_service_thread();
 
 	curl = curl_easy_init();
 	if (unlikely(!curl)) {
@@ -6866,6 +7223,10 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 		hashmeter(-1, &zero_tv, 0);
 
+		trace_poll();
+		if (opt_benchmark)
+			bench_poll();
+
 #ifdef HAVE_CURSES
 		if (curses_active_locked()) {
 			struct cgpu_info *cgpu;
@@ -7109,6 +7470,7 @@ void print_summary(void)
 
 static void clean_up(void)
 {
+	log_stop();
 #ifdef HAVE_OPENCL
 	clear_adl(nDevs);
 #endif
@@ -7122,6 +7484,8 @@ static void clean_up(void)
 #endif
 	if (!opt_realquiet && successful_connect)
 		print_summary();
+	if (opt_benchmark)
+		bench_report();
 
 	curl_global_cleanup();
 }
@@ -7840,8 +8204,6 @@ int main(int argc, char *argv[])
 
 	if (unlikely(pthread_cond_init(&gws_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init gws_cond");
-	if (unlikely(pthread_cond_init(&fresh_work_cond, NULL)))
-		quit(1, "Failed to pthread_cond_init fresh_work_cond");
 
 	sprintf(packagename, "%s %s", PACKAGE, VERSION);
 
@@ -7917,6 +8279,7 @@ int main(int argc, char *argv[])
 		enable_pool(pool);
 		pool->idle = false;
 		successful_connect = true;
+		bench_init();
 	}
 
 #ifdef HAVE_CURSES
@@ -7927,6 +8290,16 @@ int main(int argc, char *argv[])
 		enable_curses();
 #endif
 
+	trace_init();
+	work_pool_init();
+#ifndef WIN32
+	if (opt_trace)
+		signal(SIGUSR1, trace_sighandler);
+#endif
+
+	if (!opt_log_sync)
+		log_start();
+
 	applog(LOG_WARNING, "Started %s", packagename);
 	if (cnfbuf) {
 		applog(LOG_NOTICE, "Loaded configuration file %s", cnfbuf);
@@ -7952,7 +8325,7 @@ int main(int argc, char *argv[])
 	if (want_per_device_stats)
 		opt_log_output = true;
 
-	total_control_threads = 9;
+	total_control_threads = 10;
 	control_thr = calloc(total_control_threads, sizeof(*thr));
 	if (!control_thr)
 		quit(1, "Failed to calloc control_thr");
@@ -8060,6 +8433,7 @@ int main(int argc, char *argv[])
 #endif
 
 	load_temp_cutoffs();
+	affinity_init();
 
 	for (i = 0; i < total_devices; ++i)
 		devices[i]->cgminer_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
@@ -8186,11 +8560,17 @@ begin_bench:
 
 		cgpu->rolling = cgpu->total_mhashes = 0;
 	}
+	if (opt_benchmark)
+		bench_start();
 	
 	cgtime(&total_tv_start);
 	cgtime(&total_tv_end);
 	get_datestamp(datestamp, &total_tv_start);
 
+	mutex_lock(&hash_lock);
+	refresh_stats_snapshot();
+	mutex_unlock(&hash_lock);
+
 	// Start threads
 	k = 0;
 	for (i = 0; i < total_devices; ++i) {
@@ -8273,6 +8653,12 @@ begin_bench:
 	}
 #endif
 
+	/* Create metrics exporter thread */
+	metrics_thr_id = 9;
+	thr = &control_thr[metrics_thr_id];
+	if (thr_info_create(thr, NULL, metrics_thread, thr))
+		quit(1, "metrics thread create failed");
+
 #ifdef HAVE_CURSES
 	/* Create curses input thread for keyboard input. Create this last so
 	 * that we know all threads are created since this can call kill_work
@@ -8285,8 +8671,8 @@ begin_bench:
 #endif
 
 	/* Just to be sure */
-	if (total_control_threads != 9)
-		quit(1, "incorrect total_control_threads (%d) should be 9", total_control_threads);
+	if (total_control_threads != 10)
+		quit(1, "incorrect total_control_threads (%d) should be 10", total_control_threads);
 
 	/* Once everything is set up, main() becomes the getwork scheduler */
 	while (42) {